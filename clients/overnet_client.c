@@ -21,15 +21,17 @@ main( int argc, const char* argv[] )
 {
     kc_dht * dht;
     FILE* iniFile;
-    kc_contact **contacts;
-    int nodeCount;
+    kc_contact **contacts = NULL;
+    int nodeCount = 0;
+    kc_dhtBootstrap * bootstrap = NULL;
     kc_contact *contact = NULL;
     kc_hash *hash = NULL;
     
     int opt;
     char * port = NULL;
     char * addr = NULL;
-    while ( ( opt = getopt( argc, (char * const *)argv, "hf:a:p:") ) != -1 )
+    char * tablePath = NULL;
+    while ( ( opt = getopt( argc, (char * const *)argv, "hf:a:p:t:") ) != -1 )
     {
         switch ( opt ) {
             case 'a':
@@ -57,6 +59,9 @@ main( int argc, const char* argv[] )
                 port = calloc( strlen( optarg ), sizeof(char) );
                 strcpy( port, optarg );
                 break;     
+            case 't':
+                tablePath = optarg;
+                break;
             default:
                 usage(EXIT_FAILURE);
                 break;
@@ -97,6 +102,21 @@ main( int argc, const char* argv[] )
         
     kc_dhtAddIdentity( dht, contact );
     
+    /* Start from the nodes we knew last time */
+    if( tablePath != NULL && access( tablePath, R_OK ) == 0 )
+        kc_dhtLoadRoutingTable( dht, tablePath );
+    
+    /* Then ping the configured peers to fill in the rest */
+    if( nodeCount > 0 )
+    {
+        bootstrap = kc_dhtBootstrapStart( dht, contacts, nodeCount, NULL, NULL );
+        
+        int i;
+        for( i = 0; i < nodeCount; i++ )
+            kc_contactFree( contacts[i] );
+    }
+    free( contacts );
+    
 //    kc_dhtPrintState( dht );
     
 /*    kc_contact * otherContact = kc_contactInit( &addr, sizeof(struct in_addr), 5678 );
@@ -135,6 +155,10 @@ main( int argc, const char* argv[] )
         k++;
     }*/
     
+    if( bootstrap != NULL )
+        kc_dhtBootstrapFree( bootstrap );
+    if( tablePath != NULL )
+        kc_dhtSaveRoutingTable( dht, tablePath );
     kc_dhtFree( dht );
     
     return EXIT_SUCCESS;
@@ -27,6 +27,8 @@ of the following e-mail addresses (replace "(at)" with "@"):
  em(at)i-t-vision.com
 
 \****************************************************************/
+#ifndef KADC_OVERNET_OPCODES_H
+#define KADC_OVERNET_OPCODES_H
 
 /* max number of non-responses before a node is assumed dead or offline */
 #define NONRESPONSE_THRESHOLD 2	/* traditionally: 5 */
@@ -423,3 +425,5 @@ Tag:
 
 /* ----------- end old cDonkey stuff ------------ */
 #endif
+
+#endif /* KADC_OVERNET_OPCODES_H */
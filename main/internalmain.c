@@ -0,0 +1,316 @@
+/*
+ *  internalmain.c
+ *  KadC
+ *
+ *  Benchmarks the flat LRU buckets against the red-black tree per bucket
+ *  they replaced, on inserts, refreshes and closest-k selections.
+ *  Build with "make MAIN=internal".
+ *
+ */
+
+#include "kadc.h"
+#include "internal.h"
+
+#define BENCH_HASH_SIZE     128
+#define BENCH_BUCKET_SIZE   20
+#define BENCH_BUCKET_COUNT  64
+#define BENCH_ROUNDS        500
+#define BENCH_CLOSEST       20
+
+static kc_hash      * hashes[BENCH_BUCKET_COUNT][BENCH_BUCKET_SIZE];
+static kc_contact   * contacts[BENCH_BUCKET_COUNT][BENCH_BUCKET_SIZE];
+static kc_hash      * targets[BENCH_ROUNDS];
+
+static dhtBucket    * flat[BENCH_BUCKET_COUNT];
+static RbtHandle      trees[BENCH_BUCKET_COUNT];
+
+/* qsort() has no context argument, so the tree closest-k uses this one */
+static const kc_hash * sortTarget;
+
+static double
+benchElapsed( const struct timeval * start )
+{
+    struct timeval now;
+    gettimeofday( &now, NULL );
+    return ( now.tv_sec - start->tv_sec ) * 1e6 + ( now.tv_usec - start->tv_usec );
+}
+
+static void
+benchReport( const char * name, double flatUs, double treeUs, long ops )
+{
+    printf( "%-10s flat %8.1f ns/op   tree %8.1f ns/op   (x%.2f)\n",
+            name, flatUs * 1e3 / ops, treeUs * 1e3 / ops, treeUs / flatUs );
+}
+
+#pragma mark Tree buckets
+
+/* The tree buckets were keyed by the node hash */
+static RbtHandle
+treeInit( void )
+{
+    return rbtNew( kc_hashCmp );
+}
+
+static void
+treeFree( RbtHandle tree )
+{
+    RbtIterator iter;
+    while( ( iter = rbtBegin( tree ) ) != NULL )
+    {
+        kc_hash     * hash;
+        kc_dhtNode  * node;
+        rbtKeyValue( tree, iter, (void**)&hash, (void**)&node );
+        rbtErase( tree, iter );
+        kc_contactFree( node->contact );
+        dhtNodeFree( node );
+    }
+    rbtDelete( tree );
+}
+
+static void
+treeInsert( RbtHandle tree, kc_contact * contact, const kc_hash * hash )
+{
+    kc_dhtNode * node = dhtNodeInit( contact, hash );
+    if( node == NULL )
+    {
+        kc_contactFree( contact );
+        return;
+    }
+    node->lastSeen = time( NULL );
+    if( rbtInsert( tree, &node->hash, node ) != RBT_STATUS_OK )
+    {
+        kc_contactFree( contact );
+        dhtNodeFree( node );
+    }
+}
+
+static kc_dhtNode *
+treeFind( RbtHandle tree, const kc_hash * hash )
+{
+    RbtIterator iter = rbtFind( tree, (void*)hash );
+    if( iter == NULL )
+        return NULL;
+
+    kc_hash     * key;
+    kc_dhtNode  * node;
+    rbtKeyValue( tree, iter, (void**)&key, (void**)&node );
+    return node;
+}
+
+static int
+treeDistanceCmp( const void * a, const void * b )
+{
+    const kc_dhtNode * na = *(const kc_dhtNode * const *)a;
+    const kc_dhtNode * nb = *(const kc_dhtNode * const *)b;
+    return kc_hashDistanceCmp( sortTarget, &na->hash, &nb->hash );
+}
+
+/* Gathers every node then sorts them all, like the tree-based table did */
+static int
+treeClosest( const kc_hash * target, kc_dhtNode ** all, kc_dhtNode ** closest )
+{
+    int count = 0;
+    int i;
+    for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+    {
+        RbtIterator iter;
+        for( iter = rbtBegin( trees[i] ); iter != NULL; iter = rbtNext( trees[i], iter ) )
+        {
+            kc_hash * key;
+            rbtKeyValue( trees[i], iter, (void**)&key, (void**)&all[count++] );
+        }
+    }
+
+    sortTarget = target;
+    qsort( all, count, sizeof(kc_dhtNode*), treeDistanceCmp );
+
+    if( count > BENCH_CLOSEST )
+        count = BENCH_CLOSEST;
+    memcpy( closest, all, count * sizeof(kc_dhtNode*) );
+    return count;
+}
+
+#pragma mark Flat buckets
+
+/* Walks the buckets in place, keeping the k closest nodes sorted by insertion */
+static int
+flatClosest( const kc_hash * target, kc_dhtNode ** closest )
+{
+    int count = 0;
+    int i;
+    for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+    {
+        kc_dhtNode * node;
+        for( node = dhtBucketOldest( flat[i] ); node != NULL; node = dhtBucketNext( flat[i], node ) )
+        {
+            if( count == BENCH_CLOSEST
+                && kc_hashDistanceCmp( target, &node->hash, &closest[count - 1]->hash ) >= 0 )
+                continue;
+
+            int j = ( count < BENCH_CLOSEST ? count++ : count - 1 );
+            while( j > 0 && kc_hashDistanceCmp( target, &node->hash, &closest[j - 1]->hash ) < 0 )
+            {
+                closest[j] = closest[j - 1];
+                j--;
+            }
+            closest[j] = node;
+        }
+    }
+    return count;
+}
+
+#pragma mark Benchmarks
+
+static void
+benchInsert( void )
+{
+    struct timeval start;
+    double flatUs = 0, treeUs = 0;
+    int round, i, j;
+
+    for( round = 0; round < BENCH_ROUNDS; round++ )
+    {
+        for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+        {
+            dhtBucketFree( flat[i] );
+            flat[i] = dhtBucketInit( BENCH_BUCKET_SIZE );
+            treeFree( trees[i] );
+            trees[i] = treeInit();
+        }
+
+        gettimeofday( &start, NULL );
+        for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+            for( j = 0; j < BENCH_BUCKET_SIZE; j++ )
+                dhtBucketInsert( flat[i], kc_contactDup( contacts[i][j] ), hashes[i][j] );
+        flatUs += benchElapsed( &start );
+
+        gettimeofday( &start, NULL );
+        for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+            for( j = 0; j < BENCH_BUCKET_SIZE; j++ )
+                treeInsert( trees[i], kc_contactDup( contacts[i][j] ), hashes[i][j] );
+        treeUs += benchElapsed( &start );
+    }
+
+    benchReport( "insert", flatUs, treeUs, (long)BENCH_ROUNDS * BENCH_BUCKET_COUNT * BENCH_BUCKET_SIZE );
+}
+
+static void
+benchRefresh( void )
+{
+    struct timeval start;
+    double flatUs, treeUs;
+    int round, i, j;
+
+    /* The tree buckets had no recency order, a refresh only stamped the node */
+    gettimeofday( &start, NULL );
+    for( round = 0; round < BENCH_ROUNDS; round++ )
+        for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+            for( j = 0; j < BENCH_BUCKET_SIZE; j++ )
+            {
+                kc_dhtNode * node = dhtBucketFind( flat[i], hashes[i][( j * 7 + round ) % BENCH_BUCKET_SIZE] );
+                if( node != NULL )
+                    dhtBucketTouch( flat[i], node );
+            }
+    flatUs = benchElapsed( &start );
+
+    gettimeofday( &start, NULL );
+    for( round = 0; round < BENCH_ROUNDS; round++ )
+        for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+            for( j = 0; j < BENCH_BUCKET_SIZE; j++ )
+            {
+                kc_dhtNode * node = treeFind( trees[i], hashes[i][( j * 7 + round ) % BENCH_BUCKET_SIZE] );
+                if( node != NULL )
+                    node->lastSeen = time( NULL );
+            }
+    treeUs = benchElapsed( &start );
+
+    benchReport( "refresh", flatUs, treeUs, (long)BENCH_ROUNDS * BENCH_BUCKET_COUNT * BENCH_BUCKET_SIZE );
+}
+
+static void
+benchClosest( void )
+{
+    struct timeval start;
+    double flatUs, treeUs;
+    kc_dhtNode * all[BENCH_BUCKET_COUNT * BENCH_BUCKET_SIZE];
+    kc_dhtNode * flatNodes[BENCH_CLOSEST];
+    kc_dhtNode * treeNodes[BENCH_CLOSEST];
+    int round, mismatches = 0;
+
+    gettimeofday( &start, NULL );
+    for( round = 0; round < BENCH_ROUNDS; round++ )
+        flatClosest( targets[round], flatNodes );
+    flatUs = benchElapsed( &start );
+
+    gettimeofday( &start, NULL );
+    for( round = 0; round < BENCH_ROUNDS; round++ )
+        treeClosest( targets[round], all, treeNodes );
+    treeUs = benchElapsed( &start );
+
+    /* Both must agree, or the comparison means nothing */
+    for( round = 0; round < BENCH_ROUNDS; round++ )
+    {
+        int flatCount = flatClosest( targets[round], flatNodes );
+        int treeCount = treeClosest( targets[round], all, treeNodes );
+        int i;
+        if( flatCount != treeCount )
+        {
+            mismatches++;
+            continue;
+        }
+        for( i = 0; i < flatCount; i++ )
+        {
+            if( kc_hashCmp( &flatNodes[i]->hash, &treeNodes[i]->hash ) != 0 )
+            {
+                mismatches++;
+                break;
+            }
+        }
+    }
+
+    benchReport( "closest-k", flatUs, treeUs, BENCH_ROUNDS );
+    if( mismatches != 0 )
+        printf( "closest-k: %d mismatching selections !\n", mismatches );
+}
+
+int
+main( int argc, char ** argv )
+{
+    struct in_addr addr;
+    int i, j;
+
+    srandom( 1 );
+    for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+    {
+        for( j = 0; j < BENCH_BUCKET_SIZE; j++ )
+        {
+            hashes[i][j] = kc_hashRandom( BENCH_HASH_SIZE );
+            addr.s_addr = htonl( 0x0a000000 | ( i << 8 ) | j );
+            contacts[i][j] = kc_contactInit( &addr, sizeof(addr), 4662 + j );
+        }
+        flat[i] = dhtBucketInit( BENCH_BUCKET_SIZE );
+        trees[i] = treeInit();
+    }
+    for( i = 0; i < BENCH_ROUNDS; i++ )
+        targets[i] = kc_hashRandom( BENCH_HASH_SIZE );
+
+    printf( "%d buckets of %d nodes, %d rounds\n", BENCH_BUCKET_COUNT, BENCH_BUCKET_SIZE, BENCH_ROUNDS );
+    benchInsert();
+    benchRefresh();
+    benchClosest();
+
+    for( i = 0; i < BENCH_BUCKET_COUNT; i++ )
+    {
+        for( j = 0; j < BENCH_BUCKET_SIZE; j++ )
+        {
+            kc_hashFree( hashes[i][j] );
+            kc_contactFree( contacts[i][j] );
+        }
+        dhtBucketFree( flat[i] );
+        treeFree( trees[i] );
+    }
+    for( i = 0; i < BENCH_ROUNDS; i++ )
+        kc_hashFree( targets[i] );
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ *  sessionmain.c
+ *  KadC
+ *
+ *  Benchmarks demultiplexing incoming messages to their session, through
+ *  kc_sessionIndexFind() and through the scan of the session tree it replaced,
+ *  as the number of live sessions grows.
+ *  Build with "make MAIN=session".
+ *
+ */
+
+#include "kadc.h"
+#include "internal.h"
+#include "overnet.h"
+
+#define BENCH_TYPES         4
+#define BENCH_WORK          ( 1 << 22 )     /* Sessions visited by the scan at each count */
+#define BENCH_MIN_LOOKUPS   2000
+
+static const int sessionCounts[] = { 1, 8, 64, 256, 1024, 4096 };
+
+static double
+benchElapsed( const struct timeval * start )
+{
+    struct timeval now;
+    gettimeofday( &now, NULL );
+    return ( now.tv_sec - start->tv_sec ) * 1e6 + ( now.tv_usec - start->tv_usec );
+}
+
+/* The session tree scan incoming messages went through before the index */
+static kc_session *
+scanForContact( RbtHandle sessions, const kc_contact * contact, kc_messageType type )
+{
+    RbtIterator iter;
+    for( iter = rbtBegin( sessions ); iter != NULL; iter = rbtNext( sessions, iter ) )
+    {
+        kc_session * session;
+        rbtKeyValue( sessions, iter, (void**)&session, NULL );
+
+        if( kc_contactCmp( kc_sessionGetContact( session ), contact ) == 0 && kc_sessionGetType( session ) == type )
+            return session;
+    }
+    return NULL;
+}
+
+static void
+benchCount( kc_dht * dht, int count )
+{
+    RbtHandle           sessions = rbtNew( kc_sessionCmp );
+    kc_sessionIndex   * index = kc_sessionIndexInit( count );
+    kc_contact       ** contacts = calloc( count, sizeof(kc_contact*) );
+    kc_session       ** all = calloc( count, sizeof(kc_session*) );
+    struct in_addr      addr;
+    struct timeval      start;
+    double              indexUs, scanUs;
+    int                 lookups = BENCH_WORK / count;
+    int                 i, misses = 0;
+
+    if( sessions == NULL || index == NULL || contacts == NULL || all == NULL )
+    {
+        kc_logError( "benchCount: malloc failed !" );
+        exit( EXIT_FAILURE );
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        addr.s_addr = htonl( 0x0a000000 | ( i / BENCH_TYPES ) );
+        contacts[i] = kc_contactInit( &addr, sizeof(addr), 4662 );
+        all[i] = kc_sessionInit( dht, contacts[i], i % BENCH_TYPES, 0, NULL );
+        if( contacts[i] == NULL || all[i] == NULL )
+        {
+            kc_logError( "benchCount: session init failed !" );
+            exit( EXIT_FAILURE );
+        }
+        rbtInsert( sessions, all[i], all[i] );
+        kc_sessionIndexInsert( index, all[i] );
+    }
+
+    if( lookups < BENCH_MIN_LOOKUPS )
+        lookups = BENCH_MIN_LOOKUPS;
+
+    gettimeofday( &start, NULL );
+    for( i = 0; i < lookups; i++ )
+    {
+        int n = ( i * 7919UL ) % count;
+        if( kc_sessionIndexFind( index, contacts[n], 0, n % BENCH_TYPES ) != all[n] )
+            misses++;
+    }
+    indexUs = benchElapsed( &start );
+
+    gettimeofday( &start, NULL );
+    for( i = 0; i < lookups; i++ )
+    {
+        int n = ( i * 7919UL ) % count;
+        if( scanForContact( sessions, contacts[n], n % BENCH_TYPES ) != all[n] )
+            misses++;
+    }
+    scanUs = benchElapsed( &start );
+
+    printf( "%6d sessions   index %8.1f ns/msg   scan %10.1f ns/msg   (x%.1f)\n",
+            count, indexUs * 1e3 / lookups, scanUs * 1e3 / lookups, scanUs / indexUs );
+    if( misses != 0 )
+        printf( "%6d sessions   %d lookups found the wrong session !\n", count, misses );
+
+    for( i = 0; i < count; i++ )
+    {
+        kc_sessionIndexRemove( index, all[i] );
+        kc_sessionFree( all[i] );
+        kc_contactFree( contacts[i] );
+    }
+    kc_sessionIndexFree( index );
+    rbtDelete( sessions );
+    free( contacts );
+    free( all );
+}
+
+int
+main( int argc, char ** argv )
+{
+    kc_hash * hash = kc_hashRandom( ov_parameters.hashSize );
+    kc_dht  * dht = kc_dhtInit( hash, &ov_parameters );
+    unsigned int i;
+
+    if( dht == NULL )
+    {
+        kc_logError( "main: kc_dhtInit failed !" );
+        return EXIT_FAILURE;
+    }
+
+    for( i = 0; i < sizeof(sessionCounts) / sizeof(sessionCounts[0]); i++ )
+        benchCount( dht, sessionCounts[i] );
+
+    kc_dhtFree( dht );
+    kc_hashFree( hash );
+    return 0;
+}
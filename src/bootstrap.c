@@ -0,0 +1,354 @@
+/*
+ *  bootstrap.c
+ *  KadC
+ *
+ */
+
+#include "internal.h"
+
+#define BOOTSTRAP_PING_TIMEOUT  2000    /* in ms, how long we wait for a bootstrap contact to answer */
+#define BOOTSTRAP_MAX_SETTLE    16      /* Caps the answers we wait for once the table looks full, as log2( n / bucketSize ) for n nodes */
+
+struct _kc_dhtBootstrap {
+    kc_dht                * dht;
+
+    kc_contact           ** contacts;   /* Our copies, shuffled */
+    int                     count;
+    int                     next;       /* The next contact to ping */
+
+    int                     inFlight;
+    int                     answered;
+    int                     admitted;
+    int                     idle;       /* Answers since the last admitted one */
+    int                     depth;      /* The bucket count when the table got full, or 0 */
+
+    int                     done;
+    int                     notified;
+    struct timeval          startTime;
+    long                    firstLatency;   /* in ms, when bucketSize nodes got admitted, or -1 */
+    long                    filledLatency;  /* in ms, when the last admitted node left the table full, or -1 */
+    long                    fullLatency;    /* in ms, filledLatency once it ended */
+    long                    latency;        /* in ms, when it ended */
+
+    kc_dhtBootstrapCallback callback;
+    void                  * ref;
+
+    int                     refCount;   /* The user, plus one per running session */
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+};
+
+static long
+bootstrapElapsed( const kc_dhtBootstrap * bootstrap )
+{
+    struct timeval now;
+
+    gettimeofday( &now, NULL );
+    return ( now.tv_sec - bootstrap->startTime.tv_sec ) * 1000 + ( now.tv_usec - bootstrap->startTime.tv_usec ) / 1000;
+}
+
+static void
+bootstrapRelease( kc_dhtBootstrap * bootstrap )
+{
+    int last;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    last = ( --bootstrap->refCount == 0 );
+    pthread_mutex_unlock( &bootstrap->lock );
+
+    if( !last )
+        return;
+
+    int i;
+    for( i = 0; i < bootstrap->count; i++ )
+        kc_contactFree( bootstrap->contacts[i] );
+    free( bootstrap->contacts );
+    pthread_mutex_destroy( &bootstrap->lock );
+    pthread_cond_destroy( &bootstrap->cond );
+    free( bootstrap );
+}
+
+/* Must be called with the lock held */
+static void
+bootstrapFinish( kc_dhtBootstrap * bootstrap )
+{
+    if( bootstrap->done )
+        return;
+
+    bootstrap->done = 1;
+    bootstrap->latency = bootstrapElapsed( bootstrap );
+    bootstrap->fullLatency = bootstrap->filledLatency;
+    pthread_cond_broadcast( &bootstrap->cond );
+
+    kc_logNormal( "Bootstrap done in %ld ms : pinged %d of %d contacts, %d answered, %d admitted, "
+                  "first %d nodes after %ld ms, full table after %ld ms",
+                  bootstrap->latency, bootstrap->next, bootstrap->count, bootstrap->answered, bootstrap->admitted,
+                  bootstrap->dht->parameters->bucketSize, bootstrap->firstLatency, bootstrap->fullLatency );
+}
+
+static int
+bootstrapSessionCallback( const kc_dht * dht, kc_session * session, const kc_message * msg );
+
+static int
+bootstrapSend( kc_dhtBootstrap * bootstrap, kc_contact * contact )
+{
+    kc_dht * dht = bootstrap->dht;
+    int status;
+
+    kc_session * session = kc_dhtCreateAndAddOutgoingSession( dht, contact, DHT_RPC_PING, bootstrapSessionCallback );
+    if( session == NULL )
+    {
+        /* Most likely something else is already waiting on this contact */
+        kc_logVerbose( "Bootstrap: can't ping %s", kc_contactPrint( contact ) );
+        return -1;
+    }
+    kc_sessionSetRef( session, bootstrap );
+    kc_sessionSetTimeout( session, BOOTSTRAP_PING_TIMEOUT );
+
+    kc_message * msg = kc_messageInit( contact, DHT_RPC_PING, 0, NULL );
+    if( msg == NULL )
+    {
+        kc_dhtDeleteSession( dht, session );
+        kc_sessionFree( session );
+        return -1;
+    }
+
+    status = dht->parameters->callbacks.writeCallback( dht, NULL, msg );
+    if( status == 0 )
+        status = kc_sessionSend( session, msg );
+    kc_messageFree( msg );
+
+    if( status != 0 )
+    {
+        kc_logAlert( "Bootstrap: failed pinging %s", kc_contactPrint( contact ) );
+        kc_dhtDeleteSession( dht, session );
+        kc_sessionFree( session );
+        return -1;
+    }
+
+    bootstrap->inFlight++;
+    bootstrap->refCount++;
+    return 0;
+}
+
+/* Keeps bootstrapWindow pings running, must be called with the lock held */
+static void
+bootstrapAdvance( kc_dhtBootstrap * bootstrap )
+{
+    int window = bootstrap->dht->parameters->bootstrapWindow;
+
+    while( !bootstrap->done && bootstrap->inFlight < window && bootstrap->next < bootstrap->count )
+        bootstrapSend( bootstrap, bootstrap->contacts[bootstrap->next++] );
+
+    if( bootstrap->inFlight == 0 && bootstrap->next == bootstrap->count )
+        bootstrapFinish( bootstrap );
+}
+
+static int
+bootstrapSessionCallback( const kc_dht * dht, kc_session * session, const kc_message * msg )
+{
+    kc_dhtBootstrap * bootstrap = kc_sessionGetRef( session );
+    kc_dhtBootstrapCallback notify = NULL;
+
+    if( bootstrap == NULL )
+        return 1;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    bootstrap->inFlight--;
+
+    /* The protocol parse callback tells us who answered */
+    const kc_hash * hash = ( msg != NULL ? kc_messageGetHash( msg ) : NULL );
+    if( !bootstrap->done && hash != NULL && kc_hashLength( hash ) == dht->parameters->hashSize )
+    {
+        kc_contact * contact = kc_contactDup( kc_sessionGetContact( session ) );
+
+        bootstrap->answered++;
+        bootstrap->idle++;
+        if( contact != NULL && dhtAdmitNode( bootstrap->dht, contact, hash, time( NULL ), kc_sessionGetElapsed( session ) ) )
+        {
+            bootstrap->admitted++;
+            bootstrap->idle = 0;
+            if( bootstrap->firstLatency == -1 && bootstrap->admitted >= dht->parameters->bucketSize )
+                bootstrap->firstLatency = bootstrapElapsed( bootstrap );
+            bootstrap->depth = dhtTableIsFull( bootstrap->dht );
+            bootstrap->filledLatency = ( bootstrap->depth != 0 ? bootstrapElapsed( bootstrap ) : -1 );
+        }
+        else if( contact != NULL )
+            kc_contactFree( contact );
+
+        /* The last two buckets cover 1 / 2^( depth - 2 ) of the hash space, so bucketSize times
+         * that many answers in a row bringing nothing new means there is no closer node left to split them */
+        int shift = ( bootstrap->depth - 2 < BOOTSTRAP_MAX_SETTLE ? bootstrap->depth - 2 : BOOTSTRAP_MAX_SETTLE );
+        if( bootstrap->depth != 0 && bootstrap->idle >= (long)dht->parameters->bucketSize << ( shift > 0 ? shift : 0 ) )
+            bootstrapFinish( bootstrap );
+    }
+    bootstrapAdvance( bootstrap );
+
+    /* Grab the callback while locked, kc_dhtBootstrapFree() may clear it */
+    if( bootstrap->done && !bootstrap->notified )
+    {
+        bootstrap->notified = 1;
+        notify = bootstrap->callback;
+    }
+    pthread_mutex_unlock( &bootstrap->lock );
+
+    if( notify != NULL )
+        notify( bootstrap->dht, bootstrap, bootstrap->ref );
+
+    bootstrapRelease( bootstrap );
+    return 1;
+}
+
+kc_dhtBootstrap *
+kc_dhtBootstrapStart( kc_dht * dht, kc_contact ** contacts, int count, kc_dhtBootstrapCallback callback, void * ref )
+{
+    assert( dht != NULL );
+    assert( contacts != NULL || count == 0 );
+
+    int i;
+
+    kc_dhtBootstrap * self = calloc( 1, sizeof(kc_dhtBootstrap) );
+    if( self == NULL )
+    {
+        kc_logAlert( "Failed allocating bootstrap" );
+        return NULL;
+    }
+    self->contacts = malloc( ( count + 1 ) * sizeof(kc_contact*) );
+    if( self->contacts == NULL )
+    {
+        kc_logAlert( "Failed allocating bootstrap contacts" );
+        free( self );
+        return NULL;
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        kc_contact * contact = kc_contactDup( contacts[i] );
+        if( contact == NULL )
+            continue;
+
+        /* Shuffle them as they come in, so that we don't hammer the head of a stale list */
+        int j = random() % ( self->count + 1 );
+        self->contacts[self->count] = self->contacts[j];
+        self->contacts[j] = contact;
+        self->count++;
+    }
+
+    self->dht = dht;
+    self->firstLatency = -1;
+    self->filledLatency = -1;
+    self->fullLatency = -1;
+    self->callback = callback;
+    self->ref = ref;
+    self->refCount = 1;
+    pthread_mutex_init( &self->lock, NULL );
+    pthread_cond_init( &self->cond, NULL );
+    gettimeofday( &self->startTime, NULL );
+
+    kc_logVerbose( "Bootstrapping from %d contacts, %d at a time", self->count, dht->parameters->bootstrapWindow );
+
+    pthread_mutex_lock( &self->lock );
+    bootstrapAdvance( self );
+
+    int notify = 0;
+    if( self->done && !self->notified )
+    {
+        self->notified = 1;
+        notify = ( callback != NULL );
+    }
+    pthread_mutex_unlock( &self->lock );
+
+    if( notify )
+        callback( dht, self, ref );
+
+    return self;
+}
+
+int
+kc_dhtBootstrapWait( kc_dhtBootstrap * bootstrap, unsigned long int timeout )
+{
+    int status = 0;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    while( !bootstrap->done && status == 0 )
+    {
+        if( timeout == 0 )
+            pthread_cond_wait( &bootstrap->cond, &bootstrap->lock );
+        else
+            status = pthread_cond_incrtimedwait( &bootstrap->cond, &bootstrap->lock, timeout );
+    }
+    status = !bootstrap->done;
+    pthread_mutex_unlock( &bootstrap->lock );
+    return status;
+}
+
+int
+kc_dhtBootstrapIsDone( kc_dhtBootstrap * bootstrap )
+{
+    int done;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    done = bootstrap->done;
+    pthread_mutex_unlock( &bootstrap->lock );
+    return done;
+}
+
+void
+kc_dhtBootstrapFree( kc_dhtBootstrap * bootstrap )
+{
+    assert( bootstrap != NULL );
+
+    /* Cancel it, running sessions keep it alive until they end */
+    pthread_mutex_lock( &bootstrap->lock );
+    bootstrap->callback = NULL;
+    bootstrapFinish( bootstrap );
+    pthread_mutex_unlock( &bootstrap->lock );
+
+    bootstrapRelease( bootstrap );
+}
+
+void
+kc_dhtBootstrapGetStats( kc_dhtBootstrap * bootstrap, int * pinged, int * answered, int * admitted )
+{
+    pthread_mutex_lock( &bootstrap->lock );
+    if( pinged != NULL )
+        *pinged = bootstrap->next;
+    if( answered != NULL )
+        *answered = bootstrap->answered;
+    if( admitted != NULL )
+        *admitted = bootstrap->admitted;
+    pthread_mutex_unlock( &bootstrap->lock );
+}
+
+long
+kc_dhtBootstrapGetFirstLatency( kc_dhtBootstrap * bootstrap )
+{
+    long latency;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    latency = bootstrap->firstLatency;
+    pthread_mutex_unlock( &bootstrap->lock );
+    return latency;
+}
+
+long
+kc_dhtBootstrapGetFullLatency( kc_dhtBootstrap * bootstrap )
+{
+    long latency;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    latency = bootstrap->fullLatency;
+    pthread_mutex_unlock( &bootstrap->lock );
+    return latency;
+}
+
+long
+kc_dhtBootstrapGetLatency( kc_dhtBootstrap * bootstrap )
+{
+    long latency;
+
+    pthread_mutex_lock( &bootstrap->lock );
+    latency = ( bootstrap->done ? bootstrap->latency : bootstrapElapsed( bootstrap ) );
+    pthread_mutex_unlock( &bootstrap->lock );
+    return latency;
+}
@@ -9,79 +9,127 @@
 
 #include "contact.h"
 
-/* Maybe I could use sockaddrs directly ? */
-struct _kc_contact
+/* FNV-1a, 64-bit, over the fields kc_contactCmp() looks at */
+static void
+contactUpdateHash( kc_contact * contact )
 {
-    void      * addr;
-    int         type;   /* AF_INET or AF_INET6 */
-    in_port_t   port;
-};
+    const unsigned char * p;
+    size_t length;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    
+    if( contact->addr.sa.sa_family == AF_INET6 )
+    {
+        p = (const unsigned char *)&contact->addr.in6.sin6_addr;
+        length = sizeof(struct in6_addr);
+    }
+    else
+    {
+        p = (const unsigned char *)&contact->addr.in.sin_addr;
+        length = sizeof(struct in_addr);
+    }
+    
+    for( i = 0; i < length; i++ )
+        hash = ( hash ^ p[i] ) * 1099511628211ULL;
+    hash = ( hash ^ ( kc_contactGetPort( contact ) & 0xFF ) ) * 1099511628211ULL;
+    hash = ( hash ^ ( kc_contactGetPort( contact ) >> 8 ) ) * 1099511628211ULL;
+    hash = ( hash ^ (unsigned char)contact->addr.sa.sa_family ) * 1099511628211ULL;
+    
+    contact->hash = hash;
+}
 
-kc_contact *
-kc_contactInit( void * addr, size_t len, in_port_t port )
+/* Sets up a zeroed contact, returns -1 if length isn't the one of an IPv4 or IPv6 address */
+static int
+contactSet( kc_contact * contact, const void * addr, size_t length, in_port_t port )
 {
-    kc_contact * self;
-    self = malloc( sizeof(kc_contact*) );
-    if( !self )
-        return NULL;
+    memset( contact, 0, sizeof(kc_contact) );
     
-    switch( len )
+    switch( length )
     {
         case sizeof(struct in_addr):
-            self->type = AF_INET;
-            self->addr = malloc( sizeof(struct in_addr*) );
-            memcpy( self->addr, addr, sizeof(struct in_addr) );
+            contact->addr.in.sin_family = AF_INET;
+            contact->addr.in.sin_port = htons( port );
+            memcpy( &contact->addr.in.sin_addr, addr, sizeof(struct in_addr) );
             break;
             
-        case sizeof( struct in6_addr ):
-            self->type = AF_INET6;
-            self->addr = malloc( sizeof(struct in6_addr*) );
-            memcpy( &self->addr, addr, sizeof(struct in6_addr) );
+        case sizeof(struct in6_addr):
+            contact->addr.in6.sin6_family = AF_INET6;
+            contact->addr.in6.sin6_port = htons( port );
+            memcpy( &contact->addr.in6.sin6_addr, addr, sizeof(struct in6_addr) );
             break;
             
         default:
-            kc_logAlert( "Invalid length for addr parameter, len: %d", sizeof(*addr) );
-            free( self );
-            return NULL;
+            kc_logAlert( "Invalid length for addr parameter, len: %d", length );
+            return -1;
     }
-    self->port = port;
     
+    contactUpdateHash( contact );
+    return 0;
+}
+
+kc_contact *
+kc_contactInit( void * addr, size_t len, in_port_t port )
+{
+    kc_contact * self;
+    self = malloc( sizeof(kc_contact) );
+    if( !self )
+        return NULL;
+    
+    if( contactSet( self, addr, len, port ) != 0 )
+    {
+        free( self );
+        return NULL;
+    }
     return self;
 }
 
+int
+kc_contactSetSockAddr( kc_contact * contact, const struct sockaddr * addr, size_t addrLen )
+{
+    assert( contact != NULL );
+    
+    if( addr->sa_family == AF_INET && addrLen >= sizeof(struct sockaddr_in) )
+    {
+        const struct sockaddr_in * sock_in = (const struct sockaddr_in*)addr;
+        return contactSet( contact, &sock_in->sin_addr, sizeof(struct in_addr), ntohs( sock_in->sin_port ) );
+    }
+    if( addr->sa_family == AF_INET6 && addrLen >= sizeof(struct sockaddr_in6) )
+    {
+        const struct sockaddr_in6 * sock_in6 = (const struct sockaddr_in6*)addr;
+        return contactSet( contact, &sock_in6->sin6_addr, sizeof(struct in6_addr), ntohs( sock_in6->sin6_port ) );
+    }
+    return -1;
+}
+
 kc_contact *
 kc_contactInitFromSockAddr( struct sockaddr * addr, size_t addrLen )
 {
-    kc_contact * contact;
-    switch( addrLen ) {
-        case sizeof(struct sockaddr_in): {
-            struct sockaddr_in * sock_in;
-            struct in_addr addr4;
-            sock_in = (struct sockaddr_in*)addr;
-            addr4 = sock_in->sin_addr;
-            contact = kc_contactInit( &addr4, sizeof(addr4), ntohs( sock_in->sin_port ) );
-        }
-            break;
-            
-        case sizeof(struct sockaddr_in6): {
-            struct sockaddr_in6 * sock_in6;
-            struct in6_addr addr6;
-            sock_in6 = (struct sockaddr_in6*)addr;
-            addr6 = sock_in6->sin6_addr;
-            contact = kc_contactInit( &addr6, sizeof(addr6), ntohs( sock_in6->sin6_port ) );
-        }
-            break;
-            
-        default:
-            break;
+    kc_contact * contact = malloc( sizeof(kc_contact) );
+    if( contact == NULL )
+        return NULL;
+    
+    if( kc_contactSetSockAddr( contact, addr, addrLen ) != 0 )
+    {
+        free( contact );
+        return NULL;
     }
     return contact;
 }
 
+const struct sockaddr *
+kc_contactGetSockAddr( const kc_contact * contact, socklen_t * length )
+{
+    assert( contact != NULL );
+    
+    if( length != NULL )
+        *length = ( contact->addr.sa.sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in) );
+    return &contact->addr.sa;
+}
+
 kc_contact *
 kc_contactInitFromChar( char * address, char * port )
 {
-    kc_contact * contact;
+    kc_contact * contact = NULL;
     
     struct in_addr addr;
     struct in6_addr addr6;
@@ -121,30 +169,17 @@ kc_contactDup( const kc_contact * contact )
 {
     assert( contact != NULL );
     
-    int length;
-    int type = kc_contactGetType( contact );
-    switch( type )
-    {
-        case AF_INET: {
-            length = sizeof(struct in_addr);
-        }
-            break;
-        case AF_INET6: {
-            length = sizeof(struct in6_addr);
-        }
-            break;
-        default:
-            return NULL;
-            break;
-    }
+    kc_contact * self = malloc( sizeof(kc_contact) );
+    if( self == NULL )
+        return NULL;
     
-    return kc_contactInit( kc_contactGetAddr( contact ), length, kc_contactGetPort( contact ) );
+    *self = *contact;
+    return self;
 }
 
 void
 kc_contactFree( kc_contact * contact )
 {
-    free( contact->addr );
     free( contact );
 }
 
@@ -153,43 +188,50 @@ int kc_contactCmp( const void * a, const void * b)
     const kc_contact * ca = a;
     const kc_contact * cb = b;
     
-    if( ca->type != cb->type )
-        return ( ca->type < cb->type ? 1 : -1 );
+    /* Different contacts almost always differ here already */
+    if( ca->hash != cb->hash )
+        return ( ca->hash < cb->hash ? -1 : 1 );
     
-    int res;
-    if( ca->type )
-        res = memcmp( ca->addr, cb->addr, sizeof(struct in_addr) );
-    else
-        res = memcmp( ca->addr, cb->addr, sizeof(struct in6_addr) );
-    
-    if( res != 0 )
-        return res;
+    if( ca->addr.sa.sa_family != cb->addr.sa.sa_family )
+        return ( ca->addr.sa.sa_family < cb->addr.sa.sa_family ? -1 : 1 );
     
-    if( ca->port != cb->port )
-        return ( ca->port < cb->port ? -1 : 1 );
+    /* The rest of the address is zeroed, so this covers the port and address */
+    if( ca->addr.sa.sa_family == AF_INET )
+        return memcmp( &ca->addr.in, &cb->addr.in, sizeof(struct sockaddr_in) );
+    return memcmp( &ca->addr.in6, &cb->addr.in6, sizeof(struct sockaddr_in6) );
+}
+
+uint32_t
+kc_contactHash( const kc_contact * contact )
+{
+    assert( contact != NULL );
     
-    return 0;
+    return (uint32_t)( contact->hash ^ ( contact->hash >> 32 ) );
 }
 
 const void *
 kc_contactGetAddr( const kc_contact * contact )
 {
     assert( contact != NULL );
-    return contact->addr;
+    if( contact->addr.sa.sa_family == AF_INET6 )
+        return &contact->addr.in6.sin6_addr;
+    return &contact->addr.in.sin_addr;
 }
 
 in_port_t
 kc_contactGetPort( const kc_contact * contact )
 {
     assert( contact != NULL );
-    return contact->port;
+    if( contact->addr.sa.sa_family == AF_INET6 )
+        return ntohs( contact->addr.in6.sin6_port );
+    return ntohs( contact->addr.in.sin_port );
 }
 
 int
 kc_contactGetType( const kc_contact * contact )
 {
     assert( contact != NULL );
-    return contact->type;
+    return contact->addr.sa.sa_family;
 }
 
 int
@@ -205,62 +247,52 @@ void
 kc_contactSetAddr( kc_contact * contact, void * addr, size_t length )
 {
     assert( contact != NULL );
-    switch( length )
-    {
-        case sizeof(struct in_addr):
-            memcpy( contact->addr, addr, sizeof(struct in_addr) );
-            break;
-        case sizeof(struct in6_addr):
-            memcpy( contact->addr, addr, sizeof(struct in6_addr) );
-            break;
-        default:
-            kc_logAlert( "Unknown address length %d", length );
-            break;
-    }
+    contactSet( contact, addr, length, kc_contactGetPort( contact ) );
 }
 
 void
 kc_contactSetPort( kc_contact * contact, in_port_t port )
 {
     assert( contact != NULL );
-    contact->port = port;
+    if( contact->addr.sa.sa_family == AF_INET6 )
+        contact->addr.in6.sin6_port = htons( port );
+    else
+        contact->addr.in.sin_port = htons( port );
+    contactUpdateHash( contact );
 }
 
 char *
-kc_contactPrint( const kc_contact * contact )
+kc_contactFormat( char * buf, size_t len, const kc_contact * contact )
 {
+    assert( buf != NULL );
     assert( contact != NULL );
     
-    int addrLen;
-    switch( contact->type )
+    if( len == 0 )
+        return buf;
+    
+    switch( kc_contactGetType( contact ) )
     {
         case AF_INET:
-            /* sizeof("255.255.255.255\0") */
-            addrLen = 16;
-            break;
         case AF_INET6:
-            /* sizeof("ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff\0") */
-            addrLen = 40;
             break;
         default:
-            kc_logDebug( "Non-IP protocol address, ignoring..." );
-            return "(Unknown)";
+            snprintf( buf, len, "(Unknown)" );
+            return buf;
     }
     
-    static char * addrStr;
-    if( addrStr == NULL )
-        addrStr = calloc( addrLen, sizeof(char) );
-    else
-        addrStr = realloc( addrStr, addrLen * sizeof(char) );
-    assert( addrStr != NULL );
-            
-    inet_ntop( contact->type, contact->addr, addrStr, addrLen );
-    
-    static char * contactStr = NULL;
-    if( contactStr == NULL )
-        contactStr = malloc( sizeof(char*) );
-    assert( contactStr != NULL );
+    if( inet_ntop( kc_contactGetType( contact ), kc_contactGetAddr( contact ), buf, len ) == NULL )
+    {
+        snprintf( buf, len, "(Invalid)" );
+        return buf;
+    }
     
-    sprintf( contactStr, "%s:%d", addrStr, contact->port );
-    return contactStr;
+    size_t used = strlen( buf );
+    snprintf( buf + used, len - used, ":%d", kc_contactGetPort( contact ) );
+    return buf;
+}
+
+char *
+kc_contactPrint( const kc_contact * contact )
+{
+    return kc_contactFormat( kc_printBuffer(), KADC_PRINT_BUFSIZE, contact );
 }
@@ -10,7 +10,21 @@
 #ifndef __KADC_CONTACT_H__
 #define __KADC_CONTACT_H__
 
-typedef struct _kc_contact kc_contact;
+/**
+ * A network endpoint, stored inline so that it can live on the stack
+ * and be copied around without any allocation.
+ * Use kc_contactSetSockAddr() to set up one that wasn't obtained from kc_contactInit().
+ * The fields are private, use the accessors.
+ */
+typedef struct _kc_contact {
+    union {
+        struct sockaddr             sa;
+        struct sockaddr_in          in;
+        struct sockaddr_in6         in6;
+        struct sockaddr_storage     storage;
+    } addr;                         /* Only the family, port and address are set, the rest stays zeroed */
+    uint64_t                hash;   /* Of the family, address and port, so that most comparisons are one word */
+} kc_contact;
 
 kc_contact *
 kc_contactInit( void * addr, size_t length, in_port_t port );
@@ -21,15 +35,50 @@ kc_contactInitFromSockAddr( struct sockaddr * addr, size_t addrLen );
 kc_contact *
 kc_contactInitFromChar( char * address, char * port );
 
+/**
+ * Sets up a contact in place from an IPv4 or IPv6 socket address.
+ *
+ * @return 0 on success, -1 if the address family isn't supported
+ */
+int
+kc_contactSetSockAddr( kc_contact * contact, const struct sockaddr * addr, size_t addrLen );
+
+/**
+ * Gets the socket address of a contact, ready for sendto() or bind().
+ *
+ * @param length Set to the length of the address
+ */
+const struct sockaddr *
+kc_contactGetSockAddr( const kc_contact * contact, socklen_t * length );
+
 void
 kc_contactFree( kc_contact * contact );
 
+/**
+ * Copies a contact to the heap.
+ *
+ * @return A new contact you must kc_contactFree(), or NULL on failure
+ */
 kc_contact *
 kc_contactDup( const kc_contact * contact );
 
+/**
+ * Orders contacts, by their hash first, so it is no meaningful order beyond equality.
+ */
 int
 kc_contactCmp( const void * a, const void * b);
 
+/**
+ * Hashes a contact for use in hash tables.
+ *
+ * Contacts that kc_contactCmp() reports as equal have the same hash.
+ *
+ * @param contact The contact to hash
+ * @return A 32-bit hash of the contact's type, address and port
+ */
+uint32_t
+kc_contactHash( const kc_contact * contact );
+
 const void *
 kc_contactGetAddr( const kc_contact * contact );
 
@@ -48,6 +97,27 @@ kc_contactSetAddr( kc_contact * contact, void * addr, size_t length );
 void
 kc_contactSetPort( kc_contact * contact, in_port_t addr );
 
+/** Room needed to format any contact, as in "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255:65535" */
+#define KADC_CONTACT_STRLEN ( INET6_ADDRSTRLEN + 8 )
+
+/**
+ * Formats a contact as "address:port" into a caller-provided buffer.
+ *
+ * This function doesn't allocate anything, so it is safe to use from any thread.
+ *
+ * @param buf The buffer to write to.
+ * @param len The size of buf, KADC_CONTACT_STRLEN is always enough.
+ * @param contact The contact to format.
+ * @return buf.
+ */
+char *
+kc_contactFormat( char * buf, size_t len, const kc_contact * contact );
+
+/**
+ * Formats a contact into a thread-local buffer, for use as a log argument.
+ *
+ * @see hashtoa().
+ */
 char *
 kc_contactPrint( const kc_contact * contact );
 #endif
\ No newline at end of file
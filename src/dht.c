@@ -43,17 +43,33 @@ of the following e-mail addresses (replace "(at)" with "@"):
 #define MESSAGE_QUEUE_SIZE      400     /* Maximum number of queued messages in a session */
 #define MAX_SESSION_COUNT       128     /* Maximum number of concurrent "connections" */
 #define SESSION_TIMEOUT         10      /* in s, the ttl of a session */
+#define LOOKUP_TIMEOUT          30      /* in s, the deadline of a lookup */
+#define BOOTSTRAP_WINDOW        32      /* The most pings in flight while bootstrapping */
+#define PROXIMITY_MARGIN        2       /* How many times faster a node must be to replace another */
+#define PROXIMITY_MIN_GAIN      20      /* in ms, the minimum gain worth replacing a node, against jitter */
 #define MAX_MESSAGE_PER_PULSE   0       /* Unused */
-
-#define BUCKET_COUNT            128     /* Our bucket count */
+#define WHEEL_TICK              50      /* in ms, the resolution of our timers */
+#define KEYS_SHARD_BITS         4       /* Our keys are spread over 2^KEYS_SHARD_BITS locks */
+#define VALUE_BUDGET            ( 256 * 1024 ) /* in bytes, the most the objects of a key may take */
+#define TABLE_MAGIC             "KCRT"  /* Routing table snapshots */
+#define TABLE_VERSION           1
+#define TABLE_HEADER_SIZE       16
 
 #include "internal.h"
 
 #pragma mark Events
 
-void dhtReplicate( int fd, short event_type, void * arg )
+static void
+dhtWheelCB( int fd, short what, void * arg )
 {
-    kc_logVerbose( "Replicate time!" );
+    kc_dht * dht = arg;
+    
+    if( dht->stopping )
+    {
+        event_base_loopbreak( dht->eventBase );
+        return;
+    }
+    kc_wheelAdvance( dht->wheel );
 }
 
 static void
@@ -74,13 +90,22 @@ eventLog( int severity, const char *msg );
 void *
 eventLoop( void * arg );
 
+static dhtBucket *
+dhtBucketInitForDepth( kc_dht * dht );
+
+static int
+dhtValueFree( const kc_hash * key, void * value, void * ref );
+
+static int
+dhtValueReplay( const kc_journalRecord * record, void * ref );
+
 kc_dht*
 kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
 {
     assert( parameters != NULL );
     
     kc_logVerbose( "kc_dhtInit: dht init" );
-    kc_dht * dht = malloc( sizeof( kc_dht ) );
+    kc_dht * dht = calloc( 1, sizeof( kc_dht ) );
     if ( dht == NULL )
     {
 		kc_logError( "kc_dhtInit: malloc failed!");
@@ -101,6 +126,7 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
     memcpy( dht->parameters, parameters, sizeof(kc_dhtParameters) );
     /* Mandatory parameters */
     if ( dht->parameters->hashSize == 0 ||
+         dht->parameters->hashSize > KADC_HASH_MAX_BITS ||
          dht->parameters->bucketSize == 0 ||
          dht->parameters->callbacks.parseCallback == NULL || 
          dht->parameters->callbacks.readCallback == NULL ||
@@ -119,6 +145,9 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
     setToDefault( republishDelay, KADC_REPUBLISH_DELAY );
     
     setToDefault( lookupParallelism, KADC_PROBE_PARALLELISM );
+    setToDefault( lookupTimeout, LOOKUP_TIMEOUT );
+    setToDefault( bootstrapWindow, BOOTSTRAP_WINDOW );
+    setToDefault( valueBudget, VALUE_BUDGET );
 //    setToDefault( lookupDelay, KADC_PROBE_DELAY );
     
     setToDefault( maxQueuedMessages, MESSAGE_QUEUE_SIZE );
@@ -128,7 +157,8 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
 #undef setToDefault
     
     kc_logVerbose( "kc_dhtInit: mutex init" );
-    if ( ( pthread_mutex_init( &dht->lock, NULL ) != 0 ) )
+    if ( ( pthread_mutex_init( &dht->lock, NULL ) != 0 ) || ( pthread_mutex_init( &dht->contactLock, NULL ) != 0 ) ||
+         ( pthread_mutex_init( &dht->sessionLock, NULL ) != 0 ) )
     {
         kc_logAlert( "kc_dhtInit: mutex init failed" );
         kc_dhtFree( dht );
@@ -138,6 +168,12 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
 #warning FIXME: Can't get UDP working with kqueues
     setenv( "EVENT_NOKQUEUE", "1", 1 );
     kc_logVerbose( "kc_dhtInit: event base init" );
+    /* User threads add and activate events on the loop, libevent must lock its bases */
+#if defined(EVTHREAD_USE_PTHREADS_IMPLEMENTED)
+    evthread_use_pthreads();
+#elif defined(EVTHREAD_USE_WINDOWS_THREADS_IMPLEMENTED)
+    evthread_use_windows_threads();
+#endif
     dht->eventBase = event_base_new();
     if( dht->eventBase == NULL )
     {
@@ -150,7 +186,16 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
     
     kc_logVerbose( "kc_dhtInit: hash init" );
     if( hash == NULL )
-        dht->hash = kc_hashRandom( parameters->hashSize );
+    {
+        kc_hash * randomHash = kc_hashRandom( parameters->hashSize );
+        if( randomHash == NULL )
+        {
+            kc_dhtFree( dht );
+            return NULL;
+        }
+        kc_hashMove( &dht->hash, randomHash );
+        kc_hashFree( randomHash );
+    }
     else
     {
         if( kc_hashLength( hash ) != parameters->hashSize )
@@ -159,7 +204,7 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
             kc_dhtFree( dht );
             return NULL;
         }
-        dht->hash = kc_hashDup( hash );
+        kc_hashMove( &dht->hash, hash );
     }
     
     kc_logVerbose( "kc_dhtInit: identities init" );
@@ -167,10 +212,10 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
     *dht->identities = NULL;
     
     kc_logVerbose( "kc_dhtInit: keys init" );
-    dht->keys = rbtNew( kc_hashCmp );
+    dht->keys = kc_storeInit( KEYS_SHARD_BITS, 0 );
     if( dht->keys == NULL )
     {
-        kc_logAlert( "kc_dhtInit: failed creating Keys RBT" );
+        kc_logAlert( "kc_dhtInit: failed creating key store" );
         kc_dhtFree( dht );
         return NULL;
     }
@@ -183,34 +228,77 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
         kc_dhtFree( dht );
         return NULL;
     }
+    dht->sessionIndex = kc_sessionIndexInit( dht->parameters->maxSessionCount );
+    if( dht->sessionIndex == NULL )
+    {
+        kc_logAlert( "kc_dhtInit: failed creating Sessions index" );
+        kc_dhtFree( dht );
+        return NULL;
+    }
+    /* Grown as buckets get split */
+    dht->contactIndex = dhtContactIndexInit( dht->parameters->bucketSize * 4 );
+    if( dht->contactIndex == NULL )
+    {
+        kc_logAlert( "kc_dhtInit: failed creating contact index" );
+        kc_dhtFree( dht );
+        return NULL;
+    }
     
-    kc_logVerbose( "kc_dhtInit: buckets init" );
-    dht->buckets = calloc( sizeof(dhtBucket*), BUCKET_COUNT );
-    int i;
-    for( i = 0; i < BUCKET_COUNT; i++ )
+    kc_logVerbose( "kc_dhtInit: timers init" );
+    dht->wheel = kc_wheelInit( WHEEL_TICK );
+    if( dht->wheel == NULL )
+    {
+        kc_logAlert( "kc_dhtInit: failed creating timing wheel" );
+        kc_dhtFree( dht );
+        return NULL;
+    }
+    
+    if( dht->parameters->storePath != NULL )
     {
-        dht->buckets[i] = dhtBucketInit( parameters->bucketSize );
-        if ( dht->buckets[i] == NULL )
+        kc_logVerbose( "kc_dhtInit: journal init" );
+        /* Replayed objects aren't journaled again, as the journal isn't set yet */
+        kc_journal * journal = kc_journalOpen( dht->parameters->storePath, dhtValueReplay, dht );
+        if( journal == NULL )
         {
-            kc_logAlert( "kc_dhtInit: bucket init failed" );
+            kc_logAlert( "kc_dhtInit: failed opening store journal %s", dht->parameters->storePath );
             kc_dhtFree( dht );
             return NULL;
         }
+        dht->journal = journal;
+    }
+    
+    kc_logVerbose( "kc_dhtInit: buckets init" );
+    /* We start with one bucket covering the whole space, the others get created when it splits */
+    dht->buckets = calloc( sizeof(dhtBucket*), dht->parameters->hashSize );
+    if( dht->buckets == NULL )
+    {
+        kc_logAlert( "kc_dhtInit: buckets malloc failed" );
+        kc_dhtFree( dht );
+        return NULL;
     }
+    dht->buckets[0] = dhtBucketInitForDepth( dht );
+    if ( dht->buckets[0] == NULL )
+    {
+        kc_logAlert( "kc_dhtInit: bucket init failed" );
+        kc_dhtFree( dht );
+        return NULL;
+    }
+    dht->bucketCount = 1;
     
-    kc_logVerbose( "kc_dhtInit: replication timer init" );
+    kc_logVerbose( "kc_dhtInit: wheel timer init" );
     struct timeval tv;
-    tv.tv_sec = dht->parameters->replicationDelay;
-    tv.tv_usec = 0;
-    dht->replicationTimer = evperiodic_assign( NULL, dht->eventBase, &tv, dhtReplicate, dht );
-    if( dht->replicationTimer == NULL ) {
-        kc_logAlert( "kc_dhtInit: failed creating Replication Timer" );
+    tv.tv_sec = WHEEL_TICK / 1000;
+    tv.tv_usec = ( WHEEL_TICK % 1000 ) * 1000;
+    dht->wheelEvent = event_new( dht->eventBase, -1, EV_PERSIST, dhtWheelCB, dht );
+    if( dht->wheelEvent == NULL )
+    {
+        kc_logAlert( "kc_dhtInit: failed creating wheel timer" );
         kc_dhtFree( dht );
         return NULL;
     }
-    if( evtimer_add( dht->replicationTimer, &tv ) != 0)
+    if( event_add( dht->wheelEvent, &tv ) != 0 )
     {
-        kc_logAlert( "kc_dhtInit: failed adding replication timer" );
+        kc_logAlert( "kc_dhtInit: failed adding wheel timer" );
         kc_dhtFree( dht );
         return NULL;
     }
@@ -230,47 +318,71 @@ kc_dhtInit( kc_hash * hash, kc_dhtParameters * parameters )
 void
 kc_dhtFree( kc_dht * dht )
 {
-    /* We stop the background thread */
-
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    event_base_loopexit( dht->eventBase, &tv );
-    
+    /* We stop the background thread, it exits on the next wheel tick */
+    dht->stopping = 1;
     if( dht->eventThread != NULL )
         pthread_join( dht->eventThread, NULL );
     
-    event_base_free( dht->eventBase );
+    /* Pending sessions end as if they timed out, so that their callbacks release
+     * the lookups they keep alive. They can't start new ones, as we are stopping */
+    if( dht->sessions != NULL )
+    {
+        RbtIterator sessIter;
+        while( ( sessIter = rbtBegin( dht->sessions ) ) != NULL )
+        {
+            void * session;
+            void * value;
+            rbtKeyValue( dht->sessions, sessIter, &session, &value );
+            kc_sessionCancel( session );
+        }
+        rbtDelete( dht->sessions );
+    }
+    kc_sessionIndexFree( dht->sessionIndex );
     
+    /* Their events belong to the base, free them first */
     if( dht->identities != NULL )
     {
-        dhtIdentity * identity;
-        for( identity = *dht->identities; identity != NULL; identity++ )
+        dhtIdentity ** identity;
+        for( identity = dht->identities; *identity != NULL; identity++ )
         {
-            dhtIdentityFree( identity );
+            dhtIdentityFree( *identity );
         }
         free( dht->identities );
     }
     
-    if( dht->sessions != NULL )
-        rbtDelete( dht->sessions );
+    if( dht->wheelEvent != NULL )
+        event_free( dht->wheelEvent );
+    if( dht->eventBase != NULL )
+        event_base_free( dht->eventBase );
+    dhtContactIndexFree( dht->contactIndex );
+    kc_journalClose( dht->journal );
     if( dht->keys != NULL )
-        rbtDelete( dht->keys );
+    {
+        kc_storeForEach( dht->keys, dhtValueFree, NULL );
+        kc_storeFree( dht->keys );
+    }
     
     if( dht->buckets != NULL )
     {
         int i;
-        for( i = 0; i < BUCKET_COUNT; i++ )
+        for( i = 0; i < dht->bucketCount; i++ )
+        {
+            if( dht->buckets[i]->refreshLookup != NULL )
+                kc_dhtLookupFree( dht->buckets[i]->refreshLookup );
             dhtBucketFree( dht->buckets[i] );
+        }
         free( dht->buckets );
     }
     
+    /* Last, freeing lookups cancels their timers */
+    kc_wheelFree( dht->wheel );
+    
     if( dht->parameters )
         free( dht->parameters );
-    if( dht->hash )
-        kc_hashFree( dht->hash );
     if( &dht->lock )
         pthread_mutex_destroy( &dht->lock );
+    pthread_mutex_destroy( &dht->contactLock );
+    pthread_mutex_destroy( &dht->sessionLock );
     
     free( dht );
 }
@@ -283,7 +395,7 @@ eventLog( int severity, const char *msg )
         lvl = KADC_LOG_ERROR;
     else
         lvl = KADC_LOG_DEBUG;
-    kc_logPrint( lvl, msg );
+    kc_logAt( lvl, "%s", msg );
 }
 
 void *
@@ -292,24 +404,12 @@ eventLoop( void * arg )
     kc_dht * dht = arg;
     kc_logVerbose( "eventLoop: started with DHT %p", arg );
     
-    while( 1 )
+    /* The wheel timer keeps the loop busy until kc_dhtFree() breaks it */
+    int status = event_base_loop( dht->eventBase, 0 );
+    if( status != 0 )
     {
-        if( dht->eventBase == NULL )
-        {
-            break;
-        }
-        
-        struct timeval tv;
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
-        event_base_loopexit( dht->eventBase, &tv );
-        int status = event_base_loop( dht->eventBase, 0 );
-        if( status != 0 )
-        {
-            kc_logAlert( "eventLoop: exiting with error %d", status );
-            return (void*)1;
-        }
-//        kc_logVerbose( "eventLoop: looping!" );
+        kc_logAlert( "eventLoop: exiting with error %d", status );
+        return (void*)1;
     }
     kc_logVerbose( "eventLoop: exiting" );
     return 0;
@@ -352,7 +452,7 @@ kc_dhtAddIdentity( kc_dht * dht, kc_contact * contact )
     
     void *tmp;
     
-    if( ( tmp = realloc( dht->identities, sizeof(kc_contact*) * ( identityCount + 1 ) ) ) == NULL )
+    if( ( tmp = realloc( dht->identities, sizeof(dhtIdentity*) * ( identityCount + 2 ) ) ) == NULL )
     {
         kc_logAlert( "Failed realloc()ating identities array !" );
         kc_dhtUnlock( dht );
@@ -366,34 +466,371 @@ kc_dhtAddIdentity( kc_dht * dht, kc_contact * contact )
     return 0;
 }
 
+#pragma mark Routing table
+
+/* Returns the number of leading bits hash shares with our hash */
+static int
+dhtCommonPrefix( const kc_dht * dht, const kc_hash * hash )
+{
+    int bitCount = ( kc_hashLength( &dht->hash ) + 7 ) / 8 * 8;
+    int logDist = kc_hashXorlog( &dht->hash, hash );
+    if( logDist < 0 )
+        return bitCount;
+    
+    return bitCount - 1 - logDist;
+}
+
+/* Reads the bucket count, so that buckets can be indexed without the dht lock.
+ * dhtSplitLastBucket() stores a new bucket before publishing the count covering it */
+static int
+dhtLoadBucketCount( const kc_dht * dht )
+{
+    int count = *(volatile int *)&dht->bucketCount;
+    __sync_synchronize();
+    return count;
+}
+
+/* Returns the index of the bucket for hash, or -1 if it is our own hash */
+static int
+dhtBucketIndexForHash( const kc_dht * dht, const kc_hash * hash )
+{
+    int prefix = dhtCommonPrefix( dht, hash );
+    if( prefix >= kc_hashLength( &dht->hash ) )
+        return -1;
+    
+    int last = dhtLoadBucketCount( dht ) - 1;
+    return ( prefix < last ? prefix : last );
+}
+
 static dhtBucket *
 dhtBucketForHash( const kc_dht * dht, const kc_hash * hash )
 {
-    int logDist = kc_hashXorlog( dht->hash, hash );
-    if( logDist <= 0 )
+    int index = dhtBucketIndexForHash( dht, hash );
+    if( index < 0 )
         return NULL;
     
     /* Get this node's bucket */
-    return dht->buckets[logDist];
+    return dht->buckets[index];
+}
+
+/* Returns the bucket for hash, locked, or NULL if it is our own hash.
+ * The last bucket may split between the lookup and the lock, so check it still covers hash.
+ * Splits hold the lock of the bucket they split, so this holds until it gets unlocked */
+static dhtBucket *
+dhtBucketLockForHash( const kc_dht * dht, const kc_hash * hash )
+{
+    for( ;; )
+    {
+        dhtBucket * bucket = dhtBucketForHash( dht, hash );
+        if( bucket == NULL )
+            return NULL;
+        
+        dhtBucketLock( bucket );
+        if( dhtBucketForHash( dht, hash ) == bucket )
+            return bucket;
+        dhtBucketUnlock( bucket );
+    }
+}
+
+/* Picks a random hash in the range of the bucket at index */
+static void
+dhtRandomHashForBucket( const kc_dht * dht, int index, kc_hash * hash )
+{
+    int length = kc_hashLength( &dht->hash );
+    int i;
     
+    kc_hashMove( hash, &dht->hash );
+    for( i = index; i < length; i++ )
+    {
+        unsigned char mask = 0x80 >> ( i % 8 );
+        int set;
+        
+        /* All buckets but the last one share exactly index bits with us */
+        if( i == index && index < dhtLoadBucketCount( dht ) - 1 )
+            set = !( hash->id.bytes[i / 8] & mask );
+        else
+            set = random() & 1;
+        
+        if( set )
+            hash->id.bytes[i / 8] |= mask;
+        else
+            hash->id.bytes[i / 8] &= ~mask;
+    }
 }
 
+/* Inserts a node in its bucket, indexing its contact. Must be called with the bucket locked */
 static kc_dhtNode *
-dhtNodeForContact( const kc_dht * dht, const kc_contact * contact )
+dhtTableInsert( kc_dht * dht, dhtBucket * bucket, kc_contact * contact, const kc_hash * hash )
 {
-    /* TODO: Make this work */
-    return NULL;
+    kc_dhtNode * node = dhtBucketInsert( bucket, contact, hash );
+    if( node == NULL )
+        return NULL;
+    
+    pthread_mutex_lock( &dht->contactLock );
+    if( dhtContactIndexInsert( dht->contactIndex, contact, hash ) != 0 )
+        kc_logAlert( "Failed indexing node %s by contact", hashtoa( hash ) );
+    pthread_mutex_unlock( &dht->contactLock );
+    return node;
+}
+
+/* Removes a node from its bucket and from the contact index, freeing its contact.
+ * Must be called with the bucket locked */
+static void
+dhtTableRemove( kc_dht * dht, dhtBucket * bucket, kc_dhtNode * node )
+{
+    kc_contact * contact = node->contact;
+    
+    pthread_mutex_lock( &dht->contactLock );
+    dhtContactIndexRemove( dht->contactIndex, contact, &node->hash );
+    pthread_mutex_unlock( &dht->contactLock );
+    
+    dhtBucketRemove( bucket, node );
+    kc_contactFree( contact );
+}
+
+/* Gets the hash of the node at contact in our buckets. Returns 0 if there is one, -1 otherwise */
+static int
+dhtHashForContact( const kc_dht * dht, const kc_contact * contact, kc_hash * hash )
+{
+    int status;
+    
+    pthread_mutex_lock( (pthread_mutex_t *)&dht->contactLock );
+    status = dhtContactIndexFind( dht->contactIndex, contact, hash );
+    pthread_mutex_unlock( (pthread_mutex_t *)&dht->contactLock );
+    return status;
+}
+
+/* Fills a bucket up from its replacement cache, most-recently seen first.
+ * Must be called with the bucket locked */
+static void
+dhtBucketPromote( kc_dht * dht, dhtBucket * bucket )
+{
+    kc_contact    * contact;
+    kc_hash         hash;
+    time_t          lastSeen;
+    
+    while( !dhtBucketIsFull( bucket ) && ( contact = dhtBucketTakeReplacement( bucket, &hash, &lastSeen ) ) != NULL )
+    {
+        if( dhtBucketFind( bucket, &hash ) != NULL )
+        {
+            kc_contactFree( contact );
+            continue;
+        }
+        
+        kc_logVerbose( "Promoting replacement %s", hashtoa( &hash ) );
+        kc_dhtNode * node = dhtTableInsert( dht, bucket, contact, &hash );
+        assert( node != NULL );
+        node->lastSeen = lastSeen;
+        bucket->lastChanged = time( NULL );
+    }
+}
+
+/* Expires the nodes of a bucket we didn't hear of for expirationDelay,
+ * and refreshes it with a lookup if it didn't change for refreshDelay */
+static void
+dhtBucketTimeout( kc_wheelTimer * timer, void * ref )
+{
+    kc_dht        * dht = ref;
+    dhtBucket     * bucket = (dhtBucket*)timer;
+    time_t          now = time( NULL );
+    kc_dhtNode    * node;
+    int             index;
+    
+    kc_dhtLock( dht );
+    for( index = 0; index < dht->bucketCount; index++ )
+    {
+        if( dht->buckets[index] == bucket )
+            break;
+    }
+    kc_dhtUnlock( dht );
+    
+    dhtBucketLock( bucket );
+    
+    /* Nodes are in lastSeen order, so this only walks the expired ones */
+    node = dhtBucketOldest( bucket );
+    while( node != NULL && now - node->lastSeen >= dht->parameters->expirationDelay )
+    {
+        kc_dhtNode * next = dhtBucketNext( bucket, node );
+        kc_logVerbose( "Node %s expired", hashtoa( &node->hash ) );
+        dhtTableRemove( dht, bucket, node );
+        node = next;
+    }
+    dhtBucketPromote( dht, bucket );
+    node = dhtBucketOldest( bucket );
+    
+    int refresh = ( now - bucket->lastChanged >= dht->parameters->refreshDelay );
+    if( refresh )
+        bucket->lastChanged = now;
+    
+    time_t next = bucket->lastChanged + dht->parameters->refreshDelay;
+    if( node != NULL && node->lastSeen + dht->parameters->expirationDelay < next )
+        next = node->lastSeen + dht->parameters->expirationDelay;
+    
+    kc_dhtLookup * lastLookup = ( refresh ? bucket->refreshLookup : NULL );
+    if( refresh )
+        bucket->refreshLookup = NULL;
+    
+    dhtBucketUnlock( bucket );
+    
+    kc_wheelSchedule( dht->wheel, timer, ( next - now ) * 1000L );
+    if( !refresh )
+        return;
+    
+    /* The previous refresh ended long ago */
+    if( lastLookup != NULL )
+        kc_dhtLookupFree( lastLookup );
+    
+    kc_hash target;
+    dhtRandomHashForBucket( dht, index, &target );
+    kc_logVerbose( "Refreshing bucket %d with a lookup for %s", index, hashtoa( &target ) );
+    
+    kc_dhtLookup * lookup = kc_dhtLookupStart( dht, &target, 0, NULL, NULL );
+    if( lookup == NULL )
+    {
+        kc_logAlert( "Failed refreshing bucket %d", index );
+        return;
+    }
+    dhtBucketLock( bucket );
+    bucket->refreshLookup = lookup;
+    dhtBucketUnlock( bucket );
+}
+
+/* Allocates a bucket for the end of the table, and schedules its refresh.
+ * In relaxed mode, buckets get room for twice bucketSize nodes, which is
+ * only used while they are within relaxedDepth of our own range */
+static dhtBucket *
+dhtBucketInitForDepth( kc_dht * dht )
+{
+    dhtBucket * bucket;
+    
+    if( dht->parameters->relaxedDepth > 0 )
+    {
+        bucket = dhtBucketInit( dht->parameters->bucketSize * 2 );
+        if( bucket != NULL )
+            bucket->limit = dht->parameters->bucketSize;
+    }
+    else
+        bucket = dhtBucketInit( dht->parameters->bucketSize );
+    
+    if( bucket == NULL )
+        return NULL;
+    
+    bucket->lastChanged = time( NULL );
+    bucket->refreshLookup = NULL;
+    kc_wheelTimerInit( &bucket->refreshTimer, dhtBucketTimeout, dht );
+    kc_wheelSchedule( dht->wheel, &bucket->refreshTimer, dht->parameters->refreshDelay * 1000L );
+    return bucket;
+}
+
+static void
+dhtUpdateBucketLimits( kc_dht * dht )
+{
+    int last = dht->bucketCount - 1;
+    int i;
+    
+    if( dht->parameters->relaxedDepth <= 0 )
+        return;
+    
+    for( i = 0; i < last; i++ )
+    {
+        dhtBucket * bucket = dht->buckets[i];
+        dhtBucketLock( bucket );
+        bucket->limit = ( last - i <= dht->parameters->relaxedDepth ? bucket->size : dht->parameters->bucketSize );
+        
+        /* A bucket leaving the relaxed depth keeps its freshest nodes, the others become replacements */
+        while( dhtBucketCount( bucket ) > bucket->limit )
+        {
+            kc_dhtNode * node = dhtBucketOldest( bucket );
+            kc_contact * contact = kc_contactDup( node->contact );
+            kc_hash hash;
+            time_t lastSeen = node->lastSeen;
+            
+            kc_hashMove( &hash, &node->hash );
+            dhtTableRemove( dht, bucket, node );
+            if( contact != NULL )
+                dhtBucketAddReplacement( bucket, contact, &hash, lastSeen );
+        }
+        dhtBucketUnlock( bucket );
+    }
+}
+
+/* Splits the bucket covering our own range in two : the nodes sharing
+ * exactly bucketCount - 1 bits with us stay, the closer ones move to a new last bucket.
+ * Node pointers of the moved nodes are invalidated.
+ * Returns 0 on success, -1 if the table can't be split further */
+static int
+dhtSplitLastBucket( kc_dht * dht )
+{
+    int last = dht->bucketCount - 1;
+    
+    if( dht->bucketCount >= kc_hashLength( &dht->hash ) )
+        return -1;
+    
+    dhtBucket * oldBucket = dht->buckets[last];
+    dhtBucket * newBucket = dhtBucketInitForDepth( dht );
+    if( newBucket == NULL )
+    {
+        kc_logAlert( "dhtSplitLastBucket: bucket init failed" );
+        return -1;
+    }
+    
+    dhtBucketLock( oldBucket );
+    
+    kc_dhtNode * node = dhtBucketOldest( oldBucket );
+    while( node != NULL )
+    {
+        kc_dhtNode * next = dhtBucketNext( oldBucket, node );
+        if( dhtCommonPrefix( dht, &node->hash ) > last )
+        {
+            /* Keep their LRU order, their lastSeen and their round-trip-time */
+            kc_dhtNode * moved = dhtBucketInsert( newBucket, node->contact, &node->hash );
+            moved->lastSeen = node->lastSeen;
+            moved->srtt = node->srtt;
+            moved->rttvar = node->rttvar;
+            moved->rto = node->rto;
+            dhtBucketRemove( oldBucket, node );
+        }
+        node = next;
+    }
+    
+    /* Replacements follow their range, keeping their order */
+    int i, kept = 0;
+    for( i = 0; i < oldBucket->replacementCount; i++ )
+    {
+        dhtReplacement * replacement = &oldBucket->replacements[i];
+        if( dhtCommonPrefix( dht, &replacement->hash ) > last )
+            dhtBucketAddReplacement( newBucket, replacement->contact, &replacement->hash, replacement->lastSeen );
+        else
+            oldBucket->replacements[kept++] = *replacement;
+    }
+    oldBucket->replacementCount = kept;
+    dhtBucketPromote( dht, oldBucket );
+    dhtBucketPromote( dht, newBucket );
+    
+    newBucket->lastChanged = oldBucket->lastChanged;
+    
+    /* Lock-free readers must see the bucket before the count covering it */
+    dht->buckets[last + 1] = newBucket;
+    __sync_synchronize();
+    dht->bucketCount++;
+    
+    dhtBucketUnlock( oldBucket );
+    
+    dhtUpdateBucketLimits( dht );
+    
+    kc_logVerbose( "Split bucket %d, %d nodes stayed, %d moved", last, dhtBucketCount( oldBucket ), dhtBucketCount( newBucket ) );
+    return 0;
 }
 
 dhtIdentity *
 kc_dhtIdentityForContact( const kc_dht * dht,  kc_contact * contact )
 {
-    dhtIdentity * identity;
-    for( identity = *dht->identities; identity != NULL; identity++ )
+    dhtIdentity ** identity;
+    for( identity = dht->identities; *identity != NULL; identity++ )
     {
-        if( kc_contactGetType( identity->us ) == kc_contactGetType( contact ) )
+        if( kc_contactGetType( (*identity)->us ) == kc_contactGetType( contact ) )
         {
-            return identity;
+            return *identity;
         }
     }
     return NULL;
@@ -403,6 +840,8 @@ kc_session *
 kc_dhtCreateAndAddIncomingSession( kc_dht * dht, kc_contact * connectContact, kc_messageType msgType, kc_sessionCallback callback )
 {
     kc_session * session = kc_sessionInit( dht, connectContact, msgType, 1, callback );
+    if( session == NULL )
+        return NULL;
     if( kc_dhtAddSession( dht, session ) != 0 )
     {
         kc_sessionFree( session );
@@ -421,6 +860,8 @@ kc_session *
 kc_dhtCreateAndAddOutgoingSession( kc_dht * dht, kc_contact * connectContact, kc_messageType msgType, kc_sessionCallback callback )
 {
     kc_session * session = kc_sessionInit( dht, connectContact, msgType, 0, callback );
+    if( session == NULL )
+        return NULL;
     if( kc_dhtAddSession( dht, session ) != 0 )
     {
         kc_sessionFree( session );
@@ -441,83 +882,348 @@ kc_dhtAddSession( kc_dht * dht, kc_session * session )
     assert( dht != NULL );
     assert( session != NULL );
     int status;
+    
+    if( dht->stopping )
+        return -1;
+    
+    pthread_mutex_lock( &dht->sessionLock );
     status = rbtInsert( dht->sessions, session, NULL );
     if( status != RBT_STATUS_OK )
     {
-        kc_logError( "kc_dhtAddSession: Failed inserting session in DHT" );
+        pthread_mutex_unlock( &dht->sessionLock );
+        /* Duplicates are expected, callers check kc_dhtHasSession() */
+        if( status == RBT_STATUS_DUPLICATE_KEY )
+            kc_logVerbose( "kc_dhtAddSession: A session to %s is already pending", kc_contactPrint( kc_sessionGetContact( session ) ) );
+        else
+            kc_logError( "kc_dhtAddSession: Failed inserting session in DHT" );
+        return -1;
+    }
+    status = kc_sessionIndexInsert( dht->sessionIndex, session );
+    if( status != 0 )
+    {
+        rbtEraseKey( dht->sessions, session );
+        pthread_mutex_unlock( &dht->sessionLock );
+        kc_logError( "kc_dhtAddSession: Failed indexing session" );
         return -1;
     }
+    pthread_mutex_unlock( &dht->sessionLock );
     return 0;
 }
 
+int
+kc_dhtHasSession( kc_dht * dht, const kc_contact * contact, int incoming, kc_messageType type )
+{
+    assert( dht != NULL );
+    assert( contact != NULL );
+    int found;
+    
+    pthread_mutex_lock( &dht->sessionLock );
+    found = ( kc_sessionIndexFind( dht->sessionIndex, contact, incoming, type ) != NULL );
+    pthread_mutex_unlock( &dht->sessionLock );
+    return found;
+}
+
 int
 kc_dhtDeleteSession( kc_dht * dht, kc_session * session )
 {
     
     RbtIterator sessIter;
+    pthread_mutex_lock( &dht->sessionLock );
     sessIter = rbtFind( dht->sessions, session );
     if( sessIter == NULL )
     {
+        pthread_mutex_unlock( &dht->sessionLock );
         kc_logError( "kc_dhtDeleteSession: session not found" );
         return -1;
     }
     rbtErase( dht->sessions, sessIter );
+    kc_sessionIndexRemove( dht->sessionIndex, session );
+    pthread_mutex_unlock( &dht->sessionLock );
     return 0;
 }
 
 static kc_session *
 dhtSessionForMsg( const kc_dht * dht, kc_message * msg )
 {
-    RbtIterator sessIter;
-    for( sessIter = rbtBegin( dht->sessions ); sessIter != NULL; sessIter = rbtNext( dht->sessions, sessIter ) )
-    {
-        kc_session * session;
-        kc_dhtNode * node;
-        rbtKeyValue( dht->sessions, sessIter, (void*)&session, NULL );
-        
-        if( kc_contactCmp( node->contact, kc_messageGetContact( msg ) ) && kc_sessionGetType( session ) == kc_messageGetType( msg ) )
-        {
-            return session;
-        }
-    }
-    return NULL;
+    const kc_contact * contact = kc_messageGetContact( msg );
+    kc_messageType type = kc_messageGetType( msg );
+    
+    /* Answers to our own requests first, then running incoming sessions */
+    pthread_mutex_lock( (pthread_mutex_t *)&dht->sessionLock );
+    kc_session * session = kc_sessionIndexFind( dht->sessionIndex, contact, 0, type );
+    if( session == NULL )
+        session = kc_sessionIndexFind( dht->sessionIndex, contact, 1, type );
+    pthread_mutex_unlock( (pthread_mutex_t *)&dht->sessionLock );
+    return session;
 }
 
 static kc_dhtNode *
 dhtNodeForHash( const kc_dht * dht, kc_hash * hash )
 {
-    int logDist = kc_hashXorlog( dht->hash, hash );
-    if( logDist < 0 )
-    {
-        return NULL;
-    }
-    
     /* Get this node's bucket */
-    dhtBucket     * bucket = dht->buckets[logDist];
+    dhtBucket     * bucket = dhtBucketLockForHash( dht, hash );
     kc_dhtNode    * node;
     
-    RbtIterator nodeIter = rbtFind( bucket->nodes, hash );
-    if( nodeIter == NULL )
+    if( bucket == NULL )
         return NULL;
-    
-    rbtKeyValue( bucket->nodes, nodeIter, NULL, (void**)&node );
+    node = dhtBucketFind( bucket, hash );
+    dhtBucketUnlock( bucket );
     return node;
 }
 
+long
+dhtRtoForHash( const kc_dht * dht, const kc_hash * hash )
+{
+    dhtBucket     * bucket = dhtBucketLockForHash( dht, hash );
+    kc_dhtNode    * node;
+    long            rto = DHT_RTO_INITIAL;
+    
+    if( bucket == NULL )
+        return rto;
+    node = dhtBucketFind( bucket, hash );
+    if( node != NULL )
+        rto = node->rto;
+    dhtBucketUnlock( bucket );
+    return rto;
+}
+
+void
+dhtRttForHash( const kc_dht * dht, const kc_hash * hash, long rtt )
+{
+    dhtBucket     * bucket = dhtBucketLockForHash( dht, hash );
+    kc_dhtNode    * node;
+    
+    if( bucket == NULL )
+        return;
+    node = dhtBucketFind( bucket, hash );
+    if( node != NULL )
+    {
+        if( rtt < 0 )
+            dhtNodeBackoffRto( node );
+        else
+            dhtNodeUpdateRtt( node, rtt );
+    }
+    dhtBucketUnlock( bucket );
+}
+
+int
+dhtContactSeen( const kc_dht * dht, const kc_contact * contact, long rtt )
+{
+    kc_hash hash;
+    
+    if( dhtHashForContact( dht, contact, &hash ) != 0 )
+        return 0;
+    
+    dhtBucket * bucket = dhtBucketLockForHash( dht, &hash );
+    if( bucket == NULL )
+        return 0;
+    kc_dhtNode * node = dhtBucketFind( bucket, &hash );
+    if( node != NULL )
+    {
+        dhtBucketTouch( bucket, node );
+        if( rtt >= 0 )
+            dhtNodeUpdateRtt( node, rtt );
+    }
+    dhtBucketUnlock( bucket );
+    return ( node != NULL );
+}
+
+static void
+dhtBucketProbe( kc_dht * dht, dhtBucket * bucket );
+
+/* Settles a probe of the least-recently seen node of a bucket : if it answered, it goes
+ * to the tail of its bucket, otherwise it gets replaced by the freshest replacement */
+static int
+dhtProbeCallback( const kc_dht * constDht, kc_session * session, const kc_message * msg )
+{
+    kc_dht        * dht = (kc_dht *)constDht;
+    dhtBucket     * bucket = kc_sessionGetRef( session );
+    kc_hash         hash;
+    
+    dhtBucketLock( bucket );
+    kc_hashMove( &hash, &bucket->probeHash );
+    bucket->probing = 0;
+    dhtBucketUnlock( bucket );
+    
+    /* The node may have moved to a new bucket since, if this one got split */
+    bucket = dhtBucketLockForHash( dht, &hash );
+    if( bucket == NULL )
+        return 1;
+    kc_dhtNode * node = dhtBucketFind( bucket, &hash );
+    if( node != NULL && msg != NULL )
+    {
+        dhtBucketTouch( bucket, node );
+        dhtNodeUpdateRtt( node, kc_sessionGetElapsed( session ) );
+    }
+    else if( node != NULL )
+    {
+        kc_logVerbose( "Node %s didn't answer our probe, replacing it", hashtoa( &hash ) );
+        dhtTableRemove( dht, bucket, node );
+        dhtBucketPromote( dht, bucket );
+    }
+    dhtBucketUnlock( bucket );
+    
+    /* Go on with the next least-recently seen node, if replacements are still waiting */
+    dhtBucketProbe( dht, bucket );
+    return 1;
+}
+
+/* Sends a single asynchronous PING to the least-recently seen node of a full bucket,
+ * if it was seen before its freshest replacement and no probe is in flight already */
+static void
+dhtBucketProbe( kc_dht * dht, dhtBucket * bucket )
+{
+    dhtBucketLock( bucket );
+    
+    kc_dhtNode * node = dhtBucketOldest( bucket );
+    if( bucket->probing || !dhtBucketIsFull( bucket ) || node == NULL ||
+        node->lastSeen >= dhtBucketNewestReplacement( bucket ) )
+    {
+        dhtBucketUnlock( bucket );
+        return;
+    }
+    
+    kc_contact * contact = kc_contactDup( node->contact );
+    if( contact == NULL )
+    {
+        dhtBucketUnlock( bucket );
+        return;
+    }
+    long rto = node->rto;
+    kc_hashMove( &bucket->probeHash, &node->hash );
+    bucket->probing = 1;
+    
+    dhtBucketUnlock( bucket );
+    
+    /* Outside of the bucket lock, node admission never waits on the network */
+    int status = -1;
+    kc_session * session = kc_dhtCreateAndAddOutgoingSession( dht, contact, DHT_RPC_PING, dhtProbeCallback );
+    if( session != NULL )
+    {
+        kc_sessionSetRef( session, bucket );
+        kc_sessionSetTimeout( session, rto );
+        
+        kc_message * msg = kc_messageInit( contact, DHT_RPC_PING, 0, NULL );
+        if( msg != NULL )
+        {
+            status = dht->parameters->callbacks.writeCallback( dht, NULL, msg );
+            if( status == 0 )
+                status = kc_sessionSend( session, msg );
+            kc_messageFree( msg );
+        }
+        if( status != 0 )
+        {
+            kc_dhtDeleteSession( dht, session );
+            kc_sessionFree( session );
+        }
+    }
+    
+    if( status != 0 )
+    {
+        /* Most likely something else is waiting on this node already, try again on the next candidate */
+        kc_logVerbose( "Failed probing %s", kc_contactPrint( contact ) );
+        dhtBucketLock( bucket );
+        bucket->probing = 0;
+        dhtBucketUnlock( bucket );
+    }
+    /* The session has its own */
+    kc_contactFree( contact );
+}
+
+/* Caches a copy of a node that doesn't fit in its full bucket, then unlocks
+ * the bucket and probes its least-recently seen node */
+static void
+dhtBucketOfferReplacement( kc_dht * dht, dhtBucket * bucket, const kc_contact * contact, const kc_hash * hash )
+{
+    kc_contact * contactCopy = kc_contactDup( contact );
+    if( contactCopy != NULL )
+        dhtBucketAddReplacement( bucket, contactCopy, hash, time( NULL ) );
+    dhtBucketUnlock( bucket );
+    
+    dhtBucketProbe( dht, bucket );
+}
+
+int
+dhtOfferNode( kc_dht * dht, const kc_contact * contact, const kc_hash * hash, long rtt )
+{
+    dhtBucket     * bucket = dhtBucketLockForHash( dht, hash );
+    kc_dhtNode    * node;
+    kc_dhtNode    * slowest = NULL;
+    
+    if( bucket == NULL )
+        return 0;
+    
+    node = dhtBucketFind( bucket, hash );
+    if( node != NULL )
+    {
+        dhtBucketTouch( bucket, node );
+        dhtBucketUnlock( bucket );
+        return 0;
+    }
+    
+    if( dhtBucketIsFull( bucket ) )
+    {
+        if( !dht->parameters->proximityRouting )
+        {
+            dhtBucketOfferReplacement( dht, bucket, contact, hash );
+            return 0;
+        }
+        
+        /* Proximity neighbour selection : every node in this bucket is as good as
+         * the others for routing, so keep the fastest ones */
+        for( node = dhtBucketOldest( bucket ); node != NULL; node = dhtBucketNext( bucket, node ) )
+        {
+            if( node->srtt != 0 && ( slowest == NULL || node->srtt > slowest->srtt ) )
+                slowest = node;
+        }
+        if( slowest == NULL || rtt * PROXIMITY_MARGIN >= slowest->srtt ||
+            slowest->srtt - rtt < PROXIMITY_MIN_GAIN )
+        {
+            dhtBucketOfferReplacement( dht, bucket, contact, hash );
+            return 0;
+        }
+    }
+    
+    kc_contact * contactCopy = kc_contactDup( contact );
+    if( contactCopy == NULL )
+    {
+        dhtBucketUnlock( bucket );
+        return 0;
+    }
+    
+    if( slowest != NULL )
+    {
+        kc_logVerbose( "Replacing node %s (%d ms) with %s (%ld ms)", hashtoa( &slowest->hash ), slowest->srtt,
+                      kc_contactPrint( contact ), rtt );
+        dhtTableRemove( dht, bucket, slowest );
+    }
+    
+    node = dhtTableInsert( dht, bucket, contactCopy, hash );
+    assert( node != NULL );
+    dhtNodeUpdateRtt( node, rtt );
+    bucket->lastChanged = time( NULL );
+    
+    dhtBucketUnlock( bucket );
+    return 1;
+}
+
 static int
-asyncCallback( const kc_dht * dht, const kc_message * msg )
+asyncCallback( const kc_dht * dht, kc_session * session, const kc_message * msg )
 {
     assert( dht != NULL );
-    assert( msg != NULL );
+    if( msg == NULL )
+    {
+        kc_hash hash;
+        if( dhtHashForContact( dht, kc_sessionGetContact( session ), &hash ) == 0 )
+            dhtRttForHash( dht, &hash, -1 );
+        return 1;
+    }
     
     switch( kc_messageGetType( msg ) )
     {
         case DHT_RPC_PING:
         {
-            kc_dhtNode * node = dhtNodeForContact( dht, kc_messageGetContact( msg ) );
-            dhtBucket * bucket = dhtBucketForHash( dht, node->hash );
-            bucket->lastChanged = time( NULL );
-            node->lastSeen = time( NULL );
+            dhtContactSeen( dht, kc_messageGetContact( msg ), kc_sessionGetElapsed( session ) );
             return 1;
             break;
         }
@@ -535,28 +1241,41 @@ dhtSendMessage( kc_dht * dht, kc_messageType type, kc_contact * contact )
     assert( dht != NULL );
     assert( contact != NULL );
     
+    /* Only one request per contact and type may wait for an answer, as replies are routed
+     * by contact and type. If one already does, this one is answered by the same reply,
+     * so don't send anything : that session may end anytime, and resending would skew its RTT sample */
     kc_session * session = kc_dhtCreateAndAddOutgoingSession( dht, contact, type, asyncCallback );
+    if( session == NULL && kc_dhtHasSession( dht, contact, 0, type ) )
+    {
+        kc_logVerbose( "dhtSendMessage: message type %d to %s already pending", type, kc_contactPrint( contact ) );
+        return 0;
+    }
+    if( session == NULL )
+    {
+        kc_logAlert( "Failed creating session for message type %d to %s", type, kc_contactPrint( contact ) );
+        return -1;
+    }
     
-    kc_message * answer = kc_messageInit( kc_sessionGetContact( session ), kc_sessionGetType( session ), 0, NULL );
+    kc_message * answer = kc_messageInit( (kc_contact*)kc_sessionGetContact( session ), kc_sessionGetType( session ), 0, NULL );
+    if( answer == NULL )
+        return -1;
     
     kc_logVerbose( "dhtSendMessage: Writing message type: %d", kc_sessionGetType( session ) );
     status = dht->parameters->callbacks.writeCallback( dht, NULL, answer );
     if( status )
     {
         kc_logAlert( "Failed writing message type %d, err %d", kc_sessionGetType( session ), status );
-        kc_dhtUnlock( dht );
+        kc_messageFree( answer );
         return -1;
     }
     
     status = kc_sessionSend( session, answer );
+    kc_messageFree( answer );
     if( status )
     {
         kc_logAlert( "Failed sending message type %d, err %d", kc_sessionGetType( session ), status );
-        kc_dhtUnlock( dht );
         return -1;
     }
-    
-    kc_dhtUnlock( dht );
 #if 0 
     if( session->callback == NULL )
     {
@@ -595,143 +1314,54 @@ dhtPingByIP( kc_dht * dht, kc_contact * contact, kc_hash * hash, int sync )
     return 0;
 }
 
+/* Sends STOREs for key to the closest nodes we know. It searches and sends,
+ * so it must be called without the DHT locked, with a copy of the key */
 static int
-dhtPingByHash( kc_dht * dht, kc_hash * hash, int sync )
-{
-    assert( dht != NULL );
-    
-    int logDist = kc_hashXorlog( dht->hash, hash );
-    if( logDist < 0 )
-    {
-        kc_logDebug( "Trying to ping our own node. Ignoring..." );
-        return -1;
-    }
-    
-    /* Get this node's bucket */
-    dhtBucket     * bucket = dht->buckets[logDist];
-    kc_dhtNode    * node;
-    
-    RbtIterator nodeIter = rbtFind( bucket->nodes, hash );
-    if( nodeIter == NULL )
-    {
-        kc_logDebug( "Can't find a node with hash %s. Ignoring...", hashtoa( hash ) );
-        return -1;
-    }
-    
-    rbtKeyValue( bucket->nodes, nodeIter, NULL, (void**)&node );
-    
-    return dhtPingByIP( dht, node->contact, node->hash, sync );
-}
-
-static int
-dhtStore( kc_dht * dht, void * key, dhtValue * value )
+dhtStore( kc_dht * dht, const kc_hash * key )
 {
-    kc_dhtNode ** nodes;
-    kc_dhtNode * node;
+    kc_dhtNode * nodes[dht->parameters->bucketSize];
     int status;
     int count;
+    int i;
     
     assert( dht != NULL );
     assert( key != NULL );
-    assert( value != NULL );
     
-    nodes = kc_dhtGetNodes( dht, key, &count );
+    count = kc_dhtGetClosestNodes( dht, key, nodes, dht->parameters->bucketSize );
     if( count == 0 )
     {
         kc_logDebug( "No known nodes to republish to. Ignoring..." );
         return 0;
     }
     
-    for( node = nodes[0]; node != NULL; node++ )
+    status = 0;
+    for( i = 0; i < count && status == 0; i++ )
+        status = dhtSendMessage( dht, DHT_RPC_STORE, nodes[i]->contact );
+    kc_dhtFreeNodes( nodes, count );
+    
+    if( status != 0 )
     {
-        status = dhtSendMessage( dht, DHT_RPC_STORE, node->contact );
-        if( status != 0 )
-        {
-            kc_logAlert( "Failed writing DHT_RPC_STORE message" );
-            return -1;
-        }
+        kc_logAlert( "Failed writing DHT_RPC_STORE message" );
+        return -1;
     }
-    
-    free( nodes );
     return 0;
 }
 
 static void*
-dhtPerformLookup( const kc_dht * dht, kc_hash * hash, int value )
+dhtFindValue( kc_dht * dht, kc_hash * key )
 {
-    /* We select alpha contacts from the non-empty closest bucket to the key.
-     * We can spill outside the bucket if fewer than alpha contacts, and closestNode must be noted
-     */
-    kc_dhtNode ** nodes;
-    kc_dhtNode * node;
-    kc_dhtNode * closestNode;
-    int count = KADC_PROBE_PARALLELISM;
-    int status;
-    nodes = kc_dhtGetNodes( dht, hash, &count );
-    if( count == 0 )
-    {
-        kc_logDebug( "No known nodes to perform lookup from. Ignoring..." );
-        return 0;
-    }
-    
-    if( count < KADC_PROBE_PARALLELISM )
-    {
-        /* FIXME: Spill ! */
-    }
-    
-    qsort( nodes, count, sizeof(kc_dhtNode), dhtNodeCmpHash );
-    closestNode = nodes[0];
-    
-    /* We create a shortlist by issuing a FIND_* to the selected contacts.
-     * A contact failing to answer is removed from the shortlist */
-    kc_dhtNode **tempNode;
-    for( tempNode = nodes; tempNode != NULL; tempNode++ )
-    {
-        
-    }
-    
-    /* TODO: Reselect alpha contacts from the shortlist and resend a FIND_* to them => PARALLEL SEARCH.
-     * We shouldn't re-send to already contacted contacts.
-     * We update closestNode accordingly.
-     * We continue until we can't find a node closer than closestNode, or we have k contacts */
-    /* TODO: If searching a value, the search end as soon as the value is found,
-     * and the value is stored at the closest node which did not return the value */
-    
-    /* Now send those messages ! */
-    for( node = nodes[0]; node != NULL; node++ )
-    {
-        kc_message * answer = kc_messageInit( node->contact, ( value ? DHT_RPC_FIND_VALUE : DHT_RPC_FIND_NODE ), 0, NULL );
-
-        status = dht->parameters->callbacks.writeCallback( dht, NULL, answer );
-        if( status != 0 )
-        {
-            kc_logAlert( "Failed writing %s message", ( value ? "DHT_RPC_FIND_VALUE" : "DHT_RPC_FIND_NODE" ) );
-            return NULL;
-        }
-        
-        status = kc_queueEnqueue( dht->sndQueue, answer );
-        if( status != 0 )
-        {
-            kc_logAlert( "Failed enqueing %s message", ( value ? "DHT_RPC_FIND_VALUE" : "DHT_RPC_FIND_NODE" ) );
-            return NULL;
-        }
-    }
+    kc_dhtLookup * lookup = kc_dhtLookupStart( dht, key, 1, NULL, NULL );
+    if( lookup == NULL )
+        return NULL;
     
-    free( nodes );
-    return NULL;
-}
-
-static void*
-dhtFindNode( const kc_dht * dht, kc_hash * hash )
-{
-    return dhtPerformLookup( dht, hash, 0 );
+    kc_dhtLookupWait( lookup, 0 );
+    void * value = kc_dhtLookupGetValue( lookup );
+    kc_logDebug( "Value lookup for %s: %s after %d hops, %ld ms", hashtoa( key ), ( value != NULL ? "found" : "not found" ),
+                kc_dhtLookupGetHops( lookup ), kc_dhtLookupGetLatency( lookup ) );
+    kc_dhtLookupFree( lookup );
+    return value;
 }
 
-static void*
-dhtFindValue( const kc_dht * dht, kc_hash * key )
-{
-    return dhtPerformLookup( dht, key, 1 );
-}
 #if 0
 static void
 ioCallback( void * ref, kc_message *msg )
@@ -783,311 +1413,797 @@ ioCallback( void * ref, kc_message *msg )
 }
 #endif
 
-#if 0
-void *
-dhtPulse( void * arg )
+int dhtRemoveNode( kc_dht * dht, kc_hash * hash )
 {
-    kc_dht * dht = arg;
+    assert( dht != NULL );
+    
+    /* Get this node's bucket */
+    kc_dhtNode    * node;
+    dhtBucket     * bucket = dhtBucketLockForHash( dht, hash );
+    
+    if( bucket == NULL )
+        return -1;
     
-    while( parameters->bucketSize != 0 )
+    node = dhtBucketFind( bucket, hash );
+    if( node == NULL )
     {
-        /* Sessions update */
-        RbtIterator sessIter;
-        for( sessIter = rbtBegin( dht->sessions );
-             sessIter != NULL;
-             sessIter = rbtNext( dht->sessions, sessIter ) )
-        {
-            
-            dhtSession * session;
-            rbtKeyValue( dht->sessions, sessIter, (void*)session, NULL );
-            if( session == NULL )
-                continue;
-            
-            if( session->callback != NULL )
-            {
-                /* This is a synchronous session, nothing to see here */
-                continue;
-            }
-            
-            kc_message * msg = kc_queueDequeueTimeout( session->queue, 0 );
-            if( msg == NULL )
-            {
-                /* No messages here, move on */
-                continue;
-            }
-            int status = session->callback( dht, msg );
-            if( status == -1 )
-            {
-                rbtEraseKey( dht->sessions, session );
-                dhtSessionFree( session );
-            }
-        }
-        /* Routing table refresh */
-        int i;
-        for( i = 0; i < BUCKET_COUNT; i++ )
-        {
-            dhtBucket   * bucket = dht->buckets[i];
-            if( time( NULL ) - bucket->lastChanged > KADC_REFRESH_DELAY )
-            {
-                dhtBucketLock( bucket );
-                
-                RbtIterator iter;
-                for( iter = rbtBegin( bucket->nodes ); iter != NULL; iter = rbtNext( bucket->nodes, iter ) )
-                {
-                    kc_dhtNode * node;
-                    rbtKeyValue( bucket->nodes, iter, NULL, (void**)&node );
-                    if( node != NULL && time( NULL ) - node->lastSeen > KADC_REFRESH_DELAY )
-                    {
-                        if( dhtPingByHash( dht, node->hash, 1 ) == 0 )
-                            continue;
-                        else
-                        {
-                            node->lastSeen = time( NULL );
-                            bucket->lastChanged = time( NULL );
-                            break;
-                        }
-                    }
-                }
-                
-                dhtBucketUnlock( bucket );
-            }
-        }
-        
-        /* Key/Value republish */
-        int replicateAll;
-        int needsCleanup = 0;
-        replicateAll = ( time( NULL ) - dht->lastReplication >= KADC_REPLICATION_DELAY );
-        if( replicateAll )
-            kc_logNormal( "Started replicating all our keys..." );
-        
-        RbtIterator keys;
-        for( keys = rbtBegin( dht->keys ); keys != NULL; keys = rbtNext( dht->keys, keys ) )
-        {
-            void * key;
-            dhtValue * value;
-            
-            rbtKeyValue( dht->keys, keys, (void**)&key, (void**)value);
-            assert( key != NULL );
-            assert( value != NULL );
-            
-            int replicateThis = 0;
-            time_t now = time( NULL );
-            
-            /* We need to expire it */
-            if( now - value->published >= KADC_EXPIRATION_DELAY )
-            {
-                /* I'm doing this in two pass because the deletion is likely to change
-                 * the RB tree and break the iterators I'm using */
-                value->published = 0;
-                needsCleanup = 0;
-                continue;
-            }
-            
-            /* If this is our value, we need to republish it */
-            if( value->mine && now - value->published >= KADC_REPUBLISH_DELAY )
-                replicateThis = 1;
-                
-            if( replicateThis || replicateAll )
-            {
-                dhtStore( dht, key, value );
-                if( replicateThis )
-                    value->published = now;
-            }
-        }
+        dhtBucketUnlock( bucket );
+        return -1;
+    }
+    /* We remove it */
+    dhtTableRemove( dht, bucket, node );
+    
+    dhtBucketUnlock( bucket );
+    
+    return 0;
+}
+
+/* Returns the bucket a node belongs to, locked, after splitting the last bucket
+ * as long as it is full and covers the node. Returns NULL for our own hash */
+static dhtBucket *
+dhtBucketForNewNode( kc_dht * dht, const kc_hash * hash )
+{
+    dhtBucket     * bucket;
+    int             canSplit = 1;
+    
+    for( ;; )
+    {
+        /* Get this node's bucket */
+        bucket = dhtBucketLockForHash( dht, hash );
+        if( bucket == NULL )
+            return NULL;
         
-        if( replicateAll )
-        {
-            kc_logNormal( "Replication ended..." );
-            dht->lastReplication = time( NULL );
-        }
+        if( !canSplit || dhtBucketFind( bucket, hash ) != NULL ||
+            !dhtBucketIsFull( bucket ) || bucket != dht->buckets[dhtLoadBucketCount( dht ) - 1] )
+            return bucket;
         
-        if( needsCleanup )
-        {
-            kc_logNormal( "Started cleanup of expired keys" );
+        /* This bucket is full and covers our own range, split it and try again */
+        dhtBucketUnlock( bucket );
         
-            /* Two pass replication, cleanup our keys */
-            for( keys = rbtBegin( dht->keys ); keys != NULL; keys = rbtNext( dht->keys, keys ) )
-            {
-                void * key;
-                dhtValue * value;
-                
-                rbtKeyValue( dht->keys, keys, (void**)&key, (void**)value);
-                assert( key != NULL );
-                assert( value != NULL );
-                
-                if( value->published == 0 )
-                {
-                    rbtErase( dht->keys, keys );
-                    keys = rbtBegin( dht->keys );
-                }
-            }
+        kc_dhtLock( dht );
+        if( bucket == dht->buckets[dht->bucketCount - 1] && dhtBucketIsFull( bucket ) )
+            canSplit = ( dhtSplitLastBucket( dht ) == 0 );
+        kc_dhtUnlock( dht );
+    }
+}
+
+int
+kc_dhtAddNode( kc_dht * dht, kc_contact * contact, kc_hash * hash )
+{
+    assert( dht != NULL );
+    
+    kc_dhtNode    * node;
+    dhtBucket     * bucket = dhtBucketForNewNode( dht, hash );
+    
+    if( bucket == NULL )
+    {
+        kc_logVerbose( "Trying to add our own node. Ignoring." );
+        return 0;
+    }
+    
+    node = dhtBucketFind( bucket, hash );
+    if( node != NULL )
+    {
+        // This node is already in our bucket list, let's update it's info */
+        kc_logDebug( "Node %s already in our bucket, updating...", hashtoa( hash ) );
+        /* We own contact now, keep only one of the two */
+        if( contact != node->contact && kc_contactCmp( node->contact, contact ) == 0 )
+            kc_contactFree( contact );
+        else if( contact != node->contact )
+        {
+            pthread_mutex_lock( &dht->contactLock );
+            dhtContactIndexRemove( dht->contactIndex, node->contact, hash );
+            if( dhtContactIndexInsert( dht->contactIndex, contact, hash ) != 0 )
+                kc_logAlert( "Failed indexing node %s by contact", hashtoa( hash ) );
+            pthread_mutex_unlock( &dht->contactLock );
             
-            kc_logNormal( "Cleanup ended" );
+            kc_contactFree( node->contact );
+            node->contact = contact;
         }
-            
-        /* Send our messages */
-        kc_message * msg;
-        i = 0;
-        if( time( NULL ) - dht->probeDelay >= KADC_PROBE_DELAY )
+        dhtBucketTouch( bucket, node );
+        /* FIXME: handle node type */
+        //        node->type = 0;
+        dhtBucketUnlock( bucket );
+        return 1;
+    }
+    
+    if( dhtBucketIsFull( bucket ) )
+    {
+        /* Keep it as a replacement, and check on the least-heard-of node in the background.
+         * If it doesn't answer, the freshest replacement takes its slot */
+        dhtBucketAddReplacement( bucket, contact, hash, time( NULL ) );
+        dhtBucketUnlock( bucket );
+        
+        dhtBucketProbe( dht, bucket );
+        return 0;
+    }
+    
+    /* We add it to this bucket, marked as seen just now */
+    /* FIXME: Handle node type here */
+    node = dhtTableInsert( dht, bucket, contact, hash );
+    assert( node != NULL );
+    bucket->lastChanged = time( NULL );
+    
+    dhtBucketUnlock( bucket );
+    return 0;
+}
+
+int
+dhtAdmitNode( kc_dht * dht, kc_contact * contact, const kc_hash * hash, time_t lastSeen, long rtt )
+{
+    dhtBucket * bucket = dhtBucketForNewNode( dht, hash );
+    if( bucket == NULL )
+        return 0;
+    
+    if( dhtBucketFind( bucket, hash ) != NULL || dhtBucketIsFull( bucket ) )
+    {
+        dhtBucketUnlock( bucket );
+        return 0;
+    }
+    
+    kc_dhtNode * node = dhtTableInsert( dht, bucket, contact, hash );
+    assert( node != NULL );
+    node->lastSeen = lastSeen;
+    if( rtt > 0 )
+        dhtNodeUpdateRtt( node, rtt );
+    bucket->lastChanged = time( NULL );
+    
+    dhtBucketUnlock( bucket );
+    return 1;
+}
+
+int
+dhtTableIsFull( kc_dht * dht )
+{
+    int full = 1;
+    int closest = 0;
+    int i;
+    
+    kc_dhtLock( dht );
+    for( i = 0; i < dht->bucketCount && full; i++ )
+    {
+        dhtBucket * bucket = dht->buckets[i];
+        
+        dhtBucketLock( bucket );
+        full = ( dhtBucketCount( bucket ) != 0 );
+        if( i >= dht->bucketCount - 2 )
+            closest += dhtBucketCount( bucket );
+        dhtBucketUnlock( bucket );
+    }
+    kc_dhtUnlock( dht );
+    
+    return ( full && closest >= dht->parameters->bucketSize ? i : 0 );
+}
+
+void
+kc_dhtCreateNode( kc_dht * dht, kc_contact * contact )
+{
+    assert( dht != NULL );
+    assert( contact != NULL );
+    
+    dhtPingByIP( dht, contact, NULL, 0 );
+}
+
+/*
+ * A routing table snapshot is a header, then the nodes of each bucket from the
+ * least-recently to the most-recently seen, all little-endian :
+ * <pre>
+ * HEADER   ::= "KCRT" <WORD version> <WORD hashSize> <DWORD savedAt> <WORD bucketCount> <WORD 0>
+ * BUCKET   ::= <WORD nodeCount> <NODE>*
+ * NODE     ::= <hash, hashSize bits rounded up to bytes> <BYTE 4|6> <address, 4|16 bytes>
+ *              <WORD port> <DWORD seconds since last seen> <WORD srtt, 0 if unknown>
+ * </pre>
+ */
+
+static void
+dhtTablePut( unsigned char ** p, uint32_t value, int size )
+{
+    int i;
+    for( i = 0; i < size; i++, value >>= 8 )
+        *(*p)++ = (unsigned char)value;
+}
+
+static uint32_t
+dhtTableGet( const unsigned char ** p, int size )
+{
+    uint32_t value = 0;
+    int i;
+    for( i = 0; i < size; i++ )
+        value |= (uint32_t)*(*p)++ << ( 8 * i );
+    return value;
+}
+
+/* Serializes a node into buffer, returns its size or 0 if its contact can't be saved */
+static int
+dhtTablePutNode( const kc_dht * dht, const kc_dhtNode * node, time_t now, unsigned char * buffer )
+{
+    unsigned char * p = buffer;
+    int addrLength;
+    
+    switch( kc_contactGetType( node->contact ) )
+    {
+        case AF_INET:
+            addrLength = sizeof(struct in_addr);
+            break;
+        case AF_INET6:
+            addrLength = sizeof(struct in6_addr);
+            break;
+        default:
+            return 0;
+    }
+    
+    memcpy( p, node->hash.id.bytes, ( dht->parameters->hashSize + 7 ) / 8 );
+    p += ( dht->parameters->hashSize + 7 ) / 8;
+    *p++ = ( addrLength == sizeof(struct in_addr) ? 4 : 6 );
+    memcpy( p, kc_contactGetAddr( node->contact ), addrLength );
+    p += addrLength;
+    dhtTablePut( &p, kc_contactGetPort( node->contact ), 2 );
+    dhtTablePut( &p, ( now > node->lastSeen ? now - node->lastSeen : 0 ), 4 );
+    dhtTablePut( &p, ( node->srtt < 0xFFFF ? node->srtt : 0xFFFF ), 2 );
+    return p - buffer;
+}
+
+int
+kc_dhtSaveRoutingTable( const kc_dht * dht, const char * path )
+{
+    assert( dht != NULL );
+    assert( path != NULL );
+    
+    unsigned char buffer[KADC_HASH_BYTES + 32];
+    unsigned char * p = buffer;
+    time_t now = time( NULL );
+    char * tmpPath;
+    int saved = 0;
+    int failed = 0;
+    int i;
+    
+    /* Written aside, so that a crash doesn't leave a truncated snapshot behind */
+    if( asprintf( &tmpPath, "%s.tmp", path ) == -1 )
+    {
+        kc_logAlert( "kc_dhtSaveRoutingTable: Failed malloc()ing" );
+        return -1;
+    }
+    FILE * file = fopen( tmpPath, "wb" );
+    if( file == NULL )
+    {
+        kc_logError( "Failed opening %s for writing: %s", tmpPath, strerror( errno ) );
+        free( tmpPath );
+        return -1;
+    }
+    
+    kc_dhtLock( (kc_dht*)dht );
+    
+    memcpy( p, TABLE_MAGIC, 4 );
+    p += 4;
+    dhtTablePut( &p, TABLE_VERSION, 2 );
+    dhtTablePut( &p, dht->parameters->hashSize, 2 );
+    dhtTablePut( &p, now, 4 );
+    dhtTablePut( &p, dht->bucketCount, 2 );
+    dhtTablePut( &p, 0, 2 );
+    failed = ( fwrite( buffer, p - buffer, 1, file ) != 1 );
+    
+    for( i = 0; i < dht->bucketCount && !failed; i++ )
+    {
+        dhtBucket * bucket = dht->buckets[i];
+        kc_dhtNode * node;
+        
+        dhtBucketLock( bucket );
+        p = buffer;
+        dhtTablePut( &p, dhtBucketCount( bucket ), 2 );
+        failed = ( fwrite( buffer, p - buffer, 1, file ) != 1 );
+        
+        for( node = dhtBucketOldest( bucket ); node != NULL && !failed; node = dhtBucketNext( bucket, node ) )
         {
-            kc_logDebug(" Probe time !" );
-            
-            dht->probeDelay = time( NULL );
-            kc_dhtLock( dht );
-            while( ( msg = kc_queueDequeueTimeout( dht->sndQueue, 0 ) ) && i++ < KADC_PROBE_PARALLELISM )
+            int size = dhtTablePutNode( dht, node, now, buffer );
+            /* The count is already out, so a node we can't save still takes its place */
+            if( size == 0 )
             {
-                const kc_contact * contact = kc_messageGetContact( msg );
-                kc_logDebug( "Probing %s with %d", kc_contactPrint( contact ), kc_messageGetType( msg ) );
-//                int err = kc_udpIoSendMsg( dht->io, msg );
-//                if( err < 0 ) {
-//                    kc_logAlert( "Failed sending probe: %d", err );
-//                }
-                
-                kc_messageFree( msg );
+                memset( buffer, 0, sizeof(buffer) );
+                size = ( dht->parameters->hashSize + 7 ) / 8 + 1;
             }
-            kc_dhtUnlock( dht );
+            else
+                saved++;
+            failed = ( fwrite( buffer, size, 1, file ) != 1 );
         }
-            
-        sleep( 5 );
+        dhtBucketUnlock( bucket );
     }
     
-    return dht;
+    kc_dhtUnlock( (kc_dht*)dht );
+    
+    if( fclose( file ) != 0 )
+        failed = 1;
+    if( failed || rename( tmpPath, path ) != 0 )
+    {
+        kc_logError( "Failed saving routing table to %s: %s", path, strerror( errno ) );
+        unlink( tmpPath );
+        free( tmpPath );
+        return -1;
+    }
+    free( tmpPath );
+    
+    kc_logVerbose( "Saved %d nodes to %s", saved, path );
+    return saved;
 }
-#endif
 
-int dhtRemoveNode( const kc_dht * dht, kc_hash * hash )
+int
+kc_dhtLoadRoutingTable( kc_dht * dht, const char * path )
 {
     assert( dht != NULL );
+    assert( path != NULL );
     
-    /* Get this node's bucket */
-    kc_dhtNode    * node;
-    dhtBucket     * bucket = dhtBucketForHash( dht, hash );
+    unsigned char buffer[KADC_HASH_BYTES + 32];
+    const unsigned char * p = buffer;
+    time_t now = time( NULL );
+    int hashBytes = ( dht->parameters->hashSize + 7 ) / 8;
+    int loaded = 0;
+    int bucketCount, i, j;
     
-    if( bucket == NULL )
+    FILE * file = fopen( path, "rb" );
+    if( file == NULL )
+    {
+        kc_logError( "Failed opening %s for reading: %s", path, strerror( errno ) );
         return -1;
+    }
     
-    dhtBucketLock( bucket );
-    
-    RbtIterator first = rbtFind( bucket->nodes, hash );
-    if( first == NULL )
+    if( fread( buffer, TABLE_HEADER_SIZE, 1, file ) != 1 || memcmp( buffer, TABLE_MAGIC, 4 ) != 0 )
     {
-        dhtBucketUnlock( bucket );
+        kc_logError( "%s isn't a routing table snapshot", path );
+        fclose( file );
         return -1;
     }
-    rbtKeyValue( bucket->nodes, first, NULL, (void**)&node );
-    if( node == NULL )
+    p += 4;
+    int version = dhtTableGet( &p, 2 );
+    int hashSize = dhtTableGet( &p, 2 );
+    time_t savedAt = dhtTableGet( &p, 4 );
+    bucketCount = dhtTableGet( &p, 2 );
+    if( version != TABLE_VERSION || hashSize != dht->parameters->hashSize )
     {
-        dhtBucketUnlock( bucket );
+        kc_logError( "%s is a version %d snapshot of %d-bit hashes, expected version %d of %d-bit hashes",
+                     path, version, hashSize, TABLE_VERSION, dht->parameters->hashSize );
+        fclose( file );
         return -1;
     }
-    /* We remove it */
-    rbtErase( bucket->nodes, first );
-    dhtNodeFree( node );
-    bucket->availableSlots++;
     
-    dhtBucketUnlock( bucket );
+    /* Nodes are lazily revalidated : they serve lookups right away, those that answer get
+     * touched as usual, and the others age out, or get evicted for fresher nodes */
+    time_t oldest = now - dht->parameters->expirationDelay / 2;
     
+    for( i = 0; i < bucketCount; i++ )
+    {
+        if( fread( buffer, 2, 1, file ) != 1 )
+            break;
+        p = buffer;
+        int nodeCount = dhtTableGet( &p, 2 );
+        
+        for( j = 0; j < nodeCount; j++ )
+        {
+            kc_hash hash;
+            
+            if( fread( buffer, hashBytes + 1, 1, file ) != 1 )
+                break;
+            kc_hashClear( &hash, dht->parameters->hashSize );
+            memcpy( hash.id.bytes, buffer, hashBytes );
+            
+            int family = buffer[hashBytes];
+            if( family == 0 )
+                continue;   /* A node that couldn't be saved */
+            int addrLength = ( family == 4 ? sizeof(struct in_addr) : sizeof(struct in6_addr) );
+            if( ( family != 4 && family != 6 ) || fread( buffer, addrLength + 8, 1, file ) != 1 )
+                break;
+            
+            p = buffer + addrLength;
+            in_port_t port = dhtTableGet( &p, 2 );
+            time_t age = dhtTableGet( &p, 4 );
+            int srtt = dhtTableGet( &p, 2 );
+            
+            kc_contact * contact = kc_contactInit( buffer, addrLength, port );
+            if( contact == NULL )
+                continue;
+            
+            time_t lastSeen = savedAt - age;
+            if( lastSeen < oldest )
+                lastSeen = oldest;
+            if( lastSeen > now )
+                lastSeen = now;
+            
+            if( dhtAdmitNode( dht, contact, &hash, lastSeen, srtt ) )
+                loaded++;
+            else
+                kc_contactFree( contact );
+        }
+        if( j < nodeCount )
+            break;
+    }
+    
+    if( i < bucketCount )
+        kc_logAlert( "%s is truncated or corrupted, loaded the first %d nodes only", path, loaded );
+    else
+        kc_logVerbose( "Loaded %d nodes from %s", loaded, path );
+    fclose( file );
+    return loaded;
+}
+
+static int
+dhtValueFree( const kc_hash * key, void * value, void * ref )
+{
+    dhtValueSetClear( &((dhtValue*)value)->objects );
+    free( value );
     return 0;
 }
 
-int
-kc_dhtAddNode( kc_dht * dht, kc_contact * contact, kc_hash * hash )
+/* Copies the user value out, while the store keeps it alive */
+static int
+dhtValueGet( const kc_hash * key, void * value, void * ref )
 {
-    assert( dht != NULL );
+    *(void**)ref = ((dhtValue*)value)->value;
+    return 0;
+}
+
+/* Updates the user value, while the store keeps readers out */
+static int
+dhtValueSetUser( const kc_hash * key, void * value, void * ref )
+{
+    ((dhtValue*)value)->value = ref; /* FIXME: Copy ? */
+    return 0;
+}
+
+static int
+dhtValueExpire( const kc_hash * key, void * value, void * ref )
+{
+    int expired = dhtValueSetExpire( &((dhtValue*)value)->objects, *(time_t*)ref );
+    if( expired != 0 )
+        kc_logVerbose( "%d objects expired for key %s", expired, hashtoa( key ) );
+    return 0;
+}
+
+typedef struct dhtObjectArgs {
+    kc_dht            * dht;
+    const kc_hash     * key;
+    const kc_hash     * related;
+    const void        * data;
+    int                 size;
+    int                 mine;
+    time_t              published;
+    time_t              expires;
+    int                 status;
+    int                 stored;         /* Set if the object actually went in */
+} dhtObjectArgs;
+
+/* Journals the objects evicted to make room for a new one */
+static int
+dhtValueEvictObject( dhtValueEntry * entry, void * ref )
+{
+    dhtObjectArgs * args = ref;
     
-    /* Get this node's bucket */
-    kc_dhtNode    * node;
-    dhtBucket     * bucket = dhtBucketForHash( dht, hash );
+    if( args->dht->journal != NULL )
+        kc_journalExpire( args->dht->journal, args->key, &entry->related );
+    return 0;
+}
+
+static int
+dhtValueAddObject( const kc_hash * key, void * value, void * ref )
+{
+    dhtValueSet * set = &((dhtValue*)value)->objects;
+    dhtObjectArgs * args = ref;
+    dhtValueEntry * entry = dhtValueSetFind( set, args->related );
     
-    if( bucket == NULL )
+    /* Others republishing one of our objects don't take it over */
+    if( entry != NULL && entry->mine && !args->mine )
     {
-        kc_logVerbose( "Trying to add our own node. Ignoring." );
+        args->status = 1;
         return 0;
     }
+    args->status = dhtValueSetInsert( set, args->related, args->data, args->size,
+                                      args->published, args->expires, args->mine, dhtValueEvictObject, args );
+    args->stored = ( args->status != -1 );
+    return 0;
+}
+
+typedef struct dhtObjectVisit {
+    kc_dhtObjectVisitor visitor;
+    void              * ref;
+    const kc_filter   * filter;         /* Only visit matching objects if not NULL */
+    int                 max;            /* Stop after max objects if not 0 */
+    int                 visited;
+} dhtObjectVisit;
+
+static int
+dhtValueVisitEntry( dhtValueEntry * entry, void * ref )
+{
+    dhtObjectVisit * visit = ref;
+    return visit->visitor( &entry->related, entry->data, entry->size, visit->ref );
+}
+
+static int
+dhtValueVisitObjects( const kc_hash * key, void * value, void * ref )
+{
+    dhtObjectVisit * visit = ref;
     
-    RbtIterator nodeIter = rbtFind( bucket->nodes, hash );
-    if( nodeIter != NULL )
+    visit->visited = dhtValueSetFilter( &((dhtValue*)value)->objects, visit->filter, visit->max, dhtValueVisitEntry, visit );
+    return 0;
+}
+
+/* Totals of the store memory report */
+typedef struct dhtStoreReport {
+    int                 keys;
+    int                 objects;
+    long                objectBytes;
+    long                indexBytes;
+} dhtStoreReport;
+
+static int
+dhtValuePrint( const kc_hash * key, void * value, void * ref )
+{
+    dhtValue * dhtVal = value;
+    dhtStoreReport * report = ref;
+    long indexBytes = dhtValueSetIndexBytes( &dhtVal->objects );
+    
+    kc_logNormal( "Key %s: %x, %d objects in %ld bytes, %ld bytes of index%s", hashtoa( key ), dhtVal->value,
+                  dhtVal->objects.count, dhtVal->objects.bytes, indexBytes, ( dhtVal->mine ? ", ours" : "" ) );
+    report->keys++;
+    report->objects += dhtVal->objects.count;
+    report->objectBytes += dhtVal->objects.bytes;
+    report->indexBytes += indexBytes;
+    return 0;
+}
+
+/* Returns when a value needs our attention next, must be called with the DHT locked */
+static time_t
+dhtValueNextTimeout( kc_dht * dht, const dhtValue * value )
+{
+    time_t next;
+    
+    if( value->mine )
+        next = value->published + dht->parameters->republishDelay;
+    else
+        next = value->replicated + dht->parameters->replicationDelay;
+    
+    time_t expiry = dhtValueSetNextExpiry( &value->objects );
+    if( expiry != 0 && expiry < next )
+        next = expiry;
+    return next;
+}
+
+static void
+dhtValueSchedule( kc_dht * dht, dhtValue * value, time_t now )
+{
+    time_t next = dhtValueNextTimeout( dht, value );
+    kc_wheelSchedule( dht->wheel, &value->timer, ( next > now ? next - now : 0 ) * 1000L );
+}
+
+/* Republishes our keys every republishDelay, replicates the others
+ * every replicationDelay, and expires others' objects after expirationDelay */
+static void
+dhtValueTimeout( kc_wheelTimer * timer, void * ref )
+{
+    kc_dht        * dht = ref;
+    dhtValue      * value = (dhtValue*)timer;
+    time_t          now = time( NULL );
+    kc_hash         key;
+    int             store = 0;
+    
+    /* Only decide under the lock, the value may go away once we send */
+    kc_dhtLock( dht );
+    kc_storeModify( dht->keys, &value->key, dhtValueExpire, &now );
+    if( value->mine )
     {
-        dhtBucketLock( bucket );
-        
-        // This node is already in our bucket list, let's update it's info */
-        kc_logDebug( "Node %s already in our bucket, updating...", hashtoa( hash ) );
-        rbtKeyValue( bucket->nodes, nodeIter, NULL, (void**)&node );
-        node->contact = contact;
-        node->lastSeen = time(NULL);
-        /* FIXME: handle node type */
-        //        node->type = 0;
-        dhtBucketUnlock( bucket );
-        return 1;
+        if( now - value->published >= dht->parameters->republishDelay )
+        {
+            store = 1;
+            value->published = now;
+        }
+    }
+    else
+    {
+        if( value->objects.count == 0 )
+        {
+            kc_logVerbose( "Key %s expired", hashtoa( &value->key ) );
+            kc_storeRemove( dht->keys, &value->key );
+            kc_dhtUnlock( dht );
+            dhtValueFree( &value->key, value, NULL );
+            return;
+        }
+        if( now - value->replicated >= dht->parameters->replicationDelay )
+        {
+            store = 1;
+            value->replicated = now;
+        }
+    }
+    kc_hashMove( &key, &value->key );
+    dhtValueSchedule( dht, value, now );
+    kc_dhtUnlock( dht );
+    
+    if( store )
+        dhtStore( dht, &key );
+}
+
+/* Returns the value for key, creating and storing it if needed.
+ * Must be called with the DHT locked */
+static dhtValue *
+dhtValueForKeyCreate( kc_dht * dht, const kc_hash * key )
+{
+    dhtValue * dhtVal = kc_storeFind( dht->keys, key );
+    if( dhtVal != NULL )
+        return dhtVal;
+    
+    dhtVal = malloc( sizeof(dhtValue) );
+    if( dhtVal == NULL )
+    {
+        kc_logAlert( "dhtValueForKeyCreate: malloc failed !" );
+        return NULL;
+    }
+    kc_hashMove( &dhtVal->key, key );
+    dhtVal->value = NULL;
+    dhtValueSetInit( &dhtVal->objects, dht->parameters->valueBudget );
+    dhtVal->mine = 0;
+    dhtVal->published = 0;
+    dhtVal->replicated = time( NULL ); /* We just got it, no need to replicate it right away */
+    kc_wheelTimerInit( &dhtVal->timer, dhtValueTimeout, dht );
+    
+    if( kc_storeInsert( dht->keys, &dhtVal->key, dhtVal ) != 0 )
+    {
+        kc_logAlert( "dhtValueForKeyCreate: failed inserting key %s", hashtoa( key ) );
+        free( dhtVal );
+        return NULL;
+    }
+    return dhtVal;
+}
+
+/* Forgets a value we just created if it ended up empty, must be called with the DHT locked */
+static void
+dhtValueDropIfEmpty( kc_dht * dht, dhtValue * dhtVal )
+{
+    if( dhtVal->mine || dhtVal->value != NULL || dhtVal->objects.count != 0 || kc_wheelIsPending( &dhtVal->timer ) )
+        return;
+    
+    kc_storeRemove( dht->keys, &dhtVal->key );
+    dhtValueFree( &dhtVal->key, dhtVal, NULL );
+}
+
+/* Adds an object to the value for key, creating it if needed, and journals it.
+ * Returns the value, or NULL if the object didn't go in. Must be called with the DHT locked */
+static dhtValue *
+dhtValuePutObject( kc_dht * dht, dhtObjectArgs * args )
+{
+    dhtValue * dhtVal = dhtValueForKeyCreate( dht, args->key );
+    if( dhtVal == NULL )
+        return NULL;
+    
+    kc_storeModify( dht->keys, args->key, dhtValueAddObject, args );
+    if( args->status == -1 )
+    {
+        dhtValueDropIfEmpty( dht, dhtVal );
+        return NULL;
+    }
+    
+    if( args->stored && dht->journal != NULL )
+        kc_journalStore( dht->journal, args->key, args->related, args->published, args->expires,
+                         args->mine, args->data, args->size );
+    if( args->mine )
+        dhtVal->mine = 1;
+    return dhtVal;
+}
+
+/* Puts back the objects journaled by our previous run */
+static int
+dhtValueReplay( const kc_journalRecord * record, void * ref )
+{
+    kc_dht * dht = ref;
+    dhtObjectArgs args;
+    
+    if( kc_hashLength( &record->key ) != dht->parameters->hashSize )
+    {
+        kc_logError( "Dropping a journaled %d-bit key while parameters asks an %d-bit hash", kc_hashLength( &record->key ), dht->parameters->hashSize );
+        return 0;
     }
     
-    /* We don't have it, allocate one */
-    node = dhtNodeInit( contact, hash );
+    memset( &args, 0, sizeof(dhtObjectArgs) );
+    args.dht = dht;
+    args.key = &record->key;
+    args.related = &record->related;
+    args.data = record->data;
+    args.size = record->size;
+    args.mine = record->mine;
+    args.published = record->published;
+    args.expires = record->expires;
+    
+    kc_dhtLock( dht );
+    dhtValue * dhtVal = dhtValuePutObject( dht, &args );
+    if( dhtVal != NULL )
+    {
+        /* Ours get republished on their usual schedule */
+        if( args.mine && args.published > dhtVal->published )
+            dhtVal->published = args.published;
+        dhtValueSchedule( dht, dhtVal, time( NULL ) );
+    }
+    kc_dhtUnlock( dht );
+    
+    return 0;
+}
+
+int
+dhtStoreObject( kc_dht * dht, const kc_hash * key, const kc_hash * related, const void * data, int size, int mine )
+{
+    assert( dht != NULL );
+    assert( key != NULL );
+    assert( related != NULL );
+    
+    dhtObjectArgs args;
+    dhtValue * dhtVal;
+    time_t now = time( NULL );
+    kc_hash storeKey;
+    
+    memset( &args, 0, sizeof(dhtObjectArgs) );
+    args.dht = dht;
+    args.key = key;
+    args.related = related;
+    args.data = data;
+    args.size = size;
+    args.mine = mine;
+    args.published = now;
+    args.expires = ( mine ? 0 : now + dht->parameters->expirationDelay );
+    args.status = -1;
     
-    if( node == NULL )
+    kc_dhtLock( dht );
+    dhtVal = dhtValuePutObject( dht, &args );
+    if( dhtVal == NULL )
     {
-        kc_logAlert( "kc_dhtAddNode: dhtNodeInit failed !");
+        kc_dhtUnlock( dht );
         return -1;
     }
     
-    if( bucket->availableSlots == 0 )
+    if( mine )
     {
-        // This bucket is full, get the first node in this bucket, (the least-heard-of one)
-        /* Here we need to ping it to make sure it's down, then if it replies we move up
-         * in the bucket until one of them fails to reply...
-         * - If one fails, we remove it and add the new one at the end
-         * - If they all replied, we store it in our "backup nodes" list 
-         */
-        
-        dhtBucketLock( bucket );
-        RbtIterator nodeIter;
-        
-        for( nodeIter = rbtBegin( bucket->nodes ); nodeIter != NULL; nodeIter = rbtNext( bucket->nodes, nodeIter ) )
-        {
-            kc_dhtNode    * oldNode;
-            rbtKeyValue( bucket->nodes, nodeIter, NULL, (void**)&oldNode );
-            if( dhtPingByIP( dht, oldNode->contact, oldNode->hash, 1 ) == 0 )
-            {
-                /* This one replied, try next... */
-                oldNode->lastSeen = time( NULL );
-                continue;
-            } else {
-                /* We remove the old one */
-                rbtErase( bucket->nodes, nodeIter );
-                dhtNodeFree( oldNode );
-                bucket->availableSlots++;
-            }
-        }
-        
-        if( bucket->availableSlots == 0 )
-        {
-            /* We just checked every node, and none is bad, add as a backup node */
-            /* TODO: Handle backup nodes */
-            return 0;
-        }
+        kc_hashMove( &storeKey, &dhtVal->key );
+        dhtVal->published = now;
     }
+    dhtValueSchedule( dht, dhtVal, now );
+    kc_dhtUnlock( dht );
     
-    /* We mark it as seen just now */
-    node->lastSeen = time(NULL);
-    /* FIXME: Handle node type here */
+    /* Publish without the lock, the search and the sends may take a while */
+    if( mine )
+        dhtStore( dht, &storeKey );
     
-    /* We add it to this bucket */
-    bucket->lastChanged = time( NULL );
-    rbtInsert( bucket->nodes, hash, node );
-    bucket->availableSlots--;
+    return args.status;
+}
+
+int
+kc_dhtStoreObject( kc_dht * dht, kc_hash * key, kc_hash * related, const void * data, int size )
+{
+    assert( dht != NULL );
+    assert( key != NULL );
     
+    if( kc_hashLength( key ) != dht->parameters->hashSize )
+    {
+        kc_logError( "Passed an %d-bit key while parameters asks an %d-bit hash", kc_hashLength( key ), dht->parameters->hashSize );
+        return -1;
+    }
     
-    dhtBucketUnlock( bucket );
-    return 0;
+    return dhtStoreObject( dht, key, related, data, size, 1 );
 }
 
-void
-kc_dhtCreateNode( kc_dht * dht, kc_contact * contact )
+int
+kc_dhtSearchObjects( const kc_dht * dht, kc_hash * key, const kc_filter * filter, int max, kc_dhtObjectVisitor visitor, void * ref )
 {
     assert( dht != NULL );
-    assert( contact != NULL );
+    assert( key != NULL );
+    assert( visitor != NULL );
     
-    dhtPingByIP( dht, contact, NULL, 0 );
+    dhtObjectVisit visit;
+    visit.visitor = visitor;
+    visit.ref = ref;
+    visit.filter = filter;
+    visit.max = max;
+    visit.visited = 0;
+    
+    kc_storeGet( dht->keys, key, dhtValueVisitObjects, &visit );
+    return visit.visited;
+}
+
+int
+kc_dhtObjectsForKey( const kc_dht * dht, kc_hash * key, kc_dhtObjectVisitor visitor, void * ref )
+{
+    return kc_dhtSearchObjects( dht, key, NULL, 0, visitor, ref );
 }
 
 int
@@ -1096,12 +2212,32 @@ kc_dhtStoreKeyValue( kc_dht * dht, kc_hash * key, void * value )
     assert( dht != NULL );
     assert( key != NULL );
     
-    dhtValue * dhtVal = malloc( sizeof(dhtValue) );
-    dhtVal->value = value; /* FIXME: Copy ? */
-    dhtVal->published = 0; 
+    if( kc_hashLength( key ) != dht->parameters->hashSize )
+    {
+        kc_logError( "Passed an %d-bit key while parameters asks an %d-bit hash", kc_hashLength( key ), dht->parameters->hashSize );
+        return -1;
+    }
+    
+    dhtValue * dhtVal;
+    kc_hash storeKey;
+    
+    /* Writers are serialized by the DHT lock, so the value can't go away under us */
+    kc_dhtLock( dht );
+    dhtVal = dhtValueForKeyCreate( dht, key );
+    if( dhtVal == NULL )
+    {
+        kc_dhtUnlock( dht );
+        return -1;
+    }
+    kc_storeModify( dht->keys, key, dhtValueSetUser, value );
     dhtVal->mine = 1;
+    kc_hashMove( &storeKey, &dhtVal->key );
+    dhtVal->published = time( NULL );
+    dhtValueSchedule( dht, dhtVal, dhtVal->published );
+    kc_dhtUnlock( dht );
     
-    return dhtStore( dht, key, dhtVal );
+    /* Publish without the lock, the search and the sends may take a while */
+    return dhtStore( dht, &storeKey );
 }
 
 void *
@@ -1110,21 +2246,21 @@ kc_dhtValueForKey( const kc_dht * dht, void * key )
     assert( dht != NULL );
     assert( key != NULL );
     
-    dhtValue * value = rbtFind( dht->keys, key );
+    /* Only the key shard gets locked, so concurrent readers don't contend */
+    void * value = NULL;
+    kc_storeGet( dht->keys, key, dhtValueGet, &value );
     if( value != NULL )
-    {
-        return value->value;
-    }
+        return value;
     
     kc_logDebug( "Key %s not found, performing lookup", hashtoa( key ) );
     
-    return dhtFindValue( dht, key );
+    return dhtFindValue( (kc_dht*)dht, key );
 }
 
 void
 kc_dhtPrintState( const kc_dht * dht )
 {
-    kc_logNormal( "DHT %p hash : %s", dht, hashtoa( dht->hash ) );
+    kc_logNormal( "DHT %p hash : %s", dht, hashtoa( &dht->hash ) );
     if( *dht->identities == NULL )
         kc_logNormal( "No identities" );
     else
@@ -1138,6 +2274,7 @@ kc_dhtPrintState( const kc_dht * dht )
     }
     
     RbtIterator sessIter;
+    pthread_mutex_lock( (pthread_mutex_t *)&dht->sessionLock );
     if( rbtBegin( dht->sessions ) == NULL )
     {
         kc_logNormal( "No running sessions" );
@@ -1154,39 +2291,40 @@ kc_dhtPrintState( const kc_dht * dht )
                 kc_logNormal( "%s", kc_sessionPrint( session ) );
         }
     }
+    pthread_mutex_unlock( (pthread_mutex_t *)&dht->sessionLock );
 }
 
 void
 kc_dhtPrintKeys( const kc_dht * dht )
 {
-    if( rbtBegin( dht->keys ) == NULL )
+    if( kc_storeCount( dht->keys ) == 0 )
     {
         kc_logNormal( "DHT has no keys" );
     }
     else
     {
+        dhtStoreReport report;
+        memset( &report, 0, sizeof(report) );
+        
         kc_logNormal( "DHT has following keys stored :" );
-        RbtIterator keysIter;
-        for( keysIter = rbtBegin( dht->keys ); keysIter != NULL; keysIter = rbtNext( dht->keys, keysIter ) )
-        {
-            kc_hash * key;
-            dhtValue * value;
-            
-            rbtKeyValue( dht->keys, keysIter, (void*)key, (void*)value );
-            kc_logNormal( "Key %s: %x, expires %d", hashtoa( key ), value->value, time( NULL ) - value->published );
-        }
+        kc_dhtLock( (kc_dht*)dht );
+        kc_storeForEach( dht->keys, dhtValuePrint, &report );
+        kc_dhtUnlock( (kc_dht*)dht );
+        kc_logNormal( "%d keys, %d objects in %ld bytes, %ld bytes of index", report.keys, report.objects,
+                      report.objectBytes, report.indexBytes );
     }
 }
 
 void
 kc_dhtPrintTree( const kc_dht * dht )
 {
+    int count = dhtLoadBucketCount( dht );
     int i;
-    for( i = 0; i < BUCKET_COUNT; i++ )
+    for( i = 0; i < count; i++ )
     {
-        if( dht->parameters->bucketSize - dht->buckets[i]->availableSlots != 0 )
+        if( dhtBucketCount( dht->buckets[i] ) != 0 )
         {
-            kc_logNormal( "Bucket %d contains %d nodes :", i, dht->parameters->bucketSize - dht->buckets[i]->availableSlots );
+            kc_logNormal( "Bucket %d contains %d nodes :", i, dhtBucketCount( dht->buckets[i] ) );
             dhtPrintBucket( dht->buckets[i] );
         }
     }
@@ -1196,88 +2334,181 @@ int
 kc_dhtNodeCount( const kc_dht *dht )
 {
     int total = 0;
+    int count = dhtLoadBucketCount( dht );
     int i;
-    for( i = 0; i < BUCKET_COUNT; i++)
-        total += dht->parameters->bucketSize - dht->buckets[i]->availableSlots;
+    for( i = 0; i < count; i++)
+        total += dhtBucketCount( dht->buckets[i] );
     
-    return abs( total );
+    return total;
 }
 
-kc_dhtNode**
-kc_dhtGetNodes( const kc_dht * dht, kc_hash * hash, int * nodeCount )
+/* Bounded max-heap of nodes, ordered by distance to target (farthest at the root) */
+static void
+dhtHeapSiftDown( const kc_hash * target, kc_dhtNode ** heap, int count, int i )
 {
-    assert( dht != NULL );
-    assert( nodeCount != NULL );
-    
-    if( hash == NULL )
+    for( ;; )
     {
-        /* FIXME: I'm not really sure how to get a correct list of nodes here,
-         * I'll get them in order, but they'll be sorted, so maybe it's bad
-         */
-        int count = kc_dhtNodeCount( dht );
-        
-        /* We return nodeCount nodes (or parameters->bucketSize if 0), or all our nodes if we don't have enough */
-        *nodeCount = ( *nodeCount == 0 ? dht->parameters->bucketSize : *nodeCount );
-        *nodeCount = ( count < *nodeCount ? count : *nodeCount );
+        int largest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
         
-        kc_dhtNode ** nodes = calloc( *nodeCount, sizeof(kc_dhtNode) );
-        
-        int i = 0;
-        int j;
-        for( j = 0; j < BUCKET_COUNT; i++ )
-        {
-            dhtBucket * bucket = dht->buckets[i];
-            
-            RbtIterator iter;
-            for( iter = rbtBegin( bucket->nodes );
-                i < *nodeCount && iter != NULL;
-                iter = rbtNext( bucket->nodes, iter ) )
-            {
-                rbtKeyValue( bucket->nodes, iter, NULL, (void**)&nodes[i++] );
-            }
-            
-            if( i >= *nodeCount )
-                break;
-        }
+        if( left < count && kc_hashDistanceCmp( target, &heap[left]->hash, &heap[largest]->hash ) > 0 )
+            largest = left;
+        if( right < count && kc_hashDistanceCmp( target, &heap[right]->hash, &heap[largest]->hash ) > 0 )
+            largest = right;
+        if( largest == i )
+            return;
         
-        return nodes;
+        kc_dhtNode * tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
     }
-    else /* hash == NULL */
+}
+
+static void
+dhtHeapPush( const kc_hash * target, kc_dhtNode ** heap, int count, kc_dhtNode * node )
+{
+    int i = count;
+    heap[i] = node;
+    while( i > 0 )
     {
-        dhtBucket * bucket = dhtBucketForHash( dht, hash );
-        
-        int count = dht->parameters->bucketSize - bucket->availableSlots;
-        
-        /* We return nodeCount nodes (or parameters->bucketSize if 0), or all our nodes if we don't have enough */
-        *nodeCount = ( *nodeCount == 0 ? dht->parameters->bucketSize : *nodeCount );
-        *nodeCount = ( count < *nodeCount ? count : *nodeCount );
-        
-        kc_dhtNode ** nodes = calloc( *nodeCount, sizeof(kc_dhtNode) );
+        int parent = ( i - 1 ) / 2;
+        if( kc_hashDistanceCmp( target, &heap[i]->hash, &heap[parent]->hash ) <= 0 )
+            break;
         
-        RbtIterator iter;
-        int i = 0;
-        for( iter = rbtBegin( bucket->nodes );
-            i < *nodeCount && iter != NULL;
-            iter = rbtNext( bucket->nodes, iter ) )
+        kc_dhtNode * tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Offers a copy of every node of a bucket to the heap, returns the new heap size */
+static int
+dhtHeapAddBucket( const kc_hash * target, kc_dhtNode ** heap, int count, int max, dhtBucket * bucket )
+{
+    kc_dhtNode * node;
+    kc_dhtNode * copy;
+    
+    dhtBucketLock( bucket );
+    for( node = dhtBucketOldest( bucket ); node != NULL; node = dhtBucketNext( bucket, node ) )
+    {
+        if( count < max )
         {
-            rbtKeyValue( bucket->nodes, iter, NULL, (void**)&nodes[i++] );
-            
-            if( i >= *nodeCount )
-                break;
+            if( ( copy = dhtNodeDup( node ) ) != NULL )
+                dhtHeapPush( target, heap, count++, copy );
         }
-        
-        return nodes;
+        else if( kc_hashDistanceCmp( target, &node->hash, &heap[0]->hash ) < 0 )
+        {
+            /* Closer than our farthest one, replace it */
+            if( ( copy = dhtNodeDup( node ) ) == NULL )
+                continue;
+            kc_dhtFreeNodes( heap, 1 );
+            heap[0] = copy;
+            dhtHeapSiftDown( target, heap, count, 0 );
+        }
+    }
+    dhtBucketUnlock( bucket );
+    
+    return count;
+}
+
+int
+kc_dhtGetClosestNodes( const kc_dht * dht, const kc_hash * hash, kc_dhtNode ** nodes, int count )
+{
+    int found = 0;
+    int i;
+    
+    assert( dht != NULL );
+    assert( hash != NULL );
+    assert( count == 0 || nodes != NULL );
+    
+    if( count <= 0 )
+        return 0;
+    
+    /* Bucket i holds the nodes sharing exactly i leading bits with us, but the
+     * last one which holds every node sharing more. Let t be the bucket of hash.
+     * Then the nodes in t are the closest to hash, followed by those of the
+     * buckets above t (they are all in the same distance band), followed by
+     * the buckets below t, each one a farther band than the previous.
+     * So we walk those groups outward, and stop as soon as a group
+     * leaves us with enough nodes, as the next ones can only be farther. */
+    int last = dhtLoadBucketCount( dht ) - 1;
+    int target = dhtBucketIndexForHash( dht, hash );
+    if( target < 0 )
+        target = last;      /* Looking for ourselves */
+    
+    found = dhtHeapAddBucket( hash, nodes, found, count, dht->buckets[target] );
+    
+    if( found < count )
+    {
+        for( i = target + 1; i <= last; i++ )
+            found = dhtHeapAddBucket( hash, nodes, found, count, dht->buckets[i] );
+    }
+    
+    for( i = target - 1; i >= 0 && found < count; i-- )
+        found = dhtHeapAddBucket( hash, nodes, found, count, dht->buckets[i] );
+    
+    /* Heap-sort in place, so that the closest node comes first */
+    for( i = found - 1; i > 0; i-- )
+    {
+        kc_dhtNode * tmp = nodes[0];
+        nodes[0] = nodes[i];
+        nodes[i] = tmp;
+        dhtHeapSiftDown( hash, nodes, i, 0 );
+    }
+    
+    return found;
+}
+
+void
+kc_dhtFreeNodes( kc_dhtNode ** nodes, int count )
+{
+    int i;
+    for( i = 0; i < count; i++ )
+    {
+        kc_contactFree( nodes[i]->contact );
+        dhtNodeFree( nodes[i] );
+    }
+}
+
+kc_dhtNode**
+kc_dhtGetNodes( const kc_dht * dht, kc_hash * hash, int * nodeCount )
+{
+    assert( dht != NULL );
+    assert( nodeCount != NULL );
+    
+    /* We return nodeCount nodes (or parameters->bucketSize if 0), or all our nodes if we don't have enough */
+    int count = ( *nodeCount == 0 ? dht->parameters->bucketSize : *nodeCount );
+    
+    kc_dhtNode ** nodes = calloc( count, sizeof(kc_dhtNode*) );
+    if( nodes == NULL )
+    {
+        kc_logAlert( "kc_dhtGetNodes: malloc failed !" );
+        *nodeCount = 0;
+        return NULL;
+    }
+    
+    if( hash == NULL )
+    {
+        /* Closest to ourselves, that is from our own range outward */
+        *nodeCount = kc_dhtGetClosestNodes( dht, &dht->hash, nodes, count );
     }
+    else
+        *nodeCount = kc_dhtGetClosestNodes( dht, hash, nodes, count );
+    
+    return nodes;
 }
 
 kc_contact *
 kc_dhtGetOurContact( const kc_dht * dht, int type )
 {
-    dhtIdentity * identity;
-    for( identity = *dht->identities; identity != NULL; identity++ )
+    dhtIdentity ** identity;
+    for( identity = dht->identities; *identity != NULL; identity++ )
     {
-        if( kc_contactGetType( identity->us ) == type )
-            return identity->us;
+        if( kc_contactGetType( (*identity)->us ) == type )
+            return (*identity)->us;
     }
     return NULL;
 }
@@ -1285,7 +2516,7 @@ kc_dhtGetOurContact( const kc_dht * dht, int type )
 kc_hash *
 kc_dhtGetOurHash( const kc_dht * dht )
 {
-    return dht->hash;
+    return (kc_hash *)&dht->hash;
 }
 
 #if 0
@@ -1434,40 +2665,226 @@ dhtIdentityThread( void * arg )
 #endif
 
 
+#define DATAGRAM_MAX_SIZE       2048    /* Larger datagrams are dropped on reception */
+#define DATAGRAM_BATCH_SIZE     32      /* Datagrams moved per syscall */
+#define DATAGRAM_POOL_SIZE      ( 4 * DATAGRAM_BATCH_SIZE ) /* Recieve buffers, including those held by messages */
+
 static void
-identityReadCB( struct bufferevent * event, void * arg )
+identityHandleMessage( dhtIdentity * identity, kc_message * msg )
 {
-    dhtIdentity * identity = arg;
-    kc_logNormal( "Identity read for contact: %s", kc_contactPrint( identity->us ) );
-    /* Means we have recieved data from this contact */
+    kc_dht * dht = identity->dht;
+    int status;
+    
+    /* Allow the protocol to take a look at what we have here... */
+    status = dht->parameters->callbacks.parseCallback( dht, msg );
+    if( status == DHT_RPC_UNKNOWN )
+    {
+        kc_logError( "Protocol reports an unknown message type, ignoring message..." );
+        return;
+    }
+    
+    /* Any packet from a node of ours tells it is alive */
+    dhtContactSeen( dht, kc_messageGetContact( msg ), -1 );
+    
+    /* Replies are routed to the session waiting on this contact and type */
+    kc_session * session = dhtSessionForMsg( dht, msg );
+    if( session != NULL )
+    {
+        kc_sessionRecieved( session, msg );
+        return;
+    }
+    
+    /* Unsolicited request, answer it from here */
+    status = dht->parameters->callbacks.readCallback( dht, msg );
+    if( status != 0 )
+        return;
+    
+    kc_message * answer = kc_messageInit( (kc_contact*)kc_messageGetContact( msg ), kc_messageGetType( msg ), 0, NULL );
+    if( answer == NULL )
+        return;
+    
+    status = dht->parameters->callbacks.writeCallback( dht, msg, answer );
+    if( status == 0 && kc_messageGetSize( answer ) == 0 )
+        kc_logDebug( "No answer written for %s, nothing sent", kc_contactPrint( kc_messageGetContact( msg ) ) );
+    else if( status == 0 )
+        dhtIdentitySend( identity, kc_messageGetContact( answer ), kc_messageGetData( answer ), kc_messageGetSize( answer ) );
+    else
+        kc_logAlert( "Failed writing answer to %s, err %d", kc_contactPrint( kc_messageGetContact( msg ) ), status );
+    kc_messageFree( answer );
+}
+
+/* Gives a pool buffer to each recieve slot lacking one, while the pool lasts */
+static void
+identityAttachBuffers( dhtIdentity * identity )
+{
+    int i;
+    for( i = 0; i < kc_netBatchCapacity( identity->recvBatch ); i++ )
+    {
+        if( identity->recvBuffers[i] != NULL )
+            continue;
+        
+        identity->recvBuffers[i] = kc_poolGet( identity->recvPool );
+        if( identity->recvBuffers[i] == NULL )
+            break;
+        kc_netBatchAttach( identity->recvBatch, i, identity->recvBuffers[i] );
+    }
 }
 
-/* Unused ? */
 static void
-identityWriteCB( struct bufferevent * event, void * arg )
+identityReadCB( int fd, short what, void * arg )
 {
     dhtIdentity * identity = arg;
-    kc_logNormal( "Identity write for contact: %s", kc_contactPrint( identity->us ) );
+    kc_netBatch * batch = identity->recvBatch;
+    int maxCount = identity->dht->parameters->maxMessagesPerPulse;
+    int total = 0;
+    int count;
+    
+    /* Drain the socket, as every session shares it */
+    do
+    {
+        int i;
+        
+        identityAttachBuffers( identity );
+        count = kc_netBatchRecv( fd, batch );
+        for( i = 0; i < count; i++ )
+        {
+            size_t size;
+            const void * data = kc_netBatchData( batch, i, &size );
+            if( size == 0 )
+                continue;
+            
+            /* On the stack, no allocation per datagram */
+            kc_contact contact;
+            if( kc_netBatchContact( batch, i, &contact ) != 0 )
+            {
+                kc_logError( "identityReadCB: Unsupported sender address, incoming datagram lost." );
+                continue;
+            }
+            kc_logVerbose( "identityReadCB: incoming message from %s", kc_contactPrint( &contact ) );
+            
+            kc_message * msg;
+            if( identity->recvBuffers[i] != NULL )
+            {
+                /* Zero-copy, the message now holds the pool buffer reference */
+                msg = kc_messageInitView( &contact, DHT_RPC_UNKNOWN, size, (char*)data, kc_poolRelease, (void*)data );
+                if( msg != NULL )
+                {
+                    identity->recvBuffers[i] = NULL;
+                    kc_netBatchAttach( batch, i, NULL );
+                }
+            }
+            else
+            {
+                /* The pool ran dry, the batch own buffer gets reused */
+                msg = kc_messageInit( &contact, DHT_RPC_UNKNOWN, size, (char*)data );
+            }
+            if( msg == NULL )
+            {
+                kc_logError( "identityReadCB: Failed creating message, incoming datagram lost." );
+                continue;
+            }
+            
+            identityHandleMessage( identity, msg );
+            
+            kc_messageFree( msg );
+        }
+        total += ( count > 0 ? count : 0 );
+    } while( count == kc_netBatchCapacity( batch ) && ( maxCount <= 0 || total < maxCount ) );
+}
+
+/* Sends what the socket takes, and waits for it to be writable to send the rest.
+ * Must be called with sendLock held */
+static void
+identityFlush( dhtIdentity * identity )
+{
+    kc_netBatchSend( identity->fd, identity->sendBatch );
+    if( kc_netBatchCount( identity->sendBatch ) > 0 && !identity->flushPending )
+    {
+        identity->flushPending = 1;
+        if( event_add( identity->flushEvent, NULL ) != 0 )
+        {
+            kc_logAlert( "Failed waiting to send %d datagrams from %s", kc_netBatchCount( identity->sendBatch ), kc_contactPrint( identity->us ) );
+            identity->flushPending = 0;
+        }
+    }
 }
 
 static void
-identityErrorCB( struct bufferevent * event, short what, void * arg )
+identityFlushCB( int fd, short what, void * arg )
 {
     dhtIdentity * identity = arg;
-    char * errStr = calloc( 15, sizeof(char) );
-    if( what & EVBUFFER_READ )
-        sprintf( errStr, "%s", "Read" );
-    if( what & EVBUFFER_WRITE )
-        sprintf( errStr, "%s", "Write" );
-    if( what & EVBUFFER_EOF )
-        sprintf( errStr, "%s %s", errStr, "EOF" );
-    if( what & EVBUFFER_ERROR )
-        sprintf( errStr, "%s %s", errStr, "error" );
-    if( what & EVBUFFER_TIMEOUT )
-        sprintf( errStr, "%s %s", errStr, "timeout" );
-    
-    kc_logError( "%s for identity %s", errStr, kc_contactPrint( identity->us ) );
-    free( errStr );
+    
+    pthread_mutex_lock( &identity->sendLock );
+    identity->flushPending = 0;
+    identityFlush( identity );
+    pthread_mutex_unlock( &identity->sendLock );
+}
+
+int
+dhtIdentitySend( dhtIdentity * identity, const kc_contact * contact, const void * data, size_t size )
+{
+    int onEventThread = pthread_equal( pthread_self(), identity->dht->eventThread );
+    int status;
+    
+    pthread_mutex_lock( &identity->sendLock );
+    
+    status = kc_netBatchAdd( identity->sendBatch, contact, data, size );
+    if( status == 1 )
+    {
+        /* Full, make room */
+        identityFlush( identity );
+        status = kc_netBatchAdd( identity->sendBatch, contact, data, size );
+        if( status == 1 )
+        {
+            /* Still full, the socket didn't take anything */
+            pthread_mutex_unlock( &identity->sendLock );
+            kc_logAlert( "Send queue of %s full, dropping datagram to %s", kc_contactPrint( identity->us ), kc_contactPrint( contact ) );
+            return -1;
+        }
+    }
+    if( status != 0 )
+    {
+        /* Too large to be batched */
+        pthread_mutex_unlock( &identity->sendLock );
+        return kc_netSendTo( identity->fd, contact, data, size );
+    }
+    
+    if( !onEventThread )
+    {
+        /* Nobody would flush it for us before the next tick */
+        identityFlush( identity );
+    }
+    else if( !identity->flushPending )
+    {
+        identity->flushPending = 1;
+        event_active( identity->flushEvent, EV_WRITE, 0 );
+    }
+    
+    pthread_mutex_unlock( &identity->sendLock );
+    return 0;
+}
+
+/* Frees the I/O parts of an identity, which may be partially initialized */
+static void
+identityReleaseIO( dhtIdentity * identity )
+{
+    if( identity->readEvent != NULL )
+        event_free( identity->readEvent );
+    if( identity->flushEvent != NULL )
+        event_free( identity->flushEvent );
+    if( identity->recvBuffers != NULL && identity->recvBatch != NULL )
+    {
+        int i;
+        for( i = 0; i < kc_netBatchCapacity( identity->recvBatch ); i++ )
+        {
+            if( identity->recvBuffers[i] != NULL )
+                kc_poolRelease( identity->recvBuffers[i] );
+        }
+    }
+    free( identity->recvBuffers );
+    kc_poolFree( identity->recvPool );
+    kc_netBatchFree( identity->recvBatch );
+    kc_netBatchFree( identity->sendBatch );
 }
 
 dhtIdentity *
@@ -1480,7 +2897,7 @@ dhtIdentityInit( kc_dht * dht, kc_contact * contact )
     int type = kc_contactGetType( contact );
     int domain = kc_contactGetDomain( contact );
     
-    dhtIdentity * identity = malloc( sizeof(dhtIdentity) );
+    dhtIdentity * identity = calloc( 1, sizeof(dhtIdentity) );
     if( identity == NULL )
     {
         kc_logError( "Failed dhtIdentity malloc()" );
@@ -1506,50 +2923,57 @@ dhtIdentityInit( kc_dht * dht, kc_contact * contact )
         return NULL;
     }
     
-    identity->us = kc_contactDup( contact );
-    if( identity->us == NULL )
+    status = kc_netSetNonBlockingSocket( identity->fd );
+    if( status != 0 )
     {
-        kc_logAlert( "Failed creating contact for identity %s", kc_contactPrint( contact ) );
+        kc_logAlert( "Error making socket non-blocking for identity %s", kc_contactPrint( contact ) );
         kc_netClose( identity->fd );
-        
         free( identity );
         return NULL;
     }
     
-/*    pthread_create( &identity->thread, NULL, dhtIdentityThread, identity );
-    if( identity->thread == NULL )
-    {
-        kc_logError( "Failed creating identity thread" );
-        kc_netClose( identity->fd );
-        free( identity );
-        return NULL;
-    }*/
-
-    identity->inputEvent = bufferevent_new( identity->fd, identityReadCB, identityWriteCB, identityErrorCB, identity );
-    if( identity->inputEvent == NULL )
+    identity->us = kc_contactDup( contact );
+    if( identity->us == NULL )
     {
-        kc_logAlert( "Error creating buffer event for identity %s", kc_contactPrint( contact ) );
+        kc_logAlert( "Failed creating contact for identity %s", kc_contactPrint( contact ) );
         kc_netClose( identity->fd );
         free( identity );
         return NULL;
     }
     
-    status = bufferevent_base_set( dht->eventBase, identity->inputEvent );
-    if( status != 0 )
+    pthread_mutex_init( &identity->sendLock, NULL );
+    
+    int batchSize = dht->parameters->maxMessagesPerPulse;
+    if( batchSize <= 0 || batchSize > DATAGRAM_BATCH_SIZE )
+        batchSize = DATAGRAM_BATCH_SIZE;
+    
+    identity->recvBatch = kc_netBatchInit( batchSize, DATAGRAM_MAX_SIZE );
+    identity->recvPool = kc_poolInit( DATAGRAM_POOL_SIZE, DATAGRAM_MAX_SIZE );
+    identity->recvBuffers = calloc( batchSize, sizeof(void*) );
+    identity->sendBatch = kc_netBatchInit( DATAGRAM_BATCH_SIZE, DATAGRAM_MAX_SIZE );
+    identity->flushEvent = event_new( dht->eventBase, identity->fd, EV_WRITE, identityFlushCB, identity );
+    identity->readEvent = event_new( dht->eventBase, identity->fd, EV_READ | EV_PERSIST, identityReadCB, identity );
+    if( identity->recvBatch == NULL || identity->recvPool == NULL || identity->recvBuffers == NULL ||
+        identity->sendBatch == NULL || identity->flushEvent == NULL || identity->readEvent == NULL )
     {
-        kc_logAlert( "Error setting event buffer base for identity %s", kc_contactPrint( contact ) );
+        kc_logAlert( "Error creating I/O for identity %s", kc_contactPrint( contact ) );
+        identityReleaseIO( identity );
+        pthread_mutex_destroy( &identity->sendLock );
+        kc_contactFree( identity->us );
         kc_netClose( identity->fd );
-        bufferevent_free( identity->inputEvent );
         free( identity );
         return NULL;
     }
     
-    status = bufferevent_enable( identity->inputEvent, EV_READ );
+    /* Last, datagrams get handled as soon as this returns */
+    status = event_add( identity->readEvent, NULL );
     if( status != 0 )
     {
-        kc_logAlert( "Error enabling reading on event buffer for identity %s", kc_contactPrint( contact ) );
+        kc_logAlert( "Error enabling reading for identity %s", kc_contactPrint( contact ) );
+        identityReleaseIO( identity );
+        pthread_mutex_destroy( &identity->sendLock );
+        kc_contactFree( identity->us );
         kc_netClose( identity->fd );
-        bufferevent_free( identity->inputEvent );
         free( identity );
         return NULL;
     }
@@ -1562,13 +2986,17 @@ dhtIdentityFree( dhtIdentity * identity )
 {
     assert( identity != NULL );
     
-/*    int tempFd = identity->fd;
-    identity->fd = -1;
+    /* Whatever is still pending goes out now */
+    pthread_mutex_lock( &identity->sendLock );
+    kc_netBatchSend( identity->fd, identity->sendBatch );
+    if( kc_netBatchCount( identity->sendBatch ) > 0 )
+        kc_logAlert( "Dropped %d outgoing datagrams from %s, its socket is full", kc_netBatchCount( identity->sendBatch ), kc_contactPrint( identity->us ) );
+    pthread_mutex_unlock( &identity->sendLock );
     
-    pthread_join( identity->thread, NULL );*/
-    bufferevent_free( identity->inputEvent );
+    identityReleaseIO( identity );
+    pthread_mutex_destroy( &identity->sendLock );
     
-    kc_netClose( identity->fd /*tempFd*/ );
+    kc_netClose( identity->fd );
     
     kc_contactFree( identity->us );
 
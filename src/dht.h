@@ -55,6 +55,30 @@ typedef struct _kc_dhtNode kc_dhtNode;
 
 typedef struct _kc_dhtParameters kc_dhtParameters;
 
+/**
+ * A running node or value lookup
+ */
+typedef struct _kc_dhtLookup kc_dhtLookup;
+
+/**
+ * The callback prototype used when a lookup ends.
+ *
+ * It is called once, from the thread which completed the lookup.
+ */
+typedef void (*kc_dhtLookupCallback)( kc_dht * dht, kc_dhtLookup * lookup, void * ref );
+
+/**
+ * A running bootstrap
+ */
+typedef struct _kc_dhtBootstrap kc_dhtBootstrap;
+
+/**
+ * The callback prototype used when a bootstrap ends.
+ *
+ * It is called once, from the thread which completed the bootstrap.
+ */
+typedef void (*kc_dhtBootstrapCallback)( kc_dht * dht, kc_dhtBootstrap * bootstrap, void * ref );
+
 /** 
  * Creates and init a new kc_dhtInit.
  *
@@ -97,6 +121,9 @@ kc_dhtCreateNode( kc_dht * dht, kc_contact * contact );
  *
  * This method is here for protocol-implementors to use when a node is to be added to the DHT.
  * The contact and hash passed will be retained by the DHT. Do not free them.
+ * If the node's bucket is full, it waits in the bucket's replacement cache while the least-recently
+ * seen node of the bucket gets pinged in the background, and takes its place if it doesn't answer.
+ * This never blocks on the network.
  * 
  * @param dht The DHT in which to add this node.
  * @param contact The node's contact info.
@@ -106,6 +133,31 @@ kc_dhtCreateNode( kc_dht * dht, kc_contact * contact );
 int
 kc_dhtAddNode( kc_dht * dht, kc_contact * contact, kc_hash * hash );
 
+/**
+ * Saves our routing table to a file, so that a later run can start from it.
+ *
+ * @param dht The DHT whose nodes to save.
+ * @param path The file to save to, replaced once the snapshot is complete.
+ * @return The number of saved nodes, or -1 on failure.
+ */
+int
+kc_dhtSaveRoutingTable( const kc_dht * dht, const char * path );
+
+/**
+ * Loads the nodes saved by kc_dhtSaveRoutingTable() straight into our buckets.
+ *
+ * Nodes aren't pinged first, they are revalidated lazily : they serve lookups right away,
+ * keeping the last seen time and round-trip-time they were saved with, and the ones that
+ * went away age out, or get evicted as fresher nodes show up.
+ * Nodes that don't fit in their bucket anymore are dropped.
+ *
+ * @param dht The DHT in which to load the nodes.
+ * @param path The file to load from.
+ * @return The number of loaded nodes, or -1 on failure.
+ */
+int
+kc_dhtLoadRoutingTable( kc_dht * dht, const char * path );
+
 /**
  * Store a key/value pair in the DHT.
  *
@@ -120,10 +172,63 @@ kc_dhtAddNode( kc_dht * dht, kc_contact * contact, kc_hash * hash );
 int
 kc_dhtStoreKeyValue( kc_dht * dht, kc_hash * key, void * value );
 
+/**
+ * The callback prototype used to visit the objects stored under a key.
+ *
+ * It runs with the key locked, so it must not store to the DHT.
+ *
+ * @param related The hash telling this object apart from the others of the key
+ * @param data The object meta-tag list
+ * @param size The size of data
+ * @param ref The ref passed to kc_dhtObjectsForKey()
+ * @return 0 to go on visiting, anything else to stop
+ */
+typedef int (*kc_dhtObjectVisitor)( const kc_hash * related, const void * data, int size, void * ref );
+
+/**
+ * Store an object under a key in the DHT, like an Overnet k-object.
+ *
+ * A key holds any number of objects, told apart by their related hash, so this
+ * replaces only the object with the same related hash. The objects of a key
+ * share a byte budget, past which objects published by others get evicted.
+ *
+ * @param dht The DHT in which to store this object.
+ * @param key The key to store it under, like a keyword hash.
+ * @param related The related hash, like the file hash.
+ * @param data The object meta-tag list, copied.
+ * @param size The size of data.
+ * @return 0 if the object is new, 1 if it replaced another, -1 on error.
+ */
+int
+kc_dhtStoreObject( kc_dht * dht, kc_hash * key, kc_hash * related, const void * data, int size );
+
+/**
+ * Visit the objects we store under a key, sorted by related hash.
+ *
+ * This doesn't perform any lookup.
+ *
+ * @return The number of visited objects.
+ */
+int
+kc_dhtObjectsForKey( const kc_dht * dht, kc_hash * key, kc_dhtObjectVisitor visitor, void * ref );
+
+/**
+ * Visit the objects we store under a key which match a search filter.
+ *
+ * This is what answers search requests, the filter being compiled once per request.
+ *
+ * @param filter The filter, or NULL to visit all objects
+ * @param max The most objects to visit, 0 for no limit
+ * @return The number of visited objects.
+ */
+int
+kc_dhtSearchObjects( const kc_dht * dht, kc_hash * key, const kc_filter * filter, int max, kc_dhtObjectVisitor visitor, void * ref );
+
 /**
  * Retrieve a value for a key from the DHT.
  * 
  * This function search the known keys and returns the value associated with the specified key.
+ * If the key isn't stored locally, it blocks on a FIND_VALUE lookup, so don't call it from the DHT event loop.
  *
  * @param dht The DHT to lookup.
  * @param key The key to lookup.
@@ -181,18 +286,201 @@ kc_dhtRemoveNodes( kc_dht *dht );
 /** 
  * Returns a list of nodes
  *
- * The list will contain MIN( currentNodeCount, dhtBucketSize ).
- * If hash is NULL, the returned list will contain nodes from every bucket (actually in bucket order).
- * Otherwise, the returned list will contain nodes from the closest bucket to the hash.
+ * The list will contain MIN( currentNodeCount, *nodeCount ), or MIN( currentNodeCount, dhtBucketSize )
+ * if *nodeCount is 0, sorted by increasing distance to hash.
+ * If hash is NULL, the returned list will contain the nodes closest to us.
  *
+ * @see kc_dhtGetClosestNodes
  * @param dht The kc_dht to clear
  * @param hash A hash for filtering results
- * @param nodeCount A pointer that will be set to the count of returned node
- * @return An array of kc_dhtNodes
+ * @param nodeCount A pointer to the wanted node count, that will be set to the count of returned node
+ * @return A malloc()ed array of copies of kc_dhtNodes, to be freed with kc_dhtFreeNodes() then free()
  */
 kc_dhtNode **
 kc_dhtGetNodes( const kc_dht * dht, kc_hash * hash, int * nodeCount );
 
+/** 
+ * Gets the nodes closest to a hash
+ *
+ * This function walks the buckets outward from hash, keeping the count closest
+ * nodes it encounters, and stops as soon as no other bucket can hold a closer one.
+ * The nodes are copied while their bucket is locked, so they stay valid
+ * whatever happens to the routing table afterwards.
+ *
+ * @param dht The kc_dht to get the nodes from
+ * @param hash The hash to measure XOR distances from
+ * @param nodes A caller-supplied array of at least count pointers,
+ * which will receive copies of the nodes sorted by increasing distance to hash
+ * @param count The maximum number of nodes to return
+ * @return The number of nodes stored in nodes, to be freed with kc_dhtFreeNodes()
+ */
+int
+kc_dhtGetClosestNodes( const kc_dht * dht, const kc_hash * hash, kc_dhtNode ** nodes, int count );
+
+/**
+ * Frees the node copies returned by kc_dhtGetClosestNodes() or kc_dhtGetNodes().
+ *
+ * @param nodes The array holding the copies, which is not freed itself
+ * @param count The number of copies in nodes
+ */
+void
+kc_dhtFreeNodes( kc_dhtNode ** nodes, int count );
+
+/**
+ * Starts an iterative lookup.
+ *
+ * The lookup keeps a shortlist of nodes sorted by distance to target, seeded from our routing table.
+ * It keeps lookupParallelism requests running to the closest nodes not queried yet,
+ * sending a new one as soon as a reply arrives or a request times out.
+ * Each request times out after its node's retransmission timeout, estimated
+ * from the node's past round-trip-times, and is retried once with twice that timeout.
+ * It ends when the bucketSize closest nodes it knows have all answered,
+ * when no node is left to ask, when a value is found, or after lookupTimeout seconds.
+ *
+ * @param dht The DHT to search
+ * @param target The node hash or key to look for
+ * @param findValue 0 for a FIND_NODE lookup, 1 for a FIND_VALUE one
+ * @param callback An optional callback called when the lookup ends
+ * @param ref Passed to callback
+ * @return A new lookup you must kc_dhtLookupFree(), or NULL on failure
+ */
+kc_dhtLookup *
+kc_dhtLookupStart( kc_dht * dht, const kc_hash * target, int findValue, kc_dhtLookupCallback callback, void * ref );
+
+/**
+ * Waits for a lookup to end.
+ *
+ * Don't call this from the DHT event loop, which runs the lookups.
+ *
+ * @param timeout A timeout in ms, or 0 to wait forever
+ * @return 0 if the lookup ended, 1 on timeout
+ */
+int
+kc_dhtLookupWait( kc_dhtLookup * lookup, unsigned long int timeout );
+
+int
+kc_dhtLookupIsDone( kc_dhtLookup * lookup );
+
+/**
+ * Frees a lookup, cancelling it if it is still running.
+ * Lookups must be freed before their DHT.
+ */
+void
+kc_dhtLookupFree( kc_dhtLookup * lookup );
+
+const kc_hash *
+kc_dhtLookupGetTarget( const kc_dhtLookup * lookup );
+
+/**
+ * @return The value found by a FIND_VALUE lookup, or NULL
+ */
+void *
+kc_dhtLookupGetValue( kc_dhtLookup * lookup );
+
+/**
+ * Gets the closest nodes which answered the lookup.
+ *
+ * @param contacts An array of at least count pointers, or NULL. The contacts are valid until kc_dhtLookupFree().
+ * @param hashes An array of at least count pointers, or NULL. The hashes are valid until kc_dhtLookupFree().
+ * @return The number of nodes stored, sorted by increasing distance to the target
+ */
+int
+kc_dhtLookupGetNodes( kc_dhtLookup * lookup, const kc_contact ** contacts, const kc_hash ** hashes, int count );
+
+/**
+ * @return The depth of the lookup, 1 meaning only nodes from our routing table answered
+ */
+int
+kc_dhtLookupGetHops( const kc_dhtLookup * lookup );
+
+/**
+ * @return The lookup duration in ms, so far if it is still running
+ */
+long
+kc_dhtLookupGetLatency( const kc_dhtLookup * lookup );
+
+/**
+ * Adds a node returned in a lookup reply.
+ *
+ * This is for protocol-implementors, from the reply callback only. The contact and hash are copied.
+ *
+ * @return 0 if the node was added, 1 if it was already known or too far, -1 on failure
+ */
+int
+kc_dhtLookupAddNode( kc_dhtLookup * lookup, const kc_contact * contact, const kc_hash * hash );
+
+/**
+ * Sets the value returned in a FIND_VALUE reply, which ends the lookup.
+ *
+ * This is for protocol-implementors, from the reply callback only. The value is handed over as is.
+ */
+void
+kc_dhtLookupSetValue( kc_dhtLookup * lookup, void * value );
+
+/**
+ * Starts bootstrapping our routing table from a list of contacts.
+ *
+ * The contacts are pinged in random order, keeping at most bootstrapWindow pings in flight,
+ * and each one that answers goes straight into its bucket, splitting buckets as needed.
+ * It ends early once every bucket holds a node, the buckets around our own hash hold bucketSize nodes,
+ * and enough answers in a row brought nothing new that no closer node is likely left,
+ * otherwise when all contacts got pinged and answered or timed out, or when it is freed.
+ * The protocol parse callback must set the sender hash on PING replies for them to be admitted.
+ *
+ * @param dht The DHT to bootstrap
+ * @param contacts The contacts to ping, which are copied
+ * @param count The number of contacts
+ * @param callback An optional callback called when the bootstrap ends
+ * @param ref Passed to callback
+ * @return A new bootstrap you must kc_dhtBootstrapFree(), or NULL on failure
+ */
+kc_dhtBootstrap *
+kc_dhtBootstrapStart( kc_dht * dht, kc_contact ** contacts, int count, kc_dhtBootstrapCallback callback, void * ref );
+
+/**
+ * Waits for a bootstrap to end.
+ *
+ * Don't call this from the DHT event loop, which runs the bootstraps.
+ *
+ * @param timeout A timeout in ms, or 0 to wait forever
+ * @return 0 if the bootstrap ended, 1 on timeout
+ */
+int
+kc_dhtBootstrapWait( kc_dhtBootstrap * bootstrap, unsigned long int timeout );
+
+int
+kc_dhtBootstrapIsDone( kc_dhtBootstrap * bootstrap );
+
+/**
+ * Frees a bootstrap, stopping it if it is still running. Pings already sent are left to finish.
+ */
+void
+kc_dhtBootstrapFree( kc_dhtBootstrap * bootstrap );
+
+/**
+ * Gets how many contacts were pinged, how many answered, and how many of those got into our buckets.
+ */
+void
+kc_dhtBootstrapGetStats( kc_dhtBootstrap * bootstrap, int * pinged, int * answered, int * admitted );
+
+/**
+ * @return The time in ms until bucketSize nodes got admitted, or -1 if it didn't happen
+ */
+long
+kc_dhtBootstrapGetFirstLatency( kc_dhtBootstrap * bootstrap );
+
+/**
+ * @return The time in ms until the routing table got full, or -1 if it didn't happen
+ */
+long
+kc_dhtBootstrapGetFullLatency( kc_dhtBootstrap * bootstrap );
+
+/**
+ * @return The bootstrap duration in ms, so far if it is still running
+ */
+long
+kc_dhtBootstrapGetLatency( kc_dhtBootstrap * bootstrap );
+
 /**
  * Gets the IP address of the local node.
  *
@@ -0,0 +1,565 @@
+/*
+ *  filter.c
+ *  KadC
+ *
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+
+#include "filter.h"
+
+#pragma mark Meta-tag lists
+
+static inline uint32_t
+readWord( const unsigned char * p )
+{
+    return p[0] | ( p[1] << 8 );
+}
+
+static inline uint32_t
+readDword( const unsigned char * p )
+{
+    return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+}
+
+int
+kc_tagIteratorInit( kc_tagIterator * iter, const void * tags, int size )
+{
+    assert( iter != NULL );
+
+    if( tags == NULL || size < 4 )
+        return -1;
+
+    iter->cursor = (const unsigned char *)tags + 4;
+    iter->end = (const unsigned char *)tags + size;
+    iter->remaining = readDword( tags );
+    return 0;
+}
+
+int
+kc_tagNext( kc_tagIterator * iter, kc_tag * tag )
+{
+    const unsigned char * p = iter->cursor;
+    long left = iter->end - p;
+    long length;
+
+    if( iter->remaining == 0 )
+        return 0;
+
+    /* Type and name */
+    if( left < 3 )
+        return -1;
+    tag->type = p[0];
+    tag->nameLength = readWord( p + 1 );
+    p += 3;
+    left -= 3;
+    if( left < tag->nameLength )
+        return -1;
+    tag->name = p;
+    p += tag->nameLength;
+    left -= tag->nameLength;
+
+    /* Value */
+    tag->number = 0;
+    switch( tag->type )
+    {
+        case KADC_MTAG_HASH:
+            length = 16;
+            break;
+
+        case KADC_MTAG_DWORD:
+        case KADC_MTAG_FLOAT:
+            length = 4;
+            break;
+
+        case KADC_MTAG_BOOL:
+            length = 1;
+            break;
+
+        case KADC_MTAG_STRING:
+            if( left < 2 )
+                return -1;
+            length = readWord( p );
+            p += 2;
+            left -= 2;
+            break;
+
+        case KADC_MTAG_BOOL_ARRAY:
+            if( left < 2 )
+                return -1;
+            length = ( readWord( p ) + 7 ) / 8;
+            p += 2;
+            left -= 2;
+            break;
+
+        case KADC_MTAG_BLOB:
+            if( left < 4 )
+                return -1;
+            length = readDword( p );
+            p += 4;
+            left -= 4;
+            break;
+
+        default:
+            return -1;  /* We can't skip over what we don't know */
+    }
+    if( left < length )
+        return -1;
+
+    tag->value = p;
+    tag->valueLength = length;
+    if( tag->type == KADC_MTAG_DWORD )
+        tag->number = readDword( p );
+
+    iter->cursor = p + length;
+    iter->remaining--;
+    return 1;
+}
+
+#pragma mark Search filters
+
+#define FILTER_MAX_OPS          64
+#define FILTER_MAX_SLOTS        16      /* Distinct tag names a filter may test */
+#define FILTER_MAX_NAME         32
+#define FILTER_MAX_DEPTH        16      /* Tree nesting, incoming trees are untrusted */
+#define FILTER_MAX_TERMS        16
+
+#define SEARCH_BOOL             0x00
+#define SEARCH_NAME             0x01
+#define SEARCH_META             0x02
+#define SEARCH_LIMIT            0x03
+
+#define SEARCH_AND              0x00
+#define SEARCH_OR               0x01
+#define SEARCH_ANDNOT           0x02
+
+#define SEARCH_MIN              0x01
+#define SEARCH_MAX              0x02
+
+/* The bytecode has a single boolean register, set by tests and branched on by jumps,
+ * so boolean operators short-circuit like in C */
+typedef enum {
+    FILTER_OP_NAME,             /* The slot string contains operand, case-insensitively */
+    FILTER_OP_META,             /* The slot string equals operand, case-insensitively */
+    FILTER_OP_MIN,              /* The slot DWORD is at least operand */
+    FILTER_OP_MAX,              /* The slot DWORD is at most operand */
+    FILTER_OP_JUMP_FALSE,       /* Goes to op operand if the register is false */
+    FILTER_OP_JUMP_TRUE,        /* Goes to op operand if the register is true */
+    FILTER_OP_NOT
+} filterOpCode;
+
+typedef struct filterOp {
+    unsigned char           code;
+    unsigned char           slot;
+    unsigned short          length;     /* Of the string operand */
+    uint32_t                operand;    /* A limit, a string offset in tree, or a jump target */
+} filterOp;
+
+typedef struct filterSlot {
+    unsigned char           name[FILTER_MAX_NAME];
+    int                     length;
+} filterSlot;
+
+struct _kc_filter {
+    filterOp                ops[FILTER_MAX_OPS];
+    int                     opCount;
+    filterSlot              slots[FILTER_MAX_SLOTS];
+    int                     slotCount;
+    uint32_t                required;   /* Slots a list must have to possibly match */
+    kc_filterTerm           terms[FILTER_MAX_TERMS];    /* The conditions every match satisfies */
+    int                     termCount;
+    int                     size;
+    unsigned char           tree[];     /* A copy of the tree, string operands live there */
+};
+
+static const unsigned char filterNameTag = KADC_STAG_NAME;
+
+/* A term being compiled, its strings are only known by offset until the filter gets allocated */
+typedef struct filterTermSpec {
+    int                     slot;
+    int                     offset;     /* Of the value in the tree, -1 for ranges */
+    int                     length;
+    uint32_t                min;
+    uint32_t                max;
+} filterTermSpec;
+
+typedef struct filterCompiler {
+    kc_filter             * filter;
+    const unsigned char   * tree;
+    int                     position;
+    int                     size;
+    filterTermSpec          terms[FILTER_MAX_TERMS];    /* Every term the tree tests */
+    int                     termCount;
+} filterCompiler;
+
+/* Returns the slot of a tag name, adding it if needed, or -1 */
+static int
+filterSlotForName( kc_filter * filter, const unsigned char * name, int length )
+{
+    int i;
+
+    if( length > FILTER_MAX_NAME )
+        return -1;
+
+    for( i = 0; i < filter->slotCount; i++ )
+    {
+        if( filter->slots[i].length == length && memcmp( filter->slots[i].name, name, length ) == 0 )
+            return i;
+    }
+    if( filter->slotCount == FILTER_MAX_SLOTS )
+        return -1;
+
+    memcpy( filter->slots[i].name, name, length );
+    filter->slots[i].length = length;
+    return filter->slotCount++;
+}
+
+static filterOp *
+filterEmit( kc_filter * filter, filterOpCode code )
+{
+    if( filter->opCount == FILTER_MAX_OPS )
+        return NULL;
+
+    filterOp * op = &filter->ops[filter->opCount++];
+    op->code = code;
+    op->slot = 0;
+    op->length = 0;
+    op->operand = 0;
+    return op;
+}
+
+/* Reads a WORD-prefixed string, returns its offset in the tree or -1 */
+static int
+filterReadString( filterCompiler * compiler, int * length )
+{
+    if( compiler->size - compiler->position < 2 )
+        return -1;
+    *length = readWord( compiler->tree + compiler->position );
+    compiler->position += 2;
+    if( compiler->size - compiler->position < *length )
+        return -1;
+
+    int offset = compiler->position;
+    compiler->position += *length;
+    return offset;
+}
+
+/* Reads a tag name and returns its slot, or -1 */
+static int
+filterReadSlot( filterCompiler * compiler )
+{
+    int length;
+    int offset = filterReadString( compiler, &length );
+    if( offset == -1 )
+        return -1;
+    return filterSlotForName( compiler->filter, compiler->tree + offset, length );
+}
+
+/* Records a term, returns its bit in the term masks, or 0 if there are too many */
+static uint32_t
+filterAddTerm( filterCompiler * compiler, int slot, int offset, int length, uint32_t min, uint32_t max )
+{
+    if( compiler->termCount == FILTER_MAX_TERMS )
+        return 0;
+
+    filterTermSpec * term = &compiler->terms[compiler->termCount];
+    term->slot = slot;
+    term->offset = offset;
+    term->length = length;
+    term->min = min;
+    term->max = max;
+    return 1U << compiler->termCount++;
+}
+
+/* Compiles a subtree, and returns the slots it requires in required,
+ * and the terms all its matches satisfy in must.
+ * Returns 0 on success, -1 on failure */
+static int
+filterCompileNode( filterCompiler * compiler, int depth, uint32_t * required, uint32_t * must )
+{
+    kc_filter * filter = compiler->filter;
+    filterOp * op;
+    int offset, length, slot;
+
+    if( depth > FILTER_MAX_DEPTH || compiler->position >= compiler->size )
+        return -1;
+
+    switch( compiler->tree[compiler->position++] )
+    {
+        case SEARCH_BOOL:
+        {
+            uint32_t left, right;
+            uint32_t leftMust, rightMust;
+            int operator;
+
+            if( compiler->position >= compiler->size )
+                return -1;
+            operator = compiler->tree[compiler->position++];
+            if( operator != SEARCH_AND && operator != SEARCH_OR && operator != SEARCH_ANDNOT )
+                return -1;
+
+            if( filterCompileNode( compiler, depth + 1, &left, &leftMust ) != 0 )
+                return -1;
+            op = filterEmit( filter, ( operator == SEARCH_OR ? FILTER_OP_JUMP_TRUE : FILTER_OP_JUMP_FALSE ) );
+            if( op == NULL )
+                return -1;
+            int jump = filter->opCount - 1;
+
+            if( filterCompileNode( compiler, depth + 1, &right, &rightMust ) != 0 )
+                return -1;
+            if( operator == SEARCH_ANDNOT && filterEmit( filter, FILTER_OP_NOT ) == NULL )
+                return -1;
+            filter->ops[jump].operand = filter->opCount;
+
+            /* Either side of an OR may match alone, the right side of an AND NOT must not match */
+            if( operator == SEARCH_AND )
+            {
+                *required = left | right;
+                *must = leftMust | rightMust;
+            }
+            else if( operator == SEARCH_OR )
+            {
+                *required = left & right;
+                *must = leftMust & rightMust;
+            }
+            else
+            {
+                *required = left;
+                *must = leftMust;
+            }
+            return 0;
+        }
+
+        case SEARCH_NAME:
+            offset = filterReadString( compiler, &length );
+            if( offset == -1 )
+                return -1;
+            slot = filterSlotForName( filter, &filterNameTag, 1 );
+            if( slot == -1 || ( op = filterEmit( filter, FILTER_OP_NAME ) ) == NULL )
+                return -1;
+            op->operand = offset;
+            op->length = length;
+            *must = 0;  /* Substrings can't be looked up */
+            break;
+
+        case SEARCH_META:
+            offset = filterReadString( compiler, &length );
+            if( offset == -1 )
+                return -1;
+            slot = filterReadSlot( compiler );
+            if( slot == -1 || ( op = filterEmit( filter, FILTER_OP_META ) ) == NULL )
+                return -1;
+            op->operand = offset;
+            op->length = length;
+            *must = filterAddTerm( compiler, slot, offset, length, 0, 0 );
+            break;
+
+        case SEARCH_LIMIT:
+        {
+            uint32_t limit;
+            int minmax;
+
+            if( compiler->size - compiler->position < 5 )
+                return -1;
+            limit = readDword( compiler->tree + compiler->position );
+            minmax = compiler->tree[compiler->position + 4];
+            compiler->position += 5;
+            if( minmax != SEARCH_MIN && minmax != SEARCH_MAX )
+                return -1;
+
+            slot = filterReadSlot( compiler );
+            if( slot == -1 || ( op = filterEmit( filter, ( minmax == SEARCH_MIN ? FILTER_OP_MIN : FILTER_OP_MAX ) ) ) == NULL )
+                return -1;
+            op->operand = limit;
+            if( minmax == SEARCH_MIN )
+                *must = filterAddTerm( compiler, slot, -1, 0, limit, UINT32_MAX );
+            else
+                *must = filterAddTerm( compiler, slot, -1, 0, 0, limit );
+            break;
+        }
+
+        default:
+            return -1;
+    }
+
+    op->slot = slot;
+    *required = 1U << slot;
+    return 0;
+}
+
+kc_filter *
+kc_filterCompile( const void * tree, int size, int * used )
+{
+    assert( tree != NULL );
+
+    /* Compile on the stack, then allocate once we know the tree size */
+    kc_filter compiled;
+    filterCompiler compiler;
+    uint32_t must;
+    int i;
+
+    compiled.opCount = 0;
+    compiled.slotCount = 0;
+    compiled.termCount = 0;
+    compiler.filter = &compiled;
+    compiler.tree = tree;
+    compiler.position = 0;
+    compiler.size = size;
+    compiler.termCount = 0;
+
+    if( filterCompileNode( &compiler, 0, &compiled.required, &must ) != 0 )
+    {
+        kc_logDebug( "kc_filterCompile: Malformed or too large search tree" );
+        return NULL;
+    }
+    compiled.size = compiler.position;
+
+    kc_filter * self = malloc( sizeof(kc_filter) + compiled.size );
+    if( self == NULL )
+    {
+        kc_logAlert( "kc_filterCompile: Failed malloc()ing" );
+        return NULL;
+    }
+    memcpy( self, &compiled, sizeof(kc_filter) );
+    memcpy( self->tree, tree, compiled.size );
+
+    /* Only keep the terms every match satisfies, pointing to our copies of their strings */
+    for( i = 0; i < compiler.termCount; i++ )
+    {
+        filterTermSpec * spec = &compiler.terms[i];
+        kc_filterTerm * term = &self->terms[self->termCount];
+
+        if( ( must & ( 1U << i ) ) == 0 )
+            continue;
+        term->name = self->slots[spec->slot].name;
+        term->nameLength = self->slots[spec->slot].length;
+        term->value = ( spec->offset != -1 ? self->tree + spec->offset : NULL );
+        term->valueLength = spec->length;
+        term->min = spec->min;
+        term->max = spec->max;
+        self->termCount++;
+    }
+
+    if( used != NULL )
+        *used = compiled.size;
+    return self;
+}
+
+void
+kc_filterFree( kc_filter * filter )
+{
+    free( filter );
+}
+
+int
+kc_filterGetTerms( const kc_filter * filter, const kc_filterTerm ** terms )
+{
+    assert( filter != NULL );
+    assert( terms != NULL );
+
+    *terms = filter->terms;
+    return filter->termCount;
+}
+
+static int
+filterContains( const kc_tag * tag, const unsigned char * string, int length )
+{
+    int i, j;
+
+    if( tag->type != KADC_MTAG_STRING )
+        return 0;
+
+    for( i = 0; i + length <= tag->valueLength; i++ )
+    {
+        for( j = 0; j < length; j++ )
+        {
+            if( tolower( tag->value[i + j] ) != tolower( string[j] ) )
+                break;
+        }
+        if( j == length )
+            return 1;
+    }
+    return 0;
+}
+
+static int
+filterEquals( const kc_tag * tag, const unsigned char * string, int length )
+{
+    return ( tag->type == KADC_MTAG_STRING && tag->valueLength == length && filterContains( tag, string, length ) );
+}
+
+int
+kc_filterMatch( const kc_filter * filter, const void * tags, int size )
+{
+    assert( filter != NULL );
+
+    kc_tag slots[FILTER_MAX_SLOTS];
+    uint32_t present = 0;
+    kc_tagIterator iter;
+    kc_tag tag;
+    int status;
+    int i;
+
+    /* One pass over the list, keeping the tags the filter tests */
+    if( kc_tagIteratorInit( &iter, tags, size ) != 0 )
+        return 0;
+    while( ( status = kc_tagNext( &iter, &tag ) ) == 1 )
+    {
+        for( i = 0; i < filter->slotCount; i++ )
+        {
+            if( ( present & ( 1U << i ) ) == 0 &&
+                filter->slots[i].length == tag.nameLength &&
+                memcmp( filter->slots[i].name, tag.name, tag.nameLength ) == 0 )
+            {
+                slots[i] = tag;
+                present |= 1U << i;
+                break;
+            }
+        }
+    }
+    if( status == -1 || ( present & filter->required ) != filter->required )
+        return 0;
+
+    int result = 0;
+    for( i = 0; i < filter->opCount; i++ )
+    {
+        const filterOp * op = &filter->ops[i];
+        const kc_tag * slot = &slots[op->slot];
+        int has = ( ( present & ( 1U << op->slot ) ) != 0 );
+
+        switch( op->code )
+        {
+            case FILTER_OP_NAME:
+                result = has && filterContains( slot, filter->tree + op->operand, op->length );
+                break;
+
+            case FILTER_OP_META:
+                result = has && filterEquals( slot, filter->tree + op->operand, op->length );
+                break;
+
+            case FILTER_OP_MIN:
+                result = has && slot->type == KADC_MTAG_DWORD && slot->number >= op->operand;
+                break;
+
+            case FILTER_OP_MAX:
+                result = has && slot->type == KADC_MTAG_DWORD && slot->number <= op->operand;
+                break;
+
+            case FILTER_OP_JUMP_FALSE:
+                if( !result )
+                    i = op->operand - 1;
+                break;
+
+            case FILTER_OP_JUMP_TRUE:
+                if( result )
+                    i = op->operand - 1;
+                break;
+
+            case FILTER_OP_NOT:
+                result = !result;
+                break;
+        }
+    }
+    return result;
+}
@@ -0,0 +1,138 @@
+/*
+ *  filter.h
+ *  KadC
+ *
+ */
+
+#ifndef __KADC_FILTER_H__
+#define __KADC_FILTER_H__
+
+/**
+ * Meta-tag lists and search filters, as found in Overnet publish and search requests.
+ *
+ * A meta-tag list is a little-endian DWORD tag count followed by the tags :
+ * a type byte, a name (WORD length and bytes, a single KADC_STAG_* byte
+ * for the special tags), then a value depending on the type.
+ *
+ * A search filter is a tree in forward polish notation :
+ * <pre>
+ * SEARCH   ::= 0x00 <OPERATOR> <SEARCH> <SEARCH>
+ *              0x01 <STRING>                           keyword, in the name tag
+ *              0x02 <STRING> <META_NAME>               string tag value
+ *              0x03 <DWORD> <MINMAX> <META_NAME>       numeric tag limit
+ * OPERATOR ::= 0x00 AND, 0x01 OR, 0x02 AND NOT
+ * MINMAX   ::= 0x01 MIN, 0x02 MAX
+ * </pre>
+ * Filters get compiled once into flat bytecode, which then matches
+ * meta-tag lists in a single pass over their tags, without allocating.
+ *
+ * Tag types and special tag names are the KADC_MTAG_* and KADC_STAG_* values
+ * below, the same bytes as on the eDonkey/Overnet wire.
+ */
+
+/* Tag types */
+#define KADC_MTAG_HASH          0x01
+#define KADC_MTAG_STRING        0x02
+#define KADC_MTAG_DWORD         0x03
+#define KADC_MTAG_FLOAT         0x04
+#define KADC_MTAG_BOOL          0x05
+#define KADC_MTAG_BOOL_ARRAY    0x06
+#define KADC_MTAG_BLOB          0x07
+
+/* Special tag names */
+#define KADC_STAG_NAME          0x01
+#define KADC_STAG_SIZE          0x02
+#define KADC_STAG_TYPE          0x03
+#define KADC_STAG_FORMAT        0x04
+
+/**
+ * A meta-tag, pointing into the list it was read from.
+ */
+typedef struct _kc_tag {
+    int                     type;       /* KADC_MTAG_* */
+    const unsigned char   * name;
+    int                     nameLength;
+    const unsigned char   * value;      /* Raw value bytes */
+    int                     valueLength;
+    uint32_t                number;     /* The value of DWORD tags */
+} kc_tag;
+
+/**
+ * Iterates over a meta-tag list.
+ */
+typedef struct _kc_tagIterator {
+    const unsigned char   * cursor;
+    const unsigned char   * end;
+    uint32_t                remaining;  /* Tags left to read */
+} kc_tagIterator;
+
+/**
+ * Starts iterating over a meta-tag list.
+ *
+ * @return 0 on success, -1 if the list is truncated
+ */
+int
+kc_tagIteratorInit( kc_tagIterator * iter, const void * tags, int size );
+
+/**
+ * Reads the next tag.
+ *
+ * @return 1 if tag was read, 0 at the end of the list, -1 if the list is malformed
+ */
+int
+kc_tagNext( kc_tagIterator * iter, kc_tag * tag );
+
+/**
+ * A compiled search filter
+ */
+typedef struct _kc_filter kc_filter;
+
+/**
+ * A condition on a tag that all the lists matching a filter satisfy,
+ * so that an index can narrow down the lists worth matching.
+ */
+typedef struct _kc_filterTerm {
+    const unsigned char   * name;
+    int                     nameLength;
+    const unsigned char   * value;      /* The string the tag equals case-insensitively, or NULL for ranges */
+    int                     valueLength;
+    uint32_t                min;        /* The range a DWORD tag lies in */
+    uint32_t                max;
+} kc_filterTerm;
+
+/**
+ * Compiles a serialized search tree.
+ *
+ * @param tree The tree, as found in search requests
+ * @param size The bytes available at tree
+ * @param used Where to return the size of the tree, so that what follows it can be read. May be NULL
+ * @return A new filter, or NULL if the tree is malformed or too large
+ */
+kc_filter *
+kc_filterCompile( const void * tree, int size, int * used );
+
+void
+kc_filterFree( kc_filter * filter );
+
+/**
+ * Returns the terms all the lists matching a filter satisfy.
+ *
+ * Terms under an OR or an AND NOT right side don't qualify, so there may be none.
+ *
+ * @param terms Where to return the terms, which live as long as the filter
+ * @return The number of terms
+ */
+int
+kc_filterGetTerms( const kc_filter * filter, const kc_filterTerm ** terms );
+
+/**
+ * Tells whether a meta-tag list matches a filter.
+ *
+ * Lists missing a tag the filter can't do without are rejected before any evaluation.
+ *
+ * @return 1 if it matches, 0 if it doesn't or is malformed
+ */
+int
+kc_filterMatch( const kc_filter * filter, const void * tags, int size );
+
+#endif /* __KADC_FILTER_H__ */
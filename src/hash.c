@@ -31,13 +31,10 @@ of the following e-mail addresses (replace "(at)" with "@"):
 #include <math.h>
 
 /* Primitives to manipulate n-bit integers like DHT hashes...
-   They are mapped over variable-length char arrays. The first byte (buf[0]) is
-   the most significant, and its bit 0 is the most significant bit. */
-
-struct _kc_hash {
-    int length;             /* Length in bits */
-    unsigned char *hash;    /* A bitfield */
-};
+   They are mapped over fixed-size inline arrays (see struct _kc_hash in hash.h).
+   The first byte (bytes[0]) is the most significant, and its bit 0 is the most
+   significant bit. Bytes past the hash length are always kept at zero, so that
+   word-wise operations don't need to care about the actual length. */
 
 static inline int
 bitToByteCount( int bitCount )
@@ -48,31 +45,62 @@ bitToByteCount( int bitCount )
     return byteCount;
 }
 
+static inline int
+bitToWordCount( int bitCount )
+{
+    return ( bitCount + 63 ) / 64;
+}
+
+/* Returns the i-th 64-bit word of a hash as a number, the first byte of
+ * the hash ending up in the most significant bits */
+static inline uint64_t
+hashWord( const kc_hash * hash, int i )
+{
+    uint64_t w = hash->id.words[i];
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64( w );
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return w;
+#else
+    const unsigned char * p = (const unsigned char *)&hash->id.words[i];
+    int j;
+    w = 0;
+    for( j = 0; j < 8; j++ )
+        w = ( w << 8 ) | p[j];
+    return w;
+#endif
+}
+
 kc_hash *
-kc_hashInit( int length )
+kc_hashClear( kc_hash * hash, int length )
 {
-    kc_hash * self = malloc( sizeof(kc_hash) );
-    if( !self )
-        return NULL;
-    
-    self->length = length;
-    
-    self->hash = calloc( bitToByteCount( length ), sizeof(char) );
-    memset( self->hash , 0, bitToByteCount( length ) );
+    assert( hash != NULL );
+    assert( length > 0 && length <= KADC_HASH_MAX_BITS );
     
-    if( !self->hash )
+    memset( hash, 0, sizeof(kc_hash) );
+    hash->length = length;
+    return hash;
+}
+
+kc_hash *
+kc_hashInit( int length )
+{
+    if( length <= 0 || length > KADC_HASH_MAX_BITS )
     {
-        free( self );
+        kc_logError( "kc_hashInit: %d-bit hashes are not supported (max %d)", length, KADC_HASH_MAX_BITS );
         return NULL;
     }
     
-    return self;
+    kc_hash * self = malloc( sizeof(kc_hash) );
+    if( !self )
+        return NULL;
+    
+    return kc_hashClear( self, length );
 }
 
 void
 kc_hashFree( kc_hash * hash )
 {
-    free( hash->hash );
     free( hash );
 }
 
@@ -88,18 +116,19 @@ kc_hashMove( kc_hash * dest, const kc_hash * src)
 {
     assert( dest != NULL );
     assert( src != NULL );
-    assert( dest->length == src->length );
     
-	return memmove( dest, src, bitToByteCount( src->length ) );
+    if( dest != src )
+        memcpy( dest, src, sizeof(kc_hash) );
+    return dest;
 }
 
 kc_hash *
 kc_hashDup( const kc_hash * org )
 {
     assert( org != NULL );
-    if( org->hash == NULL )
+    kc_hash * i1 = malloc( sizeof(kc_hash) );
+    if( i1 == NULL )
         return NULL;
-    kc_hash * i1 = kc_hashInit( org->length );
     return kc_hashMove( i1, org );
 }
 
@@ -107,9 +136,17 @@ int kc_hashCmp( const void* i1, const void* i2 )
 {
     const kc_hash *ii1 = (const kc_hash*)i1;
     const kc_hash *ii2 = (const kc_hash*)i2;
-    assert( ii1->length != ii2->length );
+    int i;
+    
+    if( ii1->length != ii2->length )
+        return ( ii1->length < ii2->length ? -1 : 1 );
     
-    return memcmp( ii1, ii2, bitToByteCount( ii1->length ) );
+    for( i = 0; i < bitToWordCount( ii1->length ); i++ )
+    {
+        if( ii1->id.words[i] != ii2->id.words[i] )
+            return ( hashWord( ii1, i ) < hashWord( ii2, i ) ? -1 : 1 );
+    }
+    return 0;
 }
 
 #if 0
@@ -141,24 +178,30 @@ kc_hashXor( kc_hash * dest, const kc_hash * opn1, const kc_hash * opn2)
 {
     assert( opn1 != NULL );
     assert( opn2 != NULL );
-    assert( opn1->length != opn2->length );
+    assert( opn1->length == opn2->length );
     assert( dest != opn1 );
     assert( dest != opn2 );
     
     if( dest == NULL )
         dest = kc_hashInit( opn1->length );
+    else
+        dest->length = opn1->length;
     
-	int i;
-    unsigned char * op1h = opn1->hash;
-    unsigned char * op2h = opn2->hash;
-	unsigned char * dest1 = dest->hash;
-    
-	for( i = 0; i < bitToByteCount( dest->length ); i++ )
-            *dest1++ = *op1h++ ^ *op2h++;
+    int i;
+    for( i = 0; i < KADC_HASH_WORDS; i++ )
+        dest->id.words[i] = opn1->id.words[i] ^ opn2->id.words[i];
     
-	return dest;
+    return dest;
 }
 
+/* The distance engine below works on 64-bit words taken in big-endian order,
+ * so that the first byte of a hash ends up in the most significant bits of
+ * the first word. This lets us find the highest differing bit of two hashes
+ * with a single count-leading-zeros per word, without any temporary kc_hash. */
+
+#if defined(__GNUC__)
+#define hashClz64( w ) __builtin_clzll( w )
+#else
 const static char logtable[256] = {
    -1, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
 	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
@@ -178,6 +221,20 @@ const static char logtable[256] = {
 	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
 };
 
+/* w must not be 0 */
+static inline int
+hashClz64( uint64_t w )
+{
+    int n = 0;
+    while( ( w >> 56 ) == 0 )
+    {
+        w <<= 8;
+        n += 8;
+    }
+    return n + 7 - logtable[w >> 56];
+}
+#endif
+
 /* returns the position of the most significant bit of op
    (from 0 to 127) to be set to 1: in other words, the integer
    part of its log in base 2. If op is zero it returns -1
@@ -185,37 +242,103 @@ const static char logtable[256] = {
 int
 kc_hashLog( kc_hash * op )
 {
-	int i;
-    int length = bitToByteCount( op->length );
-	int l = length - 8;
-	for( i = 0; i < length; i++, op++ ) {
-		if( *op->hash != 0 )
-		{
-			return l + logtable[*op->hash];
-		}
-		l -= 8;
-	}
+    int bitCount = bitToByteCount( op->length ) * 8;
+    int i;
+    
+    for( i = 0; i < bitToWordCount( op->length ); i++ )
+    {
+        if( op->id.words[i] != 0 )
+            return bitCount - 1 - ( i * 64 + hashClz64( hashWord( op, i ) ) );
+    }
 	return -1; /* all bytes were zero */
 }
 
 int
 kc_hashXorlog( const kc_hash * opn1, const kc_hash * opn2 )
 {
-    assert( opn1->length != opn2->length );
+    int bitCount;
+    int i;
+    
+    assert( opn1 != NULL );
+    assert( opn2 != NULL );
+    assert( opn1->length == opn2->length );
+    
+    bitCount = bitToByteCount( opn1->length ) * 8;
+    for( i = 0; i < bitToWordCount( opn1->length ); i++ )
+    {
+        if( opn1->id.words[i] != opn2->id.words[i] )
+            return bitCount - 1 - ( i * 64 + hashClz64( hashWord( opn1, i ) ^ hashWord( opn2, i ) ) );
+    }
+	return -1; /* all bits were zero */
+}
+
+int
+kc_hashXorlogBatch( const kc_hash * ref, const kc_hash * const * hashes, int count, int * logs )
+{
+    uint64_t refWords[KADC_HASH_WORDS];
+    int bitCount;
+    int wordCount;
+    int i, j;
+    
+    assert( ref != NULL );
+    assert( count == 0 || ( hashes != NULL && logs != NULL ) );
+    
+    bitCount = bitToByteCount( ref->length ) * 8;
+    wordCount = bitToWordCount( ref->length );
+    for( j = 0; j < wordCount; j++ )
+        refWords[j] = hashWord( ref, j );
+    
+    for( i = 0; i < count; i++ )
+    {
+        const kc_hash * h = hashes[i];
+        assert( h->length == ref->length );
+        
+        logs[i] = -1;
+        for( j = 0; j < wordCount; j++ )
+        {
+            uint64_t w = refWords[j] ^ hashWord( h, j );
+            if( w != 0 )
+            {
+                logs[i] = bitCount - 1 - ( j * 64 + hashClz64( w ) );
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+int
+kc_hashDistanceCmp( const kc_hash * target, const kc_hash * i1, const kc_hash * i2 )
+{
+    int i;
+    
+    assert( target != NULL );
+    assert( i1 != NULL );
+    assert( i2 != NULL );
+    assert( i1->length == target->length );
+    assert( i2->length == target->length );
     
-	kc_hash * hash = kc_hashInit( opn1->length );
-	kc_hashXor( hash, opn1, opn2 );
-	return kc_hashLog( hash );
+    for( i = 0; i < bitToWordCount( target->length ); i++ )
+    {
+        if( i1->id.words[i] != i2->id.words[i] )
+        {
+            uint64_t t = hashWord( target, i );
+            return ( ( hashWord( i1, i ) ^ t ) < ( hashWord( i2, i ) ^ t ) ? -1 : 1 );
+        }
+    }
+    return 0;
 }
 
 kc_hash *
 kc_hashRandom( int length )
 {
     kc_hash * hash = kc_hashInit( length );
+    if( hash == NULL )
+        return NULL;
 
-	int i;
-	for( i = 0; i < bitToByteCount( length ); i++ )
-		hash->hash[i] = random();
+    int i;
+    for( i = 0; i < bitToByteCount( length ); i++ )
+		hash->id.bytes[i] = random();
 	return hash;
 }
 
@@ -224,10 +347,12 @@ kc_hashSrandom( int length, unsigned long seed )
 {
     kc_hash * hash = kc_hashInit( length );
 	int i;
+    if( hash == NULL )
+        return NULL;
     
     srandom( seed );
 	for( i = 0; i < bitToByteCount( length ); i++ )
-		hash->hash[i] = random();
+		hash->id.bytes[i] = random();
 	return hash;
 }
 
@@ -245,14 +370,14 @@ int128random_r(kc_hash i128, unsigned int *seed)
 kc_hash *
 int128eMule2KadC( kc_hash * kadc128int, unsigned long int *emule128int)
 {
-    assert( kadc128int->length != 16 );
+    assert( kadc128int->length == 128 );
     
 	int i, ii = 0;
 	for ( i = 0; i < 4; i++ ) {
-		kadc128int->hash[ii++] = (unsigned char)(emule128int[i] >> 24);
-		kadc128int->hash[ii++] = (unsigned char)(emule128int[i] >> 16);
-		kadc128int->hash[ii++] = (unsigned char)(emule128int[i] >>  8);
-		kadc128int->hash[ii++] = (unsigned char)(emule128int[i] >>  0);
+		kadc128int->id.bytes[ii++] = (unsigned char)(emule128int[i] >> 24);
+		kadc128int->id.bytes[ii++] = (unsigned char)(emule128int[i] >> 16);
+		kadc128int->id.bytes[ii++] = (unsigned char)(emule128int[i] >>  8);
+		kadc128int->id.bytes[ii++] = (unsigned char)(emule128int[i] >>  0);
 	}
 	return kadc128int;
 }
@@ -264,86 +389,129 @@ unsigned long int *int128KadC2eMule(unsigned long int *emule128int, kc_hash kadc
 	return emule128int;
 }
 
-void
-kc_hashPrint(FILE *fd, kc_hash * hash) {
-	int i;
-	if( hash == NULL || hash->length == 0 )
+/* Hex conversion tables : the two digits of each byte value,
+ * and the value of each character, -1 if it isn't a hex digit */
+static const char hexPairs[512] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const signed char hexValues[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+char *
+kc_hashFormat( char * buf, size_t len, const kc_hash * hash )
+{
+    assert( buf != NULL );
+    
+    if( len == 0 )
+        return buf;
+    
+    if( hash == NULL || hash->length == 0 )
     {
-		fprintf(fd, "(NULL)");
-        return;
+        snprintf( buf, len, "(NULL)" );
+        return buf;
     }
     
-    for( i = 0; i < bitToByteCount( hash->length ); i++ )
-        fprintf(fd, "%02x", hash->hash[i]);
+    int i;
+    int count = bitToByteCount( hash->length );
+    char * p = buf;
+    
+    /* Only whole bytes, if it gets truncated */
+    if( (size_t)count > ( len - 1 ) / 2 )
+        count = ( len - 1 ) / 2;
+    
+    for( i = 0; i < count; i++, p += 2 )
+        memcpy( p, &hexPairs[hash->id.bytes[i] * 2], 2 );
+    *p = '\0';
+    return buf;
 }
 
-char *hashtoa( const kc_hash * hash ) {
-    static char * hashStr;
+int
+kc_hashParse( kc_hash * hash, const char * s )
+{
+    assert( hash != NULL );
+    assert( s != NULL );
     
-    int length = ( hash == NULL ? 7 : bitToByteCount( hash->length ) );
+    size_t n = strlen( s ) & ~(size_t)1;    /* Ignore a trailing odd digit */
     
-    void * tmp;
-    if( hashStr == NULL)
-        hashStr = calloc( length, sizeof(char) );
-    else
+    if( n == 0 )
+        return -1;
+    
+    if( n > KADC_HASH_BYTES * 2 )
+        n = KADC_HASH_BYTES * 2;
+    
+    kc_hash parsed;
+    size_t i;
+    kc_hashClear( &parsed, n * 4 );
+    
+    for( i = 0; i < n / 2; i++, s += 2 )
     {
-        tmp = realloc( hashStr, length * sizeof(char) );
-        if( tmp == NULL )
-        {
-            kc_logAlert( "Failed reallocating hashStr" );
-            return "Error!";
-        }
-        hashStr = tmp;
+        int hi = hexValues[(unsigned char)s[0]];
+        int lo = hexValues[(unsigned char)s[1]];
+        if( ( hi | lo ) < 0 )
+            return -1;  /* invalid hex char */
+        parsed.id.bytes[i] = ( hi << 4 ) | lo;
     }
     
-    kc_hashSprintf( hashStr, hash );
+    *hash = parsed;
+    return 0;
+}
+
+void
+kc_hashPrint( FILE *fd, kc_hash * hash )
+{
+    char hashStr[KADC_HASH_STRLEN];
     
-    return hashStr;
+    fputs( kc_hashFormat( hashStr, sizeof(hashStr), hash ), fd );
 }
 
-/* NOTE: s MUST have space for 33 characters (32 + termin. zero) */
-char *kc_hashSprintf( char *s, const kc_hash * hash ) {
-	int i;
-	char *p = s;
-	if( hash == NULL || hash->length == 0 )
-		strcpy( p, "(NULL)" );
-	else
-    {
-		for( i = 0; i < bitToByteCount( hash->length ); i++, p += 2 )
-			sprintf( p, "%02x", hash->hash[i] );
-		*p = 0;
-	}
-	return s;
+char *
+hashtoa( const kc_hash * hash )
+{
+    return kc_hashFormat( kc_printBuffer(), KADC_PRINT_BUFSIZE, hash );
+}
+
+/* NOTE: s MUST have room for KADC_HASH_STRLEN characters */
+char *
+kc_hashSprintf( char *s, const kc_hash * hash )
+{
+    return kc_hashFormat( s, KADC_HASH_STRLEN, hash );
 }
 
 kc_hash *
 atohash( const char *s )
 {
-    kc_hash * hash;
-	int i, n;
-	unsigned int u;
-    assert( s != NULL );
-    
-    
-	if( ( ( n = strlen( s ) ) & 1 ) != 0 ) {	/* odd length string */
-		n--;
-	}
+    kc_hash parsed;
     
-    if( n == 0 )
+    if( kc_hashParse( &parsed, s ) != 0 )
         return NULL;
     
-    hash = kc_hashInit( n );
-
-	for( i = 0; i < bitToByteCount( hash->length ) && n > 0; i++, s += 2, n -= 2)
-    {
-		if( sscanf(s, "%2x", &u ) != 1 )
-        {
-            kc_hashFree( hash );
-			return NULL;	/* invalid hex char */
-        }
-		hash->hash[i] = u;
-	}
-	return hash;	/* OK */
+    kc_hash * hash = kc_hashInit( parsed.length );
+    if( hash != NULL )
+        *hash = parsed;
+    return hash;
 }
 
 /* get an kc_hash stored in network byte order (big endian) */
@@ -352,7 +520,7 @@ gethashn( kc_hash * hash, const char **ppb )
 {
 	int i;
 	for( i = 0; i < bitToByteCount( hash->length ); i++)
-		hash->hash[i] = *(*ppb)++;
+		hash->id.bytes[i] = *(*ppb)++;
 	return hash;
 }
 
@@ -362,6 +530,6 @@ puthashn( char *ppb, kc_hash * hash )
 {
 	int i;
 	for( i = 0; i < bitToByteCount( hash->length ); i++)
-		*(ppb)++ = hash->hash[i];
+		*(ppb)++ = hash->id.bytes[i];
 	return ppb;
-}
\ No newline at end of file
+}
@@ -31,19 +31,63 @@ of the following e-mail addresses (replace "(at)" with "@"):
 #define KADC_INT128_H
 
 /** @file kc_hash.h
- * This file contains primitives to manipulate 128-bit integers like, er, MD4 hashes...
+ * This file contains primitives to manipulate n-bit integers like, er, MD4 hashes...
  *
- * Internally they are mapped over 16-byte arrays. The first byte (buf[0]) is the most significant,
+ * Internally they are mapped over fixed-size inline arrays, big enough for
+ * KADC_HASH_MAX_BITS. The first byte (bytes[0]) is the most significant,
  * and its bit 0 (the one with weight 2**7) is the most significant bit.
+ * Bytes past the hash length are always zero.
  */
 
-typedef struct _kc_hash kc_hash;
+#include <stdint.h>
+
+/** The longest hash supported, in bits. Can be raised at compile time. */
+#ifndef KADC_HASH_MAX_BITS
+#define KADC_HASH_MAX_BITS  256
+#endif
+
+#define KADC_HASH_WORDS     ( ( KADC_HASH_MAX_BITS + 63 ) / 64 )
+#define KADC_HASH_BYTES     ( KADC_HASH_WORDS * 8 )
+
+/** Room needed to format any hash, see kc_hashFormat() */
+#define KADC_HASH_STRLEN    ( KADC_HASH_BYTES * 2 + 1 )
+
+/**
+ * A hash, stored inline so that it can be embedded in other structures
+ * and copied around without any allocation.
+ * Use kc_hashClear() to set up one that wasn't obtained from kc_hashInit().
+ */
+typedef struct _kc_hash {
+    int length;                                 /* Length in bits */
+    union {
+        uint64_t        words[KADC_HASH_WORDS]; /* For word-wise operations */
+        unsigned char   bytes[KADC_HASH_BYTES]; /* In network byte order */
+    } id;
+} kc_hash;
 
 //#define int128_bitnum(n, bit) (((n)[(bit)/8] >> (7-((bit)%8))) & 1)
 
+/**
+ * Allocates a zeroed kc_hash.
+ *
+ * @param length The length of the hash in bits, at most KADC_HASH_MAX_BITS
+ * @return A malloc()ed kc_hash, or NULL if length isn't supported
+ */
 kc_hash *
 kc_hashInit( int length );
 
+/**
+ * Zeroes an existing kc_hash, and sets its length.
+ *
+ * Use this on kc_hash embedded in other structures or living on the stack.
+ *
+ * @param hash The kc_hash to clear
+ * @param length The length of the hash in bits, at most KADC_HASH_MAX_BITS
+ * @return hash
+ */
+kc_hash *
+kc_hashClear( kc_hash * hash, int length );
+
 void
 kc_hashFree( kc_hash * hash );
 
@@ -51,7 +95,7 @@ int
 kc_hashLength( const kc_hash * hash);
 
 /** 
- * Moves an kc_hash from src to dest.
+ * Moves an kc_hash from src to dest. dest takes src's length.
  * @return Returns dest
  */
 kc_hash *
@@ -111,7 +155,8 @@ kc_hashLog( kc_hash * op );
 /** 
  * Return the log value of the XOR between two kc_hash.
  *
- * This function combines int128xor & int128log.
+ * This function combines int128xor & int128log, without allocating
+ * a temporary kc_hash for the XOR.
  *
  * @param opn1 An kc_hash, will be passed to int129xor
  * @param opn2 An kc_hash, will be passed to int129xor
@@ -120,6 +165,34 @@ kc_hashLog( kc_hash * op );
 int
 kc_hashXorlog( const kc_hash * opn1, const kc_hash * opn2 );
 
+/** 
+ * Computes kc_hashXorlog() of a reference hash against an array of hashes.
+ *
+ * This function does not allocate any memory. The reference hash is loaded once,
+ * which makes it cheaper than calling kc_hashXorlog() in a loop when sorting
+ * a batch of nodes into buckets.
+ *
+ * @param ref The kc_hash every other hash is compared to (usually our own hash)
+ * @param hashes An array of count kc_hash pointers, all of ref's length
+ * @param count The number of hashes in the array
+ * @param logs An array of count ints that will receive the log of each XOR
+ * @return The number of computed logs
+ */
+int
+kc_hashXorlogBatch( const kc_hash * ref, const kc_hash * const * hashes, int count, int * logs );
+
+/** 
+ * Compares the XOR distances of two kc_hash to a target, and returns a qsort()-compatible int.
+ *
+ * This function does not allocate any memory.
+ *
+ * @param target The kc_hash distances are measured from
+ * @param i1, i2 The two kc_hash to compare, all of target's length
+ * @return -1 if i1 is closer to target than i2, 1 if i2 is closer, 0 if they are equal
+ */
+int
+kc_hashDistanceCmp( const kc_hash * target, const kc_hash * i1, const kc_hash * i2 );
+
 /** 
  * Returns a random()-ized kc_hash.
  *
@@ -165,21 +238,57 @@ kc_hashKadC2eMule( unsigned long int *emule128int, kc_hash * kadc128int );
 void
 kc_hashPrint( FILE *fd, kc_hash * i128 );
 
+/**
+ * Formats a hash as hexadecimal into a caller-provided buffer.
+ *
+ * This function doesn't allocate anything, so it is safe to use from any thread.
+ * Only whole bytes are written if buf is too small, and a NULL
+ * or empty hash gets formatted as "(NULL)".
+ *
+ * @param buf The buffer to write to.
+ * @param len The size of buf, KADC_HASH_STRLEN is always enough.
+ * @param hash The hash to format.
+ * @return buf.
+ */
+char *
+kc_hashFormat( char * buf, size_t len, const kc_hash * hash );
+
+/**
+ * Parses a hexadecimal ASCII string into a hash.
+ *
+ * This is the non-allocating version of atohash(), with the same rules :
+ * an odd trailing digit is ignored, and the hash gets 4 bits per digit,
+ * up to KADC_HASH_MAX_BITS. hash is left untouched on failure.
+ *
+ * @param hash The hash to fill.
+ * @param s A C string containing hexadecimal ASCII characters.
+ * @return 0 on success, -1 if s is empty or has a non-hex character.
+ */
+int
+kc_hashParse( kc_hash * hash, const char * s );
+
 /**
  * Create an kc_hash from an ASCII string.
  * 
  * This function parses an ASCII string into an kc_hash.
- * It will return NULL if s points to an odd-length string,
- * else it truncates the string or pads it on its RIGHT side
- * with zeroes, and converts it as hex string into a kc_hash,
- * returning the address of that kc_hash
+ * It ignores the last character of an odd-length string,
+ * truncates it to KADC_HASH_MAX_BITS, and converts it as hex string
+ * into a kc_hash, returning the address of that kc_hash
  * 
- * @return A pointer to a malloc()ed kc_hash. You are responsible of free()ing this.
+ * @see kc_hashParse().
+ * @return A pointer to a malloc()ed kc_hash, or NULL if s isn't valid. You are responsible of free()ing this.
  * @param s A const pointer to a C string containing hexadecimal ASCII characters.
  */
 kc_hash *
 atohash( const char *s );
 
+/**
+ * Formats a hash as hexadecimal into a thread-local buffer.
+ *
+ * The result stays valid until a few more calls to the printing
+ * helpers from the same thread (see kc_printBuffer()), which is enough
+ * to use it as a log argument. Use kc_hashFormat() to keep it around.
+ */
 char *
 hashtoa( const kc_hash * hash );
 
@@ -7,51 +7,95 @@
  *
  */
 
+#include <limits.h>
+#include <ctype.h>
+
 #include "internal.h"
 
 /* Management of the kbuckets/kspace table */
-int
-dhtNodeCmpSeen( const void *a, const void *b )
+kc_dhtNode *
+dhtNodeInit( kc_contact * contact, const kc_hash * hash )
 {
-	const kc_dhtNode *pa = a;
-	const kc_dhtNode *pb = b;
+	kc_dhtNode *self = malloc( sizeof(kc_dhtNode) );
+    if ( !self )
+        return NULL;
     
-    /* TODO: Check I'm really sorting from least-recently seen to most-recently seen */
-	if( pa->lastSeen != pb->lastSeen)
-        return ( pa->lastSeen < pb->lastSeen ? -1 : 1 );
+    self->contact = contact;
+    if( hash )
+        kc_hashMove( &self->hash, hash );    /* copy dereferenced data */
+    else
+        memset( &self->hash, 0, sizeof(kc_hash) );
+    self->lastSeen = 0;
+    dhtNodeResetRtt( self );
     
-    return 0;
+    return self;
 }
 
-int
-dhtNodeCmpHash( const void *a, const void *b )
+void
+dhtNodeFree( kc_dhtNode *pkn )
 {
-	const kc_dhtNode *pa = a;
-	const kc_dhtNode *pb = b;
-    
-	return kc_hashCmp( pa, pb );
+	free( pkn );
 }
 
 kc_dhtNode *
-dhtNodeInit( kc_contact * contact, const kc_hash * hash )
+dhtNodeDup( const kc_dhtNode * node )
 {
-	kc_dhtNode *self = malloc( sizeof(kc_dhtNode) );
-    if ( !self )
+    kc_contact * contact = kc_contactDup( node->contact );
+    if( contact == NULL )
+        return NULL;
+    
+    kc_dhtNode * self = malloc( sizeof(kc_dhtNode) );
+    if( self == NULL )
+    {
+        kc_contactFree( contact );
         return NULL;
+    }
     
+    *self = *node;
     self->contact = contact;
-    if( hash )
-        self->hash = kc_hashDup( hash );    /* copy dereferenced data */
-	self->lastSeen = 0;
+    return self;
+}
+
+#pragma mark Round-trip-time estimation
+
+/* Jacobson/Karels estimation, as in RFC 6298 : srtt and rttvar are
+ * exponentially-weighted averages with gains 1/8 and 1/4, and
+ * rto = srtt + 4 * rttvar */
+
+void
+dhtNodeResetRtt( kc_dhtNode * node )
+{
+    node->srtt = 0;
+    node->rttvar = 0;
+    node->rto = DHT_RTO_INITIAL;
+}
+
+void
+dhtNodeUpdateRtt( kc_dhtNode * node, long rtt )
+{
+    if( rtt < 1 )
+        rtt = 1;
+    
+    if( node->srtt == 0 )
+    {
+        node->srtt = rtt;
+        node->rttvar = rtt / 2;
+    }
+    else
+    {
+        long delta = rtt - node->srtt;
+        node->srtt += delta / 8;
+        node->rttvar += ( ( delta < 0 ? -delta : delta ) - node->rttvar ) / 4;
+    }
     
-	return self;
+    long rto = node->srtt + 4 * node->rttvar;
+    node->rto = ( rto < DHT_RTO_MIN ? DHT_RTO_MIN : ( rto > DHT_RTO_MAX ? DHT_RTO_MAX : rto ) );
 }
 
 void
-dhtNodeFree( kc_dhtNode *pkn )
+dhtNodeBackoffRto( kc_dhtNode * node )
 {
-    kc_hashFree( pkn->hash );
-	free( pkn );
+    node->rto = ( node->rto * 2 > DHT_RTO_MAX ? DHT_RTO_MAX : node->rto * 2 );
 }
 
 
@@ -71,18 +115,26 @@ kc_dhtNodeSetContact( kc_dhtNode * node, kc_contact * contact )
 kc_hash *
 kc_dhtNodeGetHash( const kc_dhtNode * node )
 {
-    return node->hash;
+    return (kc_hash *)&node->hash;
 }
 
 void
 kc_dhtNodeSetHash( kc_dhtNode * node, kc_hash * hash )
 {
-    kc_hashMove( node->hash, hash );
+    kc_hashMove( &node->hash, hash );
 }
 
 dhtBucket *
 dhtBucketInit( int size )
 {
+    int i;
+    
+    if( size <= 0 || size > SHRT_MAX )
+    {
+        kc_logError( "dhtBucketInit: invalid bucket size %d", size );
+        return NULL;
+    }
+    
 	dhtBucket *pkb = malloc( sizeof(dhtBucket) );
 	if(pkb == NULL)
     {
@@ -90,13 +142,41 @@ dhtBucketInit( int size )
         return NULL;
     }
     
+    pkb->slots = calloc( size, sizeof(dhtBucketSlot) );
+    pkb->prefixes = calloc( size, sizeof(uint64_t) );
+    pkb->used = calloc( size, sizeof(unsigned char) );
+    pkb->replacements = calloc( size, sizeof(dhtReplacement) );
+    if( pkb->slots == NULL || pkb->prefixes == NULL || pkb->used == NULL || pkb->replacements == NULL )
+    {
+        kc_logError( "dhtBucketInit: slots malloc failed !" );
+        free( pkb->slots );
+        free( pkb->prefixes );
+        free( pkb->used );
+        free( pkb->replacements );
+        free( pkb );
+        return NULL;
+    }
+    
     /* if static initialization of recursive mutexes is available, use it;
      * otherwise, hope that dynamic initialization is available... */
     
     pthreadutils_mutex_init_recursive( &pkb->mutex );
     
-    pkb->nodes = rbtNew( dhtNodeCmpSeen );
-	pkb->availableSlots = size;
+    /* Every slot starts in the free list */
+    for( i = 0; i < size; i++ )
+    {
+        pkb->slots[i].prev = -1;
+        pkb->slots[i].next = ( i + 1 < size ? i + 1 : -1 );
+    }
+    pkb->size = size;
+    pkb->limit = size;
+    pkb->count = 0;
+    pkb->head = -1;
+    pkb->tail = -1;
+    pkb->freeSlots = 0;
+    pkb->replacementCount = 0;
+    pkb->probing = 0;
+    pkb->lastChanged = 0;
     
 	return pkb;
 }
@@ -116,45 +196,992 @@ dhtBucketUnlock( dhtBucket *pkb )
 void
 dhtBucketFree( dhtBucket *pkb )
 {
-	void *iter;
 	dhtBucketLock( pkb );
     
-	/* empty pkb->rbt */
-	while ( ( iter = rbtBegin( pkb->nodes ) ) != NULL)
+    int i;
+    for( i = 0; i < pkb->size; i++ )
     {
-		kc_dhtNode *pkn;
-        
-		rbtKeyValue( pkb->nodes, iter, NULL, (void**)&pkn );
-        
-		rbtErase( pkb->nodes, iter ); /* ?? */
-        
-		dhtNodeFree( pkn );	/* deallocate knode */
-	}
+        if( pkb->used[i] )
+            kc_contactFree( pkb->slots[i].node.contact );
+    }
+    free( pkb->slots );
+    free( pkb->prefixes );
+    free( pkb->used );
     
-	rbtDelete( pkb->nodes );
+    for( i = 0; i < pkb->replacementCount; i++ )
+        kc_contactFree( pkb->replacements[i].contact );
+    free( pkb->replacements );
     
 	dhtBucketUnlock( pkb );
 	pthread_mutex_destroy( &pkb->mutex );
 	free( pkb );
 }
 
+static inline short
+dhtBucketSlotIndex( const dhtBucket * bucket, const kc_dhtNode * node )
+{
+    const dhtBucketSlot * slot = (const dhtBucketSlot *)node;
+    
+    assert( slot >= bucket->slots && slot < bucket->slots + bucket->size );
+    return slot - bucket->slots;
+}
+
+/* Unlinks a slot from the LRU list */
+static void
+dhtBucketUnlink( dhtBucket * bucket, short i )
+{
+    dhtBucketSlot * slot = &bucket->slots[i];
+    
+    if( slot->prev != -1 )
+        bucket->slots[slot->prev].next = slot->next;
+    else
+        bucket->head = slot->next;
+    
+    if( slot->next != -1 )
+        bucket->slots[slot->next].prev = slot->prev;
+    else
+        bucket->tail = slot->prev;
+    
+    slot->prev = slot->next = -1;
+}
+
+/* Links a slot at the tail of the LRU list */
+static void
+dhtBucketAppend( dhtBucket * bucket, short i )
+{
+    dhtBucketSlot * slot = &bucket->slots[i];
+    
+    slot->prev = bucket->tail;
+    slot->next = -1;
+    if( bucket->tail != -1 )
+        bucket->slots[bucket->tail].next = i;
+    else
+        bucket->head = i;
+    bucket->tail = i;
+}
+
+int
+dhtBucketCount( const dhtBucket * bucket )
+{
+    return bucket->count;
+}
+
+int
+dhtBucketIsFull( const dhtBucket * bucket )
+{
+    return bucket->count >= bucket->limit;
+}
+
+kc_dhtNode *
+dhtBucketFind( const dhtBucket * bucket, const kc_hash * hash )
+{
+    uint64_t prefix = hash->id.words[0];
+    int i;
+    
+    /* Scan the contiguous prefix array first, and only look at the
+     * full hash when the first word matches */
+    for( i = 0; i < bucket->size; i++ )
+    {
+        if( bucket->prefixes[i] == prefix && bucket->used[i] &&
+            kc_hashCmp( &bucket->slots[i].node.hash, hash ) == 0 )
+            return &bucket->slots[i].node;
+    }
+    return NULL;
+}
+
+kc_dhtNode *
+dhtBucketInsert( dhtBucket * bucket, kc_contact * contact, const kc_hash * hash )
+{
+    short i = bucket->freeSlots;
+    if( i == -1 )
+        return NULL;
+    
+    dhtBucketSlot * slot = &bucket->slots[i];
+    bucket->freeSlots = slot->next;
+    
+    slot->node.contact = contact;
+    kc_hashMove( &slot->node.hash, hash );
+    slot->node.lastSeen = time( NULL );
+    dhtNodeResetRtt( &slot->node );
+    
+    bucket->prefixes[i] = hash->id.words[0];
+    bucket->used[i] = 1;
+    bucket->count++;
+    
+    dhtBucketAppend( bucket, i );
+    return &slot->node;
+}
+
+void
+dhtBucketTouch( dhtBucket * bucket, kc_dhtNode * node )
+{
+    short i = dhtBucketSlotIndex( bucket, node );
+    
+    node->lastSeen = time( NULL );
+    if( bucket->tail == i )
+        return;
+    
+    dhtBucketUnlink( bucket, i );
+    dhtBucketAppend( bucket, i );
+}
+
+void
+dhtBucketRemove( dhtBucket * bucket, kc_dhtNode * node )
+{
+    short i = dhtBucketSlotIndex( bucket, node );
+    
+    assert( bucket->used[i] );
+    
+    dhtBucketUnlink( bucket, i );
+    bucket->used[i] = 0;
+    bucket->prefixes[i] = 0;
+    bucket->count--;
+    
+    /* Push it on the free list */
+    bucket->slots[i].next = bucket->freeSlots;
+    bucket->freeSlots = i;
+}
+
+kc_dhtNode *
+dhtBucketOldest( const dhtBucket * bucket )
+{
+    if( bucket->head == -1 )
+        return NULL;
+    return &bucket->slots[bucket->head].node;
+}
+
+kc_dhtNode *
+dhtBucketNext( const dhtBucket * bucket, const kc_dhtNode * node )
+{
+    short next = bucket->slots[dhtBucketSlotIndex( bucket, node )].next;
+    if( next == -1 )
+        return NULL;
+    return &bucket->slots[next].node;
+}
+
+void
+dhtBucketAddReplacement( dhtBucket * bucket, kc_contact * contact, const kc_hash * hash, time_t lastSeen )
+{
+    int i;
+    
+    for( i = 0; i < bucket->replacementCount; i++ )
+    {
+        if( kc_hashCmp( &bucket->replacements[i].hash, hash ) == 0 )
+            break;
+    }
+    
+    if( i < bucket->replacementCount )
+        kc_contactFree( bucket->replacements[i].contact );
+    else if( bucket->replacementCount == bucket->size )
+    {
+        kc_logDebug( "Replacement %s dropped", hashtoa( &bucket->replacements[0].hash ) );
+        kc_contactFree( bucket->replacements[0].contact );
+        i = 0;
+    }
+    else
+        i = bucket->replacementCount++;
+    
+    /* Keep them in lastSeen order, this one going last */
+    memmove( &bucket->replacements[i], &bucket->replacements[i + 1],
+             ( bucket->replacementCount - 1 - i ) * sizeof(dhtReplacement) );
+    
+    dhtReplacement * replacement = &bucket->replacements[bucket->replacementCount - 1];
+    replacement->contact = contact;
+    kc_hashMove( &replacement->hash, hash );
+    replacement->lastSeen = lastSeen;
+}
+
+kc_contact *
+dhtBucketTakeReplacement( dhtBucket * bucket, kc_hash * hash, time_t * lastSeen )
+{
+    if( bucket->replacementCount == 0 )
+        return NULL;
+    
+    dhtReplacement * replacement = &bucket->replacements[--bucket->replacementCount];
+    kc_hashMove( hash, &replacement->hash );
+    if( lastSeen != NULL )
+        *lastSeen = replacement->lastSeen;
+    return replacement->contact;
+}
+
+time_t
+dhtBucketNewestReplacement( const dhtBucket * bucket )
+{
+    if( bucket->replacementCount == 0 )
+        return 0;
+    return bucket->replacements[bucket->replacementCount - 1].lastSeen;
+}
+
 void dhtPrintBucket( const dhtBucket * bucket )
 {
-    RbtIterator iter = rbtBegin( bucket->nodes );
-    if( iter != NULL )
+    kc_dhtNode * node;
+    for( node = dhtBucketOldest( bucket ); node != NULL; node = dhtBucketNext( bucket, node ) )
+    {
+        kc_logNormal( "%s at %s", hashtoa( &node->hash ), kc_contactPrint( node->contact ) );
+    }
+}
+
+#pragma mark Contact index
+
+static inline uint32_t
+dhtContactIndexHash( const kc_contact * contact )
+{
+    uint32_t hash = kc_contactHash( contact );
+    
+    /* Final mix, so that the low bits we index with depend on every input bit */
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BU;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+/* Returns the slot of contact, or of the empty slot ending its probe sequence */
+static int
+dhtContactIndexProbe( const dhtContactIndex * index, const kc_contact * contact, uint32_t hash )
+{
+    int i = hash & index->mask;
+    
+    while( index->slots[i].contact != NULL &&
+           ( index->slots[i].hash != hash || kc_contactCmp( index->slots[i].contact, contact ) != 0 ) )
+        i = ( i + 1 ) & index->mask;
+    return i;
+}
+
+static int
+dhtContactIndexGrow( dhtContactIndex * index )
+{
+    dhtContactIndexSlot * oldSlots = index->slots;
+    int oldCount = index->mask + 1;
+    int i;
+    
+    index->slots = calloc( oldCount * 2, sizeof(dhtContactIndexSlot) );
+    if( index->slots == NULL )
     {
-        do
+        index->slots = oldSlots;
+        return -1;
+    }
+    index->mask = oldCount * 2 - 1;
+    
+    for( i = 0; i < oldCount; i++ )
+    {
+        if( oldSlots[i].contact != NULL )
+            index->slots[dhtContactIndexProbe( index, oldSlots[i].contact, oldSlots[i].hash )] = oldSlots[i];
+    }
+    free( oldSlots );
+    return 0;
+}
+
+dhtContactIndex *
+dhtContactIndexInit( int expectedCount )
+{
+    dhtContactIndex * self = malloc( sizeof(dhtContactIndex) );
+    if( self == NULL )
+    {
+        kc_logError( "dhtContactIndexInit: malloc failed !" );
+        return NULL;
+    }
+    
+    /* Keep the load factor under 1/2 */
+    int slotCount = 16;
+    while( slotCount < expectedCount * 2 )
+        slotCount *= 2;
+    
+    self->slots = calloc( slotCount, sizeof(dhtContactIndexSlot) );
+    if( self->slots == NULL )
+    {
+        kc_logError( "dhtContactIndexInit: slots malloc failed !" );
+        free( self );
+        return NULL;
+    }
+    self->mask = slotCount - 1;
+    self->count = 0;
+    
+    return self;
+}
+
+void
+dhtContactIndexFree( dhtContactIndex * index )
+{
+    int i;
+    
+    if( index == NULL )
+        return;
+    for( i = 0; i <= index->mask; i++ )
+    {
+        if( index->slots[i].contact != NULL )
+            kc_contactFree( index->slots[i].contact );
+    }
+    free( index->slots );
+    free( index );
+}
+
+int
+dhtContactIndexInsert( dhtContactIndex * index, const kc_contact * contact, const kc_hash * hash )
+{
+    uint32_t h = dhtContactIndexHash( contact );
+    int i = dhtContactIndexProbe( index, contact, h );
+    
+    if( index->slots[i].contact == NULL )
+    {
+        if( ( index->count + 1 ) * 2 > index->mask + 1 )
         {
-            kc_hash * key;
-            kc_dhtNode * node;
-            
-            rbtKeyValue( bucket->nodes, iter, (void*)&key, (void*)&node );
+            if( dhtContactIndexGrow( index ) != 0 )
+            {
+                kc_logError( "dhtContactIndexInsert: Failed growing index" );
+                return -1;
+            }
+            i = dhtContactIndexProbe( index, contact, h );
+        }
+        
+        kc_contact * copy = kc_contactDup( contact );
+        if( copy == NULL )
+            return -1;
+        index->slots[i].hash = h;
+        index->slots[i].contact = copy;
+        index->count++;
+    }
+    
+    /* A node which changed its hash keeps its contact */
+    kc_hashMove( &index->slots[i].node, hash );
+    return 0;
+}
+
+int
+dhtContactIndexRemove( dhtContactIndex * index, const kc_contact * contact, const kc_hash * hash )
+{
+    int i = dhtContactIndexProbe( index, contact, dhtContactIndexHash( contact ) );
+    
+    if( index->slots[i].contact == NULL || kc_hashCmp( &index->slots[i].node, hash ) != 0 )
+        return -1;
+    
+    kc_contactFree( index->slots[i].contact );
+    
+    /* Backward-shift deletion, as in the session index */
+    int hole = i;
+    for( ;; )
+    {
+        i = ( i + 1 ) & index->mask;
+        if( index->slots[i].contact == NULL )
+            break;
+        
+        int home = index->slots[i].hash & index->mask;
+        /* Move it if its home slot isn't within ( hole, i ] */
+        if( ( ( i - home ) & index->mask ) >= ( ( i - hole ) & index->mask ) )
+        {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole].contact = NULL;
+    index->slots[hole].hash = 0;
+    index->count--;
+    
+    return 0;
+}
+
+int
+dhtContactIndexFind( const dhtContactIndex * index, const kc_contact * contact, kc_hash * hash )
+{
+    int i = dhtContactIndexProbe( index, contact, dhtContactIndexHash( contact ) );
+    
+    if( index->slots[i].contact == NULL )
+        return -1;
+    kc_hashMove( hash, &index->slots[i].node );
+    return 0;
+}
+
+#pragma mark Value sets
+
+#define VALUESET_MIN_CAPACITY   4
+#define VALUESET_INDEX_MIN      64      /* Sets get indexed once they hold that many entries */
+#define VALUEINDEX_MAX_TERMS    3       /* An entry has at most a type, a format and a size */
+#define VALUEINDEX_MAX_LOOKUPS  8       /* The most equality terms of a filter we intersect */
+
+static inline uint32_t
+dhtValueTerm( int tag, uint32_t value )
+{
+    return ( (uint32_t)tag << 24 ) | ( value & 0xFFFFFF );
+}
+
+/* Hashes a string value case-insensitively, like filters compare them */
+static uint32_t
+dhtValueTermForString( int tag, const unsigned char * value, int length )
+{
+    uint32_t hash = 2166136261U;
+    int i;
+    
+    for( i = 0; i < length; i++ )
+        hash = ( hash ^ tolower( value[i] ) ) * 16777619U;
+    return dhtValueTerm( tag, hash ^ ( hash >> 24 ) );
+}
+
+/* Sizes are bucketed by bit length, 0 to 32 */
+static inline int
+dhtValueSizeBucket( uint32_t size )
+{
+    int bucket = 0;
+    while( size != 0 )
+    {
+        bucket++;
+        size >>= 1;
+    }
+    return bucket;
+}
+
+/* Returns the index terms of an entry, from its special tags */
+static int
+dhtValueEntryTerms( const dhtValueEntry * entry, uint32_t * terms )
+{
+    kc_tagIterator iter;
+    kc_tag tag;
+    int seen = 0;   /* Tags already indexed, only the first of each counts */
+    int count = 0;
+    
+    if( kc_tagIteratorInit( &iter, entry->data, entry->size ) != 0 )
+        return 0;
+    
+    while( count < VALUEINDEX_MAX_TERMS && kc_tagNext( &iter, &tag ) == 1 )
+    {
+        if( tag.nameLength != 1 )
+            continue;
+        
+        int name = tag.name[0];
+        if( ( name != KADC_STAG_TYPE && name != KADC_STAG_FORMAT && name != KADC_STAG_SIZE ) || ( seen & ( 1 << name ) ) )
+            continue;
+        seen |= 1 << name;
+        
+        /* Filters only match the first tag of a name, which must have the right type */
+        if( name == KADC_STAG_SIZE && tag.type == KADC_MTAG_DWORD )
+            terms[count++] = dhtValueTerm( KADC_STAG_SIZE, dhtValueSizeBucket( tag.number ) );
+        else if( name != KADC_STAG_SIZE && tag.type == KADC_MTAG_STRING )
+            terms[count++] = dhtValueTermForString( name, tag.value, tag.valueLength );
+    }
+    return count;
+}
+
+/* Returns the position of term in the index, or -1 - the position it would be inserted at */
+static int
+dhtValueIndexSearch( const dhtValueIndex * index, uint32_t term )
+{
+    int low = 0;
+    int high = index->count - 1;
+    
+    while( low <= high )
+    {
+        int middle = ( low + high ) / 2;
+        
+        if( index->postings[middle].term == term )
+            return middle;
+        if( index->postings[middle].term < term )
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return -1 - low;
+}
+
+static dhtPosting *
+dhtValueIndexFind( const dhtValueIndex * index, uint32_t term )
+{
+    int i = dhtValueIndexSearch( index, term );
+    return ( i >= 0 ? &index->postings[i] : NULL );
+}
+
+/* Returns the position of entry in the posting, or -1 - the position it would be inserted at */
+static int
+dhtPostingSearch( const dhtPosting * posting, const dhtValueEntry * entry )
+{
+    int low = 0;
+    int high = posting->count - 1;
+    
+    while( low <= high )
+    {
+        int middle = ( low + high ) / 2;
+        
+        if( posting->entries[middle] == entry )
+            return middle;
+        if( (uintptr_t)posting->entries[middle] < (uintptr_t)entry )
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return -1 - low;
+}
+
+static int
+dhtValueIndexAdd( dhtValueIndex * index, dhtValueEntry * entry )
+{
+    uint32_t terms[VALUEINDEX_MAX_TERMS];
+    int count = dhtValueEntryTerms( entry, terms );
+    int t;
+    
+    for( t = 0; t < count; t++ )
+    {
+        int i = dhtValueIndexSearch( index, terms[t] );
+        if( i < 0 )
+        {
+            /* A new term, gets an empty posting */
+            if( index->count == index->capacity )
+            {
+                int capacity = ( index->capacity != 0 ? index->capacity * 2 : VALUESET_MIN_CAPACITY );
+                dhtPosting * postings = realloc( index->postings, capacity * sizeof(dhtPosting) );
+                if( postings == NULL )
+                    return -1;
+                index->postings = postings;
+                index->capacity = capacity;
+            }
+            i = -1 - i;
+            memmove( &index->postings[i + 1], &index->postings[i], ( index->count - i ) * sizeof(dhtPosting) );
+            index->postings[i].term = terms[t];
+            index->postings[i].count = 0;
+            index->postings[i].capacity = 0;
+            index->postings[i].entries = NULL;
+            index->count++;
+        }
+        
+        dhtPosting * posting = &index->postings[i];
+        if( posting->count == posting->capacity )
+        {
+            int capacity = ( posting->capacity != 0 ? posting->capacity * 2 : VALUESET_MIN_CAPACITY );
+            dhtValueEntry ** entries = realloc( posting->entries, capacity * sizeof(dhtValueEntry*) );
+            if( entries == NULL )
+                return -1;
+            posting->entries = entries;
+            posting->capacity = capacity;
+        }
+        int j = -1 - dhtPostingSearch( posting, entry );
+        memmove( &posting->entries[j + 1], &posting->entries[j], ( posting->count - j ) * sizeof(dhtValueEntry*) );
+        posting->entries[j] = entry;
+        posting->count++;
+    }
+    return 0;
+}
+
+static void
+dhtValueIndexRemove( dhtValueIndex * index, const dhtValueEntry * entry )
+{
+    uint32_t terms[VALUEINDEX_MAX_TERMS];
+    int count = dhtValueEntryTerms( entry, terms );
+    int t;
+    
+    for( t = 0; t < count; t++ )
+    {
+        int i = dhtValueIndexSearch( index, terms[t] );
+        if( i < 0 )
+            continue;
+        
+        dhtPosting * posting = &index->postings[i];
+        int j = dhtPostingSearch( posting, entry );
+        if( j < 0 )
+            continue;
+        posting->count--;
+        memmove( &posting->entries[j], &posting->entries[j + 1], ( posting->count - j ) * sizeof(dhtValueEntry*) );
+        
+        /* Drop emptied postings, so that terms of long gone entries don't pile up */
+        if( posting->count == 0 )
+        {
+            free( posting->entries );
+            index->count--;
+            memmove( &index->postings[i], &index->postings[i + 1], ( index->count - i ) * sizeof(dhtPosting) );
+        }
+    }
+}
+
+static void
+dhtValueIndexFree( dhtValueIndex * index )
+{
+    int i;
+    
+    if( index == NULL )
+        return;
+    for( i = 0; i < index->count; i++ )
+        free( index->postings[i].entries );
+    free( index->postings );
+    free( index );
+}
+
+/* Indexes all the entries of a set, gives up quietly on failure since the index is optional */
+static void
+dhtValueSetBuildIndex( dhtValueSet * set )
+{
+    int i;
+    
+    set->index = calloc( 1, sizeof(dhtValueIndex) );
+    if( set->index == NULL )
+        return;
+    
+    for( i = 0; i < set->count; i++ )
+    {
+        if( dhtValueIndexAdd( set->index, set->entries[i] ) != 0 )
+        {
+            kc_logError( "dhtValueSetBuildIndex: Failed indexing entries" );
+            dhtValueIndexFree( set->index );
+            set->index = NULL;
+            return;
+        }
+    }
+}
+
+static inline long
+dhtValueEntryCost( int size )
+{
+    return sizeof(dhtValueEntry) + size;
+}
+
+/* Returns the index of related, or -1 - the index it would be inserted at */
+static int
+dhtValueSetSearch( const dhtValueSet * set, const kc_hash * related )
+{
+    int low = 0;
+    int high = set->count - 1;
+    
+    while( low <= high )
+    {
+        int middle = ( low + high ) / 2;
+        int cmp = kc_hashCmp( &set->entries[middle]->related, related );
+        
+        if( cmp == 0 )
+            return middle;
+        if( cmp < 0 )
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return -1 - low;
+}
+
+static void
+dhtValueSetRemoveAt( dhtValueSet * set, int i )
+{
+    if( set->index != NULL )
+        dhtValueIndexRemove( set->index, set->entries[i] );
+    set->bytes -= dhtValueEntryCost( set->entries[i]->size );
+    free( set->entries[i] );
+    set->count--;
+    memmove( &set->entries[i], &set->entries[i + 1], ( set->count - i ) * sizeof(dhtValueEntry*) );
+}
+
+/* Returns the index of the others' entry expiring first, or -1 if all are ours */
+static int
+dhtValueSetVictim( const dhtValueSet * set )
+{
+    int victim = -1;
+    int i;
+    
+    for( i = 0; i < set->count; i++ )
+    {
+        if( set->entries[i]->mine )
+            continue;
+        if( victim == -1 || set->entries[i]->expires < set->entries[victim]->expires )
+            victim = i;
+    }
+    return victim;
+}
+
+void
+dhtValueSetInit( dhtValueSet * set, long budget )
+{
+    set->entries = NULL;
+    set->count = 0;
+    set->capacity = 0;
+    set->bytes = 0;
+    set->budget = budget;
+    set->index = NULL;
+}
+
+void
+dhtValueSetClear( dhtValueSet * set )
+{
+    int i;
+    
+    dhtValueIndexFree( set->index );
+    for( i = 0; i < set->count; i++ )
+        free( set->entries[i] );
+    free( set->entries );
+    dhtValueSetInit( set, set->budget );
+}
+
+dhtValueEntry *
+dhtValueSetFind( const dhtValueSet * set, const kc_hash * related )
+{
+    int i = dhtValueSetSearch( set, related );
+    return ( i >= 0 ? set->entries[i] : NULL );
+}
+
+int
+dhtValueSetInsert( dhtValueSet * set, const kc_hash * related, const void * data, int size,
+                   time_t published, time_t expires, int mine, dhtValueEntryVisitor evicted, void * ref )
+{
+    assert( set != NULL );
+    assert( related != NULL );
+    assert( size >= 0 );
+    
+    long cost = dhtValueEntryCost( size );
+    long evictable = 0;
+    int replaced = 0;
+    int i, j;
+    
+    /* Check it fits before touching anything, once the entry it replaces and others' entries are gone */
+    i = dhtValueSetSearch( set, related );
+    for( j = 0; j < set->count; j++ )
+    {
+        if( j == i || !set->entries[j]->mine )
+            evictable += dhtValueEntryCost( set->entries[j]->size );
+    }
+    if( set->bytes - evictable + cost > set->budget )
+    {
+        kc_logDebug( "Dropping a %d bytes object for %s, over budget", size, hashtoa( related ) );
+        return -1;
+    }
+    
+    dhtValueEntry * entry = malloc( sizeof(dhtValueEntry) + size );
+    if( entry == NULL )
+    {
+        kc_logAlert( "dhtValueSetInsert: Failed malloc()ing entry" );
+        return -1;
+    }
+    kc_hashMove( &entry->related, related );
+    entry->published = published;
+    entry->expires = expires;
+    entry->mine = ( mine != 0 );
+    entry->size = size;
+    memcpy( entry->data, data, size );
+    
+    if( i >= 0 )
+    {
+        dhtValueSetRemoveAt( set, i );
+        replaced = 1;
+    }
+    while( set->bytes + cost > set->budget )
+    {
+        int victim = dhtValueSetVictim( set );
+        if( evicted != NULL )
+            evicted( set->entries[victim], ref );
+        dhtValueSetRemoveAt( set, victim );
+    }
+    
+    if( set->count == set->capacity )
+    {
+        int capacity = ( set->capacity != 0 ? set->capacity * 2 : VALUESET_MIN_CAPACITY );
+        dhtValueEntry ** entries = realloc( set->entries, capacity * sizeof(dhtValueEntry*) );
+        if( entries == NULL )
+        {
+            kc_logAlert( "dhtValueSetInsert: Failed growing set" );
+            free( entry );
+            return -1;
+        }
+        set->entries = entries;
+        set->capacity = capacity;
+    }
+    
+    /* Evictions may have moved its place */
+    i = -1 - dhtValueSetSearch( set, related );
+    memmove( &set->entries[i + 1], &set->entries[i], ( set->count - i ) * sizeof(dhtValueEntry*) );
+    set->entries[i] = entry;
+    set->count++;
+    set->bytes += cost;
+    
+    if( set->index != NULL )
+    {
+        if( dhtValueIndexAdd( set->index, entry ) != 0 )
+        {
+            /* An index missing entries would hide them from searches */
+            kc_logError( "dhtValueSetInsert: Failed indexing entry, dropping the index" );
+            dhtValueIndexFree( set->index );
+            set->index = NULL;
+        }
+    }
+    else if( set->count >= VALUESET_INDEX_MIN )
+        dhtValueSetBuildIndex( set );
+    
+    return replaced;
+}
+
+int
+dhtValueSetRemove( dhtValueSet * set, const kc_hash * related )
+{
+    int i = dhtValueSetSearch( set, related );
+    if( i < 0 )
+        return -1;
+    
+    dhtValueSetRemoveAt( set, i );
+    return 0;
+}
+
+int
+dhtValueSetExpire( dhtValueSet * set, time_t now )
+{
+    int expired = 0;
+    int i = 0;
+    
+    while( i < set->count )
+    {
+        dhtValueEntry * entry = set->entries[i];
+        if( entry->expires != 0 && entry->expires <= now )
+        {
+            dhtValueSetRemoveAt( set, i );
+            expired++;
+        }
+        else
+            i++;
+    }
+    return expired;
+}
+
+time_t
+dhtValueSetNextExpiry( const dhtValueSet * set )
+{
+    time_t next = 0;
+    int i;
+    
+    for( i = 0; i < set->count; i++ )
+    {
+        time_t expires = set->entries[i]->expires;
+        if( expires != 0 && ( next == 0 || expires < next ) )
+            next = expires;
+    }
+    return next;
+}
+
+/* Visits an entry if it matches, returns non-zero to stop */
+static int
+dhtValueSetVisit( const kc_filter * filter, dhtValueEntry * entry, int max, int * visited,
+                  dhtValueEntryVisitor visitor, void * ref )
+{
+    if( filter != NULL && !kc_filterMatch( filter, entry->data, entry->size ) )
+        return 0;
+    
+    ( *visited )++;
+    return ( visitor( entry, ref ) != 0 || *visited == max );
+}
+
+int
+dhtValueSetFilter( const dhtValueSet * set, const kc_filter * filter, int max, dhtValueEntryVisitor visitor, void * ref )
+{
+    assert( set != NULL );
+    assert( visitor != NULL );
+    
+    const dhtPosting * equals[VALUEINDEX_MAX_LOOKUPS];
+    const dhtPosting * driver = NULL;
+    int equalCount = 0;
+    int low = 0, high = 32;             /* The size buckets the matches lie in */
+    int ranged = 0;
+    int visited = 0;
+    int i, j;
+    
+    if( filter != NULL && set->index != NULL )
+    {
+        const kc_filterTerm * terms;
+        int termCount = kc_filterGetTerms( filter, &terms );
+        
+        for( i = 0; i < termCount; i++ )
+        {
+            const kc_filterTerm * term = &terms[i];
             
-            assert( key != NULL );
-            assert( node != NULL );
+            if( term->nameLength != 1 )
+                continue;
+            int tag = term->name[0];
+            if( term->value != NULL && ( tag == KADC_STAG_TYPE || tag == KADC_STAG_FORMAT ) )
+            {
+                const dhtPosting * posting = dhtValueIndexFind( set->index, dhtValueTermForString( tag, term->value, term->valueLength ) );
+                if( posting == NULL )
+                    return 0;   /* No entry has this value */
+                if( equalCount < VALUEINDEX_MAX_LOOKUPS )
+                    equals[equalCount++] = posting;
+            }
+            else if( term->value == NULL && tag == KADC_STAG_SIZE )
+            {
+                if( dhtValueSizeBucket( term->min ) > low )
+                    low = dhtValueSizeBucket( term->min );
+                if( dhtValueSizeBucket( term->max ) < high )
+                    high = dhtValueSizeBucket( term->max );
+                ranged = 1;
+            }
+        }
+        if( low > high )
+            return 0;
+    }
+    
+    if( equalCount == 0 && !ranged )
+    {
+        /* Nothing to look up, match them all */
+        for( i = 0; i < set->count; i++ )
+        {
+            if( dhtValueSetVisit( filter, set->entries[i], max, &visited, visitor, ref ) )
+                break;
+        }
+        return visited;
+    }
+    
+    /* Drive from the shortest posting, or from the size buckets if they hold fewer entries */
+    int rangeCount = 0;
+    if( ranged )
+    {
+        for( j = low; j <= high; j++ )
+        {
+            const dhtPosting * posting = dhtValueIndexFind( set->index, dhtValueTerm( KADC_STAG_SIZE, j ) );
+            if( posting != NULL )
+                rangeCount += posting->count;
+        }
+    }
+    for( i = 0; i < equalCount; i++ )
+    {
+        if( driver == NULL || equals[i]->count < driver->count )
+            driver = equals[i];
+    }
+    if( driver != NULL && ( !ranged || driver->count <= rangeCount ) )
+    {
+        for( i = 0; i < driver->count; i++ )
+        {
+            dhtValueEntry * entry = driver->entries[i];
             
-            kc_logNormal( "%s at %s", hashtoa( key ), kc_contactPrint( node->contact ) );
+            /* Intersect with the other postings, the filter checks the size */
+            for( j = 0; j < equalCount; j++ )
+            {
+                if( equals[j] != driver && dhtPostingSearch( equals[j], entry ) < 0 )
+                    break;
+            }
+            if( j == equalCount && dhtValueSetVisit( filter, entry, max, &visited, visitor, ref ) )
+                break;
+        }
+        return visited;
+    }
+    
+    for( j = low; j <= high; j++ )
+    {
+        /* Size buckets are disjoint, so no entry gets visited twice */
+        const dhtPosting * posting = dhtValueIndexFind( set->index, dhtValueTerm( KADC_STAG_SIZE, j ) );
+        if( posting == NULL )
+            continue;
+        
+        for( i = 0; i < posting->count; i++ )
+        {
+            dhtValueEntry * entry = posting->entries[i];
+            int k;
             
-        } while ( ( iter = rbtNext( bucket->nodes, iter ) ) );
+            for( k = 0; k < equalCount; k++ )
+            {
+                if( dhtPostingSearch( equals[k], entry ) < 0 )
+                    break;
+            }
+            if( k == equalCount && dhtValueSetVisit( filter, entry, max, &visited, visitor, ref ) )
+                return visited;
+        }
     }
+    return visited;
+}
+
+long
+dhtValueSetIndexBytes( const dhtValueSet * set )
+{
+    long bytes;
+    int i;
+    
+    if( set->index == NULL )
+        return 0;
+    
+    bytes = sizeof(dhtValueIndex) + set->index->capacity * sizeof(dhtPosting);
+    for( i = 0; i < set->index->count; i++ )
+        bytes += set->index->postings[i].capacity * sizeof(dhtValueEntry*);
+    return bytes;
 }
@@ -29,7 +29,7 @@ typedef int (*kc_dhtParseCallback)( const kc_dht * dht, kc_message * msg );
  * the correct message to reply to the sender node.
  *
  * @param dht The DHT willing to communicate.
- * @param msg A kc_dhtMsg containing the data recieved from the node.
+ * @param msg A kc_dhtMsg containing the data recieved from the node. It and its contact are only valid during the call.
  * @return You should return 0 if you want the answer message sent, or 1 if you don't.
  */
 typedef int (*kc_dhtReadCallback)( kc_dht * dht, const kc_message * msg );
@@ -51,10 +51,26 @@ typedef int (*kc_dhtReadCallback)( kc_dht * dht, const kc_message * msg );
  */
 typedef int (*kc_dhtWriteCallback)( const kc_dht * dht, kc_message * msg, kc_message * answer );
 
+/**
+ * The callback protoype used when a FIND_NODE or FIND_VALUE reply arrives for a lookup.
+ *
+ * Requests are written by the write callback, with the lookup target available
+ * from kc_messageGetHash(). Replies must be parsed with the same message type as the request.
+ * Report the nodes found in the reply with kc_dhtLookupAddNode(), and the value, if any,
+ * with kc_dhtLookupSetValue().
+ *
+ * @param dht The DHT running the lookup.
+ * @param msg The reply.
+ * @param lookup The lookup the reply belongs to.
+ * @return You should return 0 on success, -1 otherwise.
+ */
+typedef int (*kc_dhtReplyCallback)( const kc_dht * dht, const kc_message * msg, kc_dhtLookup * lookup );
+
 typedef struct _kc_dhtCallbacks {
     kc_dhtParseCallback     parseCallback;
     kc_dhtReadCallback      readCallback;
     kc_dhtWriteCallback     writeCallback;
+    kc_dhtReplyCallback     replyCallback;  /* Optional, lookups only use our routing table without it */
 } kc_dhtCallbacks;
 
 struct _kc_dhtParameters {
@@ -64,6 +80,12 @@ struct _kc_dhtParameters {
     int republishDelay;
     
     int lookupParallelism;
+    int lookupTimeout;      /* in s, the deadline of a whole lookup */
+    int bootstrapWindow;    /* The most pings in flight while bootstrapping */
+    int proximityRouting;   /* Non-zero to prefer low round-trip-time nodes among equally close ones */
+    int valueBudget;        /* in bytes, the most the objects stored under a key may take */
+    const char * storePath; /* Where to journal stored objects so that they survive restarts, NULL to keep them in memory only.
+                             * POSIX-only, kc_dhtInit() fails if it is set on __WIN32__ */
     
     int maxQueuedMessages;
     int maxSessionCount;
@@ -72,66 +94,176 @@ struct _kc_dhtParameters {
     
     int hashSize;
     int bucketSize;
+    int relaxedDepth;       /* Buckets next to our own range that may hold twice bucketSize nodes, 0 to disable */
     kc_dhtCallbacks callbacks;
 };
 
 int openAndBindSocket( kc_contact * contact );
 
 #pragma mark struct kc_dhtNode
+/* Retransmission timeout bounds, in ms */
+#define DHT_RTO_INITIAL     1000    /* For nodes we have no round-trip-time sample of */
+#define DHT_RTO_MIN         200
+#define DHT_RTO_MAX         8000
+
 struct _kc_dhtNode {
     kc_contact    * contact;
-    kc_hash       * hash;
+    kc_hash         hash;       /* Also the key of the node in its bucket */
     
 	time_t          lastSeen;	/* Last time we heard of it */
-    //    time_t          rtt;        /* Round-trip-time to it */
+    int             srtt;       /* Smoothed round-trip-time to it in ms, 0 until we get a first sample */
+    int             rttvar;     /* Round-trip-time variation in ms */
+    int             rto;        /* Retransmission timeout in ms, backed off on every timeout */
 };
 
 #pragma mark struct dhtBucket
+/* A bucket slot. The node must stay first, so that a kc_dhtNode pointer
+ * can be turned back into its slot */
+typedef struct dhtBucketSlot {
+    kc_dhtNode          node;
+    short               prev;               /* Previous slot in LRU order, or -1 */
+    short               next;               /* Next slot in LRU order (or in the free list), or -1 */
+} dhtBucketSlot;
+
+/* A node heard of while its bucket was full, waiting for a slot to free up */
+typedef struct dhtReplacement {
+    kc_contact        * contact;
+    kc_hash             hash;
+    time_t              lastSeen;
+} dhtReplacement;
+
 typedef struct dhtBucket {
-	RbtHandle         * nodes;              /* Red-Black tree of nodes */
+    kc_wheelTimer       refreshTimer;       /* Must stay first, so that it can be turned back into its bucket */
+    dhtBucketSlot     * slots;              /* Array of size slots, never reallocated */
+    uint64_t          * prefixes;           /* First hash word of each used slot, for fast scans */
+    unsigned char     * used;               /* Slot usage flags, parallel to prefixes */
     
-    unsigned char       availableSlots;     /* Available slots in bucket */
+    short               size;               /* Slot count in bucket */
+    short               limit;              /* Node count at which the bucket is full, at most size */
+    short               count;              /* Used slot count */
+    short               head;               /* Least-recently seen node, our eviction candidate */
+    short               tail;               /* Most-recently seen node */
+    short               freeSlots;          /* Head of the free slot list */
+    
+    dhtReplacement    * replacements;       /* Replacement cache of size candidates, least-recently seen first */
+    short               replacementCount;
+    short               probing;            /* 1 while a liveness probe of probeHash is in flight */
+    kc_hash             probeHash;
     
     time_t              lastChanged;        /* Last time this bucket changed */
+    kc_dhtLookup      * refreshLookup;      /* Our last refresh of this bucket, or NULL */
     pthread_mutex_t     mutex;
 } dhtBucket;
 
+#pragma mark struct dhtContactIndex
+/* Maps the contact of each node in our buckets to its hash, so that a packet can be
+ * tied to its sender without a scan of the table. Hashes don't change when nodes
+ * move between slots or buckets, so only adding and removing nodes touch it.
+ * Open addressing with linear probing and backward-shift deletion, grown as needed */
+typedef struct dhtContactIndexSlot {
+    uint32_t            hash;           /* Cached kc_contactHash() of contact */
+    kc_contact        * contact;        /* Our copy, NULL if the slot is empty */
+    kc_hash             node;
+} dhtContactIndexSlot;
+
+typedef struct dhtContactIndex {
+    dhtContactIndexSlot * slots;
+    int                 mask;           /* Slot count - 1, slot count being a power of 2 */
+    int                 count;
+} dhtContactIndex;
+
+#pragma mark struct dhtValueSet
+/* One of the objects stored under a key, like an Overnet k-object */
+typedef struct dhtValueEntry {
+    kc_hash             related;        /* Tells the objects of a key apart, like the file hash of a keyword */
+    time_t              published;      /* Last time it was published, by us if it's ours */
+    time_t              expires;        /* 0 for ours, which we republish instead */
+    int                 mine;
+    int                 size;
+    unsigned char       data[];         /* The object meta-tag list, as sent on the wire */
+} dhtValueEntry;
+
+/* The entries sharing an indexed tag value */
+typedef struct dhtPosting {
+    uint32_t            term;           /* The tag in the top byte, a hash of its value or its size bucket below */
+    int                 count;
+    int                 capacity;
+    dhtValueEntry    ** entries;        /* Sorted by address, so that postings intersect by merging */
+} dhtPosting;
+
+/* An inverted index of the commonly filtered tags of a set entries :
+ * type, format, and size by power of 2 */
+typedef struct dhtValueIndex {
+    dhtPosting        * postings;       /* Sorted by term */
+    int                 count;
+    int                 capacity;
+} dhtValueIndex;
+
+/* The objects stored under a key, one per related hash */
+typedef struct dhtValueSet {
+    dhtValueEntry    ** entries;        /* Sorted by related hash */
+    int                 count;
+    int                 capacity;
+    long                bytes;          /* What the entries take, headers included */
+    long                budget;         /* The most they may take, others' entries get evicted past it */
+    dhtValueIndex     * index;          /* NULL until the set gets large enough to be worth it */
+} dhtValueSet;
+
 #pragma mark struct dhtValue
 typedef struct dhtValue {
-    void              * value;
+    kc_wheelTimer       timer;          /* Must stay first, so that it can be turned back into its value */
+    kc_hash             key;            /* Also the key of the value in kc_dht.keys */
+    void              * value;          /* Set by kc_dhtStoreKeyValue() */
+    dhtValueSet         objects;
     
-    int                 mine;
-    time_t              published;
+    int                 mine;           /* We published the value, or some objects */
+    time_t              published;      /* Last time we published it, if it's ours */
+    time_t              replicated;     /* Last time we replicated it */
 } dhtValue;
 
 #pragma mark dhtIdentity
 typedef struct dhtIdentity {
     kc_dht            * dht;            /* The DHT owning this identity */
     kc_contact        * us;             /* Our contact (like IPv4, IPv6 node) */
-    int                 fd;             /* The socket bound to the contact above */  
-    struct bufferevent * inputEvent;    /* The bufferevent for the socket above */
+    int                 fd;             /* The socket bound to the contact above, shared by all our sessions */  
+    struct event      * readEvent;      /* The read event for the socket above */
+    kc_netBatch       * recvBatch;      /* Recieves incoming datagrams in place into recvPool buffers */
+    kc_pool           * recvPool;       /* Buffers incoming messages are views of */
+    void             ** recvBuffers;    /* The pool buffer attached to each recvBatch slot, or NULL */
+    
+    kc_netBatch       * sendBatch;      /* Outgoing datagrams waiting for the end of the event loop tick, or for the socket to drain */
+    struct event      * flushEvent;     /* Activated to flush sendBatch, or added to wait until the socket is writable */
+    int                 flushPending;
+    pthread_mutex_t     sendLock;       /* Protects the three fields above */
 //    pthread_t           thread;         /* The thread listen to incoming data */
 } dhtIdentity;
 
 #pragma mark struct kc_dht
 struct _kc_dht {
-    RbtHandle         * keys;           /* Our stored key/values pairs */    
+    kc_store          * keys;           /* Our stored key/values pairs */
+    kc_journal        * journal;        /* Persists the objects in keys, or NULL */
     RbtHandle         * sessions;       /* Our running requests against the DHT */
+    kc_sessionIndex   * sessionIndex;   /* The same sessions, hashed for incoming message lookups */
+    pthread_mutex_t     sessionLock;    /* Protects sessions and sessionIndex */
+    dhtContactIndex   * contactIndex;   /* Node hashes by contact, for every node in our buckets */
+    pthread_mutex_t     contactLock;    /* Protects contactIndex, never held while taking another lock */
     
-    dhtBucket        ** buckets;        /* Array of BUCKET_COUNT buckets */
+    dhtBucket        ** buckets;        /* Array of hashSize bucket pointers, bucket i holding the nodes
+                                         * sharing exactly i prefix bits with us, but the last one */
+    int                 bucketCount;    /* Allocated bucket count, the last one covering our own range */
     
 //    RbtHandle         * contacts;       /* All our known nodes */
     
     kc_dhtParameters  * parameters;     /* Our parameters */
         
     struct event_base * eventBase;      /* Our libevent base */
-    struct event      * replicationTimer;
+    kc_wheel          * wheel;          /* Times our sessions, buckets and keys */
+    struct event      * wheelEvent;     /* Advances the wheel every tick */
+    volatile int        stopping;       /* Set to make the event loop exit */
     
     dhtIdentity      ** identities;     /* Pointer to an array of identities (as in "IPv4/IPv6 identity") */
-    kc_hash           * hash;           /* Our hash, because it is common between all our identities */
+    kc_hash             hash;           /* Our hash, because it is common between all our identities */
     
-    time_t              lastReplication;/* Last time we replicated our keys/values */
-    time_t              probeDelay;     /* Last time we sent our probes */
     kc_queue          * sndQueue;       /* A queue of probes we need to send */
     
     pthread_mutex_t     lock;
@@ -144,6 +276,18 @@ kc_dhtIdentityForContact( const kc_dht * dht,  kc_contact * contact );
 int
 kc_dhtAddSession( kc_dht * dht,  kc_session * session );
 
+/* Returns 1 if a session with this contact, direction and type is registered.
+ * Only a snapshot, the session itself may end anytime and mustn't be touched */
+int
+kc_dhtHasSession( kc_dht * dht, const kc_contact * contact, int incoming, kc_messageType type );
+
+kc_session *
+kc_dhtCreateAndAddOutgoingSession( kc_dht * dht, kc_contact * connectContact, kc_messageType msgType, kc_sessionCallback callback );
+
+/* The session callback of lookup requests */
+int
+lookupSessionCallback( const kc_dht * dht, kc_session * session, const kc_message * msg );
+
 int
 kc_dhtDeleteSession( kc_dht * dht, kc_session * session );
 
@@ -153,6 +297,11 @@ dhtNodeInit( kc_contact * contact, const kc_hash * hash );
 void
 dhtNodeFree( kc_dhtNode *pkn );
 
+/* Copies a node out of its bucket, contact included, to be freed with kc_dhtFreeNodes().
+ * Must be called with the bucket locked */
+kc_dhtNode *
+dhtNodeDup( const kc_dhtNode * node );
+
 
 kc_contact *
 kc_dhtNodeGetContact( const kc_dhtNode * node );
@@ -166,11 +315,64 @@ kc_dhtNodeGetHash( const kc_dhtNode * node );
 void
 kc_dhtNodeSetHash( kc_dhtNode * node, kc_hash * hash );
 
+/* Resets a node's round-trip-time estimation */
+void
+dhtNodeResetRtt( kc_dhtNode * node );
+
+/**
+ * Feeds a round-trip-time sample, in ms, to a node's estimation.
+ *
+ * Don't sample replies to retransmitted requests, we can't tell which one they answer.
+ */
+void
+dhtNodeUpdateRtt( kc_dhtNode * node, long rtt );
+
+/* Doubles a node's retransmission timeout, after one of our requests to it timed out */
+void
+dhtNodeBackoffRto( kc_dhtNode * node );
+
+/**
+ * Returns the retransmission timeout of the node with this hash, in ms.
+ *
+ * Unknown nodes get the initial timeout.
+ */
+long
+dhtRtoForHash( const kc_dht * dht, const kc_hash * hash );
+
+/* Updates the estimation of the node with this hash, if it is in our routing table.
+ * rtt is a sample in ms, or -1 if our request timed out */
+void
+dhtRttForHash( const kc_dht * dht, const kc_hash * hash, long rtt );
+
+/* Marks the node at contact as just seen, with an rtt sample in ms unless it is negative,
+ * through the contact index. Returns 1 if it is one of ours, 0 otherwise */
 int
-dhtNodeCmpSeen( const void *a, const void *b );
+dhtContactSeen( const kc_dht * dht, const kc_contact * contact, long rtt );
 
+/**
+ * Offers a node that just answered one of our requests to the routing table.
+ *
+ * It gets added if its bucket has room. With proximityRouting, a full bucket
+ * trades its slowest node for it if it answered much faster.
+ * This never pings nor splits buckets, so it is safe to call from the event loop.
+ *
+ * @param contact The node contact, copied if the node gets added
+ * @param rtt The round-trip-time of its answer in ms
+ * @return 1 if the node got added, 0 otherwise
+ */
+int
+dhtOfferNode( kc_dht * dht, const kc_contact * contact, const kc_hash * hash, long rtt );
+
+/* Puts a node straight into its bucket, splitting the last bucket as needed, without pinging anyone.
+ * Returns 1 if it went in, the bucket then owning contact, 0 if it is known already or doesn't fit */
 int
-dhtNodeCmpHash( const void *a, const void *b );
+dhtAdmitNode( kc_dht * dht, kc_contact * contact, const kc_hash * hash, time_t lastSeen, long rtt );
+
+/* Tells whether the buckets near our hash are populated : every bucket holds a node,
+ * and the last two, which split from the one covering our own range, hold bucketSize nodes.
+ * Returns the bucket count if so, 0 otherwise */
+int
+dhtTableIsFull( kc_dht * dht );
 
 dhtBucket *
 dhtBucketInit( int size );
@@ -184,10 +386,155 @@ dhtBucketLock( dhtBucket *pkb );
 void
 dhtBucketUnlock( dhtBucket *pkb );
 
+/* The functions below expect the bucket to be locked by the caller */
+
+int
+dhtBucketCount( const dhtBucket * bucket );
+
+int
+dhtBucketIsFull( const dhtBucket * bucket );
+
+/* Returns the node with this hash, or NULL if it isn't in the bucket */
+kc_dhtNode *
+dhtBucketFind( const dhtBucket * bucket, const kc_hash * hash );
+
+/* Adds a node at the tail of the bucket, marked as seen just now.
+ * Returns NULL if the bucket is full */
+kc_dhtNode *
+dhtBucketInsert( dhtBucket * bucket, kc_contact * contact, const kc_hash * hash );
+
+/* Marks a node as seen just now, and moves it to the tail of the bucket */
+void
+dhtBucketTouch( dhtBucket * bucket, kc_dhtNode * node );
+
+void
+dhtBucketRemove( dhtBucket * bucket, kc_dhtNode * node );
+
+/* Iterates over the nodes from the least-recently seen to the most-recently seen.
+ * dhtBucketOldest() gives our eviction candidate */
+kc_dhtNode *
+dhtBucketOldest( const dhtBucket * bucket );
+
+kc_dhtNode *
+dhtBucketNext( const dhtBucket * bucket, const kc_dhtNode * node );
+
+dhtContactIndex *
+dhtContactIndexInit( int expectedCount );
+
+void
+dhtContactIndexFree( dhtContactIndex * index );
+
+/* Maps contact, which gets copied, to hash, replacing the node it mapped to if any.
+ * Returns 0 on success, -1 on failure */
+int
+dhtContactIndexInsert( dhtContactIndex * index, const kc_contact * contact, const kc_hash * hash );
+
+/* Drops the mapping of contact, if it still maps to hash. Returns 0 if it did, -1 otherwise */
+int
+dhtContactIndexRemove( dhtContactIndex * index, const kc_contact * contact, const kc_hash * hash );
+
+/* Gets the hash of the node at contact. Returns 0 if there is one, -1 otherwise */
+int
+dhtContactIndexFind( const dhtContactIndex * index, const kc_contact * contact, kc_hash * hash );
+
+/* Caches a node heard of while the bucket was full, the bucket then owning contact.
+ * A node cached already gets refreshed, and the least-recently seen one makes room when the cache is full */
+void
+dhtBucketAddReplacement( dhtBucket * bucket, kc_contact * contact, const kc_hash * hash, time_t lastSeen );
+
+/* Takes the most-recently seen replacement out of the cache, handing its contact over.
+ * Returns NULL if the cache is empty */
+kc_contact *
+dhtBucketTakeReplacement( dhtBucket * bucket, kc_hash * hash, time_t * lastSeen );
+
+/* The lastSeen of the most-recently seen replacement, or 0 if the cache is empty */
+time_t
+dhtBucketNewestReplacement( const dhtBucket * bucket );
+
 void
 dhtPrintBucket( const dhtBucket * bucket );
 
+/**
+ * Stores an object under a key, replacing the one with the same related hash.
+ *
+ * Others' objects expire after expirationDelay, ours get republished.
+ * This is what incoming publish requests should end up calling.
+ *
+ * @param data The object meta-tag list, copied
+ * @param mine Non-zero if we are the publisher
+ * @return 0 if the object is new, 1 if it replaced another, -1 on failure
+ */
+int
+dhtStoreObject( kc_dht * dht, const kc_hash * key, const kc_hash * related, const void * data, int size, int mine );
+
+void
+dhtValueSetInit( dhtValueSet * set, long budget );
+
+/* Frees all the entries of a set */
+void
+dhtValueSetClear( dhtValueSet * set );
+
+dhtValueEntry *
+dhtValueSetFind( const dhtValueSet * set, const kc_hash * related );
+
+/* The callback prototype used to visit set entries, returns 0 to go on visiting */
+typedef int (*dhtValueEntryVisitor)( dhtValueEntry * entry, void * ref );
+
+/**
+ * Adds an entry to a set, replacing the one with the same related hash.
+ *
+ * If that goes over budget, others' entries get evicted, the ones expiring first first.
+ *
+ * @param expires When the entry expires, 0 for never
+ * @param evicted Called with each evicted entry right before it is freed, may be NULL
+ * @return 0 if the entry is new, 1 if it replaced another, -1 if it doesn't fit
+ */
+int
+dhtValueSetInsert( dhtValueSet * set, const kc_hash * related, const void * data, int size,
+                   time_t published, time_t expires, int mine, dhtValueEntryVisitor evicted, void * ref );
+
+/* Returns 0 on success, -1 if there is no such entry */
+int
+dhtValueSetRemove( dhtValueSet * set, const kc_hash * related );
+
+/* Removes the entries that expired by now, and returns how many */
+int
+dhtValueSetExpire( dhtValueSet * set, time_t now );
+
+/* Returns the first expiration time, or 0 if no entry expires */
+time_t
+dhtValueSetNextExpiry( const dhtValueSet * set );
+
+/**
+ * Visits the entries of a set matching a filter.
+ *
+ * If the set is indexed, and the filter has terms on indexed tags, only the
+ * entries in the intersection of their postings get matched, in no particular order.
+ * Otherwise, all entries get matched, in related hash order.
+ *
+ * @param filter The filter, or NULL to visit all entries
+ * @param max The most entries to visit, 0 for no limit
+ * @return The number of visited entries
+ */
+int
+dhtValueSetFilter( const dhtValueSet * set, const kc_filter * filter, int max, dhtValueEntryVisitor visitor, void * ref );
+
+/* Returns the memory taken by the index of a set */
+long
+dhtValueSetIndexBytes( const dhtValueSet * set );
+
 dhtIdentity *
 dhtIdentityInit( kc_dht * dht, kc_contact * contact );
 
 void dhtIdentityFree( dhtIdentity * identity );
+
+/**
+ * Queues a datagram on the identity socket.
+ *
+ * Datagrams sent from the event loop thread are flushed together once the
+ * current tick is processed, others are sent right away.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+dhtIdentitySend( dhtIdentity * identity, const kc_contact * contact, const void * data, size_t size );
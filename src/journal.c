@@ -0,0 +1,1065 @@
+/*
+ *  journal.c
+ *  KadC
+ *
+ */
+
+#include "journal.h"
+
+/* The journal relies on mmap(), writev(), pread() and fdatasync(), so it is POSIX-only */
+#ifndef __WIN32__
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define JOURNAL_MAGIC           "KCJ1"
+#define JOURNAL_INDEX_MAGIC     "KCI1"
+#define JOURNAL_VERSION         1
+#define JOURNAL_INDEX_SLOTS     1024                /* Initial slot count of the index */
+#define JOURNAL_MAX_DATA        ( 16 * 1024 * 1024 )
+#define JOURNAL_COMPACT_MIN     ( 1024 * 1024 )     /* Smaller logs are never compacted */
+#define JOURNAL_SYNC_INTERVAL   5000                /* ms between background syncs */
+#define JOURNAL_COPY_BUFFER     ( 64 * 1024 )
+
+enum {
+    JOURNAL_STORE = 1,
+    JOURNAL_EXPIRE = 2
+};
+
+typedef struct journalFileHeader {
+    char                    magic[4];
+    uint32_t                version;
+    uint32_t                hashBytes;  /* So that journals don't move across KADC_HASH_MAX_BITS either */
+    uint32_t                reserved;
+} journalFileHeader;
+
+/* Each record is this header followed by length data bytes */
+typedef struct journalRecordHeader {
+    uint32_t                crc;        /* Of the rest of the header and the data */
+    uint32_t                length;
+    uint8_t                 type;
+    uint8_t                 mine;
+    uint16_t                keyLength;  /* In bits */
+    uint16_t                relatedLength;
+    uint16_t                reserved;
+    int64_t                 published;
+    int64_t                 expires;
+    unsigned char           key[KADC_HASH_BYTES];
+    unsigned char           related[KADC_HASH_BYTES];
+} journalRecordHeader;
+
+typedef struct journalIndexHeader {
+    char                    magic[4];
+    uint32_t                version;
+    uint64_t                slotCount;  /* A power of 2 */
+    uint64_t                count;
+    uint64_t                logSize;
+    uint64_t                liveBytes;  /* The size of the records the index points to */
+} journalIndexHeader;
+
+typedef struct journalSlot {
+    uint64_t                fingerprint;    /* Of key and related */
+    uint64_t                offset;         /* Of the live store record, 0 if the slot is empty */
+    int64_t                 expires;
+    uint32_t                length;         /* Of the whole record */
+    uint32_t                reserved;
+} journalSlot;
+
+/* A live record, as listed for replays and compactions */
+typedef struct journalExtent {
+    uint64_t                offset;
+    uint64_t                length;
+    uint64_t                fingerprint;
+    uint64_t                moved;          /* Its offset in the compacted log */
+} journalExtent;
+
+struct _kc_journal {
+    char                  * logPath;
+    char                  * indexPath;
+    char                  * compactPath;
+    int                     log;
+    int                     indexFile;
+    journalIndexHeader    * index;      /* Mapped from indexFile */
+    journalSlot           * slots;      /* Right after the index header */
+    size_t                  mapSize;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    pthread_mutex_t         compactLock;    /* Serializes log swaps, held while syncing without the lock */
+    pthread_t               thread;
+    int                     started;
+    int                     stopping;
+    int                     dirty;      /* Appended since the last sync */
+};
+
+#pragma mark CRC32
+
+static uint32_t journalCrcTable[256];
+static pthread_once_t journalCrcOnce = PTHREAD_ONCE_INIT;
+
+static void
+journalCrcInit( void )
+{
+    uint32_t c;
+    int n, k;
+
+    for( n = 0; n < 256; n++ )
+    {
+        c = n;
+        for( k = 0; k < 8; k++ )
+            c = ( c & 1 ? 0xEDB88320 ^ ( c >> 1 ) : c >> 1 );
+        journalCrcTable[n] = c;
+    }
+}
+
+/* Chains like zlib's crc32(), start with 0 */
+static uint32_t
+journalCrc( uint32_t crc, const void * buffer, size_t size )
+{
+    const unsigned char * p = buffer;
+
+    crc = ~crc;
+    while( size-- > 0 )
+        crc = journalCrcTable[( crc ^ *p++ ) & 0xFF] ^ ( crc >> 8 );
+    return ~crc;
+}
+
+#pragma mark Records
+
+static void
+journalRecordInit( journalRecordHeader * header, int type, const kc_hash * key, const kc_hash * related )
+{
+    memset( header, 0, sizeof(journalRecordHeader) );
+    header->type = type;
+    header->keyLength = key->length;
+    header->relatedLength = related->length;
+    /* Bytes past the hash length are zero, so headers of the same object compare equal */
+    memcpy( header->key, key->id.bytes, KADC_HASH_BYTES );
+    memcpy( header->related, related->id.bytes, KADC_HASH_BYTES );
+}
+
+static int
+journalRecordSameObject( const journalRecordHeader * a, const journalRecordHeader * b )
+{
+    return ( a->keyLength == b->keyLength && a->relatedLength == b->relatedLength &&
+             memcmp( a->key, b->key, KADC_HASH_BYTES ) == 0 &&
+             memcmp( a->related, b->related, KADC_HASH_BYTES ) == 0 );
+}
+
+static uint32_t
+journalRecordCrc( const journalRecordHeader * header, const void * data )
+{
+    uint32_t crc = journalCrc( 0, (const char*)header + sizeof(header->crc), sizeof(journalRecordHeader) - sizeof(header->crc) );
+    return journalCrc( crc, data, header->length );
+}
+
+/* FNV-1a over the object identity */
+static uint64_t
+journalFingerprint( const journalRecordHeader * header )
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    const unsigned char * p = header->key;
+    int i;
+
+    for( i = 0; i < 2 * KADC_HASH_BYTES; i++ )
+        hash = ( hash ^ p[i] ) * 0x100000001B3ULL;
+    hash = ( hash ^ header->keyLength ) * 0x100000001B3ULL;
+    hash = ( hash ^ header->relatedLength ) * 0x100000001B3ULL;
+    return hash;
+}
+
+static int
+journalRead( int fd, void * buffer, size_t size, uint64_t offset )
+{
+    char * p = buffer;
+
+    while( size > 0 )
+    {
+        ssize_t got = pread( fd, p, size, offset );
+        if( got < 0 && errno == EINTR )
+            continue;
+        if( got <= 0 )
+            return -1;
+        p += got;
+        size -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+static int
+journalWrite( int fd, const void * buffer, size_t size )
+{
+    const char * p = buffer;
+
+    while( size > 0 )
+    {
+        ssize_t put = write( fd, p, size );
+        if( put < 0 && errno == EINTR )
+            continue;
+        if( put <= 0 )
+            return -1;
+        p += put;
+        size -= put;
+    }
+    return 0;
+}
+
+/* Appends a record to the log, returning its offset in offset. Must be called with the journal locked */
+static int
+journalAppend( kc_journal * journal, journalRecordHeader * header, const void * data, uint64_t * offset )
+{
+    struct iovec iov[2];
+    size_t total = sizeof(journalRecordHeader) + header->length;
+    ssize_t written;
+
+    header->crc = journalRecordCrc( header, data );
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(journalRecordHeader);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = header->length;
+
+    /* A single write, so that a crash tears at most this record, which the next open drops */
+    do
+        written = writev( journal->log, iov, ( header->length > 0 ? 2 : 1 ) );
+    while( written < 0 && errno == EINTR );
+
+    if( written != (ssize_t)total )
+    {
+        kc_logError( "journalAppend: Failed writing to %s: %s", journal->logPath, ( written < 0 ? strerror( errno ) : "short write" ) );
+        /* Don't leave a partial record for the next one to follow */
+        if( written > 0 && ftruncate( journal->log, journal->index->logSize ) != 0 )
+            kc_logError( "journalAppend: Failed truncating %s: %s", journal->logPath, strerror( errno ) );
+        return -1;
+    }
+
+    *offset = journal->index->logSize;
+    journal->index->logSize += total;
+    journal->dirty = 1;
+    return 0;
+}
+
+#pragma mark Index
+
+static int
+journalIndexResize( kc_journal * journal, uint64_t slotCount )
+{
+    journalIndexHeader header;
+    journalSlot * old = NULL;
+    uint64_t i;
+    size_t size = sizeof(journalIndexHeader) + slotCount * sizeof(journalSlot);
+
+    memset( &header, 0, sizeof(journalIndexHeader) );
+    memcpy( header.magic, JOURNAL_INDEX_MAGIC, sizeof(header.magic) );
+    header.version = JOURNAL_VERSION;
+
+    if( journal->index != NULL )
+    {
+        /* Both mappings share the file, so the old slots must be copied out first */
+        header = *journal->index;
+        old = malloc( header.slotCount * sizeof(journalSlot) );
+        if( old == NULL )
+        {
+            kc_logAlert( "journalIndexResize: Failed malloc()ing" );
+            return -1;
+        }
+        memcpy( old, journal->slots, header.slotCount * sizeof(journalSlot) );
+    }
+
+    void * map = MAP_FAILED;
+    if( ftruncate( journal->indexFile, size ) != 0 ||
+        ( map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->indexFile, 0 ) ) == MAP_FAILED )
+    {
+        kc_logError( "journalIndexResize: Failed mapping %s: %s", journal->indexPath, strerror( errno ) );
+        free( old );
+        return -1;
+    }
+
+    if( journal->index != NULL )
+        munmap( journal->index, journal->mapSize );
+    journal->index = map;
+    journal->slots = (journalSlot*)( journal->index + 1 );
+    journal->mapSize = size;
+
+    uint64_t oldCount = ( old != NULL ? header.slotCount : 0 );
+    header.slotCount = slotCount;
+    *journal->index = header;
+    memset( journal->slots, 0, slotCount * sizeof(journalSlot) );
+
+    for( i = 0; i < oldCount; i++ )
+    {
+        if( old[i].offset == 0 )
+            continue;
+        uint64_t j = old[i].fingerprint & ( slotCount - 1 );
+        while( journal->slots[j].offset != 0 )
+            j = ( j + 1 ) & ( slotCount - 1 );
+        journal->slots[j] = old[i];
+    }
+    free( old );
+    return 0;
+}
+
+/* Returns the slot of the object header describes, or -1 */
+static int64_t
+journalIndexFind( kc_journal * journal, uint64_t fingerprint, const journalRecordHeader * header )
+{
+    uint64_t mask = journal->index->slotCount - 1;
+    uint64_t i;
+
+    for( i = fingerprint & mask; journal->slots[i].offset != 0; i = ( i + 1 ) & mask )
+    {
+        journalRecordHeader stored;
+
+        if( journal->slots[i].fingerprint != fingerprint )
+            continue;
+        /* Fingerprints may collide, the record tells for sure */
+        if( journalRead( journal->log, &stored, sizeof(journalRecordHeader), journal->slots[i].offset ) == 0 &&
+            journalRecordSameObject( &stored, header ) )
+            return i;
+    }
+    return -1;
+}
+
+static void
+journalIndexRemoveAt( kc_journal * journal, uint64_t i )
+{
+    uint64_t mask = journal->index->slotCount - 1;
+    uint64_t hole = i;
+
+    journal->index->liveBytes -= journal->slots[i].length;
+    journal->index->count--;
+
+    /* Backward-shift deletion, as in the store */
+    for( ;; )
+    {
+        i = ( i + 1 ) & mask;
+        if( journal->slots[i].offset == 0 )
+            break;
+
+        uint64_t home = journal->slots[i].fingerprint & mask;
+        if( ( ( i - home ) & mask ) >= ( ( i - hole ) & mask ) )
+        {
+            journal->slots[hole] = journal->slots[i];
+            hole = i;
+        }
+    }
+    memset( &journal->slots[hole], 0, sizeof(journalSlot) );
+}
+
+/* Points the index at a new store record, superseding the previous one of the same object */
+static int
+journalIndexPut( kc_journal * journal, const journalRecordHeader * header, uint64_t offset )
+{
+    uint64_t fingerprint = journalFingerprint( header );
+    uint32_t length = sizeof(journalRecordHeader) + header->length;
+    int64_t i = journalIndexFind( journal, fingerprint, header );
+
+    if( i == -1 )
+    {
+        if( ( journal->index->count + 1 ) * 2 > journal->index->slotCount &&
+            journalIndexResize( journal, journal->index->slotCount * 2 ) != 0 )
+            return -1;
+
+        uint64_t mask = journal->index->slotCount - 1;
+        for( i = fingerprint & mask; journal->slots[i].offset != 0; i = ( i + 1 ) & mask )
+            ;
+        journal->index->count++;
+    }
+    else
+        journal->index->liveBytes -= journal->slots[i].length;
+
+    journal->slots[i].fingerprint = fingerprint;
+    journal->slots[i].offset = offset;
+    journal->slots[i].expires = header->expires;
+    journal->slots[i].length = length;
+    journal->index->liveBytes += length;
+    return 0;
+}
+
+static int
+journalExtentCmp( const void * a, const void * b )
+{
+    const journalExtent * e1 = a;
+    const journalExtent * e2 = b;
+
+    return ( e1->offset < e2->offset ? -1 : e1->offset > e2->offset );
+}
+
+/* Removes the slot pointing at offset */
+static void
+journalIndexRemoveOffset( kc_journal * journal, uint64_t fingerprint, uint64_t offset )
+{
+    uint64_t mask = journal->index->slotCount - 1;
+    uint64_t i;
+
+    for( i = fingerprint & mask; journal->slots[i].offset != 0; i = ( i + 1 ) & mask )
+    {
+        if( journal->slots[i].offset == offset )
+        {
+            journalIndexRemoveAt( journal, i );
+            return;
+        }
+    }
+}
+
+/*
+ * Lists the live records in log order, after dropping the ones expired by now.
+ * Must be called with the journal locked. Returns the number of records, or -1
+ */
+static int64_t
+journalLiveExtents( kc_journal * journal, time_t now, journalExtent ** extents )
+{
+    uint64_t i, count = 0, expired = 0;
+
+    *extents = malloc( ( journal->index->count + 1 ) * sizeof(journalExtent) );
+    if( *extents == NULL )
+    {
+        kc_logAlert( "journalLiveExtents: Failed malloc()ing" );
+        return -1;
+    }
+
+    /* Expired records are gathered at the end, and removed once the scan is over,
+     * as removing shifts slots around under the scan */
+    for( i = 0; i < journal->index->slotCount; i++ )
+    {
+        journalSlot * slot = &journal->slots[i];
+        journalExtent * extent;
+
+        if( slot->offset == 0 )
+            continue;
+        if( slot->expires != 0 && slot->expires <= now )
+            extent = &(*extents)[journal->index->count - ++expired];
+        else
+            extent = &(*extents)[count++];
+        extent->offset = slot->offset;
+        extent->length = slot->length;
+        extent->fingerprint = slot->fingerprint;
+        extent->moved = 0;
+    }
+
+    for( i = count; i < count + expired; i++ )
+        journalIndexRemoveOffset( journal, (*extents)[i].fingerprint, (*extents)[i].offset );
+
+    qsort( *extents, count, sizeof(journalExtent), journalExtentCmp );
+    return count;
+}
+
+#pragma mark Compaction
+
+static int
+journalShouldCompact( kc_journal * journal )
+{
+    uint64_t records = journal->index->logSize - sizeof(journalFileHeader);
+
+    return ( journal->index->logSize > JOURNAL_COMPACT_MIN && records > 2 * journal->index->liveBytes );
+}
+
+static int64_t
+journalExtentFind( const journalExtent * extents, int64_t count, uint64_t offset )
+{
+    int64_t low = 0, high = count - 1;
+
+    while( low <= high )
+    {
+        int64_t middle = ( low + high ) / 2;
+        if( extents[middle].offset == offset )
+            return middle;
+        if( extents[middle].offset < offset )
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return -1;
+}
+
+/* Copies size bytes at offset of the log to the end of to */
+static int
+journalCopy( kc_journal * journal, int to, uint64_t offset, uint64_t size, char * buffer )
+{
+    while( size > 0 )
+    {
+        size_t chunk = ( size < JOURNAL_COPY_BUFFER ? size : JOURNAL_COPY_BUFFER );
+
+        if( journalRead( journal->log, buffer, chunk, offset ) != 0 ||
+            journalWrite( to, buffer, chunk ) != 0 )
+            return -1;
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+/* Writes the live records listed in extents to compacted, noting where they moved */
+static int
+journalCompactCopy( kc_journal * journal, int compacted, journalExtent * extents, int64_t count, char * buffer, uint64_t * size )
+{
+    journalFileHeader fileHeader;
+    int64_t i, j;
+
+    memset( &fileHeader, 0, sizeof(journalFileHeader) );
+    memcpy( fileHeader.magic, JOURNAL_MAGIC, sizeof(fileHeader.magic) );
+    fileHeader.version = JOURNAL_VERSION;
+    fileHeader.hashBytes = KADC_HASH_BYTES;
+    if( journalWrite( compacted, &fileHeader, sizeof(journalFileHeader) ) != 0 )
+        return -1;
+    *size = sizeof(journalFileHeader);
+
+    for( i = 0; i < count; i = j )
+    {
+        /* Copy runs of adjacent records at once */
+        uint64_t run = extents[i].length;
+
+        extents[i].moved = *size;
+        for( j = i + 1; j < count && extents[j].offset == extents[i].offset + run; j++ )
+        {
+            extents[j].moved = *size + run;
+            run += extents[j].length;
+        }
+
+        if( journalCopy( journal, compacted, extents[i].offset, run, buffer ) != 0 )
+            return -1;
+        *size += run;
+    }
+    return 0;
+}
+
+/* Replaces the log with compacted, once the records appended past end got copied. Must be called with the journal locked */
+static int
+journalCompactSwap( kc_journal * journal, int compacted, const journalExtent * extents, int64_t count, uint64_t end, uint64_t size, char * buffer )
+{
+    uint64_t tail = size;
+    uint64_t i;
+
+    if( journalCopy( journal, compacted, end, journal->index->logSize - end, buffer ) != 0 ||
+        fdatasync( compacted ) != 0 ||
+        rename( journal->compactPath, journal->logPath ) != 0 )
+        return -1;
+
+    close( journal->log );
+    journal->log = compacted;
+    size += journal->index->logSize - end;
+
+    kc_logVerbose( "journalCompact: Compacted %s from %llu to %llu bytes", journal->logPath,
+                   (unsigned long long)journal->index->logSize, (unsigned long long)size );
+
+    /* Slots below end were all listed, as later stores only go past it */
+    for( i = 0; i < journal->index->slotCount; i++ )
+    {
+        journalSlot * slot = &journal->slots[i];
+
+        if( slot->offset == 0 )
+            continue;
+        if( slot->offset >= end )
+            slot->offset = slot->offset - end + tail;
+        else
+        {
+            int64_t extent = journalExtentFind( extents, count, slot->offset );
+            assert( extent != -1 );
+            slot->offset = extents[extent].moved;
+        }
+    }
+    journal->index->logSize = size;
+    return 0;
+}
+
+/*
+ * Rewrites the log with only its live records.
+ *
+ * The records live at the start get copied without the journal locked,
+ * as appends don't touch them. What got appended meanwhile is copied
+ * with the journal locked, right before the new log replaces the old one.
+ */
+static int
+journalCompact( kc_journal * journal )
+{
+    journalExtent * extents;
+    int64_t count;
+    uint64_t end, size;
+    int status = -1;
+
+    pthread_mutex_lock( &journal->compactLock );
+    pthread_mutex_lock( &journal->lock );
+    count = journalLiveExtents( journal, time( NULL ), &extents );
+    end = journal->index->logSize;
+    pthread_mutex_unlock( &journal->lock );
+
+    if( count < 0 )
+    {
+        pthread_mutex_unlock( &journal->compactLock );
+        return -1;
+    }
+
+    char * buffer = malloc( JOURNAL_COPY_BUFFER );
+    int compacted = open( journal->compactPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600 );
+    if( buffer == NULL || compacted == -1 )
+        kc_logError( "journalCompact: Failed creating %s", journal->compactPath );
+    else if( journalCompactCopy( journal, compacted, extents, count, buffer, &size ) == 0 )
+    {
+        pthread_mutex_lock( &journal->lock );
+        status = journalCompactSwap( journal, compacted, extents, count, end, size, buffer );
+        pthread_mutex_unlock( &journal->lock );
+    }
+
+    if( status != 0 && compacted != -1 )
+    {
+        kc_logError( "journalCompact: Failed compacting %s: %s", journal->logPath, strerror( errno ) );
+        close( compacted );
+        unlink( journal->compactPath );
+    }
+    free( buffer );
+    free( extents );
+    pthread_mutex_unlock( &journal->compactLock );
+    return status;
+}
+
+static void *
+journalThread( void * arg )
+{
+    kc_journal * journal = arg;
+
+    pthread_mutex_lock( &journal->lock );
+    while( !journal->stopping )
+    {
+        if( journalShouldCompact( journal ) )
+        {
+            pthread_mutex_unlock( &journal->lock );
+            int status = journalCompact( journal );
+            pthread_mutex_lock( &journal->lock );
+            if( status == 0 )
+                continue;
+            /* Don't retry right away */
+        }
+
+        if( pthread_cond_incrtimedwait( &journal->cond, &journal->lock, JOURNAL_SYNC_INTERVAL ) == ETIMEDOUT &&
+            journal->dirty )
+        {
+            /* Sync without the lock so that stores go on meanwhile, whatever they append
+             * marks the log dirty again. kc_journalCompact() may replace the log from
+             * another thread, so hold compactLock to keep it open, taken before the lock as usual */
+            journal->dirty = 0;
+            pthread_mutex_unlock( &journal->lock );
+            pthread_mutex_lock( &journal->compactLock );
+            int status = fdatasync( journal->log );
+            pthread_mutex_unlock( &journal->compactLock );
+            pthread_mutex_lock( &journal->lock );
+            if( status != 0 )
+            {
+                kc_logError( "journalThread: Failed syncing %s: %s", journal->logPath, strerror( errno ) );
+                journal->dirty = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock( &journal->lock );
+    return NULL;
+}
+
+#pragma mark Opening
+
+/* Scans the log, checking its records and rebuilding the index */
+static int
+journalLoad( kc_journal * journal )
+{
+    journalFileHeader fileHeader;
+    journalRecordHeader header;
+    struct stat st;
+    unsigned char * data = NULL;
+    uint32_t capacity = 0;
+    uint64_t offset;
+
+    if( fstat( journal->log, &st ) != 0 )
+    {
+        kc_logError( "journalLoad: Failed stat()ing %s: %s", journal->logPath, strerror( errno ) );
+        return -1;
+    }
+
+    if( (uint64_t)st.st_size < sizeof(journalFileHeader) )
+    {
+        /* New, or torn while being created */
+        memset( &fileHeader, 0, sizeof(journalFileHeader) );
+        memcpy( fileHeader.magic, JOURNAL_MAGIC, sizeof(fileHeader.magic) );
+        fileHeader.version = JOURNAL_VERSION;
+        fileHeader.hashBytes = KADC_HASH_BYTES;
+        if( ftruncate( journal->log, 0 ) != 0 ||
+            journalWrite( journal->log, &fileHeader, sizeof(journalFileHeader) ) != 0 )
+        {
+            kc_logError( "journalLoad: Failed initializing %s: %s", journal->logPath, strerror( errno ) );
+            return -1;
+        }
+        journal->index->logSize = sizeof(journalFileHeader);
+        return 0;
+    }
+
+    if( journalRead( journal->log, &fileHeader, sizeof(journalFileHeader), 0 ) != 0 ||
+        memcmp( fileHeader.magic, JOURNAL_MAGIC, sizeof(fileHeader.magic) ) != 0 ||
+        fileHeader.version != JOURNAL_VERSION ||
+        fileHeader.hashBytes != KADC_HASH_BYTES )
+    {
+        kc_logError( "journalLoad: %s isn't a journal this build can read", journal->logPath );
+        return -1;
+    }
+
+    /* Index offsets point into the log, so it must be in place while scanning */
+    journal->index->logSize = st.st_size;
+
+    for( offset = sizeof(journalFileHeader); offset + sizeof(journalRecordHeader) <= (uint64_t)st.st_size; )
+    {
+        if( journalRead( journal->log, &header, sizeof(journalRecordHeader), offset ) != 0 ||
+            ( header.type != JOURNAL_STORE && header.type != JOURNAL_EXPIRE ) ||
+            header.length > JOURNAL_MAX_DATA ||
+            offset + sizeof(journalRecordHeader) + header.length > (uint64_t)st.st_size )
+            break;
+
+        if( header.length > capacity )
+        {
+            unsigned char * grown = realloc( data, header.length );
+            if( grown == NULL )
+            {
+                kc_logAlert( "journalLoad: Failed malloc()ing" );
+                free( data );
+                return -1;
+            }
+            data = grown;
+            capacity = header.length;
+        }
+        if( journalRead( journal->log, data, header.length, offset + sizeof(journalRecordHeader) ) != 0 ||
+            journalRecordCrc( &header, data ) != header.crc )
+            break;
+
+        if( header.type == JOURNAL_STORE )
+        {
+            if( journalIndexPut( journal, &header, offset ) != 0 )
+            {
+                free( data );
+                return -1;
+            }
+        }
+        else
+        {
+            int64_t i = journalIndexFind( journal, journalFingerprint( &header ), &header );
+            if( i != -1 )
+                journalIndexRemoveAt( journal, i );
+        }
+        offset += sizeof(journalRecordHeader) + header.length;
+    }
+    free( data );
+
+    if( offset < (uint64_t)st.st_size )
+    {
+        /* Only the last record can be torn, anything past a bad one is dropped as well */
+        kc_logAlert( "journalLoad: Dropping %llu bytes of torn or corrupted records at the end of %s",
+                     (unsigned long long)( st.st_size - offset ), journal->logPath );
+        if( ftruncate( journal->log, offset ) != 0 )
+        {
+            kc_logError( "journalLoad: Failed truncating %s: %s", journal->logPath, strerror( errno ) );
+            return -1;
+        }
+    }
+    journal->index->logSize = offset;
+    return 0;
+}
+
+static int
+journalReplay( kc_journal * journal, kc_journalReplayCallback replay, void * ref )
+{
+    journalExtent * extents;
+    journalRecordHeader * header;
+    kc_journalRecord record;
+    char * buffer = NULL;
+    uint64_t capacity = 0;
+    int64_t count, i;
+
+    count = journalLiveExtents( journal, time( NULL ), &extents );
+    if( count < 0 )
+        return -1;
+
+    for( i = 0; i < count && replay != NULL; i++ )
+    {
+        if( extents[i].length > capacity )
+        {
+            char * grown = realloc( buffer, extents[i].length );
+            if( grown == NULL )
+            {
+                kc_logAlert( "journalReplay: Failed malloc()ing" );
+                break;
+            }
+            buffer = grown;
+            capacity = extents[i].length;
+        }
+        if( journalRead( journal->log, buffer, extents[i].length, extents[i].offset ) != 0 )
+        {
+            kc_logError( "journalReplay: Failed reading %s: %s", journal->logPath, strerror( errno ) );
+            break;
+        }
+
+        header = (journalRecordHeader*)buffer;
+        kc_hashClear( &record.key, header->keyLength );
+        memcpy( record.key.id.bytes, header->key, KADC_HASH_BYTES );
+        kc_hashClear( &record.related, header->relatedLength );
+        memcpy( record.related.id.bytes, header->related, KADC_HASH_BYTES );
+        record.published = header->published;
+        record.expires = header->expires;
+        record.mine = header->mine;
+        record.data = header + 1;
+        record.size = header->length;
+
+        if( replay( &record, ref ) != 0 )
+            break;
+    }
+
+    kc_logVerbose( "journalReplay: Replayed %lld of %lld objects from %s", (long long)i, (long long)count, journal->logPath );
+    free( buffer );
+    free( extents );
+    return 0;
+}
+
+static void
+journalDestroy( kc_journal * journal )
+{
+    if( journal->index != NULL )
+        munmap( journal->index, journal->mapSize );
+    if( journal->indexFile != -1 )
+        close( journal->indexFile );
+    if( journal->log != -1 )
+        close( journal->log );
+    free( journal->logPath );
+    free( journal->indexPath );
+    free( journal->compactPath );
+    pthread_cond_destroy( &journal->cond );
+    pthread_mutex_destroy( &journal->compactLock );
+    pthread_mutex_destroy( &journal->lock );
+    free( journal );
+}
+
+kc_journal *
+kc_journalOpen( const char * path, kc_journalReplayCallback replay, void * ref )
+{
+    assert( path != NULL );
+
+    pthread_once( &journalCrcOnce, journalCrcInit );
+
+    kc_journal * self = calloc( 1, sizeof(kc_journal) );
+    if( self == NULL )
+    {
+        kc_logAlert( "kc_journalOpen: Failed malloc()ing" );
+        return NULL;
+    }
+    self->log = -1;
+    self->indexFile = -1;
+    pthread_mutex_init( &self->lock, NULL );
+    pthread_mutex_init( &self->compactLock, NULL );
+    pthread_cond_init( &self->cond, NULL );
+
+    if( asprintf( &self->logPath, "%s.log", path ) == -1 ||
+        asprintf( &self->indexPath, "%s.idx", path ) == -1 ||
+        asprintf( &self->compactPath, "%s.compact", path ) == -1 )
+    {
+        kc_logAlert( "kc_journalOpen: Failed malloc()ing paths" );
+        journalDestroy( self );
+        return NULL;
+    }
+
+    self->log = open( self->logPath, O_RDWR | O_CREAT | O_APPEND, 0600 );
+    self->indexFile = open( self->indexPath, O_RDWR | O_CREAT, 0600 );
+    if( self->log == -1 || self->indexFile == -1 )
+    {
+        kc_logError( "kc_journalOpen: Failed opening %s: %s", path, strerror( errno ) );
+        journalDestroy( self );
+        return NULL;
+    }
+
+    /* The index is rebuilt from scratch, so a crash can't leave it out of step with the log */
+    if( ftruncate( self->indexFile, 0 ) != 0 ||
+        journalIndexResize( self, JOURNAL_INDEX_SLOTS ) != 0 ||
+        journalLoad( self ) != 0 ||
+        journalReplay( self, replay, ref ) != 0 )
+    {
+        kc_logError( "kc_journalOpen: Failed loading %s", path );
+        journalDestroy( self );
+        return NULL;
+    }
+
+    if( pthread_create( &self->thread, NULL, journalThread, self ) != 0 )
+    {
+        kc_logError( "kc_journalOpen: Failed creating the compaction thread" );
+        journalDestroy( self );
+        return NULL;
+    }
+
+    return self;
+}
+
+void
+kc_journalClose( kc_journal * journal )
+{
+    if( journal == NULL )
+        return;
+
+    pthread_mutex_lock( &journal->lock );
+    journal->stopping = 1;
+    pthread_cond_signal( &journal->cond );
+    pthread_mutex_unlock( &journal->lock );
+    pthread_join( journal->thread, NULL );
+
+    fdatasync( journal->log );
+    msync( journal->index, journal->mapSize, MS_SYNC );
+    journalDestroy( journal );
+}
+
+#pragma mark Journaling
+
+int
+kc_journalStore( kc_journal * journal, const kc_hash * key, const kc_hash * related,
+                 time_t published, time_t expires, int mine, const void * data, int size )
+{
+    assert( journal != NULL );
+    assert( key != NULL );
+    assert( related != NULL );
+    assert( size >= 0 && size <= JOURNAL_MAX_DATA );
+
+    journalRecordHeader header;
+    uint64_t offset;
+    int status = -1;
+
+    journalRecordInit( &header, JOURNAL_STORE, key, related );
+    header.length = size;
+    header.mine = ( mine != 0 );
+    header.published = published;
+    header.expires = expires;
+
+    pthread_mutex_lock( &journal->lock );
+    if( journalAppend( journal, &header, data, &offset ) == 0 )
+        status = journalIndexPut( journal, &header, offset );
+    if( journalShouldCompact( journal ) )
+        pthread_cond_signal( &journal->cond );
+    pthread_mutex_unlock( &journal->lock );
+
+    return status;
+}
+
+int
+kc_journalExpire( kc_journal * journal, const kc_hash * key, const kc_hash * related )
+{
+    assert( journal != NULL );
+    assert( key != NULL );
+    assert( related != NULL );
+
+    journalRecordHeader header;
+    uint64_t offset;
+    int status = 0;
+
+    journalRecordInit( &header, JOURNAL_EXPIRE, key, related );
+
+    pthread_mutex_lock( &journal->lock );
+    /* Nothing to kill if the object wasn't journaled, or already expired */
+    int64_t i = journalIndexFind( journal, journalFingerprint( &header ), &header );
+    if( i != -1 )
+    {
+        status = journalAppend( journal, &header, NULL, &offset );
+        if( status == 0 )
+            journalIndexRemoveAt( journal, i );
+        if( journalShouldCompact( journal ) )
+            pthread_cond_signal( &journal->cond );
+    }
+    pthread_mutex_unlock( &journal->lock );
+
+    return status;
+}
+
+int
+kc_journalSync( kc_journal * journal )
+{
+    assert( journal != NULL );
+
+    int status;
+
+    pthread_mutex_lock( &journal->lock );
+    status = fdatasync( journal->log );
+    if( status == 0 )
+        journal->dirty = 0;
+    else
+        kc_logError( "kc_journalSync: Failed syncing %s: %s", journal->logPath, strerror( errno ) );
+    pthread_mutex_unlock( &journal->lock );
+
+    return status;
+}
+
+int
+kc_journalCompact( kc_journal * journal )
+{
+    assert( journal != NULL );
+
+    return journalCompact( journal );
+}
+
+long
+kc_journalGetSize( kc_journal * journal, long * live )
+{
+    assert( journal != NULL );
+
+    long size;
+
+    pthread_mutex_lock( &journal->lock );
+    size = journal->index->logSize;
+    if( live != NULL )
+        *live = journal->index->liveBytes;
+    pthread_mutex_unlock( &journal->lock );
+
+    return size;
+}
+
+#else /* __WIN32__ */
+
+kc_journal *
+kc_journalOpen( const char * path, kc_journalReplayCallback replay, void * ref )
+{
+    assert( path != NULL );
+
+    kc_logError( "kc_journalOpen: Journals aren't supported on this platform, can't open %s", path );
+    return NULL;
+}
+
+void
+kc_journalClose( kc_journal * journal )
+{
+    assert( journal == NULL );
+}
+
+int
+kc_journalStore( kc_journal * journal, const kc_hash * key, const kc_hash * related,
+                 time_t published, time_t expires, int mine, const void * data, int size )
+{
+    assert( journal != NULL );
+    return -1;
+}
+
+int
+kc_journalExpire( kc_journal * journal, const kc_hash * key, const kc_hash * related )
+{
+    assert( journal != NULL );
+    return -1;
+}
+
+int
+kc_journalSync( kc_journal * journal )
+{
+    assert( journal != NULL );
+    return -1;
+}
+
+int
+kc_journalCompact( kc_journal * journal )
+{
+    assert( journal != NULL );
+    return -1;
+}
+
+long
+kc_journalGetSize( kc_journal * journal, long * live )
+{
+    assert( journal != NULL );
+    return -1;
+}
+
+#endif /* __WIN32__ */
@@ -0,0 +1,106 @@
+/*
+ *  journal.h
+ *  KadC
+ *
+ */
+
+#ifndef __KADC_JOURNAL_H__
+#define __KADC_JOURNAL_H__
+
+/**
+ * A persistent journal of stored objects.
+ *
+ * Stores and expirations get appended to a log file <path>.log, each record
+ * with a checksum, so that a record torn by a crash is detected and dropped,
+ * along with anything after it. The live record of each ( key, related ) pair
+ * is tracked in an open addressing table mapped from <path>.idx, which is
+ * rebuilt in a single sequential pass over the log on open.
+ * Once most of the log is dead, a background thread compacts it into a new
+ * log holding only the live, unexpired records, which then replaces the old one.
+ *
+ * Records are written in host byte order, so journals don't move across architectures.
+ * All functions are thread-safe.
+ */
+typedef struct _kc_journal kc_journal;
+
+/**
+ * A stored object, as replayed.
+ */
+typedef struct _kc_journalRecord {
+    kc_hash                 key;
+    kc_hash                 related;
+    time_t                  published;
+    time_t                  expires;    /* 0 if it never expires */
+    int                     mine;
+    const void            * data;       /* Only valid during the replay callback */
+    int                     size;
+} kc_journalRecord;
+
+/**
+ * The callback prototype used to replay the live objects of a journal, in the order they were stored.
+ *
+ * @return 0 to go on replaying, anything else to stop
+ */
+typedef int (*kc_journalReplayCallback)( const kc_journalRecord * record, void * ref );
+
+/**
+ * Opens a journal, creating it if needed, and replays the objects that are still live.
+ *
+ * Objects that expired meanwhile are dropped instead.
+ *
+ * Journals are POSIX-only : on __WIN32__ this always fails.
+ *
+ * @param path The path of the journal files, without their extensions
+ * @param replay The callback replayed records are passed to, or NULL
+ * @return A journal, or NULL on failure
+ */
+kc_journal *
+kc_journalOpen( const char * path, kc_journalReplayCallback replay, void * ref );
+
+/**
+ * Closes a journal, syncing it to disk.
+ */
+void
+kc_journalClose( kc_journal * journal );
+
+/**
+ * Appends a store record, superseding the previous one for ( key, related ).
+ *
+ * @param expires When the object expires, 0 for never
+ * @return 0 on success, -1 on failure
+ */
+int
+kc_journalStore( kc_journal * journal, const kc_hash * key, const kc_hash * related,
+                 time_t published, time_t expires, int mine, const void * data, int size );
+
+/**
+ * Appends an expire record, killing the store record for ( key, related ).
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+kc_journalExpire( kc_journal * journal, const kc_hash * key, const kc_hash * related );
+
+/**
+ * Flushes the journal to disk.
+ *
+ * Without it, a crash of the process loses nothing, but a crash of the system may lose the last records.
+ */
+int
+kc_journalSync( kc_journal * journal );
+
+/**
+ * Compacts the journal right away, instead of waiting for its background thread.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+kc_journalCompact( kc_journal * journal );
+
+/**
+ * Returns the size of the log, and in live the size of its live records.
+ */
+long
+kc_journalGetSize( kc_journal * journal, long * live );
+
+#endif /* __KADC_JOURNAL_H__ */
@@ -31,12 +31,18 @@
 
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <event2/thread.h>
 
 #include "logging.h"
 #include "utils.h"
 #include "hash.h"
 #include "bufio.h"
 #include "queue.h"
+#include "pool.h"
+#include "wheel.h"
+#include "store.h"
+#include "filter.h"
+#include "journal.h"
 #include "rbt.h"
 #include "contact.h"
 #include "inifiles.h"
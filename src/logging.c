@@ -31,6 +31,8 @@ of the following e-mail addresses (replace "(at)" with "@"):
 static FILE *logf = NULL;
 static pthread_mutex_t console_io_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+int kc_logThreshold = KADC_LOG_MIN_LEVEL;
+
 FILE *
 kc_logOpen( char *filename )
 {
@@ -48,61 +50,53 @@ kc_logSetFile( FILE *f )
     pthread_mutex_unlock( &console_io_mutex );
 }
 
+void
+kc_logSetLevel( kc_logLevel lvl )
+{
+    kc_logThreshold = lvl;
+}
+
 void
 kc_logFile( FILE *f, kc_logLevel lvl, const char *fmt, ... )
 {
-    assert( f == NULL );
+    assert( f != NULL );
     
-	va_list ap;
+    if( !kc_logEnabled( lvl ) )
+        return;
+    
+    va_list ap;
     
-	va_start(ap, fmt);
+    va_start(ap, fmt);
 
-	pthread_mutex_lock( &console_io_mutex );
-	
+    pthread_mutex_lock( &console_io_mutex );
+    
     vfprintf( f, fmt, ap );
     
-	if( f != stdout )
-		fflush( f );
+    if( f != stdout )
+        fflush( f );
     
-	pthread_mutex_unlock( &console_io_mutex );
+    pthread_mutex_unlock( &console_io_mutex );
     
-	va_end( ap );
+    va_end( ap );
 }
 
 void
 kc_log( kc_logLevel lvl, const char * fmt, va_list ap, int stamp )
 {
-	pthread_mutex_lock( &console_io_mutex );
-    char  * dbgMsg;
-    char  * dbgLvl = "";
+    const char * dbgLvl = "";
     
-    vasprintf( &dbgMsg, fmt, ap );
-    if( dbgMsg == NULL )
-    {
-        printf( "Failed allocating memory for message: %s", fmt );
+    /* Bail out before doing anything, callers not going through the macros end up here */
+    if( !kc_logEnabled( lvl ) )
         return;
-    }
-    
-    /* Maybe handle this as a global log level instead of a preprocessor macro... */    
     
     switch ( lvl )
     {
         case KADC_LOG_VERBOSE:
-
-#ifdef VERBOSEDEBUG
             dbgLvl = "(VERBOSEDEBUG) ";
-#else
-            free( dbgMsg );
-            return;
-#endif
             break;
+            
         case KADC_LOG_DEBUG:
-#ifdef DEBUG
             dbgLvl = "(DEBUG) ";
-#else
-            free( dbgMsg );
-            return;
-#endif
             break;
             
         case KADC_LOG_NORMAL:
@@ -120,21 +114,27 @@ kc_log( kc_logLevel lvl, const char * fmt, va_list ap, int stamp )
         default:
             break;
     }
+    
+    /* Straight to the FILE, no intermediate allocation */
+    pthread_mutex_lock( &console_io_mutex );
     if( logf == NULL )
         logf = stdout;
+    
+    fputs( dbgLvl, logf );
     if ( stamp == 1 )
     {
+        char timeStr[32];
         time_t now = time( NULL );
-        fprintf( logf, "%s%s: %s\n", dbgLvl, ctime( &now ), dbgMsg );
+        strftime( timeStr, sizeof(timeStr), "%a %b %d %H:%M:%S %Y", localtime( &now ) );
+        fprintf( logf, "%s: ", timeStr );
     }
-    else
-        fprintf( logf, "%s%s\n", dbgLvl, dbgMsg );
-	
+    vfprintf( logf, fmt, ap );
+    fputc( '\n', logf );
+    
     if ( logf != stdout )
         fflush( logf );
     
-    free( dbgMsg );
-	pthread_mutex_unlock( &console_io_mutex );
+    pthread_mutex_unlock( &console_io_mutex );
 }
 
 void
@@ -36,11 +36,35 @@ of the following e-mail addresses (replace "(at)" with "@"):
  * This file implements a mutex-protected output facility,
  * with an ability to switch the output log file.
  */
-#define kc_logVerbose( ... )  kc_logPrint( KADC_LOG_VERBOSE, __VA_ARGS__ )
-#define kc_logDebug( ... )    kc_logPrint( KADC_LOG_DEBUG, __VA_ARGS__ )
-#define kc_logNormal( ... )   kc_logPrint( KADC_LOG_NORMAL,  __VA_ARGS__ )
-#define kc_logAlert( ... )    kc_logPrint( KADC_LOG_ALERT, __VA_ARGS__ )
-#define kc_logError( ... )    kc_logPrint( KADC_LOG_ERROR, __VA_ARGS__ )
+/* The log macros check the level before anything else, so that the arguments
+ * of a suppressed message (hashtoa() and friends) aren't even evaluated. */
+#define kc_logAt( lvl, ... )  do { if( kc_logEnabled( lvl ) ) kc_logPrint( lvl, __VA_ARGS__ ); } while( 0 )
+
+#define kc_logVerbose( ... )  kc_logAt( KADC_LOG_VERBOSE, __VA_ARGS__ )
+#define kc_logDebug( ... )    kc_logAt( KADC_LOG_DEBUG, __VA_ARGS__ )
+#define kc_logNormal( ... )   kc_logAt( KADC_LOG_NORMAL,  __VA_ARGS__ )
+#define kc_logAlert( ... )    kc_logAt( KADC_LOG_ALERT, __VA_ARGS__ )
+#define kc_logError( ... )    kc_logAt( KADC_LOG_ERROR, __VA_ARGS__ )
+
+/**
+ * The lowest level compiled in : VERBOSEDEBUG enables everything,
+ * DEBUG everything but verbose messages.
+ */
+#if defined(VERBOSEDEBUG)
+#define KADC_LOG_MIN_LEVEL  KADC_LOG_VERBOSE
+#elif defined(DEBUG)
+#define KADC_LOG_MIN_LEVEL  KADC_LOG_DEBUG
+#else
+#define KADC_LOG_MIN_LEVEL  KADC_LOG_NORMAL
+#endif
+
+/**
+ * Tells if messages of a given level get logged.
+ *
+ * Levels below KADC_LOG_MIN_LEVEL are folded away at compile time,
+ * the others are checked against kc_logSetLevel().
+ */
+#define kc_logEnabled( lvl )  ( (lvl) >= KADC_LOG_MIN_LEVEL && (int)(lvl) >= kc_logThreshold )
 
 /** 
  * A message's log level.
@@ -53,6 +77,20 @@ typedef enum {
     KADC_LOG_ERROR
 } kc_logLevel;
 
+/** The current log level, use kc_logSetLevel() to change it */
+extern int kc_logThreshold;
+
+/** 
+ * Sets the lowest level of the messages to log.
+ *
+ * Messages below KADC_LOG_MIN_LEVEL are never logged, whatever the level set here.
+ * Defaults to KADC_LOG_MIN_LEVEL.
+ *
+ * @param lvl The lowest level to log.
+ */
+void
+kc_logSetLevel( kc_logLevel lvl );
+
 /** 
  * Opens a file from name for logging purposes.
  *
@@ -0,0 +1,635 @@
+/*
+ *  lookup.c
+ *  KadC
+ *
+ */
+
+#include "internal.h"
+
+#define LOOKUP_SHORTLIST_FACTOR 3       /* The shortlist holds that many times bucketSize candidates */
+#define LOOKUP_MAX_TRIES        2       /* Requests sent to a candidate before we give up on it */
+
+typedef enum {
+    LOOKUP_CANDIDATE_NEW,               /* Not queried yet */
+    LOOKUP_CANDIDATE_WAITING,           /* Queried, waiting for its answer */
+    LOOKUP_CANDIDATE_RESPONDED,
+    LOOKUP_CANDIDATE_DEFERRED,          /* Another request to it is pending, queried once that one ends */
+    LOOKUP_CANDIDATE_FAILED             /* Timed out, or we failed to query it */
+} dhtLookupCandidateState;
+
+typedef struct dhtLookupCandidate {
+    kc_hash                 hash;
+    kc_contact            * contact;    /* Ours, also used by the candidate session while WAITING */
+    dhtLookupCandidateState state;
+    int                     hop;        /* 1 for nodes from our routing table, n + 1 for nodes returned at hop n */
+    int                     tries;      /* Requests sent to it so far */
+    long                    rto;        /* Its node's timeout, then the timeout of its last request, in ms */
+} dhtLookupCandidate;
+
+struct _kc_dhtLookup {
+    kc_dht                * dht;
+    kc_hash                 target;
+    int                     findValue;
+
+    dhtLookupCandidate    * candidates; /* The shortlist, sorted by increasing distance to target */
+    int                     count;
+    int                     capacity;
+    int                     wanted;     /* k, the number of responded nodes we want */
+
+    int                     inFlight;
+    int                     replyHop;   /* Hop of the candidate whose reply is being parsed */
+    int                     hops;
+    void                  * value;
+
+    int                     done;
+    int                     notified;
+    struct timeval          startTime;
+    struct timeval          endTime;
+
+    kc_dhtLookupCallback    callback;
+    void                  * ref;
+
+    kc_wheelTimer           retryTimer; /* Queries deferred candidates again */
+    int                     retryPending;
+
+    int                     refCount;   /* The user, plus one per running session and one while retryPending */
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+};
+
+static void
+lookupRelease( kc_dhtLookup * lookup )
+{
+    int last;
+
+    pthread_mutex_lock( &lookup->lock );
+    last = ( --lookup->refCount == 0 );
+    pthread_mutex_unlock( &lookup->lock );
+
+    if( !last )
+        return;
+
+    int i;
+    for( i = 0; i < lookup->count; i++ )
+        kc_contactFree( lookup->candidates[i].contact );
+    free( lookup->candidates );
+    pthread_mutex_destroy( &lookup->lock );
+    pthread_cond_destroy( &lookup->cond );
+    free( lookup );
+}
+
+static dhtLookupCandidate *
+lookupCandidateForContact( kc_dhtLookup * lookup, const kc_contact * contact )
+{
+    int i;
+    for( i = 0; i < lookup->count; i++ )
+    {
+        if( kc_contactCmp( lookup->candidates[i].contact, contact ) == 0 )
+            return &lookup->candidates[i];
+    }
+    return NULL;
+}
+
+/* Returns the time left before the lookup deadline, in ms */
+static long
+lookupRemaining( const kc_dhtLookup * lookup )
+{
+    return lookup->dht->parameters->lookupTimeout * 1000L - kc_dhtLookupGetLatency( lookup );
+}
+
+/* Must be called with the lock held */
+static void
+lookupFinish( kc_dhtLookup * lookup )
+{
+    if( lookup->done )
+        return;
+
+    lookup->done = 1;
+    gettimeofday( &lookup->endTime, NULL );
+    pthread_cond_broadcast( &lookup->cond );
+
+    kc_logVerbose( "Lookup for %s done in %d hops, %ld ms, %s", hashtoa( &lookup->target ), lookup->hops,
+                  kc_dhtLookupGetLatency( lookup ), ( lookup->value != NULL ? "value found" : "no value" ) );
+}
+
+/* Returns 1 if the k closest live candidates all responded, or nothing is left to ask */
+static int
+lookupIsComplete( const kc_dhtLookup * lookup )
+{
+    int seen = 0;
+    int i;
+
+    if( lookup->value != NULL )
+        return 1;
+
+    for( i = 0; i < lookup->count && seen < lookup->wanted; i++ )
+    {
+        switch( lookup->candidates[i].state )
+        {
+            case LOOKUP_CANDIDATE_FAILED:
+                continue;
+            case LOOKUP_CANDIDATE_RESPONDED:
+                seen++;
+                break;
+            default:
+                return 0;
+        }
+    }
+    return ( seen == lookup->wanted || lookup->inFlight == 0 );
+}
+
+/* Returns 0 once the request is sent, 1 if the candidate is busy with another request, -1 on failure */
+static int
+lookupSend( kc_dhtLookup * lookup, dhtLookupCandidate * candidate )
+{
+    kc_dht * dht = lookup->dht;
+    kc_messageType type = ( lookup->findValue ? DHT_RPC_FIND_VALUE : DHT_RPC_FIND_NODE );
+    long remaining = lookupRemaining( lookup );
+    long rto;
+    int status;
+    
+    if( remaining <= 0 )
+        return -1;
+    
+    /* Use the node's own timeout, backing off exponentially on retransmissions,
+     * but never wait past the lookup deadline */
+    rto = ( candidate->tries == 0 ? candidate->rto : candidate->rto * 2 );
+    if( rto > remaining )
+        rto = remaining;
+
+    kc_session * session = kc_dhtCreateAndAddOutgoingSession( dht, candidate->contact, type, lookupSessionCallback );
+    if( session == NULL )
+    {
+        /* Replies are routed by contact and type, so while another lookup or a probe waits
+         * on this node we can't query it. That isn't the node's fault, try again later */
+        if( !dht->stopping && kc_dhtHasSession( dht, candidate->contact, 0, type ) )
+        {
+            kc_logVerbose( "Lookup for %s: %s is busy, deferring it", hashtoa( &lookup->target ), kc_contactPrint( candidate->contact ) );
+            return 1;
+        }
+        kc_logVerbose( "Lookup for %s: can't query %s", hashtoa( &lookup->target ), kc_contactPrint( candidate->contact ) );
+        return -1;
+    }
+    kc_sessionSetRef( session, lookup );
+    kc_sessionSetTimeout( session, rto );
+
+    kc_message * msg = kc_messageInit( candidate->contact, type, 0, NULL );
+    if( msg == NULL )
+    {
+        kc_dhtDeleteSession( dht, session );
+        kc_sessionFree( session );
+        return -1;
+    }
+    kc_messageSetHash( msg, &lookup->target );
+
+    status = dht->parameters->callbacks.writeCallback( dht, NULL, msg );
+    if( status == 0 )
+        status = kc_sessionSend( session, msg );
+    kc_messageFree( msg );
+
+    if( status != 0 )
+    {
+        kc_logAlert( "Lookup for %s: failed sending request to %s", hashtoa( &lookup->target ), kc_contactPrint( candidate->contact ) );
+        kc_dhtDeleteSession( dht, session );
+        kc_sessionFree( session );
+        return -1;
+    }
+
+    candidate->state = LOOKUP_CANDIDATE_WAITING;
+    candidate->tries++;
+    candidate->rto = rto;
+    lookup->inFlight++;
+    lookup->refCount++;
+    return 0;
+}
+
+/* Returns the fastest new candidate among the k closest live ones that share
+ * the XOR-prefix band of candidate first, all of them being as close to the target */
+static dhtLookupCandidate *
+lookupFastestInBand( kc_dhtLookup * lookup, int first, int seen )
+{
+    dhtLookupCandidate * fastest = &lookup->candidates[first];
+    int band = kc_hashXorlog( &lookup->target, &fastest->hash );
+    int i;
+
+    seen++;     /* first itself */
+    for( i = first + 1; i < lookup->count && seen < lookup->wanted; i++ )
+    {
+        dhtLookupCandidate * candidate = &lookup->candidates[i];
+
+        if( kc_hashXorlog( &lookup->target, &candidate->hash ) != band )
+            break;
+        if( candidate->state == LOOKUP_CANDIDATE_FAILED )
+            continue;
+        seen++;
+        if( candidate->state == LOOKUP_CANDIDATE_NEW && candidate->rto < fastest->rto )
+            fastest = candidate;
+    }
+    return fastest;
+}
+
+static void lookupRetryCB( kc_wheelTimer * timer, void * ref );
+
+/* Retries the deferred candidates after delay ms, about when the request keeping
+ * them busy times out at worst. Must be called with the lock held */
+static void
+lookupDefer( kc_dhtLookup * lookup, long delay )
+{
+    long remaining = lookupRemaining( lookup );
+
+    if( lookup->retryPending )
+        return;
+    if( delay > remaining )
+        delay = remaining;
+
+    lookup->retryPending = 1;
+    lookup->refCount++;
+    kc_wheelSchedule( lookup->dht->wheel, &lookup->retryTimer, delay );
+}
+
+/* Keeps lookupParallelism requests running to the closest unqueried candidates,
+ * must be called with the lock held */
+static void
+lookupAdvance( kc_dhtLookup * lookup )
+{
+    int alpha = lookup->dht->parameters->lookupParallelism;
+
+    if( lookupRemaining( lookup ) <= 0 )
+    {
+        kc_logVerbose( "Lookup for %s reached its deadline", hashtoa( &lookup->target ) );
+        lookupFinish( lookup );
+        return;
+    }
+
+    while( !lookup->done && lookup->inFlight < alpha )
+    {
+        dhtLookupCandidate * next = NULL;
+        int seen = 0;
+        int i;
+
+        /* Only the k closest live candidates are worth asking */
+        for( i = 0; i < lookup->count && seen < lookup->wanted; i++ )
+        {
+            if( lookup->candidates[i].state == LOOKUP_CANDIDATE_FAILED )
+                continue;
+            if( lookup->candidates[i].state == LOOKUP_CANDIDATE_NEW )
+            {
+                next = &lookup->candidates[i];
+                break;
+            }
+            seen++;
+        }
+        if( next == NULL )
+            break;
+
+        if( lookup->dht->parameters->proximityRouting )
+            next = lookupFastestInBand( lookup, i, seen );
+
+        switch( lookupSend( lookup, next ) )
+        {
+            case 0:
+                break;
+            case 1:
+                next->state = LOOKUP_CANDIDATE_DEFERRED;
+                lookupDefer( lookup, next->rto );
+                break;
+            default:
+                next->state = LOOKUP_CANDIDATE_FAILED;
+                break;
+        }
+    }
+
+    if( lookupIsComplete( lookup ) )
+        lookupFinish( lookup );
+}
+
+static void
+lookupRetryCB( kc_wheelTimer * timer, void * ref )
+{
+    kc_dhtLookup * lookup = ref;
+    kc_dhtLookupCallback notify = NULL;
+    int i;
+
+    pthread_mutex_lock( &lookup->lock );
+    lookup->retryPending = 0;
+    if( !lookup->done )
+    {
+        for( i = 0; i < lookup->count; i++ )
+        {
+            if( lookup->candidates[i].state == LOOKUP_CANDIDATE_DEFERRED )
+                lookup->candidates[i].state = LOOKUP_CANDIDATE_NEW;
+        }
+        lookupAdvance( lookup );
+    }
+
+    if( lookup->done && !lookup->notified )
+    {
+        lookup->notified = 1;
+        notify = lookup->callback;
+    }
+    pthread_mutex_unlock( &lookup->lock );
+
+    if( notify != NULL )
+        notify( lookup->dht, lookup, lookup->ref );
+
+    lookupRelease( lookup );
+}
+
+int
+lookupSessionCallback( const kc_dht * dht, kc_session * session, const kc_message * msg )
+{
+    kc_dhtLookup * lookup = kc_sessionGetRef( session );
+    kc_dhtLookupCallback notify = NULL;
+
+    if( lookup == NULL )
+        return 1;
+
+    pthread_mutex_lock( &lookup->lock );
+    lookup->inFlight--;
+
+    dhtLookupCandidate * candidate = lookupCandidateForContact( lookup, kc_sessionGetContact( session ) );
+    if( !lookup->done && candidate != NULL && candidate->state == LOOKUP_CANDIDATE_WAITING )
+    {
+        if( msg == NULL )
+        {
+            dhtRttForHash( dht, &candidate->hash, -1 );
+            candidate->state = ( candidate->tries < LOOKUP_MAX_TRIES ? LOOKUP_CANDIDATE_NEW : LOOKUP_CANDIDATE_FAILED );
+        }
+        else
+        {
+            /* After a retransmission, we can't tell which request this answers */
+            if( candidate->tries == 1 )
+            {
+                long rtt = kc_sessionGetElapsed( session );
+                dhtRttForHash( dht, &candidate->hash, rtt );
+                dhtOfferNode( lookup->dht, candidate->contact, &candidate->hash, rtt );
+            }
+            candidate->state = LOOKUP_CANDIDATE_RESPONDED;
+            if( candidate->hop > lookup->hops )
+                lookup->hops = candidate->hop;
+
+            /* Let the protocol feed us with the nodes or value in this reply.
+             * The candidate may move as nodes get inserted, so don't use it past here */
+            lookup->replyHop = candidate->hop;
+            if( dht->parameters->callbacks.replyCallback != NULL )
+                dht->parameters->callbacks.replyCallback( dht, msg, lookup );
+        }
+        lookupAdvance( lookup );
+    }
+    else if( !lookup->done )
+    {
+        lookupAdvance( lookup );
+    }
+
+    /* Grab the callback while locked, kc_dhtLookupFree() may clear it */
+    if( lookup->done && !lookup->notified )
+    {
+        lookup->notified = 1;
+        notify = lookup->callback;
+    }
+    pthread_mutex_unlock( &lookup->lock );
+
+    if( notify != NULL )
+        notify( lookup->dht, lookup, lookup->ref );
+
+    lookupRelease( lookup );
+    return 1;
+}
+
+kc_dhtLookup *
+kc_dhtLookupStart( kc_dht * dht, const kc_hash * target, int findValue, kc_dhtLookupCallback callback, void * ref )
+{
+    assert( dht != NULL );
+    assert( target != NULL );
+
+    int k = dht->parameters->bucketSize;
+
+    kc_dhtLookup * self = calloc( 1, sizeof(kc_dhtLookup) );
+    if( self == NULL )
+    {
+        kc_logAlert( "Failed allocating lookup" );
+        return NULL;
+    }
+
+    self->capacity = LOOKUP_SHORTLIST_FACTOR * k;
+    self->candidates = calloc( self->capacity, sizeof(dhtLookupCandidate) );
+    if( self->candidates == NULL )
+    {
+        kc_logAlert( "Failed allocating lookup shortlist" );
+        free( self );
+        return NULL;
+    }
+
+    self->dht = dht;
+    kc_hashMove( &self->target, target );
+    self->findValue = findValue;
+    self->wanted = k;
+    self->callback = callback;
+    self->ref = ref;
+    self->refCount = 1;
+    kc_wheelTimerInit( &self->retryTimer, lookupRetryCB, self );
+    pthread_mutex_init( &self->lock, NULL );
+    pthread_cond_init( &self->cond, NULL );
+    gettimeofday( &self->startTime, NULL );
+
+    /* Seed the shortlist from our routing table */
+    kc_dhtNode * nodes[k];
+    int count = kc_dhtGetClosestNodes( dht, target, nodes, k );
+    int i;
+
+    pthread_mutex_lock( &self->lock );
+    self->replyHop = 0;
+    for( i = 0; i < count; i++ )
+        kc_dhtLookupAddNode( self, nodes[i]->contact, &nodes[i]->hash );
+    kc_dhtFreeNodes( nodes, count );
+
+    kc_logVerbose( "Starting %s lookup for %s from %d nodes", ( findValue ? "value" : "node" ), hashtoa( target ), self->count );
+    lookupAdvance( self );
+
+    int notify = 0;
+    if( self->done && !self->notified )
+    {
+        self->notified = 1;
+        notify = ( callback != NULL );
+    }
+    pthread_mutex_unlock( &self->lock );
+
+    if( notify )
+        callback( dht, self, ref );
+
+    return self;
+}
+
+int
+kc_dhtLookupWait( kc_dhtLookup * lookup, unsigned long int timeout )
+{
+    int status = 0;
+
+    pthread_mutex_lock( &lookup->lock );
+    while( !lookup->done && status == 0 )
+    {
+        if( timeout == 0 )
+            pthread_cond_wait( &lookup->cond, &lookup->lock );
+        else
+            status = pthread_cond_incrtimedwait( &lookup->cond, &lookup->lock, timeout );
+    }
+    status = !lookup->done;
+    pthread_mutex_unlock( &lookup->lock );
+    return status;
+}
+
+int
+kc_dhtLookupIsDone( kc_dhtLookup * lookup )
+{
+    int done;
+
+    pthread_mutex_lock( &lookup->lock );
+    done = lookup->done;
+    pthread_mutex_unlock( &lookup->lock );
+    return done;
+}
+
+void
+kc_dhtLookupFree( kc_dhtLookup * lookup )
+{
+    assert( lookup != NULL );
+
+    int retried = 0;
+
+    /* Cancel it, running sessions keep it alive until they end. A retry already
+     * running can't be cancelled anymore, it releases the lookup itself */
+    pthread_mutex_lock( &lookup->lock );
+    lookup->callback = NULL;
+    lookupFinish( lookup );
+    if( lookup->retryPending && kc_wheelCancel( lookup->dht->wheel, &lookup->retryTimer ) )
+    {
+        lookup->retryPending = 0;
+        retried = 1;
+    }
+    pthread_mutex_unlock( &lookup->lock );
+
+    if( retried )
+        lookupRelease( lookup );
+    lookupRelease( lookup );
+}
+
+const kc_hash *
+kc_dhtLookupGetTarget( const kc_dhtLookup * lookup )
+{
+    return &lookup->target;
+}
+
+void *
+kc_dhtLookupGetValue( kc_dhtLookup * lookup )
+{
+    void * value;
+
+    pthread_mutex_lock( &lookup->lock );
+    value = lookup->value;
+    pthread_mutex_unlock( &lookup->lock );
+    return value;
+}
+
+int
+kc_dhtLookupGetNodes( kc_dhtLookup * lookup, const kc_contact ** contacts, const kc_hash ** hashes, int count )
+{
+    int found = 0;
+    int i;
+
+    pthread_mutex_lock( &lookup->lock );
+    for( i = 0; i < lookup->count && found < count; i++ )
+    {
+        if( lookup->candidates[i].state != LOOKUP_CANDIDATE_RESPONDED )
+            continue;
+        if( contacts != NULL )
+            contacts[found] = lookup->candidates[i].contact;
+        if( hashes != NULL )
+            hashes[found] = &lookup->candidates[i].hash;
+        found++;
+    }
+    pthread_mutex_unlock( &lookup->lock );
+    return found;
+}
+
+int
+kc_dhtLookupGetHops( const kc_dhtLookup * lookup )
+{
+    return lookup->hops;
+}
+
+long
+kc_dhtLookupGetLatency( const kc_dhtLookup * lookup )
+{
+    struct timeval now;
+    const struct timeval * end = &lookup->endTime;
+
+    if( !lookup->done )
+    {
+        gettimeofday( &now, NULL );
+        end = &now;
+    }
+    return ( end->tv_sec - lookup->startTime.tv_sec ) * 1000 + ( end->tv_usec - lookup->startTime.tv_usec ) / 1000;
+}
+
+#pragma mark Protocol side
+
+int
+kc_dhtLookupAddNode( kc_dhtLookup * lookup, const kc_contact * contact, const kc_hash * hash )
+{
+    int i;
+
+    if( kc_hashCmp( hash, &lookup->dht->hash ) == 0 )
+        return 1;
+
+    /* Find its place, bailing out on duplicates */
+    for( i = 0; i < lookup->count; i++ )
+    {
+        int cmp = kc_hashDistanceCmp( &lookup->target, hash, &lookup->candidates[i].hash );
+        if( cmp == 0 )
+            return 1;
+        if( cmp < 0 )
+            break;
+    }
+    if( lookupCandidateForContact( lookup, contact ) != NULL )
+        return 1;
+
+    if( lookup->count == lookup->capacity )
+    {
+        /* Make room by dropping the farthest candidate nobody is waiting on */
+        int drop;
+        for( drop = lookup->count - 1; drop >= i; drop-- )
+        {
+            if( lookup->candidates[drop].state != LOOKUP_CANDIDATE_WAITING )
+                break;
+        }
+        if( drop < i )
+            return 1;
+
+        kc_contactFree( lookup->candidates[drop].contact );
+        memmove( &lookup->candidates[drop], &lookup->candidates[drop + 1],
+                 ( lookup->count - drop - 1 ) * sizeof(dhtLookupCandidate) );
+        lookup->count--;
+    }
+
+    kc_contact * contactCopy = kc_contactDup( contact );
+    if( contactCopy == NULL )
+        return -1;
+
+    memmove( &lookup->candidates[i + 1], &lookup->candidates[i],
+             ( lookup->count - i ) * sizeof(dhtLookupCandidate) );
+    kc_hashMove( &lookup->candidates[i].hash, hash );
+    lookup->candidates[i].contact = contactCopy;
+    lookup->candidates[i].state = LOOKUP_CANDIDATE_NEW;
+    lookup->candidates[i].hop = lookup->replyHop + 1;
+    lookup->candidates[i].tries = 0;
+    lookup->candidates[i].rto = dhtRtoForHash( lookup->dht, hash );
+    lookup->count++;
+    return 0;
+}
+
+void
+kc_dhtLookupSetValue( kc_dhtLookup * lookup, void * value )
+{
+    lookup->value = value;
+    lookup->hops = lookup->replyHop;
+}
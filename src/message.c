@@ -21,14 +21,87 @@ struct kc_message {
     int                 size;
     char              * data;
     
+    /* Ownership of the above buffer */
+    int                 refCount;
+    kc_messageReleaseCallback release;  /**< Called instead of free()ing data, NULL for owned data */
+    void              * releaseRef;
+    int                 isView;         /**< The data isn't ours to realloc() */
+    
+    /* The hash this message is about (lookup target, key), if hasHash */
+    kc_hash             hash;
+    int                 hasHash;
+    
     /* Protocol-specific stuff */
     void              * protocolStuff;
+    
+    struct kc_message * nextFree;   /**< Link in the recycled messages list */
 };
 
+#define MESSAGE_CACHE_SIZE  64      /* Freed messages kept around for reuse */
+
+/* Recycled message structs, so the steady-state message flow doesn't hit malloc() */
+static kc_message     * freeMessages = NULL;
+static int              freeMessageCount = 0;
+static pthread_mutex_t  freeMessagesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static kc_message *
+messageAlloc( void )
+{
+    kc_message * self;
+    
+    pthread_mutex_lock( &freeMessagesLock );
+    self = freeMessages;
+    if( self != NULL )
+    {
+        freeMessages = self->nextFree;
+        freeMessageCount--;
+    }
+    pthread_mutex_unlock( &freeMessagesLock );
+    
+    if( self == NULL )
+        self = malloc( sizeof(kc_message) );
+    if( self == NULL )
+        return NULL;
+    
+    memset( self, 0, sizeof(kc_message) );
+    self->refCount = 1;
+    return self;
+}
+
+static void
+messageRecycle( kc_message * message )
+{
+    pthread_mutex_lock( &freeMessagesLock );
+    if( freeMessageCount < MESSAGE_CACHE_SIZE )
+    {
+        message->nextFree = freeMessages;
+        freeMessages = message;
+        freeMessageCount++;
+        message = NULL;
+    }
+    pthread_mutex_unlock( &freeMessagesLock );
+    
+    free( message );
+}
+
+static void
+messageReleaseData( kc_message * message )
+{
+    if( !message->isView )
+        free( message->data );
+    else if( message->release != NULL )
+        message->release( message->releaseRef );
+    
+    message->data = NULL;
+    message->isView = 0;
+    message->release = NULL;
+    message->releaseRef = NULL;
+}
+
 kc_message *
 kc_messageInit( kc_contact * contact, kc_messageType type, size_t length, char* data )
 {
-    kc_message * self = malloc( sizeof(kc_message) );
+    kc_message * self = messageAlloc();
     if( !self )
         return NULL;
     self->contact = contact;
@@ -36,15 +109,48 @@ kc_messageInit( kc_contact * contact, kc_messageType type, size_t length, char*
     self->size = length;
     if( data != NULL )
     {
-        memcpy( self->data, data, length);
+        self->data = malloc( length );
+        if( self->data != NULL )
+            memcpy( self->data, data, length );
     }
     else
     {
-        self->data = calloc( length, sizeof(char*) );
+        self->data = calloc( length, sizeof(char) );
     }
+    if( self->data == NULL && length != 0 )
+    {
+        messageRecycle( self );
+        return NULL;
+    }
+    return self;
+}
+
+kc_message *
+kc_messageInitView( kc_contact * contact, kc_messageType type, size_t length, char * data,
+                    kc_messageReleaseCallback release, void * ref )
+{
+    kc_message * self = messageAlloc();
+    if( !self )
+        return NULL;
+    self->contact = contact;
+    self->type = type;
+    self->size = length;
+    self->data = data;
+    self->isView = 1;
+    self->release = release;
+    self->releaseRef = ref;
     return self;
 }
 
+kc_message *
+kc_messageRetain( kc_message * message )
+{
+    assert( message != NULL );
+    assert( message->refCount > 0 );
+    __sync_fetch_and_add( &message->refCount, 1 );
+    return message;
+}
+
 kc_message *
 kc_messageInitFromEvBuffer( kc_contact * contact, kc_messageType type, struct evbuffer * buffer )
 {
@@ -58,8 +164,12 @@ void
 kc_messageFree( kc_message * message )
 {
     assert( message != NULL );
-    free( message->data );
-    free( message );
+    assert( message->refCount > 0 );
+    if( __sync_sub_and_fetch( &message->refCount, 1 ) != 0 )
+        return;
+    
+    messageReleaseData( message );
+    messageRecycle( message );
 }
 
 const kc_contact *
@@ -113,12 +223,29 @@ kc_messageSetData( kc_message * message, void * data, size_t size )
     if( data == NULL )
     {
         assert( size != 0 );
-        free( message->data );
-        message->data = NULL;
+        messageReleaseData( message );
         message->size = 0;
         return 0;
     }
     
+    if( message->isView )
+    {
+        /* Views can't be resized, switch to our own buffer.
+         * data may point into the view, so copy it before releasing the view */
+        void * copy = malloc( size );
+        if( copy == NULL )
+        {
+            kc_logAlert( "Failed allocating message buffer" );
+            return -1;
+        }
+        memcpy( copy, data, size );
+
+        messageReleaseData( message );
+        message->data = copy;
+        message->size = size;
+        return 0;
+    }
+
     void * tmp = realloc( message->data, size );
     if( tmp == NULL )
     {
@@ -132,6 +259,22 @@ kc_messageSetData( kc_message * message, void * data, size_t size )
     return 0;
 }
 
+const kc_hash *
+kc_messageGetHash( const kc_message * message )
+{
+    assert( message != NULL );
+    return ( message->hasHash ? &message->hash : NULL );
+}
+
+void
+kc_messageSetHash( kc_message * message, const kc_hash * hash )
+{
+    assert( message != NULL );
+    message->hasHash = ( hash != NULL );
+    if( hash != NULL )
+        kc_hashMove( &message->hash, hash );
+}
+
 int
 kc_messageWriteToBufferEvent( kc_message * message, struct bufferevent * bufevent )
 {
@@ -31,12 +31,46 @@ typedef enum {
     DHT_RPC_PROTOCOL_SPECIFIC   /* Used for extended (aka non-Kademlia) messages */
 } kc_messageType;
 
+/**
+ * The callback prototype used to release the data of a message view.
+ *
+ * @param ref The ref passed to kc_messageInitView()
+ */
+typedef void (*kc_messageReleaseCallback)( void * ref );
+
+/**
+ * Creates a message holding a copy of data, or length zeroed bytes if data is NULL.
+ */
 kc_message *
 kc_messageInit( kc_contact * contact, kc_messageType type, size_t length, char* data );
 
+/**
+ * Creates a message pointing to data without copying it.
+ *
+ * When the last reference to the message goes away, release( ref ) is called instead of
+ * free()ing the data. kc_poolRelease() is a suitable release callback for pooled buffers.
+ *
+ * @param release The release callback, or NULL if data outlives the message
+ */
+kc_message *
+kc_messageInitView( kc_contact * contact, kc_messageType type, size_t length, char * data,
+                    kc_messageReleaseCallback release, void * ref );
+
+/**
+ * Adds a reference to a message, which then needs one more kc_messageFree().
+ * The message contact isn't retained, kc_contactDup() it if you need it later.
+ *
+ * @return The message
+ */
+kc_message *
+kc_messageRetain( kc_message * message );
+
 kc_message *
 kc_messageInitFromEvBuffer( kc_contact * contact, kc_messageType type, struct evbuffer * buffer );
 
+/**
+ * Drops a reference to a message, freeing it when there is none left.
+ */
 void
 kc_messageFree( kc_message * message );
 
@@ -61,6 +95,17 @@ kc_messageSetType( kc_message * message, kc_messageType type );
 int
 kc_messageSetData( kc_message * message, void * data, size_t size );
 
+/**
+ * Gets the hash a message is about, like the target of a FIND_NODE.
+ *
+ * @return The hash, or NULL if the message has none
+ */
+const kc_hash *
+kc_messageGetHash( const kc_message * message );
+
+void
+kc_messageSetHash( kc_message * message, const kc_hash * hash );
+
 int
 kc_messageWriteToBufferEvent( kc_message * message, struct bufferevent * bufevent );
 
@@ -30,58 +30,17 @@ of the following e-mail addresses (replace "(at)" with "@"):
 
 #ifdef __WIN32__
 #define NET_LOG_ERROR( str ) kc_logAlert( str ": %d (%s)", WSAGetLastError(), WSAGetLastErrorMessageOccurred() )
+/* The socket can't take more datagrams for now, as opposed to an error with one of them */
+#define NET_SEND_WOULD_BLOCK() ( WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAENOBUFS )
 #else
 #define NET_LOG_ERROR( str ) kc_logAlert( str ": %d (%s)", errno, strerror(errno) )
+#define NET_SEND_WOULD_BLOCK() ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS )
 #endif
 
-struct sockaddr *
-contactToSockAddr( kc_contact * contact )
-{
-    int type = kc_contactGetType( contact );
-    struct sockaddr * sockaddr = NULL;
-    
-    in_port_t port = kc_contactGetPort( contact );
-    
-    const void * addr = kc_contactGetAddr( contact );
-    
-    switch( type )
-    {
-        case AF_INET: {
-            size_t size = sizeof(struct sockaddr_in);
-            void *t = malloc( size );
-            sockaddr = (struct sockaddr*)t;
-            struct sockaddr_in * addr_in = (struct sockaddr_in*)sockaddr;
-            
-            memset( addr_in, 0, sizeof(struct sockaddr_in) );
-            
-            //addr_in->sin_len = sizeof(struct sockaddr_in);
-            addr_in->sin_family = AF_INET;
-            addr_in->sin_port = htons( port );
-            
-            memcpy( &addr_in->sin_addr, addr, sizeof(struct in_addr) );
-        }
-            return sockaddr;
-            
-        case AF_INET6: {
-            sockaddr = malloc( sizeof(struct sockaddr_in6) );
-            struct sockaddr_in6 * addr_in6 = (struct sockaddr_in6*)sockaddr;
-            
-            memset( addr_in6, 0, sizeof(struct sockaddr_in6) );
-            
-            //addr_in6->sin6_len = sizeof(struct sockaddr_in6);
-            addr_in6->sin6_family = AF_INET6;
-            addr_in6->sin6_port = htons( port );
-            
-            memcpy( &addr_in6->sin6_addr, addr, sizeof(struct in6_addr) );
-        }
-            return sockaddr;
-            
-        default:
-            break;
-    };
-    kc_logAlert( "Unsupported address size: %d", sizeof(addr) );
-    return NULL;
-}
+/* recvmmsg()/sendmmsg() are Linux-only, everyone else gets one syscall per datagram */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define NET_HAVE_MMSG
+#endif
 
 int
 kc_netOpen( int type, int domain )
@@ -118,15 +77,14 @@ kc_netBind( int fd, kc_contact * contact )
 {
     kc_logVerbose( "Binding socket %d to %s", fd, kc_contactPrint( contact ) );
     
-    struct sockaddr * local = contactToSockAddr( contact );
+    socklen_t length;
+    const struct sockaddr * local = kc_contactGetSockAddr( contact, &length );
     
-    if( bind( fd, local, sizeof(*local) ) < 0)
+    if( bind( fd, local, length ) < 0)
     {
         NET_LOG_ERROR( "Failed binding socket" );
-        free( local );
         return -1;
     }
-    free( local );
     return fd;
 }
 
@@ -136,15 +94,14 @@ kc_netConnect( int fd, kc_contact * contact )
 {
     kc_logVerbose( "Connecting socket %d to %s", fd, kc_contactPrint( contact ) );
     
-    struct sockaddr * local = contactToSockAddr( contact );
+    socklen_t length;
+    const struct sockaddr * remote = kc_contactGetSockAddr( contact, &length );
     
-    if( connect( fd, local, sizeof(*local) ) < 0)
+    if( connect( fd, remote, length ) < 0)
     {
         NET_LOG_ERROR( "Failed connecting socket" );
-        free( local );
         return -1;
     }
-    free( local );
     return fd;
 }
 
@@ -154,6 +111,321 @@ kc_netSetNonBlockingSocket( int socket )
     return evutil_make_socket_nonblocking( socket );
 }
 
+int
+kc_netSendTo( int fd, const kc_contact * contact, const void * data, size_t size )
+{
+    socklen_t length;
+    const struct sockaddr * remote = kc_contactGetSockAddr( contact, &length );
+    
+    if( sendto( fd, data, size, 0, remote, length ) < 0 )
+    {
+        NET_LOG_ERROR( "Failed sending datagram" );
+        return -1;
+    }
+    return 0;
+}
+
+int
+kc_netRecvFrom( int fd, void * buffer, size_t size, kc_contact ** contact )
+{
+    struct sockaddr_storage remote;
+    socklen_t length = sizeof(remote);
+    ssize_t count;
+    
+    count = recvfrom( fd, buffer, size, 0, (struct sockaddr*)&remote, &length );
+    if( count < 0 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            NET_LOG_ERROR( "Failed recieving datagram" );
+        return -1;
+    }
+    
+    *contact = kc_contactInitFromSockAddr( (struct sockaddr*)&remote, length );
+    if( *contact == NULL )
+    {
+        kc_logAlert( "Failed creating contact for incoming datagram" );
+        return -1;
+    }
+    return count;
+}
+
+#pragma mark Datagram batches
+
+struct _kc_netBatch {
+    int                         capacity;
+    int                         count;
+    size_t                      bufferSize;
+    
+    char                      * buffers;    /* capacity slots of bufferSize bytes, allocated once */
+    char                     ** slots;      /* The buffer used by each slot, ours unless attached */
+    size_t                    * sizes;
+    struct sockaddr_storage   * addrs;
+    socklen_t                 * addrLens;
+#ifdef NET_HAVE_MMSG
+    struct iovec              * iovecs;
+    struct mmsghdr            * headers;
+#endif
+};
+
+kc_netBatch *
+kc_netBatchInit( int capacity, size_t bufferSize )
+{
+    assert( capacity > 0 );
+    assert( bufferSize > 0 );
+    
+    kc_netBatch * self = calloc( 1, sizeof(kc_netBatch) );
+    if( self == NULL )
+    {
+        kc_logAlert( "Failed allocating datagram batch" );
+        return NULL;
+    }
+    
+    self->capacity = capacity;
+    self->bufferSize = bufferSize;
+    self->buffers = malloc( capacity * bufferSize );
+    self->slots = calloc( capacity, sizeof(char*) );
+    self->sizes = calloc( capacity, sizeof(size_t) );
+    self->addrs = calloc( capacity, sizeof(struct sockaddr_storage) );
+    self->addrLens = calloc( capacity, sizeof(socklen_t) );
+#ifdef NET_HAVE_MMSG
+    self->iovecs = calloc( capacity, sizeof(struct iovec) );
+    self->headers = calloc( capacity, sizeof(struct mmsghdr) );
+    if( self->iovecs == NULL || self->headers == NULL )
+    {
+        kc_logAlert( "Failed allocating datagram batch headers" );
+        kc_netBatchFree( self );
+        return NULL;
+    }
+#endif
+    if( self->buffers == NULL || self->slots == NULL || self->sizes == NULL ||
+        self->addrs == NULL || self->addrLens == NULL )
+    {
+        kc_logAlert( "Failed allocating datagram batch buffers" );
+        kc_netBatchFree( self );
+        return NULL;
+    }
+    
+    int i;
+    for( i = 0; i < capacity; i++ )
+        self->slots[i] = self->buffers + i * bufferSize;
+    return self;
+}
+
+void
+kc_netBatchFree( kc_netBatch * batch )
+{
+    if( batch == NULL )
+        return;
+    
+    free( batch->buffers );
+    free( batch->slots );
+    free( batch->sizes );
+    free( batch->addrs );
+    free( batch->addrLens );
+#ifdef NET_HAVE_MMSG
+    free( batch->iovecs );
+    free( batch->headers );
+#endif
+    free( batch );
+}
+
+int
+kc_netBatchCount( const kc_netBatch * batch )
+{
+    return batch->count;
+}
+
+int
+kc_netBatchCapacity( const kc_netBatch * batch )
+{
+    return batch->capacity;
+}
+
+const void *
+kc_netBatchData( const kc_netBatch * batch, int i, size_t * size )
+{
+    assert( i >= 0 && i < batch->count );
+    
+    if( size != NULL )
+        *size = batch->sizes[i];
+    return batch->slots[i];
+}
+
+void
+kc_netBatchAttach( kc_netBatch * batch, int i, void * buffer )
+{
+    assert( i >= 0 && i < batch->capacity );
+    
+    batch->slots[i] = ( buffer != NULL ? buffer : batch->buffers + i * batch->bufferSize );
+}
+
+int
+kc_netBatchContact( const kc_netBatch * batch, int i, kc_contact * contact )
+{
+    assert( i >= 0 && i < batch->count );
+    
+    return kc_contactSetSockAddr( contact, (struct sockaddr*)&batch->addrs[i], batch->addrLens[i] );
+}
+
+#ifdef NET_HAVE_MMSG
+static void
+batchPrepareHeaders( kc_netBatch * batch, int count, int forReading )
+{
+    int i;
+    for( i = 0; i < count; i++ )
+    {
+        batch->iovecs[i].iov_base = batch->slots[i];
+        batch->iovecs[i].iov_len = ( forReading ? batch->bufferSize : batch->sizes[i] );
+        
+        memset( &batch->headers[i], 0, sizeof(struct mmsghdr) );
+        batch->headers[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->headers[i].msg_hdr.msg_namelen = ( forReading ? sizeof(struct sockaddr_storage) : batch->addrLens[i] );
+        batch->headers[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->headers[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+#endif
+
+int
+kc_netBatchRecv( int fd, kc_netBatch * batch )
+{
+    int i;
+    
+    batch->count = 0;
+#ifdef NET_HAVE_MMSG
+    batchPrepareHeaders( batch, batch->capacity, 1 );
+    
+    int count = recvmmsg( fd, batch->headers, batch->capacity, MSG_DONTWAIT, NULL );
+    if( count < 0 )
+    {
+        if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            NET_LOG_ERROR( "Failed recieving datagrams" );
+        return -1;
+    }
+    
+    for( i = 0; i < count; i++ )
+    {
+        /* Oversized datagrams are dropped, not handed over truncated */
+        if( batch->headers[i].msg_hdr.msg_flags & MSG_TRUNC )
+            batch->sizes[i] = 0;
+        else
+            batch->sizes[i] = batch->headers[i].msg_len;
+        batch->addrLens[i] = batch->headers[i].msg_hdr.msg_namelen;
+    }
+    batch->count = count;
+#else
+    for( i = 0; i < batch->capacity; i++ )
+    {
+        batch->addrLens[i] = sizeof(struct sockaddr_storage);
+        ssize_t size = recvfrom( fd, batch->slots[i], batch->bufferSize, 0,
+                                 (struct sockaddr*)&batch->addrs[i], &batch->addrLens[i] );
+        if( size < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                NET_LOG_ERROR( "Failed recieving datagram" );
+            break;
+        }
+        batch->sizes[i] = size;
+    }
+    batch->count = i;
+    if( i == 0 )
+        return -1;
+#endif
+    return batch->count;
+}
+
+int
+kc_netBatchAdd( kc_netBatch * batch, const kc_contact * contact, const void * data, size_t size )
+{
+    if( batch->count == batch->capacity )
+        return 1;
+    
+    if( size > batch->bufferSize )
+        return -1;
+    
+    int i = batch->count;
+    const struct sockaddr * remote = kc_contactGetSockAddr( contact, &batch->addrLens[i] );
+    memcpy( &batch->addrs[i], remote, batch->addrLens[i] );
+    
+    memcpy( batch->slots[i], data, size );
+    batch->sizes[i] = size;
+    batch->count++;
+    return 0;
+}
+
+/* Moves the datagrams from first on to the start of the batch, swapping
+ * the slots so that every buffer stays in use exactly once */
+static void
+batchKeepFrom( kc_netBatch * batch, int first )
+{
+    int i;
+    
+    for( i = 0; first + i < batch->count; i++ )
+    {
+        char * slot = batch->slots[i];
+        batch->slots[i] = batch->slots[first + i];
+        batch->slots[first + i] = slot;
+        batch->sizes[i] = batch->sizes[first + i];
+        memmove( &batch->addrs[i], &batch->addrs[first + i], batch->addrLens[first + i] );
+        batch->addrLens[i] = batch->addrLens[first + i];
+    }
+    batch->count = i;
+}
+
+int
+kc_netBatchSend( int fd, kc_netBatch * batch )
+{
+    int sent = 0;
+    int dropped = 0;
+    int next = 0;
+    
+    if( batch->count == 0 )
+        return 0;
+    
+#ifdef NET_HAVE_MMSG
+    batchPrepareHeaders( batch, batch->count, 0 );
+    
+    while( next < batch->count )
+    {
+        int status = sendmmsg( fd, batch->headers + next, batch->count - next, 0 );
+        if( status < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( NET_SEND_WOULD_BLOCK() )
+                break;
+            /* Only the first remaining datagram failed, skip it like sendto() below does */
+            NET_LOG_ERROR( "Failed sending datagram" );
+            next++;
+            dropped++;
+            continue;
+        }
+        next += status;
+        sent += status;
+    }
+#else
+    for( ; next < batch->count; next++ )
+    {
+        if( sendto( fd, batch->slots[next], batch->sizes[next], 0,
+                    (struct sockaddr*)&batch->addrs[next], batch->addrLens[next] ) < 0 )
+        {
+            if( NET_SEND_WOULD_BLOCK() )
+                break;
+            NET_LOG_ERROR( "Failed sending datagram" );
+            dropped++;
+            continue;
+        }
+        sent++;
+    }
+#endif
+    if( dropped > 0 )
+        kc_logAlert( "Dropped %d of %d outgoing datagrams", dropped, batch->count );
+    
+    /* The socket is full, what's left waits for it to drain */
+    batchKeepFrom( batch, next );
+    return sent;
+}
+
 void
 kc_netClose( int socket )
 {
@@ -51,6 +51,104 @@ kc_netConnect( int fd, kc_contact * contact );
 int
 kc_netSetNonBlockingSocket( int socket );
 
+/**
+ * Sends a datagram to contact through an unconnected socket.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+kc_netSendTo( int fd, const kc_contact * contact, const void * data, size_t size );
+
+/**
+ * Reads a datagram from an unconnected socket.
+ *
+ * @param contact Set to a newly allocated contact for the sender, which you must kc_contactFree()
+ * @return The datagram size, or -1 on failure (check errno for EAGAIN on non-blocking sockets)
+ */
+int
+kc_netRecvFrom( int fd, void * buffer, size_t size, kc_contact ** contact );
+
+/**
+ * A set of preallocated datagram buffers, used to move several datagrams
+ * per syscall (with recvmmsg()/sendmmsg() where available).
+ *
+ * A batch is either filled by kc_netBatchRecv(), or with kc_netBatchAdd()
+ * then emptied by kc_netBatchSend(). It isn't thread-safe.
+ */
+typedef struct _kc_netBatch kc_netBatch;
+
+/**
+ * Creates a datagram batch.
+ *
+ * @param capacity The maximum number of datagrams per batch
+ * @param bufferSize The maximum size of a datagram, larger incoming datagrams are dropped
+ * @return A new batch, or NULL on failure
+ */
+kc_netBatch *
+kc_netBatchInit( int capacity, size_t bufferSize );
+
+void
+kc_netBatchFree( kc_netBatch * batch );
+
+int
+kc_netBatchCount( const kc_netBatch * batch );
+
+int
+kc_netBatchCapacity( const kc_netBatch * batch );
+
+/**
+ * Gets a datagram from the batch.
+ *
+ * @param size Set to the datagram size. Dropped datagrams have a size of 0 and should be skipped.
+ * @return A pointer to the datagram data, valid until the batch is reused
+ */
+const void *
+kc_netBatchData( const kc_netBatch * batch, int i, size_t * size );
+
+/**
+ * Makes a slot use a caller-supplied buffer, so datagrams are recieved in place.
+ *
+ * @param buffer A buffer of at least the batch bufferSize, or NULL to use the batch own buffer again
+ */
+void
+kc_netBatchAttach( kc_netBatch * batch, int i, void * buffer );
+
+/**
+ * Sets up a contact in place for the sender of a recieved datagram.
+ *
+ * @return 0 on success, -1 if the sender address isn't supported
+ */
+int
+kc_netBatchContact( const kc_netBatch * batch, int i, kc_contact * contact );
+
+/**
+ * Replaces the batch content with as many pending datagrams as possible.
+ *
+ * @return The number of datagrams read, or -1 if there was none (check errno for EAGAIN)
+ */
+int
+kc_netBatchRecv( int fd, kc_netBatch * batch );
+
+/**
+ * Copies a datagram into the batch for a later kc_netBatchSend().
+ *
+ * @return 0 on success, 1 if the batch is full, -1 if the datagram can't be batched
+ */
+int
+kc_netBatchAdd( kc_netBatch * batch, const kc_contact * contact, const void * data, size_t size );
+
+/**
+ * Sends the datagrams in the batch, until the socket can't take more.
+ *
+ * Datagrams the socket refuses on their own, like oversized ones, are dropped.
+ * When the socket is full (EAGAIN, ENOBUFS), the datagrams not sent yet stay
+ * in the batch, in order, for another call once the socket is writable.
+ *
+ * @return The number of datagrams sent, kc_netBatchCount() tells how many are left
+ */
+int
+kc_netBatchSend( int fd, kc_netBatch * batch );
+
 void
 kc_netClose( int socket );
 
@@ -35,7 +35,7 @@ ov_writePing( const kc_dht * dht, kc_message * message )
     msg->node.unused = 0;
     
     int status;
-    status = kc_messageSetData( message, msg, sizeof(msg) );
+    status = kc_messageSetData( message, msg, sizeof(struct ov_connect) );
     
     free( msg );
     return status;
@@ -51,16 +51,20 @@ ov_writePingReply( const kc_dht * dht, kc_message * message )
     msg->messageType = OVERNET_CONNECT_REPLY;
     
     /* We try to get nodes out of our DHT */
-    int nodeCount;
+    int nodeCount = 0;
     kc_dhtNode ** nodes;
     
     nodes = kc_dhtGetNodes( dht, NULL, &nodeCount );
 
     int i; /* Node count inside our msg->nodes array, index of our last (empty) node */
-    kc_dhtNode * currentNode; /* Pointer to our current node from the DHT */
+    int n;
     
-    for( currentNode = *nodes, i = 0; currentNode != NULL; currentNode++ )
+    /* Room for ourselves too */
+    msg = realloc( msg, sizeof(struct ov_connect_reply) + sizeof(struct ov_node) * ( nodeCount + 1 ) );
+    
+    for( n = 0, i = 0; n < nodeCount; n++ )
     {
+        kc_dhtNode * currentNode = nodes[n]; /* Our copy of the current node from the DHT */
         kc_contact * contact = kc_dhtNodeGetContact( currentNode );
         if( kc_contactGetType( contact ) != AF_INET )
         {
@@ -68,9 +72,6 @@ ov_writePingReply( const kc_dht * dht, kc_message * message )
             continue;
         }
         
-        /* - 4 is for nodes pointer in ov_connect_reply */
-        msg = realloc( msg, sizeof(struct ov_connect_reply) + sizeof(struct ov_node) * i );
-        
         puthashn( msg->nodes[i].hash, kc_dhtNodeGetHash( currentNode ) );
         memcpy( msg->nodes[i].ip, kc_contactGetAddr( contact ), sizeof(struct in_addr) );
         msg->nodes[i].port = kc_contactGetPort( contact );
@@ -80,9 +81,23 @@ ov_writePingReply( const kc_dht * dht, kc_message * message )
         i++;
     }
     
+    kc_dhtFreeNodes( nodes, nodeCount );
+    free( nodes );
+    
+    /* Overnet peers list themselves last, that's how the pinger learns our hash */
+    kc_contact * us = kc_dhtGetOurContact( dht, AF_INET );
+    if( us != NULL && kc_hashLength( kc_dhtGetOurHash( dht ) ) == 128 )
+    {
+        puthashn( msg->nodes[i].hash, kc_dhtGetOurHash( dht ) );
+        memcpy( msg->nodes[i].ip, kc_contactGetAddr( us ), sizeof(struct in_addr) );
+        msg->nodes[i].port = kc_contactGetPort( us );
+        msg->nodes[i].unused = 0;
+        i++;
+    }
+    
     msg->nodeCount = i;
     int status;
-    size_t size = sizeof(struct ov_connect_reply) + 8 * sizeof(struct ov_node);
+    size_t size = sizeof(struct ov_connect_reply) + i * sizeof(struct ov_node);
     status = kc_messageSetData( message, msg, size );
     free( msg );
     return status;
@@ -94,6 +109,42 @@ ov_writePublicize( const kc_dht * dht, size_t * size )
     return NULL;
 }
 
+/* Sets the hash of the message sender from an Overnet peer */
+static void
+ov_setSenderHash( kc_message * msg, const struct ov_node * node )
+{
+    kc_hash hash;
+    const char * p = node->hash;
+    
+    kc_hashClear( &hash, 128 );
+    gethashn( &hash, &p );
+    kc_messageSetHash( msg, &hash );
+}
+
+/* Finds the sender among the peers of a connect reply : the one at its address,
+ * or else the last one if it has its port, as Overnet peers list themselves last
+ * with the address they think they have */
+static const struct ov_node *
+ov_findSender( kc_message * msg, const struct ov_connect_reply * reply, int nodeCount )
+{
+    const kc_contact * contact = kc_messageGetContact( msg );
+    int i;
+    
+    if( nodeCount == 0 || kc_contactGetType( contact ) != AF_INET )
+        return NULL;
+    
+    for( i = 0; i < nodeCount; i++ )
+    {
+        if( memcmp( reply->nodes[i].ip, kc_contactGetAddr( contact ), sizeof(struct in_addr) ) == 0 &&
+            reply->nodes[i].port == kc_contactGetPort( contact ) )
+            return &reply->nodes[i];
+    }
+    
+    if( reply->nodes[nodeCount - 1].port == kc_contactGetPort( contact ) )
+        return &reply->nodes[nodeCount - 1];
+    return NULL;
+}
+
 int
 ov_parseCallback( const kc_dht * dht, kc_message * msg )
 {
@@ -115,6 +166,9 @@ ov_parseCallback( const kc_dht * dht, kc_message * msg )
         case OVERNET_CONNECT:
             kc_logDebug( "parseCallback: got a OVERNET_CONNECT" );
             
+            if( kc_messageGetSize( msg ) >= sizeof(struct ov_connect) )
+                ov_setSenderHash( msg, &((struct ov_connect*)header)->node );
+            
             kc_messageSetType( msg, DHT_RPC_PING );
             return DHT_RPC_PING;
             break;
@@ -122,6 +176,18 @@ ov_parseCallback( const kc_dht * dht, kc_message * msg )
         case OVERNET_CONNECT_REPLY:
             kc_logDebug( "parseCallback: got a OVERNET_CONNECT_REPLY" );
             
+            if( kc_messageGetSize( msg ) >= sizeof(struct ov_connect_reply) )
+            {
+                struct ov_connect_reply * reply = (struct ov_connect_reply*)header;
+                int nodeCount = ( kc_messageGetSize( msg ) - sizeof(struct ov_connect_reply) ) / sizeof(struct ov_node);
+                if( reply->nodeCount >= 0 && reply->nodeCount < nodeCount )
+                    nodeCount = reply->nodeCount;
+                
+                const struct ov_node * sender = ov_findSender( msg, reply, nodeCount );
+                if( sender != NULL )
+                    ov_setSenderHash( msg, sender );
+            }
+            
             kc_messageSetType( msg, DHT_RPC_PING );
             return DHT_RPC_PING;
             
@@ -190,16 +256,16 @@ ov_readCallback( kc_dht * dht, const kc_message * msg )
                 struct in_addr addr;
                 in_port_t port;
                 
-                int byteCount = dht->parameters->hashSize / 8;
-                if( byteCount % 8 != 0 )
-                    byteCount++;
+                int byteCount = ( dht->parameters->hashSize + 7 ) / 8;
                 
-                const char * hashPtr = calloc( byteCount, sizeof(char) );
-                evbuffer_remove( buffer, (char*)hashPtr, byteCount );
+                char hashBuf[KADC_HASH_BYTES];
+                const char * hashPtr = hashBuf;
+                evbuffer_remove( buffer, hashBuf, byteCount );
                 
-                kc_hash    * hash = kc_hashInit( dht->parameters->hashSize );
+                kc_hash hash;
+                kc_hashClear( &hash, dht->parameters->hashSize );
                 
-                gethashn( hash, &hashPtr );
+                gethashn( &hash, &hashPtr );
                 evbuffer_remove( buffer, &addr, sizeof(struct in_addr) );
                 //                addr = getipn( &bp );
                 //                port = getushortle( &bp );
@@ -208,7 +274,7 @@ ov_readCallback( kc_dht * dht, const kc_message * msg )
                 //                type = *bp++;
                 
                 kc_contact * newContact = kc_contactInit( &addr, sizeof(struct in_addr), port );
-                type = kc_dhtAddNode( dht, newContact, hash );
+                type = kc_dhtAddNode( dht, newContact, &hash );
                 if( type == 0 )
                     kc_dhtCreateNode( dht, newContact );
                 
@@ -261,8 +327,8 @@ ov_writeCallback( const kc_dht * dht, kc_message * msg, kc_message * answer )
             }
                 break;
             default:
-                assert(0);
-                break;
+                /* Not supported yet, this fails the session */
+                return -1;
         }
     }
     else
@@ -271,9 +337,6 @@ ov_writeCallback( const kc_dht * dht, kc_message * msg, kc_message * answer )
         {
             case DHT_RPC_PING:
             {
-                kc_contact * contact = kc_contactDup( kc_messageGetContact( msg ) );
-                answer = kc_messageInit( contact, DHT_RPC_PING, 0, NULL );
-
                 return ov_writePingReply( dht, answer );
             } 
                 break;
@@ -294,6 +357,11 @@ kc_dhtParameters ov_parameters = {
     0,/*int republishDelay;*/
     
     0,/*int lookupParallelism;*/
+    0,/*int lookupTimeout;*/
+    0,/*int bootstrapWindow;*/
+    0,/*int proximityRouting;*/
+    0,/*int valueBudget;*/
+    NULL,/*const char * storePath;*/
     
     0,/*int maxQueuedMessages;*/
     0,/*int maxSessionCount;*/
@@ -302,6 +370,7 @@ kc_dhtParameters ov_parameters = {
     
     128,/*int hashSize;*/
     20,/*int bucketSize;*/
+    0,/*int relaxedDepth;*/
     {
         ov_parseCallback,
         ov_readCallback,
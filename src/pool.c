@@ -0,0 +1,176 @@
+/*
+ *  pool.c
+ *  KadC
+ *
+ */
+
+#include "pool.h"
+
+typedef struct poolHeader {
+    kc_pool           * pool;
+    struct poolHeader * next;       /* Next free buffer, when on the free list */
+    int                 refCount;
+    int                 pad;        /* Keeps the data below 8-byte aligned on 32-bit platforms */
+} poolHeader;
+
+struct _kc_pool {
+    char              * memory;     /* count slots of slotSize bytes */
+    size_t              slotSize;
+    size_t              bufferSize;
+    int                 count;
+    
+    poolHeader        * freeList;
+    int                 available;
+    int                 freed;      /* kc_poolFree() was called, the last buffer released frees the pool */
+    pthread_mutex_t     lock;
+};
+
+static inline poolHeader *
+poolHeaderForBuffer( void * buffer )
+{
+    return (poolHeader*)buffer - 1;
+}
+
+kc_pool *
+kc_poolInit( int count, size_t bufferSize )
+{
+    assert( count > 0 );
+    assert( bufferSize > 0 );
+    
+    kc_pool * self = malloc( sizeof(kc_pool) );
+    if( self == NULL )
+    {
+        kc_logAlert( "Failed allocating buffer pool" );
+        return NULL;
+    }
+    
+    /* Round slots up so every header stays aligned */
+    self->slotSize = ( sizeof(poolHeader) + bufferSize + 7 ) & ~(size_t)7;
+    self->bufferSize = bufferSize;
+    self->count = count;
+    self->memory = malloc( self->slotSize * count );
+    if( self->memory == NULL )
+    {
+        kc_logAlert( "Failed allocating %d pool buffers of %d bytes", count, bufferSize );
+        free( self );
+        return NULL;
+    }
+    
+    int i;
+    self->freeList = NULL;
+    for( i = count - 1; i >= 0; i-- )
+    {
+        poolHeader * header = (poolHeader*)( self->memory + i * self->slotSize );
+        header->pool = self;
+        header->refCount = 0;
+        header->next = self->freeList;
+        self->freeList = header;
+    }
+    self->available = count;
+    self->freed = 0;
+    
+    pthread_mutex_init( &self->lock, NULL );
+    
+    return self;
+}
+
+static void
+poolDestroy( kc_pool * pool )
+{
+    pthread_mutex_destroy( &pool->lock );
+    free( pool->memory );
+    free( pool );
+}
+
+void
+kc_poolFree( kc_pool * pool )
+{
+    int inUse;
+    
+    if( pool == NULL )
+        return;
+    
+    pthread_mutex_lock( &pool->lock );
+    pool->freed = 1;
+    inUse = pool->count - pool->available;
+    pthread_mutex_unlock( &pool->lock );
+    
+    if( inUse != 0 )
+    {
+        /* Messages may still be views of them, kc_poolRelease() frees us with the last one */
+        kc_logVerbose( "Buffer pool %p freed with %d buffers still in use, deferring", pool, inUse );
+        return;
+    }
+    poolDestroy( pool );
+}
+
+void *
+kc_poolGet( kc_pool * pool )
+{
+    poolHeader * header;
+    
+    pthread_mutex_lock( &pool->lock );
+    header = pool->freeList;
+    if( header != NULL )
+    {
+        pool->freeList = header->next;
+        pool->available--;
+    }
+    pthread_mutex_unlock( &pool->lock );
+    
+    if( header == NULL )
+        return NULL;
+    
+    header->next = NULL;
+    header->refCount = 1;
+    return header + 1;
+}
+
+void
+kc_poolRetain( void * buffer )
+{
+    poolHeader * header = poolHeaderForBuffer( buffer );
+    assert( header->refCount > 0 );
+    
+    __sync_fetch_and_add( &header->refCount, 1 );
+}
+
+void
+kc_poolRelease( void * buffer )
+{
+    poolHeader * header = poolHeaderForBuffer( buffer );
+    assert( header->refCount > 0 );
+    
+    if( __sync_sub_and_fetch( &header->refCount, 1 ) != 0 )
+        return;
+    
+    kc_pool * pool = header->pool;
+    int last;
+    
+    pthread_mutex_lock( &pool->lock );
+    header->next = pool->freeList;
+    pool->freeList = header;
+    pool->available++;
+    last = ( pool->freed && pool->available == pool->count );
+    pthread_mutex_unlock( &pool->lock );
+    
+    if( last )
+        poolDestroy( pool );
+}
+
+size_t
+kc_poolBufferSize( const kc_pool * pool )
+{
+    return pool->bufferSize;
+}
+
+int
+kc_poolAvailable( kc_pool * pool )
+{
+    int available;
+    
+    pthread_mutex_lock( &pool->lock );
+    available = pool->available;
+    pthread_mutex_unlock( &pool->lock );
+    return available;
+}
@@ -0,0 +1,68 @@
+/*
+ *  pool.h
+ *  KadC
+ *
+ */
+
+#ifndef __KADC_POOL_H__
+#define __KADC_POOL_H__
+
+/**
+ * A pool of fixed-size, reference-counted buffers.
+ *
+ * All buffers are allocated once at creation, so getting and releasing
+ * them never hits the allocator. Buffers are handled through their data
+ * pointer, which makes kc_poolRelease() usable as a release callback.
+ * Getting, retaining and releasing buffers is thread-safe.
+ */
+typedef struct _kc_pool kc_pool;
+
+/**
+ * Creates a buffer pool.
+ *
+ * @param count The number of buffers in the pool
+ * @param bufferSize The size of each buffer
+ * @return A new pool, or NULL on failure
+ */
+kc_pool *
+kc_poolInit( int count, size_t bufferSize );
+
+/**
+ * Frees a buffer pool.
+ *
+ * Buffers still in use stay valid: the pool is only freed once the last
+ * of them is released. No buffer may be got from it after this call.
+ */
+void
+kc_poolFree( kc_pool * pool );
+
+/**
+ * Gets a free buffer from the pool, with a reference count of 1.
+ *
+ * @return A pointer to the buffer data, or NULL if the pool is exhausted
+ */
+void *
+kc_poolGet( kc_pool * pool );
+
+/**
+ * Adds a reference to a pooled buffer.
+ */
+void
+kc_poolRetain( void * buffer );
+
+/**
+ * Removes a reference to a pooled buffer, returning it to its pool when there is none left.
+ */
+void
+kc_poolRelease( void * buffer );
+
+size_t
+kc_poolBufferSize( const kc_pool * pool );
+
+/**
+ * @return The number of buffers currently available
+ */
+int
+kc_poolAvailable( kc_pool * pool );
+
+#endif /* __KADC_POOL_H__ */
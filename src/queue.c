@@ -7,211 +7,309 @@
  *
  */
 
-/* Queues */
-typedef struct _qnode {
-	struct _qnode *next;
-	void *data;
-} kc_qnode;
+/* Queues are bounded multi-producer/multi-consumer rings, after Dmitry Vyukov's
+ design: each cell carries a sequence number telling producers and consumers
+ whether it is theirs to use, so the enqueue and dequeue fast paths only need
+ one compare-and-swap and never take a lock nor allocate.
+ The mutex/cond pair is only used to put consumers to sleep when the queue is empty. */
+
+#define QUEUE_CACHE_LINE 64
+
+typedef struct _qcell {
+    volatile size_t sequence;
+    void *data;
+} kc_qcell;
 
 /* The mutex/cond pair may be shared among queues; one thread may
  then wait for data to be available in any of them */
 
 struct _mutex_cond_pair {
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	int refcount;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int refcount;
+    volatile int waiters;   /* Threads sleeping on cond, so producers can skip signaling */
 };
 
-/* TODO: decrement size so that we keep track of how many items there is in queue */
 struct _kc_queue {
-	kc_qnode *head;
-	kc_qnode *tail;
-	struct _mutex_cond_pair *mcp;
-	int size;
-	int n;
+    kc_qcell *cells;
+    size_t mask;            /* Cell count - 1, cell count being a power of 2 */
+    struct _mutex_cond_pair *mcp;
+    int size;
+
+    /* Producers and consumers positions live on separate cache lines */
+    char pad0[QUEUE_CACHE_LINE];
+    volatile size_t enqueuePos;
+    char pad1[QUEUE_CACHE_LINE - sizeof(size_t)];
+    volatile size_t dequeuePos;
+    char pad2[QUEUE_CACHE_LINE - sizeof(size_t)];
+    volatile int n;         /* Item count, updated after items are published or consumed */
+    volatile int shutdown;  /* Set under the mcp mutex, blocking consumers stop waiting once it is */
 };
 
 /* allocates queue and initializes all fields incl. methods */
 kc_queue *kc_queueInit( int size )
 {
-	kc_queue *q;
-	const static pthread_mutex_t pti = PTHREAD_MUTEX_INITIALIZER;
-	const static pthread_cond_t  pci = PTHREAD_COND_INITIALIZER;
-	q = malloc( sizeof(kc_queue) );
-	if( q != NULL ) {
-		q->head = NULL;
-		q->tail = NULL;
-		q->size = size;
-		q->n = 0;
-		q->mcp = malloc( sizeof(struct _mutex_cond_pair) );
-		if( q->mcp == NULL ) {
-			free( q );
-			return NULL;
-		}
-        
-		q->mcp->mutex = pti;
-		q->mcp->cond = pci;
-		q->mcp->refcount = 1;
-		/*q->resetq = &resetq;
-		q->enq = &enq;
-		q->deqw = &deqw;
-		q->deqtw = &deqtw;
-		q->associate = &associateq;
-		q->select = &selectq;
-		q->destroy = &destroyq;*/
-	}
-	return q;
+    kc_queue *q;
+    const static pthread_mutex_t pti = PTHREAD_MUTEX_INITIALIZER;
+    const static pthread_cond_t  pci = PTHREAD_COND_INITIALIZER;
+    size_t cellCount;
+    size_t i;
+
+    assert( size > 0 );
+
+    q = calloc( 1, sizeof(kc_queue) );
+    if( q != NULL ) {
+        /* The ring needs a power of 2 cells, the queue may hold a bit more than size */
+        for( cellCount = 2; cellCount < (size_t)size; cellCount <<= 1 )
+            ;
+        q->cells = malloc( cellCount * sizeof(kc_qcell) );
+        if( q->cells == NULL ) {
+            free( q );
+            return NULL;
+        }
+        for( i = 0; i < cellCount; i++ )
+            q->cells[i].sequence = i;
+        q->mask = cellCount - 1;
+        q->size = size;
+        q->n = 0;
+        q->shutdown = 0;
+        q->mcp = malloc( sizeof(struct _mutex_cond_pair) );
+        if( q->mcp == NULL ) {
+            free( q->cells );
+            free( q );
+            return NULL;
+        }
+
+        q->mcp->mutex = pti;
+        q->mcp->cond = pci;
+        q->mcp->refcount = 1;
+        q->mcp->waiters = 0;
+    }
+    return q;
 }
 
 void kc_queueFree( kc_queue *q )
 {
-	kc_queueEmpty( q );
-	if( --q->mcp->refcount == 0) {
-		pthread_mutex_destroy( &q->mcp->mutex );
-		pthread_cond_destroy( &q->mcp->cond );
-		free( q->mcp );
-	}
-	free( q );
+    kc_queueEmpty( q );
+    if( --q->mcp->refcount == 0) {
+        pthread_mutex_destroy( &q->mcp->mutex );
+        pthread_cond_destroy( &q->mcp->cond );
+        free( q->mcp );
+    }
+    free( q->cells );
+    free( q );
+}
+
+/* Claims the next free cell, returns 0 if the ring is full */
+static int queuePush( kc_queue *q, void *data )
+{
+    kc_qcell *cell;
+    size_t pos = q->enqueuePos;
+
+    for( ;; ) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = cell->sequence;
+        __sync_synchronize();
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if( diff == 0 ) {
+            size_t prev = __sync_val_compare_and_swap( &q->enqueuePos, pos, pos + 1 );
+            if( prev == pos )
+                break;
+            pos = prev;
+        } else if( diff < 0 ) {
+            return 0; /* The consumers haven't freed this cell yet */
+        } else {
+            pos = q->enqueuePos;
+        }
+    }
+
+    cell->data = data;
+    __sync_synchronize();
+    cell->sequence = pos + 1;
+    return 1;
+}
+
+/* Takes the oldest published cell, returns 0 if the ring is empty */
+static int queuePop( kc_queue *q, void **data )
+{
+    kc_qcell *cell;
+    size_t pos = q->dequeuePos;
+
+    for( ;; ) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = cell->sequence;
+        __sync_synchronize();
+        intptr_t diff = (intptr_t)seq - (intptr_t)( pos + 1 );
+        if( diff == 0 ) {
+            size_t prev = __sync_val_compare_and_swap( &q->dequeuePos, pos, pos + 1 );
+            if( prev == pos )
+                break;
+            pos = prev;
+        } else if( diff < 0 ) {
+            return 0; /* No producer published this cell yet */
+        } else {
+            pos = q->dequeuePos;
+        }
+    }
+
+    *data = cell->data;
+    __sync_synchronize();
+    cell->sequence = pos + q->mask + 1;
+    return 1;
+}
+
+/* Wakes consumers if items went into a queue that held previousCount items */
+static void queueSignal( kc_queue *q, int previousCount )
+{
+    if( previousCount != 0 || q->mcp->waiters == 0 )
+        return;
+
+    pthread_mutex_lock( &q->mcp->mutex );
+    pthread_cond_broadcast( &q->mcp->cond );
+    pthread_mutex_unlock( &q->mcp->mutex );
+}
+
+static int queueTake( kc_queue *q, void **data )
+{
+    if( !queuePop( q, data ) )
+        return 0;
+    __sync_fetch_and_sub( &q->n, 1 );
+    return 1;
 }
 
 kc_queue *kc_queueEmpty( kc_queue *q )
 {
-	kc_qnode *cur, *next;
-    
-	assert( q != NULL );
-	pthread_mutex_lock(&q->mcp->mutex);
-	for(cur=q->head; cur != NULL; cur = next) {
-		next = cur->next;
-		free(cur);
-	}
-	q->head = NULL;
-	q->tail = NULL;
-	q->n = 0;
-	pthread_mutex_unlock(&q->mcp->mutex);
-	return q;
+    void *data;
+
+    assert( q != NULL );
+    while( queueTake( q, &data ) )
+        ;
+    return q;
 }
 
 int
 kc_queueEnqueue( kc_queue *q, void *data )
 {
-	kc_qnode *new;
-    
-	pthread_mutex_lock(&q->mcp->mutex);
-	if( data != NULL )
+    assert( q != NULL );
+    if( data == NULL )
     {
-		assert( q != NULL );
-		if( q->n >= q->size )
-        {
-			pthread_mutex_unlock( &q->mcp->mutex );
-			return 1; /* queue full */
-		}
-		new = malloc( sizeof(kc_qnode) );
-		if( new == NULL )
-        {
-			pthread_mutex_unlock( &q->mcp->mutex );
-			return -1; /* no memory */
-		}
-		q->n++;
-		new->data = data;
-		new->next = NULL;
-        
-		if( q->tail == NULL )
-        {
-			assert( q->head == NULL );
-			q->head = new;
-		} else {
-			assert( q->tail->next == NULL );
-			q->tail->next = new;
-		}
-		q->tail = new;
-	}
-	pthread_mutex_unlock( &q->mcp->mutex );
-	pthread_cond_signal( &q->mcp->cond );
-	return 0;
+        /* Only wake up the listeners */
+        pthread_mutex_lock( &q->mcp->mutex );
+        pthread_cond_broadcast( &q->mcp->cond );
+        pthread_mutex_unlock( &q->mcp->mutex );
+        return 0;
+    }
+
+    if( !queuePush( q, data ) )
+        return 1; /* queue full */
+
+    queueSignal( q, __sync_fetch_and_add( &q->n, 1 ) );
+    return 0;
 }
 
+int
+kc_queueEnqueueBatch( kc_queue *q, void **items, int count )
+{
+    int i;
+
+    assert( q != NULL );
+    for( i = 0; i < count; i++ )
+    {
+        assert( items[i] != NULL );
+        if( !queuePush( q, items[i] ) )
+            break;
+    }
+    if( i > 0 )
+        queueSignal( q, __sync_fetch_and_add( &q->n, i ) );
+    return i;
+}
 
-void *kc_queueDequeue( kc_queue *q )
+int
+kc_queueDequeueBatch( kc_queue *q, void **items, int max )
 {
-	kc_qnode *cur;
-	void *data = NULL;
-    
-	assert( q != NULL );
-	pthread_mutex_lock( &q->mcp->mutex );
-    
-	if( q->head == NULL )	/* if no data at this moment */
-		pthread_cond_wait( &q->mcp->cond, &q->mcp->mutex );
-    
-	if( q->head != NULL )
+    int i;
+
+    assert( q != NULL );
+    for( i = 0; i < max; i++ )
     {
-        /* if pthread_cond_wait() was NOT interrupted, but instead there are non-NULL data */
-		q->n--;
-		cur = q->head;
-		q->head = cur->next;
-		if( q->head == NULL )
-        {
-			assert( q->n == 0 );
-			q->tail = NULL;
-		}
-        else
-        {
-			assert( q->n != 0 );
-		}
-		data = cur->data;
-		free( cur );
-	}
-	pthread_mutex_unlock( &q->mcp->mutex );
-	return data;	/* which will be NULL if pthread_cond_wait() was interrupted or a NULL was enq'd */
+        if( !queuePop( q, &items[i] ) )
+            break;
+    }
+    if( i > 0 )
+        __sync_fetch_and_sub( &q->n, i );
+    return i;
 }
 
-void *kc_queueDequeueTimeout( kc_queue *q, unsigned long int timeout)
+/* Sleeps until the queue gets data, with timeout in ms or forever if timeout is NULL.
+ Returns 0 or ETIMEDOUT */
+static int queueWait( kc_queue *q, unsigned long int *timeout )
 {
-	kc_qnode *cur;
-	void *data = NULL;
-	int status = 0;
-    
-	assert( q != NULL );
-	pthread_mutex_lock( &q->mcp->mutex );
-    
-	if( q->head == NULL ) /* i.e., while queue is empty */
-		status = pthread_cond_incrtimedwait( &q->mcp->cond, &q->mcp->mutex, timeout );
-    
-	/* Here status can only be either 0 or ETIMEDOUT */
-	if( status == 0 && q->head != NULL )
+    int status = 0;
+
+    pthread_mutex_lock( &q->mcp->mutex );
+    __sync_fetch_and_add( &q->mcp->waiters, 1 );
+
+    if( q->n == 0 && !q->shutdown )	/* if no data at this moment */
     {
-		q->n--;
-		cur = q->head;
-		q->head = cur->next;
-		if( q->head == NULL )
-        {
-			assert( q->n == 0 );
-			q->tail = NULL;
-		}
+        if( timeout == NULL )
+            pthread_cond_wait( &q->mcp->cond, &q->mcp->mutex );
         else
-        {
-			assert( q->n != 0 );
-		}
-		data = cur->data;
-		free( cur );
-	}
-	pthread_mutex_unlock( &q->mcp->mutex );
-	return data;
+            status = pthread_cond_incrtimedwait( &q->mcp->cond, &q->mcp->mutex, *timeout );
+    }
+
+    __sync_fetch_and_sub( &q->mcp->waiters, 1 );
+    pthread_mutex_unlock( &q->mcp->mutex );
+    return status;
 }
 
-int kc_queueCount( kc_queue *q )
+void *kc_queueDequeue( kc_queue *q )
 {
-    kc_qnode *cur;
-    
+    void *data = NULL;
+
     assert( q != NULL );
-    
-    pthread_mutex_lock( &q->mcp->mutex );
-    
-    for( cur = q->head; cur != NULL; cur = cur->next )
+
+    /* Wakeups may be spurious, or another consumer may have taken the item first */
+    for( ;; )
     {
-        //TODO: 
+        if( queueTake( q, &data ) )
+            return data;
+        if( q->shutdown )
+            return NULL;
+        queueWait( q, NULL );
     }
+}
+
+void *kc_queueDequeueTimeout( kc_queue *q, unsigned long int timeout)
+{
+    void *data = NULL;
+
+    assert( q != NULL );
+    if( queueTake( q, &data ) )
+        return data;
+
+    if( timeout == 0 || queueWait( q, &timeout ) != 0 )
+        return NULL;
+
+    if( !queueTake( q, &data ) )
+        data = NULL;
+    return data;
+}
+
+void kc_queueShutdown( kc_queue *q )
+{
+    assert( q != NULL );
+
+    pthread_mutex_lock( &q->mcp->mutex );
+    q->shutdown = 1;
+    pthread_cond_broadcast( &q->mcp->cond );
     pthread_mutex_unlock( &q->mcp->mutex );
-    return 0;
+}
+
+int kc_queueCount( kc_queue *q )
+{
+    assert( q != NULL );
+
+    return q->n;
 }
 
 /* let q point to q1's mutex/cond pair; the pair originally
@@ -224,66 +322,66 @@ int kc_queueCount( kc_queue *q )
 
 int kc_queueAssociate( kc_queue *q, kc_queue *q1)
 {
-	struct _mutex_cond_pair *oldqmcp = q->mcp;
-    
-	if( q->mcp == q1->mcp )
-		return 1;	/* they are already associated! do nothing */
-	q->mcp = q1->mcp;
-	q->mcp->refcount++;
-	if( --oldqmcp->refcount == 0) {
-		pthread_mutex_destroy( &oldqmcp->mutex );
-		pthread_cond_destroy( &oldqmcp->cond );
-		free( oldqmcp );
-	}
-	return 0;
+    struct _mutex_cond_pair *oldqmcp = q->mcp;
+
+    if( q->mcp == q1->mcp )
+        return 1;	/* they are already associated! do nothing */
+    q->mcp = q1->mcp;
+    q->mcp->refcount++;
+    if( --oldqmcp->refcount == 0) {
+        pthread_mutex_destroy( &oldqmcp->mutex );
+        pthread_cond_destroy( &oldqmcp->cond );
+        free( oldqmcp );
+    }
+    return 0;
 }
 
 long int kc_queueSelect( kc_queue *qarray[], unsigned long int timeout )
 {
-	long int returned_value = 0;
-	struct _mutex_cond_pair *mcp;
-	int status = 0;
-	int nqueues;
-	int i;
-    
-    assert( qarray == NULL );
-    assert( qarray[0] == NULL );
-    
-	mcp = qarray[0]->mcp;
-	if(mcp == NULL)
-		return -1;
-    
-	nqueues = mcp->refcount;
-	if( nqueues < 0 || nqueues > 31 )
-		return -1;
-    
-	/* sanity check: qarray[0]...qarray[refcount-1] must be non-NULL and
+    long int returned_value = 0;
+    struct _mutex_cond_pair *mcp;
+    int nqueues;
+    int i;
+
+    assert( qarray != NULL );
+    assert( qarray[0] != NULL );
+
+    mcp = qarray[0]->mcp;
+    if(mcp == NULL)
+        return -1;
+
+    nqueues = mcp->refcount;
+    if( nqueues < 0 || nqueues > 31 )
+        return -1;
+
+    /* sanity check: qarray[0]...qarray[refcount-1] must be non-NULL and
      their mcp must point to the same mcp as qarray[0] */
-	for( i = 0; i < nqueues; i++ )
+    for( i = 0; i < nqueues; i++ )
     {
-		if( qarray[i] == NULL || qarray[i]->mcp != mcp )
-			return -1;
-	}
-    
-	pthread_mutex_lock( &mcp->mutex );	/* \\\\\\ LOCK SHARED MUTEX \\\\\\ */
-    
-	for( i = 0; i < nqueues; i++ )
+        if( qarray[i] == NULL || qarray[i]->mcp != mcp )
+            return -1;
+    }
+
+    pthread_mutex_lock( &mcp->mutex );	/* \\\\\\ LOCK SHARED MUTEX \\\\\\ */
+    __sync_fetch_and_add( &mcp->waiters, 1 );
+
+    for( i = 0; i < nqueues; i++ )
     {
-		if( qarray[i]->head != NULL ) /* i.e., if this queue has data */
-			break;
-	}
-	if( i == nqueues )	/* i.e. if none of the queues have data */
-		status = pthread_cond_incrtimedwait( &mcp->cond, &mcp->mutex, timeout );
-    
-	/* Here status can only be either 0 or ETIMEDOUT */
-	for( i = 0; i < nqueues; i++ )
+        if( qarray[i]->n != 0 ) /* i.e., if this queue has data */
+            break;
+    }
+    if( i == nqueues )	/* i.e. if none of the queues have data */
+        pthread_cond_incrtimedwait( &mcp->cond, &mcp->mutex, timeout );
+
+    /* Here status can only be either 0 or ETIMEDOUT */
+    for( i = 0; i < nqueues; i++ )
     {
-		if( qarray[i]->head != NULL ) /* i.e., if this queue has data */
-			returned_value |= (1 << i);
-	}
-    
-	pthread_mutex_unlock( &mcp->mutex );	/* ///// UNLOCK SHARED MUTEX ///// */
-    
-	return returned_value;	/* zero if no queue has data */
-}
+        if( qarray[i]->n != 0 ) /* i.e., if this queue has data */
+            returned_value |= (1 << i);
+    }
+
+    __sync_fetch_and_sub( &mcp->waiters, 1 );
+    pthread_mutex_unlock( &mcp->mutex );	/* ///// UNLOCK SHARED MUTEX ///// */
 
+    return returned_value;	/* zero if no queue has data */
+}
@@ -17,7 +17,8 @@ typedef struct _kc_queue kc_queue;
 /**
  * Allocates and initializes a new queue
  *
- * This function handle the succesful creation of a queue
+ * This function handle the succesful creation of a queue.
+ * Queues are lock-free rings, allocated once: size is rounded up to a power of 2.
  * @param size The maximum size of the queue
  * @return An initialized kc_queue structure
  */
@@ -44,9 +45,9 @@ kc_queue *kc_queueEmpty( kc_queue *q );
  * Add an item to the queue
  * 
  * This function enqueues an item in the queue.
- * Enqueuing NULL will trigger dequeuing on the listening threads
- * because it performs a pthread_cond_signal() without putting
- * data in the queue.
+ * Enqueuing NULL wakes up the listening threads without putting
+ * data in the queue. kc_queueDequeue() goes back to sleep if the queue
+ * is still empty, use kc_queueShutdown() to release it.
  * 
  * @param q The queue to enqueue in.
  * @param data A pointer to the item to queue
@@ -54,13 +55,37 @@ kc_queue *kc_queueEmpty( kc_queue *q );
  */
 int kc_queueEnqueue( kc_queue *q, void *data );
 
+/**
+ * Add several items to the queue
+ *
+ * This function enqueues items in order, waking the listening threads at most once.
+ *
+ * @param q The queue to enqueue in.
+ * @param items An array of non-NULL items to queue
+ * @param count The number of items in the array
+ * @return The number of items enqueued, which is less than count if the queue got full.
+ */
+int kc_queueEnqueueBatch( kc_queue *q, void **items, int count );
+
+/**
+ * Dequeue several items from a queue, without blocking.
+ *
+ * @param q The queue to dequeue from.
+ * @param items An array receiving the dequeued items.
+ * @param max The size of the items array.
+ * @return The number of items dequeued, 0 if the queue was empty.
+ */
+int kc_queueDequeueBatch( kc_queue *q, void **items, int max );
+
 /**
  * Dequeue an item from a queue.
  * 
  * This function dequeues an item from the queue.
- * It will block the executing thread until there is data avaliable
+ * It will block the executing thread until there is data avaliable,
+ * or the queue is shut down.
  * @param The queue to dequeue from.
- * @return A pointer to the dequeued item. You are responsible for freeing it.
+ * @return A pointer to the dequeued item, or NULL if the queue was shut down
+ * and is empty. You are responsible for freeing it.
  */
 void *kc_queueDequeue( kc_queue *q );
 
@@ -76,7 +101,23 @@ void *kc_queueDequeue( kc_queue *q );
  */
 void *kc_queueDequeueTimeout( kc_queue *q, unsigned long int timeout );
 
-/* TODO: Doxy this ! */
+/**
+ * Shuts a queue down.
+ *
+ * Wakes up the threads blocked in kc_queueDequeue(), which from then on
+ * returns NULL instead of blocking once the queue is empty.
+ * Enqueuing still works, so that items queued meanwhile can be drained.
+ * @param q The queue to shut down.
+ */
+void kc_queueShutdown( kc_queue *q );
+
+/**
+ * Get the number of items in a queue.
+ *
+ * This is O(1), but only a snapshot when other threads use the queue.
+ * @param q The queue to count.
+ * @return The number of queued items.
+ */
 int kc_queueCount( kc_queue *q );
 
 /**
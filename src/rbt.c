@@ -377,3 +377,22 @@ void *rbtFind(RbtHandle h, void *key) {
     }
     return NULL;
 }
+
+void *rbtLowerBound(RbtHandle h, void *key) {
+    RbtType *rbt = h;
+
+    NodeType *current, *bound = NULL;
+    current = rbt->root;
+    while(current != SENTINEL) {
+        int rc = rbt->compare(key, current->key);
+        if (rc == 0) return current;
+        if (rc < 0) {
+            // current is a candidate, look for a smaller one
+            bound = current;
+            current = current->left;
+        } else {
+            current = current->right;
+        }
+    }
+    return bound;
+}
@@ -79,6 +79,10 @@ void rbtKeyValue(RbtHandle h, RbtIterator i, void **key, void **value);
 RbtIterator rbtFind(RbtHandle h, void *key);
 // returns iterator associated with key
 
+RbtIterator rbtLowerBound(RbtHandle h, void *key);
+// returns iterator of the first node whose key is not less than key,
+// or NULL if there is none
+
 int rbtSize(RbtHandle h);
 
 #endif
@@ -16,10 +16,13 @@ struct _kc_session {
     kc_messageType          type;
     int                     incoming;
     
-    int                     socket;
-    struct bufferevent    * bufferEvent;
+    dhtIdentity           * identity;   /* The identity whose socket we share */
+    kc_wheelTimer           timer;      /* Expires the session, pending once started */
+    long                    timeout;    /* in ms */
+    struct timeval          sentTime;   /* When we last sent something, zeroed until then */
     
     kc_sessionCallback      callback;
+    void                  * ref;
     
     kc_dht                * dht;
 };
@@ -45,41 +48,12 @@ kc_sessionCmp( const void *a, const void *b )
 }
 
 static void
-sessionReadCB( struct bufferevent * event, void * arg )
+sessionTimeoutCB( kc_wheelTimer * timer, void * ref )
 {
-    kc_session * session = arg;
-    kc_logNormal( "Session read for contact: %s", kc_contactPrint( session->contact ) );
-    /* Means we have recieved data from this contact */
-}
-
-static void
-sessionWriteCB( struct bufferevent * event, void * arg )
-{
-    kc_session * session = arg;
-    kc_logNormal( "Session write for contact: %s", kc_contactPrint( session->contact ) );
-}
-
-static void
-sessionErrorCB( struct bufferevent * event, short what, void * arg )
-{
-    kc_session * session = arg;
-    char * errStr = calloc( 15, sizeof(char) );
-    if( what & EVBUFFER_READ )
-        sprintf( errStr, "%s", "Read" );
-    if( what & EVBUFFER_WRITE )
-        sprintf( errStr, "%s", "Write" );
-    if( what & EVBUFFER_EOF )
-        sprintf( errStr, "%s %s", errStr, "EOF" );
-    if( what & EVBUFFER_ERROR )
-        sprintf( errStr, "%s %s", errStr, "error" );
-    if( what & EVBUFFER_TIMEOUT )
-        sprintf( errStr, "%s %s", errStr, "timeout" );
-    
-    kc_logError( "%s for contact %s", errStr, kc_contactPrint( session->contact ) );
-    free( errStr );
+    kc_session * session = ref;
+    kc_logVerbose( "Session timeout for contact: %s", kc_contactPrint( session->contact ) );
     
-    kc_dhtDeleteSession( session->dht, session );
-    kc_sessionFree( session );
+    kc_sessionCancel( session );
 }
 
 kc_session *
@@ -93,13 +67,23 @@ kc_sessionInit( kc_dht * dht, kc_contact * connectContact, kc_messageType type,
         return NULL;
     }
     
-    self->contact = connectContact;
+    /* Our own copy, whoever gave us this contact may drop it before we are done */
+    self->contact = kc_contactDup( connectContact );
+    if( self->contact == NULL )
+    {
+        kc_logError( "dhtSessionInit: Failed copying contact" );
+        free( self );
+        return NULL;
+    }
     self->type = type;
     self->incoming = incoming;
     self->callback = callback;
+    self->ref = NULL;
     
-    self->socket = -1;
-    self->bufferEvent = NULL;
+    self->identity = NULL;
+    kc_wheelTimerInit( &self->timer, sessionTimeoutCB, self );
+    self->timeout = dht->parameters->sessionTimeout * 1000L;
+    timerclear( &self->sentTime );
     
     self->dht = dht;
     
@@ -111,83 +95,48 @@ kc_sessionInit( kc_dht * dht, kc_contact * connectContact, kc_messageType type,
 void
 kc_sessionFree( kc_session * session )
 {
-    if( session->bufferEvent != NULL )
-        bufferevent_free( session->bufferEvent );
-    if( session->socket != -1 )
-        kc_netClose( session->socket );
+    kc_wheelCancel( session->dht->wheel, &session->timer );
     
+    kc_contactFree( session->contact );
     free( session );
 }
 
+void
+kc_sessionCancel( kc_session * session )
+{
+    assert( session != NULL );
+    
+    /* Unregister it first, so that the callback may retry with a new session */
+    kc_dhtDeleteSession( session->dht, session );
+    if( session->callback != NULL )
+        session->callback( session->dht, session, NULL );
+    
+    kc_sessionFree( session );
+}
+
 int
 kc_sessionStart( kc_session * session )
 {
-    dhtIdentity * id = kc_dhtIdentityForContact( session->dht, session->contact );
-    if( id == NULL )
+    session->identity = kc_dhtIdentityForContact( session->dht, session->contact );
+    if( session->identity == NULL )
     {
         kc_logError( "No identity available to start session to contact %s", kc_contactPrint( session->contact ) );
         return -1;
     }
-    kc_contact * bindContact = id->us;
-    
-    int contactType = kc_contactGetType( session->contact );
     
-    session->socket = kc_netOpen( contactType, SOCK_DGRAM );
-    if( session->socket == -1 )
-    {
-        kc_logError( "Unable to open socket to %s", kc_contactPrint( session->contact ) );
-        return 1;
-    }
-    
-    int status;
-    status = kc_netBind( session->socket, bindContact );
-    if( status == -1 )
-    {
-        kc_logError( "Unable to bind socket" );
-        return 1;
-    }
-    
-    status = kc_netConnect( session->socket, session->contact );
-    if( status == -1 )
-    {
-        kc_logError( "Unable to connect socket" );
-        return 1;
-    }
-    
-    session->bufferEvent = bufferevent_new( session->socket, sessionReadCB, sessionWriteCB, sessionErrorCB, session );
-    if( session->bufferEvent == NULL )
-    {
-        kc_logError( "Failed creating event buffer" );
-        return 1;
-    }
-    if( bufferevent_base_set( session->dht->eventBase, session->bufferEvent ) != 0 )
-    {
-        kc_logError( "Failed setting event buffer base" );
-        return 1;
-    }
-    
-    int timeout = session->dht->parameters->sessionTimeout;
-    bufferevent_settimeout( session->bufferEvent, timeout, timeout );
-    
-    if( bufferevent_enable( session->bufferEvent, EV_READ | EV_WRITE ) != 0 )
-    {
-        kc_logError( "Failed enabling event buffer" );
-        return 1;
-    }
+    kc_wheelSchedule( session->dht->wheel, &session->timer, session->timeout );
     return 0;
 }
 
-static void
-evbufferCB(struct evbuffer * evbuf, size_t oldSize, size_t newSize, void * arg )
-{
-    kc_logVerbose( "evbufferCB: buffer %p modified %d -> %d", evbuf, oldSize, newSize );
-}
-
 int
 kc_sessionSend( kc_session * session, kc_message * message )
 {
     assert( session != NULL );
-    return kc_messageWriteToBufferEvent( message, session->bufferEvent );
+    assert( session->identity != NULL );
+    
+    gettimeofday( &session->sentTime, NULL );
+    return dhtIdentitySend( session->identity, session->contact,
+                            kc_messageGetData( message ), kc_messageGetSize( message ) );
 }
 
 int
@@ -196,16 +145,44 @@ kc_sessionRecieved( kc_session * session, kc_message * message )
     assert( session != NULL );
     assert( message != NULL );
     
-    int status;
-    status = kc_messageWriteToBufferEvent( message, session->bufferEvent );
-    if( status != 0 )
-    {
-        kc_logAlert( "failed adding message buffer to session with error %d", status);
-        return -1;
-    }
+    /* Unregister it during the callback, like on timeouts, so that the callback may
+     * start a new exchange with this contact, or free the contact if it ends this one.
+     * A non-zero return from the callback means the exchange is over */
+    kc_dhtDeleteSession( session->dht, session );
+    if( session->callback != NULL && session->callback( session->dht, session, message ) == 0 &&
+        kc_dhtAddSession( session->dht, session ) == 0 )
+        return 0;
+    
+    kc_sessionFree( session );
+    return 1;
+}
+
+int
+kc_sessionSetTimeout( kc_session * session, long timeout )
+{
+    assert( session != NULL );
+    assert( timeout > 0 );
+    
+    session->timeout = timeout;
+    
+    /* Already started, re-arm it from now */
+    kc_wheelReschedule( session->dht->wheel, &session->timer, timeout );
     return 0;
 }
 
+long
+kc_sessionGetElapsed( const kc_session * session )
+{
+    assert( session != NULL );
+    
+    if( !timerisset( &session->sentTime ) )
+        return -1;
+    
+    struct timeval now;
+    gettimeofday( &now, NULL );
+    return ( now.tv_sec - session->sentTime.tv_sec ) * 1000 + ( now.tv_usec - session->sentTime.tv_usec ) / 1000;
+}
+
 const kc_contact *
 kc_sessionGetContact( const kc_session * session )
 {
@@ -220,16 +197,234 @@ kc_sessionGetType( const kc_session * session )
     return session->type;
 }
 
+void
+kc_sessionSetRef( kc_session * session, void * ref )
+{
+    assert( session != NULL );
+    session->ref = ref;
+}
+
+void *
+kc_sessionGetRef( const kc_session * session )
+{
+    assert( session != NULL );
+    return session->ref;
+}
+
+char *
+kc_sessionFormat( char * buf, size_t len, const kc_session * session )
+{
+    assert( buf != NULL );
+    assert( session != NULL );
+    
+    char contactStr[KADC_CONTACT_STRLEN];
+    
+    if( len != 0 )
+        snprintf( buf, len, "%s session to %s", ( session->incoming ? "Incoming" : "Outgoing" ),
+                  kc_contactFormat( contactStr, sizeof(contactStr), session->contact ) );
+    return buf;
+}
+
 char *
 kc_sessionPrint( const kc_session * session )
 {
+    return kc_sessionFormat( kc_printBuffer(), KADC_PRINT_BUFSIZE, session );
+}
+
+#pragma mark Session index
+
+typedef struct sessionIndexSlot {
+    uint32_t                hash;       /* Cached hash of the session key */
+    kc_session            * session;    /* NULL if the slot is empty */
+} sessionIndexSlot;
+
+struct _kc_sessionIndex {
+    sessionIndexSlot      * slots;
+    int                     mask;       /* Slot count - 1, slot count being a power of 2 */
+    int                     count;
+};
+
+static inline uint32_t
+sessionKeyHash( const kc_contact * contact, int incoming, kc_messageType type )
+{
+    uint32_t hash = kc_contactHash( contact );
+    
+    hash ^= ( (uint32_t)type << 1 ) | ( incoming ? 1 : 0 );
+    /* Final mix, so that the low bits we index with depend on every input bit */
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BU;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static inline int
+sessionKeyMatches( const kc_session * session, const kc_contact * contact, int incoming, kc_messageType type )
+{
+    return ( session->type == type &&
+             ( session->incoming != 0 ) == ( incoming != 0 ) &&
+             kc_contactCmp( session->contact, contact ) == 0 );
+}
+
+static int
+sessionIndexAlloc( kc_sessionIndex * index, int slotCount )
+{
+    index->slots = calloc( slotCount, sizeof(sessionIndexSlot) );
+    if( index->slots == NULL )
+        return -1;
+    index->mask = slotCount - 1;
+    return 0;
+}
+
+/* Places a session in the first free slot of its probe sequence */
+static void
+sessionIndexPlace( kc_sessionIndex * index, uint32_t hash, kc_session * session )
+{
+    int i = hash & index->mask;
+    while( index->slots[i].session != NULL )
+        i = ( i + 1 ) & index->mask;
+    
+    index->slots[i].hash = hash;
+    index->slots[i].session = session;
+}
+
+static int
+sessionIndexGrow( kc_sessionIndex * index )
+{
+    sessionIndexSlot * oldSlots = index->slots;
+    int oldCount = index->mask + 1;
+    int i;
+    
+    if( sessionIndexAlloc( index, oldCount * 2 ) != 0 )
+    {
+        index->slots = oldSlots;
+        return -1;
+    }
+    
+    for( i = 0; i < oldCount; i++ )
+    {
+        if( oldSlots[i].session != NULL )
+            sessionIndexPlace( index, oldSlots[i].hash, oldSlots[i].session );
+    }
+    free( oldSlots );
+    return 0;
+}
+
+kc_sessionIndex *
+kc_sessionIndexInit( int expectedCount )
+{
+    kc_sessionIndex * self = malloc( sizeof(kc_sessionIndex) );
+    if( self == NULL )
+    {
+        kc_logError( "kc_sessionIndexInit: Failed malloc()ing" );
+        return NULL;
+    }
+    
+    /* Keep the load factor under 1/2 */
+    int slotCount = 16;
+    while( slotCount < expectedCount * 2 )
+        slotCount *= 2;
+    
+    if( sessionIndexAlloc( self, slotCount ) != 0 )
+    {
+        kc_logError( "kc_sessionIndexInit: Failed malloc()ing slots" );
+        free( self );
+        return NULL;
+    }
+    self->count = 0;
+    
+    return self;
+}
+
+void
+kc_sessionIndexFree( kc_sessionIndex * index )
+{
+    if( index == NULL )
+        return;
+    free( index->slots );
+    free( index );
+}
+
+int
+kc_sessionIndexInsert( kc_sessionIndex * index, kc_session * session )
+{
+    assert( index != NULL );
     assert( session != NULL );
     
-    static char * contactStr = NULL;
-    if( contactStr != NULL )
-        free( contactStr );
-    asprintf( &contactStr, "%s session to %s", ( session->incoming ? "Incoming" : "Outgoing" ), kc_contactPrint( session->contact ) );
-    assert( contactStr != NULL );
+    if( kc_sessionIndexFind( index, session->contact, session->incoming, session->type ) != NULL )
+        return 1;
+    
+    if( ( index->count + 1 ) * 2 > index->mask + 1 && sessionIndexGrow( index ) != 0 )
+    {
+        kc_logError( "kc_sessionIndexInsert: Failed growing index" );
+        return -1;
+    }
     
-    return contactStr;
+    sessionIndexPlace( index, sessionKeyHash( session->contact, session->incoming, session->type ), session );
+    index->count++;
+    return 0;
+}
+
+int
+kc_sessionIndexRemove( kc_sessionIndex * index, const kc_session * session )
+{
+    assert( index != NULL );
+    assert( session != NULL );
+    
+    uint32_t hash = sessionKeyHash( session->contact, session->incoming, session->type );
+    int i = hash & index->mask;
+    
+    while( index->slots[i].session != session )
+    {
+        if( index->slots[i].session == NULL )
+            return -1;
+        i = ( i + 1 ) & index->mask;
+    }
+    
+    /* Backward-shift deletion : pull up the following entries of the cluster
+     * which would be unreachable with a hole here, so we never need tombstones */
+    int hole = i;
+    for( ;; )
+    {
+        i = ( i + 1 ) & index->mask;
+        if( index->slots[i].session == NULL )
+            break;
+        
+        int home = index->slots[i].hash & index->mask;
+        /* Move it if its home slot isn't within ( hole, i ] */
+        if( ( ( i - home ) & index->mask ) >= ( ( i - hole ) & index->mask ) )
+        {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole].session = NULL;
+    index->slots[hole].hash = 0;
+    index->count--;
+    
+    return 0;
+}
+
+kc_session *
+kc_sessionIndexFind( const kc_sessionIndex * index, const kc_contact * contact, int incoming, kc_messageType type )
+{
+    assert( index != NULL );
+    assert( contact != NULL );
+    
+    uint32_t hash = sessionKeyHash( contact, incoming, type );
+    int i = hash & index->mask;
+    
+    for( ; index->slots[i].session != NULL; i = ( i + 1 ) & index->mask )
+    {
+        if( index->slots[i].hash == hash &&
+            sessionKeyMatches( index->slots[i].session, contact, incoming, type ) )
+            return index->slots[i].session;
+    }
+    return NULL;
+}
+
+int
+kc_sessionIndexCount( const kc_sessionIndex * index )
+{
+    assert( index != NULL );
+    return index->count;
 }
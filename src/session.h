@@ -10,16 +10,29 @@
 #ifndef __KADC_SESSION_H__
 #define __KADC_SESSION_H__
 
-typedef int (*kc_sessionCallback)( const kc_dht * dht, const kc_message * msg );
-
 typedef struct _kc_session kc_session;
 
+/**
+ * The callback prototype used when a session gets a message.
+ *
+ * @param msg The recieved message, or NULL if the session timed out
+ * @return 0 to keep the session running, anything else to end it
+ */
+typedef int (*kc_sessionCallback)( const kc_dht * dht, kc_session * session, const kc_message * msg );
+
 kc_session *
 kc_sessionInit( kc_dht * dht, kc_contact * connectContact, kc_messageType type, int incoming, kc_sessionCallback callback );
 
 void
 kc_sessionFree( kc_session * session );
 
+/**
+ * Ends a session as if it timed out : unregisters it, calls its callback
+ * without a message, then frees it.
+ */
+void
+kc_sessionCancel( kc_session * session );
+
 int
 kc_sessionCmp( const void *a, const void *b );
 
@@ -32,13 +45,113 @@ kc_sessionSend( kc_session * session, kc_message * message );
 int
 kc_sessionRecieved( kc_session * session, kc_message * message );
 
+/**
+ * Sets how long a session waits for a message before timing out.
+ *
+ * It defaults to the sessionTimeout DHT parameter. If the session is already
+ * started, its timer restarts from now.
+ *
+ * @param timeout The new timeout in ms
+ * @return 0 on success, -1 on failure
+ */
+int
+kc_sessionSetTimeout( kc_session * session, long timeout );
+
+/**
+ * Returns the time elapsed since the session last sent a message, in ms.
+ *
+ * Called when a reply arrives, this gives the round-trip-time to the session contact.
+ *
+ * @return The elapsed time, or -1 if nothing was sent yet
+ */
+long
+kc_sessionGetElapsed( const kc_session * session );
+
 const kc_contact *
 kc_sessionGetContact( const kc_session * session );
 
 kc_messageType
 kc_sessionGetType( const kc_session * session );
 
+/**
+ * Attaches caller data to a session, for use by its callback.
+ */
+void
+kc_sessionSetRef( kc_session * session, void * ref );
+
+void *
+kc_sessionGetRef( const kc_session * session );
+
+/** Room needed to format any session, see kc_sessionFormat() */
+#define KADC_SESSION_STRLEN ( KADC_CONTACT_STRLEN + 20 )
+
+/**
+ * Formats a session as "Incoming/Outgoing session to address:port"
+ * into a caller-provided buffer, without allocating anything.
+ *
+ * @param buf The buffer to write to.
+ * @param len The size of buf, KADC_SESSION_STRLEN is always enough.
+ * @param session The session to format.
+ * @return buf.
+ */
+char *
+kc_sessionFormat( char * buf, size_t len, const kc_session * session );
+
+/**
+ * Formats a session into a thread-local buffer, for use as a log argument.
+ *
+ * @see hashtoa().
+ */
 char *
 kc_sessionPrint( const kc_session * session );
 
+/**
+ * A hash index of sessions, keyed like kc_sessionCmp() on
+ * ( contact, incoming, type ), for constant-time demultiplexing
+ * of incoming messages.
+ *
+ * It uses open addressing with linear probing, and grows as needed.
+ * It doesn't own the sessions it indexes.
+ */
+typedef struct _kc_sessionIndex kc_sessionIndex;
+
+/**
+ * Creates an empty session index.
+ *
+ * @param expectedCount The number of sessions the index should hold without growing
+ * @return A new index, or NULL on failure
+ */
+kc_sessionIndex *
+kc_sessionIndexInit( int expectedCount );
+
+void
+kc_sessionIndexFree( kc_sessionIndex * index );
+
+/**
+ * Adds a session to the index.
+ *
+ * @return 0 on success, 1 if an equal session is already indexed, -1 on failure
+ */
+int
+kc_sessionIndexInsert( kc_sessionIndex * index, kc_session * session );
+
+/**
+ * Removes a session from the index.
+ *
+ * @return 0 on success, -1 if this session isn't indexed
+ */
+int
+kc_sessionIndexRemove( kc_sessionIndex * index, const kc_session * session );
+
+/**
+ * Finds the session matching the passed key.
+ *
+ * @return The indexed session, or NULL if there is none
+ */
+kc_session *
+kc_sessionIndexFind( const kc_sessionIndex * index, const kc_contact * contact, int incoming, kc_messageType type );
+
+int
+kc_sessionIndexCount( const kc_sessionIndex * index );
+
 #endif /* __KADC_SESSION_H__ */
\ No newline at end of file
@@ -0,0 +1,432 @@
+/*
+ *  store.c
+ *  KadC
+ *
+ */
+
+#include "store.h"
+
+#define STORE_MAX_SHARD_BITS    8
+#define STORE_SHARD_SLOTS       16      /* Initial slot count of a shard table */
+#define STORE_CACHE_LINE        64
+
+typedef struct storeSlot {
+    uint32_t                hash;       /* Cached hash of the key */
+    const kc_hash         * key;        /* NULL if the slot is empty */
+    void                  * value;
+} storeSlot;
+
+typedef struct storeShard {
+    pthread_rwlock_t        lock;
+    storeSlot             * slots;
+    int                     mask;       /* Slot count - 1, slot count being a power of 2 */
+    int                     count;
+    RbtHandle               ordered;    /* The same keys in order, or NULL */
+
+    /* Keeps each shard lock on its own cache lines */
+    char                    pad[STORE_CACHE_LINE];
+} storeShard;
+
+struct _kc_store {
+    int                     shardBits;
+    storeShard            * shards;
+};
+
+static inline uint32_t
+storeKeyHash( const kc_hash * key )
+{
+    /* Keys are uniform hashes, but their top bits select the shard, so mix them all down */
+    uint64_t hash = 0;
+    int i;
+
+    for( i = 0; i < KADC_HASH_WORDS; i++ )
+        hash = ( hash ^ key->id.words[i] ) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 29;
+    return (uint32_t)hash;
+}
+
+static inline storeShard *
+storeShardForKey( const kc_store * store, const kc_hash * key )
+{
+    return &store->shards[key->id.bytes[0] >> ( 8 - store->shardBits )];
+}
+
+static int
+storeShardAlloc( storeShard * shard, int slotCount )
+{
+    shard->slots = calloc( slotCount, sizeof(storeSlot) );
+    if( shard->slots == NULL )
+        return -1;
+    shard->mask = slotCount - 1;
+    return 0;
+}
+
+/* Places a key in the first free slot of its probe sequence */
+static void
+storeShardPlace( storeShard * shard, uint32_t hash, const kc_hash * key, void * value )
+{
+    int i = hash & shard->mask;
+    while( shard->slots[i].key != NULL )
+        i = ( i + 1 ) & shard->mask;
+
+    shard->slots[i].hash = hash;
+    shard->slots[i].key = key;
+    shard->slots[i].value = value;
+}
+
+static int
+storeShardGrow( storeShard * shard )
+{
+    storeSlot * oldSlots = shard->slots;
+    int oldCount = shard->mask + 1;
+    int i;
+
+    if( storeShardAlloc( shard, oldCount * 2 ) != 0 )
+    {
+        shard->slots = oldSlots;
+        return -1;
+    }
+
+    for( i = 0; i < oldCount; i++ )
+    {
+        if( oldSlots[i].key != NULL )
+            storeShardPlace( shard, oldSlots[i].hash, oldSlots[i].key, oldSlots[i].value );
+    }
+    free( oldSlots );
+    return 0;
+}
+
+/* Returns the slot index of key, or -1. Must be called with the shard locked */
+static int
+storeShardLookup( const storeShard * shard, const kc_hash * key )
+{
+    uint32_t hash = storeKeyHash( key );
+    int i = hash & shard->mask;
+
+    for( ; shard->slots[i].key != NULL; i = ( i + 1 ) & shard->mask )
+    {
+        if( shard->slots[i].hash == hash && kc_hashCmp( shard->slots[i].key, key ) == 0 )
+            return i;
+    }
+    return -1;
+}
+
+kc_store *
+kc_storeInit( int shardBits, int ordered )
+{
+    assert( shardBits >= 0 && shardBits <= STORE_MAX_SHARD_BITS );
+
+    int shardCount = 1 << shardBits;
+    int i;
+
+    kc_store * self = malloc( sizeof(kc_store) );
+    if( self == NULL )
+    {
+        kc_logAlert( "kc_storeInit: Failed malloc()ing" );
+        return NULL;
+    }
+    self->shardBits = shardBits;
+    self->shards = calloc( shardCount, sizeof(storeShard) );
+    if( self->shards == NULL )
+    {
+        kc_logAlert( "kc_storeInit: Failed malloc()ing shards" );
+        free( self );
+        return NULL;
+    }
+
+    for( i = 0; i < shardCount; i++ )
+    {
+        storeShard * shard = &self->shards[i];
+
+        pthread_rwlock_init( &shard->lock, NULL );
+        if( storeShardAlloc( shard, STORE_SHARD_SLOTS ) != 0 ||
+            ( ordered && ( shard->ordered = rbtNew( kc_hashCmp ) ) == NULL ) )
+        {
+            kc_logAlert( "kc_storeInit: Failed creating shard %d", i );
+            pthread_rwlock_destroy( &shard->lock );
+            free( shard->slots );
+            while( i-- > 0 )
+            {
+                /* Free the shards we already created */
+                pthread_rwlock_destroy( &self->shards[i].lock );
+                free( self->shards[i].slots );
+                if( self->shards[i].ordered != NULL )
+                    rbtDelete( self->shards[i].ordered );
+            }
+            free( self->shards );
+            free( self );
+            return NULL;
+        }
+    }
+
+    return self;
+}
+
+void
+kc_storeFree( kc_store * store )
+{
+    int i;
+
+    if( store == NULL )
+        return;
+
+    for( i = 0; i < 1 << store->shardBits; i++ )
+    {
+        storeShard * shard = &store->shards[i];
+
+        pthread_rwlock_destroy( &shard->lock );
+        free( shard->slots );
+        if( shard->ordered != NULL )
+            rbtDelete( shard->ordered );
+    }
+    free( store->shards );
+    free( store );
+}
+
+int
+kc_storeInsert( kc_store * store, const kc_hash * key, void * value )
+{
+    assert( store != NULL );
+    assert( key != NULL );
+
+    storeShard * shard = storeShardForKey( store, key );
+    int status = 0;
+
+    pthread_rwlock_wrlock( &shard->lock );
+
+    if( storeShardLookup( shard, key ) != -1 )
+        status = 1;
+    else if( ( shard->count + 1 ) * 2 > shard->mask + 1 && storeShardGrow( shard ) != 0 )
+    {
+        kc_logError( "kc_storeInsert: Failed growing shard" );
+        status = -1;
+    }
+    else if( shard->ordered != NULL && rbtInsert( shard->ordered, (void*)key, value ) != RBT_STATUS_OK )
+    {
+        kc_logError( "kc_storeInsert: Failed inserting in ordered index" );
+        status = -1;
+    }
+    else
+    {
+        storeShardPlace( shard, storeKeyHash( key ), key, value );
+        shard->count++;
+    }
+
+    pthread_rwlock_unlock( &shard->lock );
+    return status;
+}
+
+void *
+kc_storeRemove( kc_store * store, const kc_hash * key )
+{
+    assert( store != NULL );
+    assert( key != NULL );
+
+    storeShard * shard = storeShardForKey( store, key );
+    void * value;
+
+    pthread_rwlock_wrlock( &shard->lock );
+
+    int i = storeShardLookup( shard, key );
+    if( i == -1 )
+    {
+        pthread_rwlock_unlock( &shard->lock );
+        return NULL;
+    }
+    value = shard->slots[i].value;
+
+    if( shard->ordered != NULL )
+        rbtEraseKey( shard->ordered, (void*)key );
+
+    /* Backward-shift deletion, as in the session index */
+    int hole = i;
+    for( ;; )
+    {
+        i = ( i + 1 ) & shard->mask;
+        if( shard->slots[i].key == NULL )
+            break;
+
+        int home = shard->slots[i].hash & shard->mask;
+        /* Move it if its home slot isn't within ( hole, i ] */
+        if( ( ( i - home ) & shard->mask ) >= ( ( i - hole ) & shard->mask ) )
+        {
+            shard->slots[hole] = shard->slots[i];
+            hole = i;
+        }
+    }
+    shard->slots[hole].key = NULL;
+    shard->slots[hole].value = NULL;
+    shard->slots[hole].hash = 0;
+    shard->count--;
+
+    pthread_rwlock_unlock( &shard->lock );
+    return value;
+}
+
+void *
+kc_storeFind( kc_store * store, const kc_hash * key )
+{
+    assert( store != NULL );
+    assert( key != NULL );
+
+    storeShard * shard = storeShardForKey( store, key );
+    void * value = NULL;
+
+    pthread_rwlock_rdlock( &shard->lock );
+    int i = storeShardLookup( shard, key );
+    if( i != -1 )
+        value = shard->slots[i].value;
+    pthread_rwlock_unlock( &shard->lock );
+
+    return value;
+}
+
+static int
+storeVisit( kc_store * store, const kc_hash * key, int write, kc_storeVisitor visitor, void * ref )
+{
+    assert( store != NULL );
+    assert( key != NULL );
+    assert( visitor != NULL );
+
+    storeShard * shard = storeShardForKey( store, key );
+
+    if( write )
+        pthread_rwlock_wrlock( &shard->lock );
+    else
+        pthread_rwlock_rdlock( &shard->lock );
+    int i = storeShardLookup( shard, key );
+    if( i != -1 )
+        visitor( shard->slots[i].key, shard->slots[i].value, ref );
+    pthread_rwlock_unlock( &shard->lock );
+
+    return ( i != -1 );
+}
+
+int
+kc_storeGet( kc_store * store, const kc_hash * key, kc_storeVisitor visitor, void * ref )
+{
+    return storeVisit( store, key, 0, visitor, ref );
+}
+
+int
+kc_storeModify( kc_store * store, const kc_hash * key, kc_storeVisitor visitor, void * ref )
+{
+    return storeVisit( store, key, 1, visitor, ref );
+}
+
+/* Visits a shard in key order from the first key not less than from, up to to.
+ * Returns the number of visited values, or -1 - that number if the visitor asked to stop */
+static int
+storeShardWalkOrdered( storeShard * shard, const kc_hash * from, const kc_hash * to, kc_storeVisitor visitor, void * ref )
+{
+    RbtIterator iter = ( from != NULL ? rbtLowerBound( shard->ordered, (void*)from ) : rbtBegin( shard->ordered ) );
+    int visited = 0;
+
+    for( ; iter != NULL; iter = rbtNext( shard->ordered, iter ) )
+    {
+        kc_hash * key;
+        void * value;
+
+        rbtKeyValue( shard->ordered, iter, (void**)&key, &value );
+        if( to != NULL && kc_hashCmp( key, to ) > 0 )
+            break;
+
+        visited++;
+        if( visitor( key, value, ref ) != 0 )
+            return -1 - visited;
+    }
+    return visited;
+}
+
+int
+kc_storeForEach( kc_store * store, kc_storeVisitor visitor, void * ref )
+{
+    assert( store != NULL );
+    assert( visitor != NULL );
+
+    int visited = 0;
+    int i, j;
+
+    for( i = 0; i < 1 << store->shardBits; i++ )
+    {
+        storeShard * shard = &store->shards[i];
+        int stop = 0;
+
+        pthread_rwlock_rdlock( &shard->lock );
+        if( shard->ordered != NULL )
+        {
+            int count = storeShardWalkOrdered( shard, NULL, NULL, visitor, ref );
+            stop = ( count < 0 );
+            visited += ( stop ? -1 - count : count );
+        }
+        else
+        {
+            for( j = 0; j <= shard->mask && !stop; j++ )
+            {
+                if( shard->slots[j].key == NULL )
+                    continue;
+                visited++;
+                stop = visitor( shard->slots[j].key, shard->slots[j].value, ref );
+            }
+        }
+        pthread_rwlock_unlock( &shard->lock );
+
+        if( stop )
+            break;
+    }
+    return visited;
+}
+
+int
+kc_storeRange( kc_store * store, const kc_hash * from, const kc_hash * to, kc_storeVisitor visitor, void * ref )
+{
+    assert( store != NULL );
+    assert( from != NULL );
+    assert( to != NULL );
+    assert( visitor != NULL );
+
+    if( store->shards[0].ordered == NULL )
+    {
+        kc_logError( "kc_storeRange: This store isn't ordered" );
+        return -1;
+    }
+
+    /* Shards cover contiguous ranges, so only walk the ones between from and to */
+    int first = from->id.bytes[0] >> ( 8 - store->shardBits );
+    int last = to->id.bytes[0] >> ( 8 - store->shardBits );
+    int visited = 0;
+    int i;
+
+    for( i = first; i <= last; i++ )
+    {
+        storeShard * shard = &store->shards[i];
+
+        pthread_rwlock_rdlock( &shard->lock );
+        int count = storeShardWalkOrdered( shard, from, to, visitor, ref );
+        pthread_rwlock_unlock( &shard->lock );
+
+        if( count < 0 )
+            return visited - 1 - count;
+        visited += count;
+    }
+    return visited;
+}
+
+int
+kc_storeCount( kc_store * store )
+{
+    assert( store != NULL );
+
+    int count = 0;
+    int i;
+
+    for( i = 0; i < 1 << store->shardBits; i++ )
+    {
+        pthread_rwlock_rdlock( &store->shards[i].lock );
+        count += store->shards[i].count;
+        pthread_rwlock_unlock( &store->shards[i].lock );
+    }
+    return count;
+}
@@ -0,0 +1,129 @@
+/*
+ *  store.h
+ *  KadC
+ *
+ */
+
+#ifndef __KADC_STORE_H__
+#define __KADC_STORE_H__
+
+/**
+ * A sharded key/value store, keyed by kc_hash.
+ *
+ * Keys are spread over a power of 2 shards by their most significant bits,
+ * so each shard covers a contiguous range of the key space. Every shard has
+ * its own read/write lock and an open addressing hash table, so that lookups
+ * in different shards never contend, and lookups in the same shard only
+ * contend with writers. Shards may also keep an ordered index of their keys,
+ * which allows walking the store in key order and scanning key ranges.
+ *
+ * The store doesn't own its keys nor its values : keys must stay valid and
+ * unchanged as long as they are stored, which usually means they live in
+ * the stored value. All functions are thread-safe.
+ */
+typedef struct _kc_store kc_store;
+
+/**
+ * The callback prototype used to visit stored values.
+ *
+ * It runs with the shard of the key locked, so it must not call back into the store.
+ *
+ * @param key The stored key
+ * @param value The stored value
+ * @param ref The ref passed along the callback
+ * @return 0 to go on visiting, anything else to stop
+ */
+typedef int (*kc_storeVisitor)( const kc_hash * key, void * value, void * ref );
+
+/**
+ * Creates an empty store.
+ *
+ * @param shardBits The number of key bits used to select a shard, from 0 to 8
+ * @param ordered Non-zero to keep an ordered index, needed by kc_storeRange()
+ * @return A new store, or NULL on failure
+ */
+kc_store *
+kc_storeInit( int shardBits, int ordered );
+
+/**
+ * Frees a store.
+ *
+ * Stored keys and values aren't touched, use kc_storeForEach() first to free them.
+ */
+void
+kc_storeFree( kc_store * store );
+
+/**
+ * Adds a value to the store.
+ *
+ * @param key The key, which must outlive its stay in the store
+ * @return 0 on success, 1 if the key is already stored, -1 on failure
+ */
+int
+kc_storeInsert( kc_store * store, const kc_hash * key, void * value );
+
+/**
+ * Removes a key from the store.
+ *
+ * @return The value it was stored with, or NULL if it wasn't stored
+ */
+void *
+kc_storeRemove( kc_store * store, const kc_hash * key );
+
+/**
+ * Finds the value stored with a key.
+ *
+ * The shard isn't locked anymore when this returns, so the caller must
+ * make sure the value isn't removed and freed meanwhile.
+ * Use kc_storeGet() to safely read from a value.
+ *
+ * @return The stored value, or NULL if key isn't stored
+ */
+void *
+kc_storeFind( kc_store * store, const kc_hash * key );
+
+/**
+ * Visits the value stored with a key, with its shard locked for reading.
+ *
+ * @return 1 if key was found and visited, 0 otherwise
+ */
+int
+kc_storeGet( kc_store * store, const kc_hash * key, kc_storeVisitor visitor, void * ref );
+
+/**
+ * Visits the value stored with a key, with its shard locked for writing,
+ * so that the visitor can update it while readers are kept out.
+ *
+ * @return 1 if key was found and visited, 0 otherwise
+ */
+int
+kc_storeModify( kc_store * store, const kc_hash * key, kc_storeVisitor visitor, void * ref );
+
+/**
+ * Visits all the stored values, one shard at a time.
+ *
+ * Values are visited in key order if the store is ordered.
+ * The visitor may free the visited key and value if the store is freed right after.
+ *
+ * @return The number of visited values
+ */
+int
+kc_storeForEach( kc_store * store, kc_storeVisitor visitor, void * ref );
+
+/**
+ * Visits the values whose keys are within [ from, to ], in key order.
+ *
+ * Only the shards overlapping the range are locked, one at a time.
+ *
+ * @return The number of visited values, or -1 if the store isn't ordered
+ */
+int
+kc_storeRange( kc_store * store, const kc_hash * from, const kc_hash * to, kc_storeVisitor visitor, void * ref );
+
+/**
+ * Returns the number of stored values.
+ */
+int
+kc_storeCount( kc_store * store );
+
+#endif /* __KADC_STORE_H__ */
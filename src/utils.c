@@ -147,3 +147,13 @@ pthread_rand_seed( void )
 {
 	return ( time(NULL) ^ (unsigned)pthread_self() );
 }
+
+char *
+kc_printBuffer( void )
+{
+	static __thread char buffers[KADC_PRINT_SLOTS][KADC_PRINT_BUFSIZE];
+	static __thread int slot = 0;
+
+	slot = ( slot + 1 ) % KADC_PRINT_SLOTS;
+	return buffers[slot];
+}
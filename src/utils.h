@@ -63,4 +63,14 @@ void pthreadutils_mutex_init_recursive(pthread_mutex_t *pmutex);
 /* Returns a thread specific random seed for use with rand_r */
 unsigned int pthread_rand_seed();
 
+/* Size of the buffers returned by kc_printBuffer() */
+#define KADC_PRINT_BUFSIZE  128
+#define KADC_PRINT_SLOTS    8
+
+/* Returns a thread-local scratch buffer of KADC_PRINT_BUFSIZE bytes, for the
+   "Print" helpers that hand back a string (hashtoa(), kc_contactPrint()...).
+   It cycles through KADC_PRINT_SLOTS of them, so that a few of those can be
+   used as arguments to the same log line. */
+char *kc_printBuffer(void);
+
 #endif /* _KADC_UTILS_H */
\ No newline at end of file
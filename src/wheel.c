@@ -0,0 +1,311 @@
+/*
+ *  wheel.c
+ *  KadC
+ *
+ */
+
+#include "wheel.h"
+
+/* The first wheel has 256 slots of one tick, the others 64 slots
+ * of a whole turn of the previous wheel. Timers further away than
+ * the last wheel wait in its farthest slot, and get rehashed as it comes */
+#define WHEEL_ROOT_BITS     8
+#define WHEEL_BITS          6
+#define WHEEL_LEVELS        4
+
+#define WHEEL_ROOT_SIZE     ( 1 << WHEEL_ROOT_BITS )
+#define WHEEL_SIZE          ( 1 << WHEEL_BITS )
+#define WHEEL_ROOT_MASK     ( WHEEL_ROOT_SIZE - 1 )
+#define WHEEL_MASK          ( WHEEL_SIZE - 1 )
+
+/* The number of ticks the first level wheels cover */
+#define WHEEL_SPAN( level ) ( (uint64_t)1 << ( WHEEL_ROOT_BITS + ( level ) * WHEEL_BITS ) )
+
+struct _kc_wheel {
+    kc_wheelTimer     * root[WHEEL_ROOT_SIZE];
+    kc_wheelTimer     * levels[WHEEL_LEVELS - 1][WHEEL_SIZE];
+    kc_wheelTimer     * expired;        /* Timers waiting for their callback to run */
+
+    uint64_t            now;            /* The next tick to process */
+    long                tick;           /* in ms */
+    struct timeval      start;          /* Tick 0 */
+    int                 count;
+
+    pthread_mutex_t     lock;
+};
+
+static uint64_t
+wheelMsSinceStart( const kc_wheel * wheel )
+{
+    struct timeval now;
+    gettimeofday( &now, NULL );
+
+    long long ms = ( now.tv_sec - wheel->start.tv_sec ) * 1000LL + ( now.tv_usec - wheel->start.tv_usec ) / 1000;
+    return ( ms > 0 ? ms : 0 );
+}
+
+static inline void
+wheelLink( kc_wheelTimer ** list, kc_wheelTimer * timer )
+{
+    timer->next = *list;
+    if( timer->next != NULL )
+        timer->next->pprev = &timer->next;
+    timer->pprev = list;
+    *list = timer;
+}
+
+static inline void
+wheelUnlink( kc_wheelTimer * timer )
+{
+    *timer->pprev = timer->next;
+    if( timer->next != NULL )
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* Hashes a timer in the slot matching its expiration, must be called with the lock held */
+static void
+wheelPlace( kc_wheel * wheel, kc_wheelTimer * timer )
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level;
+
+    if( expires < wheel->now )
+        expires = wheel->now;
+    delta = expires - wheel->now;
+
+    if( delta < WHEEL_SPAN( 0 ) )
+    {
+        wheelLink( &wheel->root[expires & WHEEL_ROOT_MASK], timer );
+        return;
+    }
+
+    for( level = 1; level < WHEEL_LEVELS - 1; level++ )
+    {
+        if( delta < WHEEL_SPAN( level ) )
+            break;
+    }
+    /* Too far for the last wheel, wait in its farthest slot */
+    if( delta >= WHEEL_SPAN( level ) )
+        expires = wheel->now + WHEEL_SPAN( level ) - 1;
+
+    int shift = WHEEL_ROOT_BITS + ( level - 1 ) * WHEEL_BITS;
+    wheelLink( &wheel->levels[level - 1][( expires >> shift ) & WHEEL_MASK], timer );
+}
+
+/* Rehashes the timers of the current slot of a level, returns that slot index */
+static int
+wheelCascade( kc_wheel * wheel, int level )
+{
+    int shift = WHEEL_ROOT_BITS + ( level - 1 ) * WHEEL_BITS;
+    int index = ( wheel->now >> shift ) & WHEEL_MASK;
+    kc_wheelTimer * timer = wheel->levels[level - 1][index];
+
+    wheel->levels[level - 1][index] = NULL;
+    while( timer != NULL )
+    {
+        kc_wheelTimer * next = timer->next;
+        wheelPlace( wheel, timer );
+        timer = next;
+    }
+    return index;
+}
+
+/* Processes one tick, moving the timers expiring in it to the expired list */
+static void
+wheelStep( kc_wheel * wheel )
+{
+    int index = wheel->now & WHEEL_ROOT_MASK;
+    int level;
+
+    /* Every turn of a wheel, refill it from the next level */
+    if( index == 0 )
+    {
+        for( level = 1; level < WHEEL_LEVELS; level++ )
+        {
+            if( wheelCascade( wheel, level ) != 0 )
+                break;
+        }
+    }
+
+    kc_wheelTimer * timer = wheel->root[index];
+    while( timer != NULL )
+    {
+        kc_wheelTimer * next = timer->next;
+
+        wheelUnlink( timer );
+        if( timer->expires > wheel->now )
+            wheelPlace( wheel, timer ); /* Not due before a later turn */
+        else
+            wheelLink( &wheel->expired, timer );
+        timer = next;
+    }
+    wheel->now++;
+}
+
+kc_wheel *
+kc_wheelInit( long tick )
+{
+    assert( tick > 0 );
+
+    kc_wheel * self = calloc( 1, sizeof(kc_wheel) );
+    if( self == NULL )
+    {
+        kc_logAlert( "Failed allocating timing wheel" );
+        return NULL;
+    }
+
+    self->tick = tick;
+    gettimeofday( &self->start, NULL );
+    pthread_mutex_init( &self->lock, NULL );
+
+    return self;
+}
+
+void
+kc_wheelFree( kc_wheel * wheel )
+{
+    if( wheel == NULL )
+        return;
+
+    pthread_mutex_destroy( &wheel->lock );
+    free( wheel );
+}
+
+long
+kc_wheelGetTick( const kc_wheel * wheel )
+{
+    assert( wheel != NULL );
+    return wheel->tick;
+}
+
+void
+kc_wheelTimerInit( kc_wheelTimer * timer, kc_wheelCallback callback, void * ref )
+{
+    assert( timer != NULL );
+    assert( callback != NULL );
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->ref = ref;
+}
+
+/* Must be called with the wheel locked */
+static void
+wheelArm( kc_wheel * wheel, kc_wheelTimer * timer, long delay )
+{
+    if( delay < 0 )
+        delay = 0;
+
+    if( timer->pprev != NULL )
+        wheelUnlink( timer );
+    else
+        wheel->count++;
+
+    /* Round up, so that timers never expire early */
+    timer->expires = ( wheelMsSinceStart( wheel ) + delay + wheel->tick - 1 ) / wheel->tick;
+    wheelPlace( wheel, timer );
+}
+
+void
+kc_wheelSchedule( kc_wheel * wheel, kc_wheelTimer * timer, long delay )
+{
+    assert( wheel != NULL );
+    assert( timer != NULL );
+
+    pthread_mutex_lock( &wheel->lock );
+    wheelArm( wheel, timer, delay );
+    pthread_mutex_unlock( &wheel->lock );
+}
+
+int
+kc_wheelReschedule( kc_wheel * wheel, kc_wheelTimer * timer, long delay )
+{
+    assert( wheel != NULL );
+    assert( timer != NULL );
+
+    int pending;
+
+    pthread_mutex_lock( &wheel->lock );
+    pending = ( timer->pprev != NULL );
+    if( pending )
+        wheelArm( wheel, timer, delay );
+    pthread_mutex_unlock( &wheel->lock );
+
+    return pending;
+}
+
+int
+kc_wheelCancel( kc_wheel * wheel, kc_wheelTimer * timer )
+{
+    assert( wheel != NULL );
+    assert( timer != NULL );
+
+    int pending;
+
+    pthread_mutex_lock( &wheel->lock );
+    pending = ( timer->pprev != NULL );
+    if( pending )
+    {
+        wheelUnlink( timer );
+        wheel->count--;
+    }
+    pthread_mutex_unlock( &wheel->lock );
+
+    return pending;
+}
+
+int
+kc_wheelIsPending( const kc_wheelTimer * timer )
+{
+    assert( timer != NULL );
+    return ( timer->pprev != NULL );
+}
+
+int
+kc_wheelAdvance( kc_wheel * wheel )
+{
+    assert( wheel != NULL );
+
+    int expired = 0;
+
+    pthread_mutex_lock( &wheel->lock );
+
+    uint64_t now = wheelMsSinceStart( wheel ) / wheel->tick;
+    if( wheel->count == 0 && wheel->now <= now )
+        wheel->now = now + 1;   /* Nothing to walk through */
+    while( wheel->now <= now )
+        wheelStep( wheel );
+
+    /* Run callbacks one at a time, so that they can cancel or schedule any timer */
+    while( wheel->expired != NULL )
+    {
+        kc_wheelTimer * timer = wheel->expired;
+        wheelUnlink( timer );
+        wheel->count--;
+        expired++;
+
+        pthread_mutex_unlock( &wheel->lock );
+        timer->callback( timer, timer->ref );
+        pthread_mutex_lock( &wheel->lock );
+    }
+
+    pthread_mutex_unlock( &wheel->lock );
+    return expired;
+}
+
+int
+kc_wheelCount( kc_wheel * wheel )
+{
+    int count;
+
+    assert( wheel != NULL );
+    pthread_mutex_lock( &wheel->lock );
+    count = wheel->count;
+    pthread_mutex_unlock( &wheel->lock );
+    return count;
+}
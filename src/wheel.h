@@ -0,0 +1,115 @@
+/*
+ *  wheel.h
+ *  KadC
+ *
+ */
+
+#ifndef __KADC_WHEEL_H__
+#define __KADC_WHEEL_H__
+
+/**
+ * A hierarchical timing wheel.
+ *
+ * Timers are hashed by expiration tick into the slots of a few wheels of
+ * increasing granularity, and cascade to finer wheels as their time comes.
+ * Scheduling and cancelling are O(1), and advancing the wheel only costs
+ * the timers that expire, so it doesn't matter how many are pending.
+ * The wheel must be advanced regularly, usually from a single periodic event.
+ * All functions are thread-safe, and callbacks run without the wheel locked.
+ */
+typedef struct _kc_wheel kc_wheel;
+
+typedef struct _kc_wheelTimer kc_wheelTimer;
+
+/**
+ * The callback prototype used when a timer expires.
+ *
+ * The timer isn't pending anymore, so the callback may schedule it again, or free it.
+ *
+ * @param timer The expired timer
+ * @param ref The ref passed to kc_wheelTimerInit()
+ */
+typedef void (*kc_wheelCallback)( kc_wheelTimer * timer, void * ref );
+
+/**
+ * A timer, meant to be embedded in the structure it times.
+ *
+ * Its fields are private, set it up with kc_wheelTimerInit().
+ */
+struct _kc_wheelTimer {
+    kc_wheelTimer         * next;
+    kc_wheelTimer        ** pprev;      /* The pointer to us in our list, NULL when not pending */
+    uint64_t                expires;    /* In ticks */
+    kc_wheelCallback        callback;
+    void                  * ref;
+};
+
+/**
+ * Creates a timing wheel.
+ *
+ * @param tick The wheel resolution in ms, timers expire up to a tick late
+ * @return A new wheel, or NULL on failure
+ */
+kc_wheel *
+kc_wheelInit( long tick );
+
+/**
+ * Frees a timing wheel.
+ *
+ * Pending timers are just forgotten.
+ */
+void
+kc_wheelFree( kc_wheel * wheel );
+
+long
+kc_wheelGetTick( const kc_wheel * wheel );
+
+void
+kc_wheelTimerInit( kc_wheelTimer * timer, kc_wheelCallback callback, void * ref );
+
+/**
+ * Schedules a timer, rescheduling it if it is pending.
+ *
+ * @param delay The delay before it expires, in ms
+ */
+void
+kc_wheelSchedule( kc_wheel * wheel, kc_wheelTimer * timer, long delay );
+
+/**
+ * Reschedules a timer, but only if it is pending.
+ *
+ * Unlike checking kc_wheelIsPending() first, this can't race with the timer
+ * expiring or being cancelled meanwhile.
+ *
+ * @param delay The delay before it expires, in ms
+ * @return 1 if the timer was pending and got rescheduled, 0 otherwise
+ */
+int
+kc_wheelReschedule( kc_wheel * wheel, kc_wheelTimer * timer, long delay );
+
+/**
+ * Cancels a timer. Does nothing if it isn't pending.
+ *
+ * @return 1 if the timer was pending, 0 if it wasn't or its callback already started
+ */
+int
+kc_wheelCancel( kc_wheel * wheel, kc_wheelTimer * timer );
+
+int
+kc_wheelIsPending( const kc_wheelTimer * timer );
+
+/**
+ * Runs the callbacks of all the timers that expired by now.
+ *
+ * @return The number of expired timers
+ */
+int
+kc_wheelAdvance( kc_wheel * wheel );
+
+/**
+ * Returns the number of pending timers.
+ */
+int
+kc_wheelCount( kc_wheel * wheel );
+
+#endif /* __KADC_WHEEL_H__ */